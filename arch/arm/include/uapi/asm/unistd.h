@@ -420,6 +420,9 @@
 #define __NR_copy_file_range		(__NR_SYSCALL_BASE+391)
 #define __NR_preadv2			(__NR_SYSCALL_BASE+392)
 #define __NR_pwritev2			(__NR_SYSCALL_BASE+393)
+#define __NR_io_uring_setup		(__NR_SYSCALL_BASE+394)
+#define __NR_io_uring_enter		(__NR_SYSCALL_BASE+395)
+#define __NR_io_uring_register		(__NR_SYSCALL_BASE+396)
 
 /*
  * The following SWIs are ARM private.
@@ -0,0 +1,896 @@
+/*
+ * Budget Fair Queueing (BFQ) I/O scheduler for blk-mq.
+ *
+ * Distributes the throughput of a device among cgroups in proportion to
+ * their bfq.weight.  Every cgroup with I/O pending on the device is a
+ * group, and groups get the device one at a time: the group in service
+ * dispatches requests until it has used up its budget (in sectors), has
+ * run out of requests, or has held the device for longer than
+ * timeout_sync.  The next group is picked with B-WF2Q+: each group has a
+ * virtual start and finish time, finish = start + budget / weight, and the
+ * eligible group (start <= system virtual time) with the smallest finish
+ * time goes next.  A group is charged for the sectors it dispatched, or
+ * for its whole budget if it timed out, so seeky groups pay for the device
+ * time they take.
+ *
+ * Budgets follow each group's behaviour: a group that uses up its budget
+ * has it doubled, up to max_budget; one that runs dry gets what it used.
+ *
+ * When the group in service runs out of requests right after a sync one
+ * while other groups are waiting, the device is idled for slice_idle so
+ * that the group can issue its next request before service moves on.
+ * Without this, a group doing synchronous I/O loses its share to groups
+ * that keep deeper queues.
+ *
+ * The schedule is global to the device, so only devices with a single
+ * hardware queue are supported.
+ *
+ * See Documentation/block/bfq-iosched.txt
+ */
+#include <linux/kernel.h>
+#include <linux/module.h>
+#include <linux/slab.h>
+#include <linux/blkdev.h>
+#include <linux/blk-mq.h>
+#include <linux/elevator.h>
+#include <linux/hrtimer.h>
+#include <linux/ktime.h>
+#include <linux/rbtree.h>
+#include <linux/blk-cgroup.h>
+
+#include "blk.h"
+#include "blk-mq.h"
+#include "blk-mq-sched.h"
+
+/* max sectors a group may dispatch in one turn */
+static const int bfq_max_budget = 16 * 1024;
+/* max time a group may hold the device in one turn */
+static const int bfq_timeout_sync = HZ / 8;
+/* how long to wait for the next request of the group in service */
+static const u64 bfq_slice_idle = 8 * NSEC_PER_MSEC;
+/* fifo expiry of async and sync requests, inside a group */
+static const int bfq_fifo_expire[2] = { HZ / 4, HZ / 8 };
+
+#define BFQ_WEIGHT_MIN		1
+#define BFQ_WEIGHT_MAX		1000
+#define BFQ_WEIGHT_DFL		100
+
+/* virtual times are sectors of service, shifted left, divided by weight */
+#define BFQ_SERVICE_SHIFT	22
+
+enum bfq_expiration {
+	BFQ_EXP_BUDGET,		/* used up its budget */
+	BFQ_EXP_EMPTY,		/* ran out of requests */
+	BFQ_EXP_TIMEOUT,	/* held the device for too long */
+};
+
+struct bfq_group {
+#ifdef CONFIG_BFQ_GROUP_IOSCHED
+	/* must be the first member */
+	struct blkg_policy_data pd;
+#endif
+	struct rb_node node;		/* on bfqd->active, by finish time */
+	u64 start;			/* virtual start time */
+	u64 finish;			/* virtual finish time */
+	unsigned int weight;
+	unsigned int new_weight;	/* applied at the start of a turn */
+	int budget;			/* sectors per turn */
+	bool active;			/* has requests or is in service */
+	bool last_sync;			/* last request dispatched was sync */
+
+	struct rb_root sort_list;	/* pending requests, by sector */
+	struct list_head fifo[2];	/* pending requests, async and sync */
+	struct request *next_rq;	/* next in sort order */
+	unsigned int nr_queued;
+};
+
+struct bfq_group_data {
+	/* must be the first member */
+	struct blkcg_policy_data cpd;
+
+	unsigned int weight;
+};
+
+struct bfq_data {
+	struct request_queue *queue;
+
+	/*
+	 * All of the below is protected by the queue lock.
+	 */
+	struct rb_root active;		/* backlogged groups but in_service */
+	u64 vtime;			/* system virtual time */
+	unsigned int wsum;		/* weight of all active groups */
+	unsigned int queued;		/* requests held, over all groups */
+
+	struct bfq_group *in_service;
+	int served;			/* sectors dispatched in this turn */
+	unsigned long turn_start;	/* jiffies */
+	bool idling;
+	struct hrtimer idle_timer;
+
+	struct bfq_group *root_group;
+
+	/*
+	 * tunables
+	 */
+	int max_budget;
+	int timeout_sync;
+	u64 slice_idle;
+	int fifo_expire[2];
+};
+
+static void bfq_init_group(struct bfq_group *bfqg, unsigned int weight)
+{
+	RB_CLEAR_NODE(&bfqg->node);
+	bfqg->sort_list = RB_ROOT;
+	INIT_LIST_HEAD(&bfqg->fifo[0]);
+	INIT_LIST_HEAD(&bfqg->fifo[1]);
+	bfqg->weight = weight;
+	bfqg->new_weight = weight;
+}
+
+#ifdef CONFIG_BFQ_GROUP_IOSCHED
+
+static struct blkcg_policy blkcg_policy_bfq;
+
+static inline struct bfq_group *pd_to_bfqg(struct blkg_policy_data *pd)
+{
+	return pd ? container_of(pd, struct bfq_group, pd) : NULL;
+}
+
+static inline struct blkcg_gq *bfqg_to_blkg(struct bfq_group *bfqg)
+{
+	return pd_to_blkg(&bfqg->pd);
+}
+
+static inline struct bfq_group *blkg_to_bfqg(struct blkcg_gq *blkg)
+{
+	return pd_to_bfqg(blkg_to_pd(blkg, &blkcg_policy_bfq));
+}
+
+static inline struct bfq_group_data *
+cpd_to_bfqgd(struct blkcg_policy_data *cpd)
+{
+	return cpd ? container_of(cpd, struct bfq_group_data, cpd) : NULL;
+}
+
+static inline struct bfq_group_data *blkcg_to_bfqgd(struct blkcg *blkcg)
+{
+	return cpd_to_bfqgd(blkcg_to_cpd(blkcg, &blkcg_policy_bfq));
+}
+
+static inline void bfqg_get(struct bfq_group *bfqg)
+{
+	blkg_get(bfqg_to_blkg(bfqg));
+}
+
+static inline void bfqg_put(struct bfq_group *bfqg)
+{
+	blkg_put(bfqg_to_blkg(bfqg));
+}
+
+/*
+ * Group of the cgroup that issued @bio.  Called under the queue lock and
+ * rcu_read_lock(), which keep the blkg from going away before the caller
+ * got a reference.
+ */
+static struct bfq_group *bfq_bio_group(struct bfq_data *bfqd, struct bio *bio)
+{
+	struct blkcg_gq *blkg;
+	struct bfq_group *bfqg = NULL;
+
+	blkg = blkg_lookup(bio_blkcg(bio), bfqd->queue);
+	if (blkg)
+		bfqg = blkg_to_bfqg(blkg);
+
+	return bfqg ?: bfqd->root_group;
+}
+
+#else /* CONFIG_BFQ_GROUP_IOSCHED */
+
+static inline void bfqg_get(struct bfq_group *bfqg) { }
+static inline void bfqg_put(struct bfq_group *bfqg) { }
+
+static struct bfq_group *bfq_bio_group(struct bfq_data *bfqd, struct bio *bio)
+{
+	return bfqd->root_group;
+}
+
+#endif /* CONFIG_BFQ_GROUP_IOSCHED */
+
+static inline u64 bfq_delta(int service, unsigned int weight)
+{
+	return div_u64((u64)service << BFQ_SERVICE_SHIFT, weight);
+}
+
+static void bfq_active_insert(struct bfq_data *bfqd, struct bfq_group *bfqg)
+{
+	struct rb_node **p = &bfqd->active.rb_node;
+	struct rb_node *parent = NULL;
+	struct bfq_group *__bfqg;
+
+	while (*p) {
+		parent = *p;
+		__bfqg = rb_entry(parent, struct bfq_group, node);
+
+		if (bfqg->finish < __bfqg->finish)
+			p = &(*p)->rb_left;
+		else
+			p = &(*p)->rb_right;
+	}
+
+	rb_link_node(&bfqg->node, parent, p);
+	rb_insert_color(&bfqg->node, &bfqd->active);
+}
+
+/*
+ * @bfqg got a request after having none: it starts competing again, at
+ * the system virtual time, or where its last turn ended if it was
+ * overcharged.
+ */
+static void bfq_activate_group(struct bfq_data *bfqd, struct bfq_group *bfqg)
+{
+	bfqg->weight = bfqg->new_weight;
+	if (!bfqg->budget || bfqg->budget > bfqd->max_budget)
+		bfqg->budget = bfqd->max_budget;
+
+	bfqg->start = max(bfqd->vtime, bfqg->finish);
+	bfqg->finish = bfqg->start + bfq_delta(bfqg->budget, bfqg->weight);
+	bfqg->active = true;
+	bfqd->wsum += bfqg->weight;
+	bfq_active_insert(bfqd, bfqg);
+}
+
+/*
+ * Pick the eligible group with the smallest finish time and take it off
+ * the active tree.  If no group is eligible, the virtual time jumps to the
+ * smallest start time.
+ */
+static struct bfq_group *bfq_select_group(struct bfq_data *bfqd)
+{
+	struct bfq_group *bfqg, *first = NULL;
+	struct rb_node *n;
+
+	for (n = rb_first(&bfqd->active); n; n = rb_next(n)) {
+		bfqg = rb_entry(n, struct bfq_group, node);
+
+		if (bfqg->start <= bfqd->vtime)
+			goto found;
+		if (!first || bfqg->start < first->start)
+			first = bfqg;
+	}
+
+	if (!first)
+		return NULL;
+
+	bfqd->vtime = first->start;
+	bfqg = first;
+found:
+	rb_erase(&bfqg->node, &bfqd->active);
+	RB_CLEAR_NODE(&bfqg->node);
+	return bfqg;
+}
+
+static void bfq_set_in_service(struct bfq_data *bfqd, struct bfq_group *bfqg)
+{
+	/* keeps the group around until its turn ends, see bfq_expire() */
+	bfqg_get(bfqg);
+	bfqd->in_service = bfqg;
+	bfqd->served = 0;
+	bfqd->turn_start = jiffies;
+}
+
+/*
+ * End the turn of the group in service: charge it, adapt its budget and
+ * put it back in the competition if it still has requests.
+ */
+static void bfq_expire(struct bfq_data *bfqd, enum bfq_expiration reason)
+{
+	struct bfq_group *bfqg = bfqd->in_service;
+	int charge = bfqd->served;
+
+	switch (reason) {
+	case BFQ_EXP_BUDGET:
+		bfqg->budget = min(bfqg->budget * 2, bfqd->max_budget);
+		break;
+	case BFQ_EXP_EMPTY:
+		bfqg->budget = max(bfqd->served, bfqd->max_budget / 32);
+		break;
+	case BFQ_EXP_TIMEOUT:
+		charge = max(charge, bfqg->budget);
+		break;
+	}
+	charge = max(charge, 1);
+
+	bfqg->finish = bfqg->start + bfq_delta(charge, bfqg->weight);
+	bfqd->vtime += div_u64((u64)charge << BFQ_SERVICE_SHIFT, bfqd->wsum);
+
+	bfqd->in_service = NULL;
+	bfqd->wsum -= bfqg->weight;
+
+	if (bfqg->nr_queued) {
+		/* continuously backlogged: the next turn starts at finish */
+		bfqg->weight = bfqg->new_weight;
+		bfqg->start = bfqg->finish;
+		bfqg->finish = bfqg->start + bfq_delta(bfqg->budget,
+						       bfqg->weight);
+		bfqd->wsum += bfqg->weight;
+		bfq_active_insert(bfqd, bfqg);
+	} else
+		bfqg->active = false;
+
+	bfqg_put(bfqg);
+}
+
+/*
+ * Idle only when it protects the group in service against other groups,
+ * and only after a sync request: async writers don't wait for completions.
+ */
+static bool bfq_may_idle(struct bfq_data *bfqd, struct bfq_group *bfqg)
+{
+	return bfqd->slice_idle && bfqg->last_sync &&
+		!RB_EMPTY_ROOT(&bfqd->active) &&
+		time_before(jiffies, bfqd->turn_start + bfqd->timeout_sync);
+}
+
+static enum hrtimer_restart bfq_idle_timer_fn(struct hrtimer *timer)
+{
+	struct bfq_data *bfqd = container_of(timer, struct bfq_data,
+					     idle_timer);
+	struct request_queue *q = bfqd->queue;
+	unsigned long flags;
+
+	spin_lock_irqsave(q->queue_lock, flags);
+	if (bfqd->idling) {
+		bfqd->idling = false;
+		if (bfqd->in_service && !bfqd->in_service->nr_queued)
+			bfq_expire(bfqd, BFQ_EXP_EMPTY);
+	}
+	spin_unlock_irqrestore(q->queue_lock, flags);
+
+	blk_mq_run_hw_queues(q, true);
+	return HRTIMER_NORESTART;
+}
+
+static void bfq_remove_request(struct bfq_data *bfqd, struct request *rq)
+{
+	struct bfq_group *bfqg = rq->elv.priv[0];
+
+	if (bfqg->next_rq == rq) {
+		struct rb_node *next = rb_next(&rq->rb_node);
+
+		bfqg->next_rq = next ? rb_entry_rq(next) : NULL;
+	}
+
+	rq_fifo_clear(rq);
+	elv_rb_del(&bfqg->sort_list, rq);
+	bfqg->nr_queued--;
+	bfqd->queued--;
+}
+
+/*
+ * Within a group, expired requests go first, sync before async.  Otherwise
+ * the group is served in ascending sector order, wrapping around at the
+ * end.
+ */
+static struct request *bfq_choose_request(struct bfq_group *bfqg)
+{
+	struct request *rq;
+	int sync;
+
+	for (sync = 1; sync >= 0; sync--) {
+		if (list_empty(&bfqg->fifo[sync]))
+			continue;
+		rq = rq_entry_fifo(bfqg->fifo[sync].next);
+		if (time_after_eq(jiffies, (unsigned long)rq->fifo_time))
+			return rq;
+	}
+
+	if (bfqg->next_rq)
+		return bfqg->next_rq;
+	return rb_entry_rq(rb_first(&bfqg->sort_list));
+}
+
+static struct request *__bfq_dispatch_request(struct bfq_data *bfqd)
+{
+	struct bfq_group *bfqg = bfqd->in_service;
+	struct rb_node *next;
+	struct request *rq;
+
+	if (bfqg) {
+		if (bfqd->idling)
+			return NULL;
+
+		if (!bfqg->nr_queued) {
+			if (bfq_may_idle(bfqd, bfqg)) {
+				bfqd->idling = true;
+				hrtimer_start(&bfqd->idle_timer,
+					      ns_to_ktime(bfqd->slice_idle),
+					      HRTIMER_MODE_REL);
+				return NULL;
+			}
+			bfq_expire(bfqd, BFQ_EXP_EMPTY);
+		} else if (time_after(jiffies,
+				      bfqd->turn_start + bfqd->timeout_sync))
+			bfq_expire(bfqd, BFQ_EXP_TIMEOUT);
+	}
+
+	bfqg = bfqd->in_service;
+	if (!bfqg) {
+		bfqg = bfq_select_group(bfqd);
+		if (!bfqg)
+			return NULL;
+		bfq_set_in_service(bfqd, bfqg);
+	}
+
+	rq = bfq_choose_request(bfqg);
+	next = rb_next(&rq->rb_node);
+	bfq_remove_request(bfqd, rq);
+	bfqg->next_rq = next ? rb_entry_rq(next) : NULL;
+
+	bfqd->served += blk_rq_sectors(rq);
+	bfqg->last_sync = rq_is_sync(rq);
+	if (bfqd->served >= bfqg->budget)
+		bfq_expire(bfqd, BFQ_EXP_BUDGET);
+
+	return rq;
+}
+
+static struct request *bfq_dispatch_request(struct blk_mq_hw_ctx *hctx)
+{
+	struct request_queue *q = hctx->queue;
+	struct bfq_data *bfqd = q->elevator->elevator_data;
+	struct request *rq;
+	unsigned long flags;
+
+	spin_lock_irqsave(q->queue_lock, flags);
+	rq = __bfq_dispatch_request(bfqd);
+	spin_unlock_irqrestore(q->queue_lock, flags);
+
+	return rq;
+}
+
+static bool bfq_has_work(struct blk_mq_hw_ctx *hctx)
+{
+	struct bfq_data *bfqd = hctx->queue->elevator->elevator_data;
+
+	return READ_ONCE(bfqd->queued) != 0;
+}
+
+static void bfq_add_request(struct bfq_data *bfqd, struct request *rq)
+{
+	struct bfq_group *bfqg = bfq_bio_group(bfqd, rq->bio);
+	const int sync = rq_is_sync(rq);
+
+	/* dropped when the request completes */
+	bfqg_get(bfqg);
+	rq->elv.priv[0] = bfqg;
+
+	elv_rb_add(&bfqg->sort_list, rq);
+	rq->fifo_time = jiffies + bfqd->fifo_expire[sync];
+	list_add_tail(&rq->queuelist, &bfqg->fifo[sync]);
+	bfqg->nr_queued++;
+	bfqd->queued++;
+
+	if (bfqg == bfqd->in_service) {
+		if (bfqd->idling) {
+			bfqd->idling = false;
+			hrtimer_try_to_cancel(&bfqd->idle_timer);
+		}
+	} else if (!bfqg->active)
+		bfq_activate_group(bfqd, bfqg);
+}
+
+static void bfq_insert_requests(struct blk_mq_hw_ctx *hctx,
+				struct list_head *list)
+{
+	struct request_queue *q = hctx->queue;
+	struct bfq_data *bfqd = q->elevator->elevator_data;
+
+	rcu_read_lock();
+	spin_lock_irq(q->queue_lock);
+	while (!list_empty(list)) {
+		struct request *rq;
+
+		rq = list_first_entry(list, struct request, queuelist);
+		list_del_init(&rq->queuelist);
+		bfq_add_request(bfqd, rq);
+	}
+	spin_unlock_irq(q->queue_lock);
+	rcu_read_unlock();
+}
+
+static void bfq_completed_request(struct blk_mq_hw_ctx *hctx,
+				  struct request *rq)
+{
+	bfqg_put(rq->elv.priv[0]);
+}
+
+/*
+ * Only requests of the group that issued @bio are merge candidates.
+ */
+static bool bfq_bio_merge(struct blk_mq_hw_ctx *hctx, struct bio *bio)
+{
+	struct request_queue *q = hctx->queue;
+	struct bfq_data *bfqd = q->elevator->elevator_data;
+	sector_t sector = bio->bi_iter.bi_sector;
+	struct bfq_group *bfqg;
+	struct request *rq = NULL, *free = NULL;
+	struct rb_node *n;
+	bool merged = false;
+
+	rcu_read_lock();
+	spin_lock_irq(q->queue_lock);
+	bfqg = bfq_bio_group(bfqd, bio);
+
+	/* back merge: the last request starting at or before @sector */
+	n = bfqg->sort_list.rb_node;
+	while (n) {
+		struct request *__rq = rb_entry_rq(n);
+
+		if (blk_rq_pos(__rq) <= sector) {
+			rq = __rq;
+			n = n->rb_right;
+		} else
+			n = n->rb_left;
+	}
+	if (rq && rq_end_sector(rq) == sector &&
+	    blk_mq_sched_try_merge(q, rq, bio, &free) == ELEVATOR_BACK_MERGE) {
+		merged = true;
+		goto out;
+	}
+
+	rq = elv_rb_find(&bfqg->sort_list, bio_end_sector(bio));
+	if (rq && blk_mq_sched_try_merge(q, rq, bio, &free) ==
+		  ELEVATOR_FRONT_MERGE) {
+		/* the start sector moved, reposition request */
+		if (!free) {
+			elv_rb_del(&bfqg->sort_list, rq);
+			elv_rb_add(&bfqg->sort_list, rq);
+		}
+		merged = true;
+	}
+out:
+	spin_unlock_irq(q->queue_lock);
+	rcu_read_unlock();
+
+	if (free)
+		blk_mq_free_request(free);
+	return merged;
+}
+
+/*
+ * @next, of the same group as @rq, was merged into @rq and is about to be
+ * freed.  @rq inherits the earlier fifo expiry of the two.
+ */
+static void bfq_requests_merged(struct blk_mq_hw_ctx *hctx, struct request *rq,
+				struct request *next)
+{
+	struct bfq_data *bfqd = hctx->queue->elevator->elevator_data;
+
+	if (!list_empty(&rq->queuelist) && !list_empty(&next->queuelist) &&
+	    time_before((unsigned long)next->fifo_time,
+			(unsigned long)rq->fifo_time)) {
+		list_move(&rq->queuelist, &next->queuelist);
+		rq->fifo_time = next->fifo_time;
+	}
+
+	bfq_remove_request(bfqd, next);
+}
+
+static int bfq_init_queue(struct request_queue *q, struct elevator_type *e)
+{
+	struct elevator_queue *eq;
+	struct bfq_data *bfqd;
+	int ret;
+
+	if (q->nr_hw_queues != 1)
+		return -EINVAL;
+
+	eq = elevator_alloc(q, e);
+	if (!eq)
+		return -ENOMEM;
+
+	bfqd = kzalloc_node(sizeof(*bfqd), GFP_KERNEL, q->node);
+	if (!bfqd) {
+		kobject_put(&eq->kobj);
+		return -ENOMEM;
+	}
+	eq->elevator_data = bfqd;
+
+	bfqd->queue = q;
+	bfqd->active = RB_ROOT;
+	hrtimer_init(&bfqd->idle_timer, CLOCK_MONOTONIC, HRTIMER_MODE_REL);
+	bfqd->idle_timer.function = bfq_idle_timer_fn;
+
+	bfqd->max_budget = bfq_max_budget;
+	bfqd->timeout_sync = bfq_timeout_sync;
+	bfqd->slice_idle = bfq_slice_idle;
+	bfqd->fifo_expire[0] = bfq_fifo_expire[0];
+	bfqd->fifo_expire[1] = bfq_fifo_expire[1];
+
+#ifdef CONFIG_BFQ_GROUP_IOSCHED
+	ret = blkcg_activate_policy(q, &blkcg_policy_bfq);
+	if (ret)
+		goto out_free;
+	bfqd->root_group = blkg_to_bfqg(q->root_blkg);
+#else
+	ret = -ENOMEM;
+	bfqd->root_group = kzalloc_node(sizeof(*bfqd->root_group),
+					GFP_KERNEL, q->node);
+	if (!bfqd->root_group)
+		goto out_free;
+	bfq_init_group(bfqd->root_group, BFQ_WEIGHT_DFL);
+#endif
+
+	q->elevator = eq;
+	return 0;
+
+out_free:
+	kfree(bfqd);
+	kobject_put(&eq->kobj);
+	return ret;
+}
+
+static void bfq_exit_queue(struct elevator_queue *e)
+{
+	struct bfq_data *bfqd = e->elevator_data;
+	struct request_queue *q = bfqd->queue;
+
+	hrtimer_cancel(&bfqd->idle_timer);
+
+	spin_lock_irq(q->queue_lock);
+	if (bfqd->in_service)
+		bfq_expire(bfqd, BFQ_EXP_EMPTY);
+	spin_unlock_irq(q->queue_lock);
+
+	WARN_ON(bfqd->queued);
+
+#ifdef CONFIG_BFQ_GROUP_IOSCHED
+	blkcg_deactivate_policy(q, &blkcg_policy_bfq);
+#else
+	kfree(bfqd->root_group);
+#endif
+	kfree(bfqd);
+}
+
+/*
+ * sysfs parts below
+ */
+
+#define SHOW_FUNCTION(__FUNC, __VAR, __CONV)				\
+static ssize_t __FUNC(struct elevator_queue *e, char *page)		\
+{									\
+	struct bfq_data *bfqd = e->elevator_data;			\
+	u64 __data = __VAR;						\
+	if (__CONV == 1)						\
+		__data = jiffies_to_msecs(__data);			\
+	else if (__CONV == 2)						\
+		__data = div_u64(__data, NSEC_PER_USEC);		\
+	return sprintf(page, "%llu\n", __data);				\
+}
+SHOW_FUNCTION(bfq_max_budget_show, bfqd->max_budget, 0);
+SHOW_FUNCTION(bfq_timeout_sync_show, bfqd->timeout_sync, 1);
+SHOW_FUNCTION(bfq_slice_idle_us_show, bfqd->slice_idle, 2);
+SHOW_FUNCTION(bfq_fifo_expire_async_show, bfqd->fifo_expire[0], 1);
+SHOW_FUNCTION(bfq_fifo_expire_sync_show, bfqd->fifo_expire[1], 1);
+#undef SHOW_FUNCTION
+
+#define STORE_FUNCTION(__FUNC, __PTR, MIN, MAX, __CONV)			\
+static ssize_t __FUNC(struct elevator_queue *e, const char *page, size_t count)	\
+{									\
+	struct bfq_data *bfqd = e->elevator_data;			\
+	unsigned long __data;						\
+	int ret;							\
+									\
+	ret = kstrtoul(page, 10, &__data);				\
+	if (ret)							\
+		return ret;						\
+	if (__data < (MIN))						\
+		__data = (MIN);						\
+	else if (__data > (MAX))					\
+		__data = (MAX);						\
+	if (__CONV == 1)						\
+		*(__PTR) = msecs_to_jiffies(__data);			\
+	else if (__CONV == 2)						\
+		*(__PTR) = (u64)__data * NSEC_PER_USEC;			\
+	else								\
+		*(__PTR) = __data;					\
+	return count;							\
+}
+STORE_FUNCTION(bfq_max_budget_store, &bfqd->max_budget, 32, INT_MAX, 0);
+STORE_FUNCTION(bfq_timeout_sync_store, &bfqd->timeout_sync, 1, INT_MAX, 1);
+STORE_FUNCTION(bfq_slice_idle_us_store, &bfqd->slice_idle, 0, UINT_MAX, 2);
+STORE_FUNCTION(bfq_fifo_expire_async_store, &bfqd->fifo_expire[0], 1, INT_MAX, 1);
+STORE_FUNCTION(bfq_fifo_expire_sync_store, &bfqd->fifo_expire[1], 1, INT_MAX, 1);
+#undef STORE_FUNCTION
+
+#define BFQ_ATTR(name) \
+	__ATTR(name, S_IRUGO|S_IWUSR, bfq_##name##_show, bfq_##name##_store)
+
+static struct elv_fs_entry bfq_attrs[] = {
+	BFQ_ATTR(max_budget),
+	BFQ_ATTR(timeout_sync),
+	BFQ_ATTR(slice_idle_us),
+	BFQ_ATTR(fifo_expire_async),
+	BFQ_ATTR(fifo_expire_sync),
+	__ATTR_NULL
+};
+
+static struct elevator_type iosched_bfq = {
+	.mq_ops = {
+		.init_sched		= bfq_init_queue,
+		.exit_sched		= bfq_exit_queue,
+		.bio_merge		= bfq_bio_merge,
+		.former_request		= elv_rb_former_request,
+		.latter_request		= elv_rb_latter_request,
+		.requests_merged	= bfq_requests_merged,
+		.insert_requests	= bfq_insert_requests,
+		.dispatch_request	= bfq_dispatch_request,
+		.has_work		= bfq_has_work,
+		.completed_request	= bfq_completed_request,
+	},
+
+	.uses_mq = true,
+	.elevator_attrs = bfq_attrs,
+	.elevator_name = "bfq",
+	.elevator_owner = THIS_MODULE,
+};
+
+#ifdef CONFIG_BFQ_GROUP_IOSCHED
+
+static struct blkcg_policy_data *bfq_cpd_alloc(gfp_t gfp)
+{
+	struct bfq_group_data *bgd;
+
+	bgd = kzalloc(sizeof(*bgd), gfp);
+	if (!bgd)
+		return NULL;
+	return &bgd->cpd;
+}
+
+static void bfq_cpd_init(struct blkcg_policy_data *cpd)
+{
+	cpd_to_bfqgd(cpd)->weight = BFQ_WEIGHT_DFL;
+}
+
+static void bfq_cpd_free(struct blkcg_policy_data *cpd)
+{
+	kfree(cpd_to_bfqgd(cpd));
+}
+
+static struct blkg_policy_data *bfq_pd_alloc(gfp_t gfp, int node)
+{
+	struct bfq_group *bfqg;
+
+	bfqg = kzalloc_node(sizeof(*bfqg), gfp, node);
+	if (!bfqg)
+		return NULL;
+
+	bfq_init_group(bfqg, BFQ_WEIGHT_DFL);
+	return &bfqg->pd;
+}
+
+static void bfq_pd_init(struct blkg_policy_data *pd)
+{
+	struct bfq_group *bfqg = pd_to_bfqg(pd);
+	struct bfq_group_data *bgd = blkcg_to_bfqgd(pd->blkg->blkcg);
+
+	bfqg->weight = bgd->weight;
+	bfqg->new_weight = bgd->weight;
+}
+
+static void bfq_pd_free(struct blkg_policy_data *pd)
+{
+	kfree(pd_to_bfqg(pd));
+}
+
+static u64 bfq_weight_read(struct cgroup_subsys_state *css,
+			   struct cftype *cft)
+{
+	struct bfq_group_data *bgd = blkcg_to_bfqgd(css_to_blkcg(css));
+
+	return bgd ? bgd->weight : 0;
+}
+
+/*
+ * The new weight applies to each group of the cgroup from the start of
+ * its next turn.
+ */
+static int bfq_weight_write(struct cgroup_subsys_state *css,
+			    struct cftype *cft, u64 val)
+{
+	struct blkcg *blkcg = css_to_blkcg(css);
+	struct bfq_group_data *bgd;
+	struct blkcg_gq *blkg;
+	int ret = 0;
+
+	if (val < BFQ_WEIGHT_MIN || val > BFQ_WEIGHT_MAX)
+		return -ERANGE;
+
+	spin_lock_irq(&blkcg->lock);
+	bgd = blkcg_to_bfqgd(blkcg);
+	if (!bgd) {
+		ret = -EINVAL;
+		goto out;
+	}
+	bgd->weight = val;
+
+	hlist_for_each_entry(blkg, &blkcg->blkg_list, blkcg_node) {
+		struct bfq_group *bfqg = blkg_to_bfqg(blkg);
+
+		if (bfqg)
+			bfqg->new_weight = val;
+	}
+out:
+	spin_unlock_irq(&blkcg->lock);
+	return ret;
+}
+
+static struct cftype bfq_blkcg_legacy_files[] = {
+	{
+		.name = "bfq.weight",
+		.read_u64 = bfq_weight_read,
+		.write_u64 = bfq_weight_write,
+	},
+	{ }	/* terminate */
+};
+
+static struct cftype bfq_blkcg_files[] = {
+	{
+		.name = "bfq.weight",
+		.read_u64 = bfq_weight_read,
+		.write_u64 = bfq_weight_write,
+	},
+	{ }	/* terminate */
+};
+
+static struct blkcg_policy blkcg_policy_bfq = {
+	.dfl_cftypes		= bfq_blkcg_files,
+	.legacy_cftypes		= bfq_blkcg_legacy_files,
+
+	.cpd_alloc_fn		= bfq_cpd_alloc,
+	.cpd_init_fn		= bfq_cpd_init,
+	.cpd_free_fn		= bfq_cpd_free,
+
+	.pd_alloc_fn		= bfq_pd_alloc,
+	.pd_init_fn		= bfq_pd_init,
+	.pd_free_fn		= bfq_pd_free,
+};
+
+#endif /* CONFIG_BFQ_GROUP_IOSCHED */
+
+static int __init bfq_init(void)
+{
+	int ret;
+
+#ifdef CONFIG_BFQ_GROUP_IOSCHED
+	ret = blkcg_policy_register(&blkcg_policy_bfq);
+	if (ret)
+		return ret;
+#endif
+
+	ret = elv_register(&iosched_bfq);
+	if (ret) {
+#ifdef CONFIG_BFQ_GROUP_IOSCHED
+		blkcg_policy_unregister(&blkcg_policy_bfq);
+#endif
+		return ret;
+	}
+
+	return 0;
+}
+
+static void __exit bfq_exit(void)
+{
+	elv_unregister(&iosched_bfq);
+#ifdef CONFIG_BFQ_GROUP_IOSCHED
+	blkcg_policy_unregister(&blkcg_policy_bfq);
+#endif
+}
+
+module_init(bfq_init);
+module_exit(bfq_exit);
+
+MODULE_LICENSE("GPL");
+MODULE_DESCRIPTION("Budget Fair Queueing IO scheduler");
@@ -30,6 +30,7 @@
 #include <linux/cgroup.h>
 
 #include <trace/events/block.h>
+#include "blk.h"
 
 /*
  * Test patch to inline a certain number of bi_io_vec's inside the bio
@@ -241,10 +242,14 @@ fallback:
 
 static void __bio_free(struct bio *bio)
 {
+	blk_throtl_bio_release(bio);
 	bio_disassociate_task(bio);
 
 	if (bio_integrity(bio))
 		bio_integrity_free(bio);
+
+	if (bio_has_crypt_ctx(bio))
+		bio_crypt_free_ctx(bio);
 }
 
 static void bio_free(struct bio *bio)
@@ -617,6 +622,11 @@ struct bio *bio_clone_fast(struct bio *bio, gfp_t gfp_mask, struct bio_set *bs)
 		}
 	}
 
+	if (bio_crypt_clone(b, bio, gfp_mask) < 0) {
+		bio_put(b);
+		return NULL;
+	}
+
 	return b;
 }
 EXPORT_SYMBOL(bio_clone_fast);
@@ -690,6 +700,11 @@ struct bio *bio_clone_bioset(struct bio *bio_src, gfp_t gfp_mask,
 		}
 	}
 
+	if (bio_crypt_clone(bio, bio_src, gfp_mask) < 0) {
+		bio_put(bio);
+		return NULL;
+	}
+
 	bio_clone_blkcg_association(bio, bio_src);
 
 	return bio;
@@ -898,6 +913,9 @@ void bio_advance(struct bio *bio, unsigned bytes)
 	if (bio_integrity(bio))
 		bio_integrity_advance(bio, bytes);
 
+	if (bio_has_crypt_ctx(bio))
+		bio_crypt_advance(bio, bytes);
+
 	bio_advance_iter(bio, &bio->bi_iter, bytes);
 }
 EXPORT_SYMBOL(bio_advance);
@@ -1745,6 +1763,8 @@ again:
 	if (!bio_remaining_done(bio))
 		return;
 
+	blk_throtl_bio_endio(bio);
+
 	/*
 	 * Need to have a real endio function for chained bios, otherwise
 	 * various corner cases will break (like stacking block devices that
@@ -2041,6 +2061,73 @@ static void __init biovec_init_slabs(void)
 	}
 }
 
+#ifdef CONFIG_BLK_INLINE_ENCRYPTION
+static struct kmem_cache *bio_crypt_ctx_cache;
+static mempool_t *bio_crypt_ctx_pool;
+
+/**
+ * bio_crypt_set_ctx - attach an encryption context to a bio
+ * @bio:	bio to encrypt or decrypt
+ * @key:	key to use, must outlive @bio
+ * @dun:	data unit number of the first data unit of @bio
+ * @gfp_mask:	memory allocation mask
+ *
+ * Description: The data of @bio is encrypted on its way to the device, or
+ *   decrypted once read, by the device itself if it supports the key's mode
+ *   and data unit size, and by the block layer otherwise.  The context is
+ *   freed with the bio.  Cannot fail if @gfp_mask allows direct reclaim.
+ */
+int bio_crypt_set_ctx(struct bio *bio, const struct blk_crypto_key *key,
+		      u64 dun, gfp_t gfp_mask)
+{
+	struct bio_crypt_ctx *bc;
+
+	bc = mempool_alloc(bio_crypt_ctx_pool, gfp_mask);
+	if (!bc)
+		return -ENOMEM;
+
+	bc->bc_key = key;
+	bc->bc_dun = dun;
+	bio->bi_crypt_context = bc;
+	return 0;
+}
+EXPORT_SYMBOL_GPL(bio_crypt_set_ctx);
+
+void bio_crypt_free_ctx(struct bio *bio)
+{
+	mempool_free(bio->bi_crypt_context, bio_crypt_ctx_pool);
+	bio->bi_crypt_context = NULL;
+}
+
+int bio_crypt_clone(struct bio *dst, struct bio *src, gfp_t gfp_mask)
+{
+	struct bio_crypt_ctx *bc = src->bi_crypt_context;
+
+	if (!bc)
+		return 0;
+	return bio_crypt_set_ctx(dst, bc->bc_key, bc->bc_dun, gfp_mask);
+}
+EXPORT_SYMBOL_GPL(bio_crypt_clone);
+
+void bio_crypt_advance(struct bio *bio, unsigned int bytes)
+{
+	struct bio_crypt_ctx *bc = bio->bi_crypt_context;
+
+	bc->bc_dun += bytes >> ilog2(bc->bc_key->data_unit_size);
+}
+
+static void __init bio_crypt_init(void)
+{
+	bio_crypt_ctx_cache = KMEM_CACHE(bio_crypt_ctx, SLAB_PANIC);
+	bio_crypt_ctx_pool = mempool_create_slab_pool(BIO_POOL_SIZE,
+						      bio_crypt_ctx_cache);
+	if (!bio_crypt_ctx_pool)
+		panic("bio: can't create crypt context pool\n");
+}
+#else
+static inline void bio_crypt_init(void) { }
+#endif
+
 static int __init init_bio(void)
 {
 	bio_slab_max = 2;
@@ -2050,6 +2137,7 @@ static int __init init_bio(void)
 		panic("bio: can't allocate bios\n");
 
 	bio_integrity_init();
+	bio_crypt_init();
 	biovec_init_slabs();
 
 	fs_bio_set = bioset_create(BIO_POOL_SIZE, 0);
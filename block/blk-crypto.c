@@ -0,0 +1,533 @@
+/*
+ * Inline encryption support and its software fallback
+ *
+ * A bio may carry an encryption context, see bio_crypt_set_ctx(): a key
+ * and the data unit number (DUN) of its first data unit.  Its data is to be
+ * encrypted on the way to the device and decrypted on the way back, each
+ * data unit separately with its DUN as IV.  Drivers with an inline
+ * encryption engine advertise the modes and data unit sizes they support
+ * with blk_queue_inline_crypto() and find the context in the bios of their
+ * requests.
+ *
+ * For every other queue, blk_crypto_bio_prep() does the work in software
+ * when the bio is submitted.  Writes are encrypted into bounce pages taken
+ * from a pool and sent down in a new bio, so the caller's pages stay
+ * plaintext.  Reads are decrypted in place from a workqueue once they
+ * complete.  Each bio's data units are fed to the cipher through a batch
+ * of requests in flight at once, which keeps asynchronous implementations
+ * busy.  The bounce pages, cipher requests and read contexts are still
+ * allocated for every IO; they are backed by mempools only so that the
+ * fallback makes progress under memory pressure.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation.
+ */
+#include <linux/kernel.h>
+#include <linux/module.h>
+#include <linux/bio.h>
+#include <linux/blkdev.h>
+#include <linux/blk-crypto.h>
+#include <linux/mempool.h>
+#include <linux/scatterlist.h>
+#include <linux/slab.h>
+#include <linux/workqueue.h>
+#include <crypto/skcipher.h>
+
+/*
+ * Bounce pages kept for writes, and bios to carry them.  A write bio never
+ * takes more pages than the pool holds, see blk_crypto_alloc_bounce_pages().
+ */
+#define BLK_CRYPTO_BOUNCE_POOL_SIZE	32
+/* data units in flight at once, per bio */
+#define BLK_CRYPTO_BATCH		8
+#define BLK_CRYPTO_IV_SIZE		16
+
+static const struct blk_crypto_mode {
+	const char *cipher;
+	unsigned int key_size;
+} blk_crypto_modes[BLK_ENCRYPTION_MODE_MAX] = {
+	[BLK_ENCRYPTION_MODE_AES_256_XTS] = {
+		.cipher		= "xts(aes)",
+		.key_size	= 64,
+	},
+};
+
+struct blk_crypto_slot {
+	struct skcipher_request *req;
+	struct scatterlist src, dst;
+	union {
+		__le64 dun;
+		u8 bytes[BLK_CRYPTO_IV_SIZE];
+	} iv;
+};
+
+/*
+ * The cipher requests of one bio.  Allocated from the key's pool, with the
+ * requests themselves, whose size depends on the cipher, following it.
+ */
+struct blk_crypto_batch {
+	struct completion done;
+	atomic_t pending;
+	int err;
+	struct blk_crypto_slot slots[BLK_CRYPTO_BATCH];
+	u8 reqs[0] CRYPTO_MINALIGN_ATTR;
+};
+
+/* what a read needs to be decrypted and completed */
+struct blk_crypto_read_ctx {
+	struct bio *bio;
+	bio_end_io_t *end_io;
+	void *private;
+	struct bio_crypt_ctx *bc;
+	struct bvec_iter iter;
+	struct work_struct work;
+};
+
+static struct bio_set *blk_crypto_bio_set;
+static struct bio_set *blk_crypto_split_set;
+static mempool_t *blk_crypto_page_pool;
+static struct kmem_cache *blk_crypto_read_ctx_cache;
+static mempool_t *blk_crypto_read_ctx_pool;
+static struct workqueue_struct *blk_crypto_wq;
+static DEFINE_MUTEX(blk_crypto_page_lock);
+
+static unsigned int blk_crypto_req_size(struct crypto_skcipher *tfm)
+{
+	return ALIGN(sizeof(struct skcipher_request) +
+		     crypto_skcipher_reqsize(tfm), CRYPTO_MINALIGN);
+}
+
+/**
+ * blk_crypto_init_key - prepare an inline encryption key
+ * @key:	key to set up
+ * @raw:	the raw key
+ * @size:	size of @raw in bytes
+ * @mode:	encryption algorithm
+ * @data_unit_size: size of the units the data is en/decrypted in
+ *
+ * Description: Also sets up what the software fallback needs to use the
+ *   key, since it can't allocate that in the IO path.  Free the key with
+ *   blk_crypto_free_key() once no bio uses it anymore.
+ */
+int blk_crypto_init_key(struct blk_crypto_key *key, const u8 *raw,
+			unsigned int size, enum blk_crypto_mode_num mode,
+			unsigned int data_unit_size)
+{
+	struct crypto_skcipher *tfm;
+	int ret;
+
+	if (mode <= BLK_ENCRYPTION_MODE_INVALID ||
+	    mode >= BLK_ENCRYPTION_MODE_MAX ||
+	    size != blk_crypto_modes[mode].key_size)
+		return -EINVAL;
+	if (!is_power_of_2(data_unit_size) || data_unit_size < 512 ||
+	    data_unit_size > PAGE_SIZE)
+		return -EINVAL;
+
+	memset(key, 0, sizeof(*key));
+	key->mode = mode;
+	key->data_unit_size = data_unit_size;
+	key->size = size;
+	memcpy(key->raw, raw, size);
+
+	tfm = crypto_alloc_skcipher(blk_crypto_modes[mode].cipher, 0, 0);
+	if (IS_ERR(tfm)) {
+		ret = PTR_ERR(tfm);
+		goto out_zero;
+	}
+	crypto_skcipher_set_flags(tfm, CRYPTO_TFM_REQ_WEAK_KEY);
+	ret = crypto_skcipher_setkey(tfm, raw, size);
+	if (ret)
+		goto out_free_tfm;
+
+	ret = -ENOMEM;
+	key->fallback_pool = mempool_create_kmalloc_pool(1,
+				sizeof(struct blk_crypto_batch) +
+				BLK_CRYPTO_BATCH * blk_crypto_req_size(tfm));
+	if (!key->fallback_pool)
+		goto out_free_tfm;
+
+	key->fallback_tfm = tfm;
+	return 0;
+
+out_free_tfm:
+	crypto_free_skcipher(tfm);
+out_zero:
+	memzero_explicit(key, sizeof(*key));
+	return ret;
+}
+EXPORT_SYMBOL_GPL(blk_crypto_init_key);
+
+void blk_crypto_free_key(struct blk_crypto_key *key)
+{
+	mempool_destroy(key->fallback_pool);
+	crypto_free_skcipher(key->fallback_tfm);
+	memzero_explicit(key, sizeof(*key));
+}
+EXPORT_SYMBOL_GPL(blk_crypto_free_key);
+
+/**
+ * blk_queue_inline_crypto - advertise inline encryption support
+ * @q:		the request queue for the device
+ * @mode:	encryption algorithm
+ * @data_unit_sizes: bitmask of the data unit sizes supported for @mode
+ *
+ * Description: Bios for @q that are encrypted with @mode and one of
+ *   @data_unit_sizes are passed to the driver with their encryption
+ *   context, instead of being handled by the software fallback.
+ */
+void blk_queue_inline_crypto(struct request_queue *q,
+			     enum blk_crypto_mode_num mode,
+			     unsigned int data_unit_sizes)
+{
+	q->crypto_modes[mode] = data_unit_sizes;
+}
+EXPORT_SYMBOL_GPL(blk_queue_inline_crypto);
+
+static bool blk_crypto_queue_supports(struct request_queue *q,
+				      const struct blk_crypto_key *key)
+{
+	return q->crypto_modes[key->mode] & key->data_unit_size;
+}
+
+static void blk_crypto_req_done(struct crypto_async_request *areq, int err)
+{
+	struct blk_crypto_batch *batch = areq->data;
+
+	/* a backlogged request was started, it will be back */
+	if (err == -EINPROGRESS)
+		return;
+
+	if (err)
+		batch->err = err;
+	if (atomic_dec_and_test(&batch->pending))
+		complete(&batch->done);
+}
+
+/* wait for the requests in flight, and get the batch ready for more */
+static int blk_crypto_batch_wait(struct blk_crypto_batch *batch)
+{
+	int err;
+
+	if (!atomic_dec_and_test(&batch->pending))
+		wait_for_completion(&batch->done);
+
+	err = batch->err;
+	atomic_set(&batch->pending, 1);
+	reinit_completion(&batch->done);
+	return err;
+}
+
+/*
+ * En/decrypt the data of @src described by @iter, starting with data unit
+ * @dun.  The result goes to the pages of @dst, which has one segment for
+ * each segment of @src with the same offset and length, or back to @src if
+ * @dst is NULL.
+ */
+static int blk_crypto_crypt_bio(const struct blk_crypto_key *key, u64 dun,
+				struct bio *src, struct bvec_iter iter,
+				struct bio *dst, bool encrypt)
+{
+	unsigned int dus = key->data_unit_size;
+	unsigned int req_size = blk_crypto_req_size(key->fallback_tfm);
+	struct blk_crypto_batch *batch;
+	struct bvec_iter src_iter;
+	struct bio_vec bv;
+	int i, nr = 0, seg = 0;
+	int ret = 0;
+
+	batch = mempool_alloc(key->fallback_pool, GFP_NOIO);
+	init_completion(&batch->done);
+	atomic_set(&batch->pending, 1);
+	batch->err = 0;
+
+	for (i = 0; i < BLK_CRYPTO_BATCH; i++) {
+		struct skcipher_request *req = (void *)batch->reqs +
+					       i * req_size;
+
+		skcipher_request_set_tfm(req, key->fallback_tfm);
+		skcipher_request_set_callback(req,
+				CRYPTO_TFM_REQ_MAY_BACKLOG |
+				CRYPTO_TFM_REQ_MAY_SLEEP,
+				blk_crypto_req_done, batch);
+		batch->slots[i].req = req;
+	}
+
+	__bio_for_each_segment(bv, src, src_iter, iter) {
+		struct page *dst_page = dst ? dst->bi_io_vec[seg].bv_page :
+					      bv.bv_page;
+		unsigned int off;
+
+		seg++;
+		for (off = 0; off < bv.bv_len; off += dus) {
+			struct blk_crypto_slot *slot = &batch->slots[nr];
+
+			sg_init_table(&slot->src, 1);
+			sg_set_page(&slot->src, bv.bv_page, dus,
+				    bv.bv_offset + off);
+			sg_init_table(&slot->dst, 1);
+			sg_set_page(&slot->dst, dst_page, dus,
+				    bv.bv_offset + off);
+			memset(&slot->iv, 0, sizeof(slot->iv));
+			slot->iv.dun = cpu_to_le64(dun++);
+			skcipher_request_set_crypt(slot->req, &slot->src,
+						   &slot->dst, dus,
+						   slot->iv.bytes);
+
+			atomic_inc(&batch->pending);
+			if (encrypt)
+				ret = crypto_skcipher_encrypt(slot->req);
+			else
+				ret = crypto_skcipher_decrypt(slot->req);
+			if (ret != -EINPROGRESS && ret != -EBUSY)
+				blk_crypto_req_done(&slot->req->base, ret);
+
+			if (++nr == BLK_CRYPTO_BATCH) {
+				ret = blk_crypto_batch_wait(batch);
+				if (ret)
+					goto out;
+				nr = 0;
+			}
+		}
+	}
+
+	ret = blk_crypto_batch_wait(batch);
+out:
+	mempool_free(batch, key->fallback_pool);
+	return ret;
+}
+
+static void blk_crypto_free_bounce_pages(struct bio *bio)
+{
+	struct bio_vec *bv;
+	int i;
+
+	bio_for_each_segment_all(bv, bio, i)
+		mempool_free(bv->bv_page, blk_crypto_page_pool);
+}
+
+/*
+ * Give @enc_bio a bounce page for each segment of @src_bio.  Try without
+ * waiting first.  If both the page allocator and the pool are dry, hand
+ * back what we got and wait for pages with blk_crypto_page_lock held:
+ * several writers each sitting on part of the pool could otherwise wait
+ * for each other forever, while a single waiter gets all it needs once
+ * enough of the writes in flight complete.
+ */
+static void blk_crypto_alloc_bounce_pages(struct bio *enc_bio,
+					  struct bio *src_bio)
+{
+	gfp_t gfp = GFP_NOWAIT | __GFP_NOWARN;
+	struct bvec_iter iter;
+	struct bio_vec bv;
+
+retry:
+	bio_for_each_segment(bv, src_bio, iter) {
+		struct bio_vec *enc_bv = &enc_bio->bi_io_vec[enc_bio->bi_vcnt];
+
+		enc_bv->bv_page = mempool_alloc(blk_crypto_page_pool, gfp);
+		if (!enc_bv->bv_page) {
+			blk_crypto_free_bounce_pages(enc_bio);
+			enc_bio->bi_vcnt = 0;
+			enc_bio->bi_iter.bi_size = 0;
+			mutex_lock(&blk_crypto_page_lock);
+			gfp = GFP_NOIO;
+			goto retry;
+		}
+		enc_bv->bv_len = bv.bv_len;
+		enc_bv->bv_offset = bv.bv_offset;
+		enc_bio->bi_vcnt++;
+		enc_bio->bi_iter.bi_size += bv.bv_len;
+	}
+
+	if (gfp == GFP_NOIO)
+		mutex_unlock(&blk_crypto_page_lock);
+}
+
+static void blk_crypto_write_endio(struct bio *enc_bio)
+{
+	struct bio *src_bio = enc_bio->bi_private;
+
+	blk_crypto_free_bounce_pages(enc_bio);
+	src_bio->bi_error = enc_bio->bi_error;
+	bio_put(enc_bio);
+	bio_endio(src_bio);
+}
+
+/*
+ * Replace *@bio_ptr by a bio with the encrypted data.  A bio with more
+ * segments than there are pages in the bounce pool is split, and the rest
+ * queued on current->bio_list, to be encrypted once the head is on its
+ * way.  The splits come from a bio_set of their own: a writer holding a
+ * split while waiting for an encrypted bio must not be what keeps
+ * another writer from getting one.
+ */
+static bool blk_crypto_encrypt_bio(struct bio **bio_ptr)
+{
+	struct bio *src_bio = *bio_ptr;
+	struct bio_crypt_ctx *bc = src_bio->bi_crypt_context;
+	struct bvec_iter iter;
+	struct bio_vec bv;
+	struct bio *enc_bio;
+	int ret;
+
+	if (bio_segments(src_bio) > BLK_CRYPTO_BOUNCE_POOL_SIZE) {
+		unsigned int sectors = 0, i = 0;
+		struct bio *split;
+
+		bio_for_each_segment(bv, src_bio, iter) {
+			if (i++ == BLK_CRYPTO_BOUNCE_POOL_SIZE)
+				break;
+			sectors += bv.bv_len >> 9;
+		}
+
+		split = bio_split(src_bio, sectors, GFP_NOIO,
+				  blk_crypto_split_set);
+		bio_chain(split, src_bio);
+		bio_list_add(current->bio_list, src_bio);
+		src_bio = split;
+	}
+
+	enc_bio = bio_alloc_bioset(GFP_NOIO, bio_segments(src_bio),
+				   blk_crypto_bio_set);
+	enc_bio->bi_bdev = src_bio->bi_bdev;
+	enc_bio->bi_opf = src_bio->bi_opf;
+	enc_bio->bi_iter.bi_sector = src_bio->bi_iter.bi_sector;
+	bio_clone_blkcg_association(enc_bio, src_bio);
+	blk_crypto_alloc_bounce_pages(enc_bio, src_bio);
+
+	ret = blk_crypto_crypt_bio(bc->bc_key, bc->bc_dun, src_bio,
+				   src_bio->bi_iter, enc_bio, true);
+	if (ret) {
+		blk_crypto_free_bounce_pages(enc_bio);
+		bio_put(enc_bio);
+		src_bio->bi_error = -EIO;
+		bio_endio(src_bio);
+		return false;
+	}
+
+	enc_bio->bi_private = src_bio;
+	enc_bio->bi_end_io = blk_crypto_write_endio;
+	*bio_ptr = enc_bio;
+	return true;
+}
+
+static void blk_crypto_read_work(struct work_struct *work)
+{
+	struct blk_crypto_read_ctx *rc =
+		container_of(work, struct blk_crypto_read_ctx, work);
+	struct bio *bio = rc->bio;
+
+	if (!bio->bi_error &&
+	    blk_crypto_crypt_bio(rc->bc->bc_key, rc->bc->bc_dun, bio,
+				 rc->iter, NULL, false))
+		bio->bi_error = -EIO;
+
+	bio->bi_end_io = rc->end_io;
+	bio->bi_private = rc->private;
+	bio->bi_crypt_context = rc->bc;
+	mempool_free(rc, blk_crypto_read_ctx_pool);
+	bio_endio(bio);
+}
+
+/* decryption may sleep, so it can't be done from the completion */
+static void blk_crypto_read_endio(struct bio *bio)
+{
+	struct blk_crypto_read_ctx *rc = bio->bi_private;
+
+	INIT_WORK(&rc->work, blk_crypto_read_work);
+	queue_work(blk_crypto_wq, &rc->work);
+}
+
+/*
+ * Hook the completion of a read, after which its data is decrypted.  The
+ * encryption context is taken off the bio meanwhile, so the layers below
+ * see a plain read.
+ */
+static void blk_crypto_prep_read(struct bio *bio)
+{
+	struct blk_crypto_read_ctx *rc;
+
+	rc = mempool_alloc(blk_crypto_read_ctx_pool, GFP_NOIO);
+	rc->bio = bio;
+	rc->end_io = bio->bi_end_io;
+	rc->private = bio->bi_private;
+	rc->bc = bio->bi_crypt_context;
+	/* splitting below advances the bio, but the data starts here */
+	rc->iter = bio->bi_iter;
+
+	bio->bi_crypt_context = NULL;
+	bio->bi_end_io = blk_crypto_read_endio;
+	bio->bi_private = rc;
+}
+
+/* the software fallback works in whole data units per segment */
+static bool blk_crypto_bio_aligned(struct bio *bio, unsigned int dus)
+{
+	struct bvec_iter iter;
+	struct bio_vec bv;
+
+	bio_for_each_segment(bv, bio, iter)
+		if (bv.bv_len & (dus - 1))
+			return false;
+	return true;
+}
+
+/**
+ * blk_crypto_bio_prep - prepare an encrypted bio for submission
+ * @bio_ptr:	the bio being submitted
+ *
+ * Description: Called by generic_make_request() with current->bio_list
+ *   set.  If the bio has an encryption context its queue can't handle,
+ *   the software fallback takes over, and *@bio_ptr may be replaced by a
+ *   bio with encrypted data.  Returns false if the bio was failed instead.
+ */
+bool blk_crypto_bio_prep(struct bio **bio_ptr)
+{
+	struct bio *bio = *bio_ptr;
+	const struct blk_crypto_key *key;
+
+	if (!bio_has_crypt_ctx(bio) || !bio_has_data(bio))
+		return true;
+
+	key = bio->bi_crypt_context->bc_key;
+	if (blk_crypto_queue_supports(bdev_get_queue(bio->bi_bdev), key))
+		return true;
+
+	if (bio_op(bio) == REQ_OP_WRITE_SAME ||
+	    !blk_crypto_bio_aligned(bio, key->data_unit_size)) {
+		bio->bi_error = -EIO;
+		bio_endio(bio);
+		return false;
+	}
+
+	if (op_is_write(bio_op(bio)))
+		return blk_crypto_encrypt_bio(bio_ptr);
+
+	blk_crypto_prep_read(bio);
+	return true;
+}
+
+static int __init blk_crypto_init(void)
+{
+	blk_crypto_bio_set = bioset_create(BLK_CRYPTO_BOUNCE_POOL_SIZE, 0);
+	blk_crypto_split_set = bioset_create(BIO_POOL_SIZE, 0);
+	blk_crypto_page_pool =
+		mempool_create_page_pool(BLK_CRYPTO_BOUNCE_POOL_SIZE, 0);
+	blk_crypto_read_ctx_cache = KMEM_CACHE(blk_crypto_read_ctx,
+					       SLAB_PANIC);
+	blk_crypto_read_ctx_pool = mempool_create_slab_pool(BIO_POOL_SIZE,
+						blk_crypto_read_ctx_cache);
+	blk_crypto_wq = alloc_workqueue("blk_crypto",
+					WQ_UNBOUND | WQ_HIGHPRI |
+					WQ_MEM_RECLAIM, 0);
+
+	if (!blk_crypto_bio_set || !blk_crypto_split_set ||
+	    !blk_crypto_page_pool || !blk_crypto_read_ctx_pool ||
+	    !blk_crypto_wq)
+		panic("blk-crypto: failed to allocate fallback resources\n");
+
+	return 0;
+}
+subsys_initcall(blk_crypto_init);
@@ -694,6 +694,9 @@ static int attempt_merge(struct request_queue *q, struct request *req,
 	    !blk_write_same_mergeable(req->bio, next->bio))
 		return 0;
 
+	if (!bio_crypt_ctx_mergeable(req->bio, blk_rq_bytes(req), next->bio))
+		return 0;
+
 	/*
 	 * If we are allowed to merge, then append bio list
 	 * from next to rq and release next. merge_requests_fn
@@ -743,7 +746,9 @@ static int attempt_merge(struct request_queue *q, struct request *req,
 
 	/* owner-ship of bio passed from next to req */
 	next->bio = NULL;
-	__blk_put_request(q, next);
+	/* blk-mq schedulers free it once they dropped their lock */
+	if (!q->mq_ops)
+		__blk_put_request(q, next);
 	return 1;
 }
 
@@ -804,6 +809,15 @@ bool blk_rq_merge_ok(struct request *rq, struct bio *bio)
 	    !blk_write_same_mergeable(rq->bio, bio))
 		return false;
 
+	/* encrypted data units must stay consecutive */
+	if (blk_rq_pos(rq) + blk_rq_sectors(rq) == bio->bi_iter.bi_sector) {
+		if (!bio_crypt_ctx_mergeable(rq->bio, blk_rq_bytes(rq), bio))
+			return false;
+	} else if (!bio_crypt_ctx_mergeable(bio, bio->bi_iter.bi_size,
+					    rq->bio)) {
+		return false;
+	}
+
 	return true;
 }
 
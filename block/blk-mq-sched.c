@@ -0,0 +1,231 @@
+/*
+ * I/O scheduler framework for blk-mq
+ *
+ * An I/O scheduler attached to a blk-mq queue (see struct elevator_mq_ops)
+ * gets to see regular filesystem requests between their allocation and
+ * their issue to the driver.  Flush sequences, passthrough requests and
+ * requeued requests bypass it and go through the software queues as
+ * before, ahead of anything the scheduler holds.
+ *
+ * Requests keep the driver tag they were allocated with while they sit in
+ * the scheduler, so a request is always dispatched on the hardware queue
+ * it was inserted on, and the queue depth bounds how much the scheduler
+ * gets to reorder.
+ */
+#include <linux/kernel.h>
+#include <linux/module.h>
+#include <linux/blk-mq.h>
+
+#include <trace/events/block.h>
+
+#include "blk.h"
+#include "blk-mq.h"
+#include "blk-mq-sched.h"
+
+int blk_mq_sched_init_hctx(struct request_queue *q, struct blk_mq_hw_ctx *hctx,
+			   unsigned int hctx_idx)
+{
+	struct elevator_queue *e = q->elevator;
+
+	if (e && e->type->mq_ops.init_hctx)
+		return e->type->mq_ops.init_hctx(hctx, hctx_idx);
+	return 0;
+}
+
+void blk_mq_sched_exit_hctx(struct request_queue *q, struct blk_mq_hw_ctx *hctx,
+			    unsigned int hctx_idx)
+{
+	struct elevator_queue *e = q->elevator;
+
+	if (e && e->type->mq_ops.exit_hctx)
+		e->type->mq_ops.exit_hctx(hctx, hctx_idx);
+	hctx->sched_data = NULL;
+}
+
+/*
+ * Attach @e to @q.  The caller has frozen and quiesced the queue.  The
+ * scheduler's init_sched() allocates the elevator_queue and sets
+ * q->elevator, like the legacy elevator_init_fn() does.
+ */
+int blk_mq_init_sched(struct request_queue *q, struct elevator_type *e)
+{
+	struct blk_mq_hw_ctx *hctx;
+	unsigned int i;
+	int ret;
+
+	ret = e->mq_ops.init_sched(q, e);
+	if (ret)
+		return ret;
+
+	queue_for_each_hw_ctx(q, hctx, i) {
+		ret = blk_mq_sched_init_hctx(q, hctx, i);
+		if (ret)
+			goto err;
+	}
+
+	return 0;
+
+err:
+	while (i--)
+		blk_mq_sched_exit_hctx(q, q->queue_hw_ctx[i], i);
+	elevator_exit(q->elevator);
+	q->elevator = NULL;
+	return ret;
+}
+
+void blk_mq_exit_sched(struct request_queue *q, struct elevator_queue *e)
+{
+	struct blk_mq_hw_ctx *hctx;
+	unsigned int i;
+
+	queue_for_each_hw_ctx(q, hctx, i)
+		blk_mq_sched_exit_hctx(q, hctx, i);
+	q->elevator = NULL;
+	elevator_exit(e);
+}
+
+/*
+ * A frozen queue has no requests left, but a hardware queue run may still
+ * be pending from before the freeze.  Stop the hardware queues and wait
+ * for such runs, so nobody looks at q->elevator while it is switched.
+ *
+ * Hardware queues the driver had stopped itself are left for the driver
+ * to restart, unless the delayed restart of blk_mq_delay_queue() had to
+ * be cancelled here.
+ */
+void blk_mq_sched_quiesce(struct request_queue *q)
+{
+	struct blk_mq_hw_ctx *hctx;
+	unsigned int i;
+
+	queue_for_each_hw_ctx(q, hctx, i) {
+		bool restart;
+
+		restart = !test_and_set_bit(BLK_MQ_S_STOPPED, &hctx->state);
+		cancel_delayed_work_sync(&hctx->run_work);
+		if (cancel_delayed_work_sync(&hctx->delay_work))
+			restart = true;
+		if (restart)
+			set_bit(BLK_MQ_S_SCHED_QUIESCED, &hctx->state);
+	}
+}
+
+void blk_mq_sched_unquiesce(struct request_queue *q)
+{
+	struct blk_mq_hw_ctx *hctx;
+	unsigned int i;
+
+	queue_for_each_hw_ctx(q, hctx, i) {
+		if (!test_and_clear_bit(BLK_MQ_S_SCHED_QUIESCED, &hctx->state))
+			continue;
+		clear_bit(BLK_MQ_S_STOPPED, &hctx->state);
+		blk_mq_run_hw_queue(hctx, true);
+	}
+}
+
+/**
+ * blk_mq_sched_try_merge - merge a bio into a request held by a scheduler
+ * @q:		the queue
+ * @rq:		candidate request, found by the scheduler
+ * @bio:	bio to merge
+ * @merged_request: set to the request merged away, or NULL
+ *
+ * Returns ELEVATOR_BACK_MERGE or ELEVATOR_FRONT_MERGE if @bio was merged
+ * into @rq, and ELEVATOR_NO_MERGE otherwise.  The scheduler is expected
+ * to hold its own lock.
+ *
+ * Like the legacy path, a successful bio merge is followed by an attempt
+ * to merge @rq with the request after it (back merge) or before it (front
+ * merge), which may now be contiguous.  If that works, the scheduler's
+ * requests_merged() has been called with its lock held, *@merged_request
+ * is the request that went away (possibly @rq itself), and the caller
+ * must free it with blk_mq_free_request() after dropping the lock.
+ * Otherwise the scheduler must reposition @rq if its start or end sector
+ * changed.
+ */
+int blk_mq_sched_try_merge(struct request_queue *q, struct request *rq,
+			   struct bio *bio, struct request **merged_request)
+{
+	struct request *other;
+	int el_ret;
+
+	*merged_request = NULL;
+
+	if (!elv_bio_merge_ok(rq, bio))
+		return ELEVATOR_NO_MERGE;
+
+	el_ret = blk_try_merge(rq, bio);
+	if (el_ret == ELEVATOR_BACK_MERGE) {
+		if (!bio_attempt_back_merge(q, rq, bio))
+			return ELEVATOR_NO_MERGE;
+		other = elv_latter_request(q, rq);
+		if (other && blk_attempt_req_merge(q, rq, other))
+			*merged_request = other;
+		return ELEVATOR_BACK_MERGE;
+	} else if (el_ret == ELEVATOR_FRONT_MERGE) {
+		if (!bio_attempt_front_merge(q, rq, bio))
+			return ELEVATOR_NO_MERGE;
+		other = elv_former_request(q, rq);
+		if (other && blk_attempt_req_merge(q, other, rq))
+			*merged_request = rq;
+		return ELEVATOR_FRONT_MERGE;
+	}
+
+	return ELEVATOR_NO_MERGE;
+}
+EXPORT_SYMBOL_GPL(blk_mq_sched_try_merge);
+
+/*
+ * Give the scheduler a chance to merge @bio into a request it holds,
+ * before a new request is allocated for it.
+ */
+bool blk_mq_sched_bio_merge(struct request_queue *q, struct bio *bio)
+{
+	struct elevator_queue *e = q->elevator;
+	struct blk_mq_hw_ctx *hctx;
+	struct blk_mq_ctx *ctx;
+	bool ret = false;
+
+	if (!e || !e->type->mq_ops.bio_merge)
+		return false;
+	if (blk_queue_nomerges(q) || !bio_mergeable(bio))
+		return false;
+
+	ctx = blk_mq_get_ctx(q);
+	hctx = q->mq_ops->map_queue(q, ctx->cpu);
+	if (hctx->flags & BLK_MQ_F_SHOULD_MERGE)
+		ret = e->type->mq_ops.bio_merge(hctx, bio);
+	blk_mq_put_ctx(ctx);
+
+	return ret;
+}
+
+/*
+ * Hand the requests on @list, all mapped to @hctx, to the scheduler and
+ * run the hardware queue.
+ */
+void blk_mq_sched_insert_requests(struct blk_mq_hw_ctx *hctx,
+				  struct list_head *list, bool async)
+{
+	struct request_queue *q = hctx->queue;
+	struct elevator_queue *e = q->elevator;
+	struct request *rq;
+
+	list_for_each_entry(rq, list, queuelist) {
+		trace_block_rq_insert(q, rq);
+		rq->cmd_flags |= REQ_ELVPRIV;
+	}
+
+	e->type->mq_ops.insert_requests(hctx, list);
+	blk_mq_run_hw_queue(hctx, async);
+}
+
+void blk_mq_sched_insert_request(struct request *rq, bool async)
+{
+	struct request_queue *q = rq->q;
+	struct blk_mq_hw_ctx *hctx = q->mq_ops->map_queue(q, rq->mq_ctx->cpu);
+	LIST_HEAD(list);
+
+	list_add(&rq->queuelist, &list);
+	blk_mq_sched_insert_requests(hctx, &list, async);
+}
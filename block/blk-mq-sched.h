@@ -0,0 +1,56 @@
+#ifndef BLK_MQ_SCHED_H
+#define BLK_MQ_SCHED_H
+
+#include <linux/blk-mq.h>
+#include <linux/elevator.h>
+
+#include "blk-mq.h"
+
+int blk_mq_init_sched(struct request_queue *q, struct elevator_type *e);
+void blk_mq_exit_sched(struct request_queue *q, struct elevator_queue *e);
+int blk_mq_sched_init_hctx(struct request_queue *q, struct blk_mq_hw_ctx *hctx,
+			   unsigned int hctx_idx);
+void blk_mq_sched_exit_hctx(struct request_queue *q, struct blk_mq_hw_ctx *hctx,
+			    unsigned int hctx_idx);
+void blk_mq_sched_quiesce(struct request_queue *q);
+void blk_mq_sched_unquiesce(struct request_queue *q);
+
+bool blk_mq_sched_bio_merge(struct request_queue *q, struct bio *bio);
+int blk_mq_sched_try_merge(struct request_queue *q, struct request *rq,
+			   struct bio *bio, struct request **merged_request);
+void blk_mq_sched_insert_request(struct request *rq, bool async);
+void blk_mq_sched_insert_requests(struct blk_mq_hw_ctx *hctx,
+				  struct list_head *list, bool async);
+
+static inline struct request *
+blk_mq_sched_dispatch_request(struct blk_mq_hw_ctx *hctx)
+{
+	struct elevator_queue *e = hctx->queue->elevator;
+
+	if (!e)
+		return NULL;
+	return e->type->mq_ops.dispatch_request(hctx);
+}
+
+static inline bool blk_mq_sched_has_work(struct blk_mq_hw_ctx *hctx)
+{
+	struct elevator_queue *e = hctx->queue->elevator;
+
+	if (e && e->type->mq_ops.has_work)
+		return e->type->mq_ops.has_work(hctx);
+	return false;
+}
+
+/*
+ * Called when a request that went through the scheduler is freed.
+ */
+static inline void blk_mq_sched_completed_request(struct blk_mq_hw_ctx *hctx,
+						  struct request *rq)
+{
+	struct elevator_queue *e = hctx->queue->elevator;
+
+	if (e && e->type->mq_ops.completed_request)
+		e->type->mq_ops.completed_request(hctx, rq);
+}
+
+#endif
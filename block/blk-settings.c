@@ -107,6 +107,7 @@ void blk_set_default_limits(struct queue_limits *lim)
 	lim->io_opt = 0;
 	lim->misaligned = 0;
 	lim->cluster = 1;
+	lim->zoned = BLK_ZONED_NONE;
 }
 EXPORT_SYMBOL(blk_set_default_limits);
 
@@ -540,6 +541,7 @@ int blk_stack_limits(struct queue_limits *t, struct queue_limits *b,
 					   b->max_segment_size);
 
 	t->misaligned |= b->misaligned;
+	t->zoned = max(t->zoned, b->zoned);
 
 	alignment = queue_limit_alignment_offset(b, start);
 
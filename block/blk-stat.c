@@ -0,0 +1,291 @@
+/*
+ * Block request completion time statistics
+ *
+ * Once QUEUE_FLAG_STATS is set, blk-mq stamps each request with the time
+ * it was issued to the driver and records its completion latency in per-cpu
+ * buckets, split by data direction and by request size from 512 bytes to
+ * 64k and larger.  Samples are only taken while a window is open: windows
+ * are opened on demand by blk_stat_activate(), and when one closes the
+ * per-cpu samples are folded into q->poll_stat[].  Buckets that saw no
+ * completions during a window keep the result of the last one that did.
+ *
+ * Hybrid polling uses these to sleep for part of the expected completion
+ * time before it starts to spin.
+ *
+ * Independently of the above, QUEUE_FLAG_LAT_HIST (on by default) counts
+ * every completed fs request in per-cpu log2 latency histograms, split by
+ * operation and size class.  Those are cumulative, like diskstats, and
+ * cost a timestamp and a per-cpu increment per request.  They cover legacy
+ * request queues too; bio based queues have no requests to count.
+ */
+#include <linux/kernel.h>
+#include <linux/blkdev.h>
+#include <linux/percpu.h>
+#include <linux/timer.h>
+#include <linux/math64.h>
+#include <linux/log2.h>
+
+#include "blk-stat.h"
+#include "blk-wbt.h"
+
+void blk_stat_reset(struct blk_rq_stat *stat)
+{
+	stat->mean = 0;
+	stat->min = -1ULL;
+	stat->max = 0;
+	stat->batch = 0;
+	stat->nr_samples = 0;
+}
+
+void blk_stat_sum(struct blk_rq_stat *dst, const struct blk_rq_stat *src)
+{
+	if (!src->nr_samples)
+		return;
+
+	dst->min = min(dst->min, src->min);
+	dst->max = max(dst->max, src->max);
+	dst->batch += src->batch;
+	dst->nr_samples += src->nr_samples;
+	dst->mean = div_u64(dst->batch, dst->nr_samples);
+}
+
+void blk_stat_add_sample(struct blk_rq_stat *stat, u64 value)
+{
+	stat->min = min(stat->min, value);
+	stat->max = max(stat->max, value);
+	stat->batch += value;
+	stat->nr_samples++;
+}
+
+/*
+ * Reads and writes alternate, and each size bucket covers a power of two:
+ * 0/1 are 512 byte reads/writes, 2/3 are 1k, ..., 14/15 are 64k and up.
+ */
+int blk_stat_rq_bucket(const struct request *rq)
+{
+	unsigned int bytes = blk_rq_bytes(rq);
+	int ddir = rq_data_dir(rq);
+	int bucket;
+
+	if (bytes < 512)
+		return -1;
+
+	bucket = ddir + 2 * (ilog2(bytes) - 9);
+	if (bucket >= BLK_MQ_POLL_STATS_BKTS)
+		return ddir + BLK_MQ_POLL_STATS_BKTS - 2;
+	return bucket;
+}
+
+const char *const blk_lat_hist_op_name[BLK_LAT_HIST_OPS] = {
+	[BLK_LAT_HIST_READ]	= "read",
+	[BLK_LAT_HIST_WRITE]	= "write",
+	[BLK_LAT_HIST_DISCARD]	= "discard",
+	[BLK_LAT_HIST_FLUSH]	= "flush",
+};
+
+const u32 blk_lat_hist_size_max[BLK_LAT_HIST_SIZES] = {
+	4 << 10, 64 << 10, 512 << 10, U32_MAX,
+};
+
+const char *const blk_lat_hist_size_name[BLK_LAT_HIST_SIZES] = {
+	"4k", "64k", "512k", "max",
+};
+
+/* the upper bound of a latency bucket, in ns; the last one is open ended */
+u64 blk_lat_hist_bucket_max(int bucket)
+{
+	return 1ULL << (BLK_LAT_HIST_MIN_SHIFT + bucket);
+}
+
+static int blk_lat_hist_op(const struct request *rq)
+{
+	switch (req_op(rq)) {
+	case REQ_OP_READ:
+		return BLK_LAT_HIST_READ;
+	case REQ_OP_DISCARD:
+	case REQ_OP_SECURE_ERASE:
+		return BLK_LAT_HIST_DISCARD;
+	case REQ_OP_FLUSH:
+		return BLK_LAT_HIST_FLUSH;
+	default:
+		return BLK_LAT_HIST_WRITE;
+	}
+}
+
+static void blk_lat_hist_add(struct request_queue *q, struct request *rq,
+			     u64 value)
+{
+	unsigned int bytes = blk_rq_bytes(rq);
+	int op, size, bucket;
+
+	if (rq->cmd_type != REQ_TYPE_FS)
+		return;
+
+	op = blk_lat_hist_op(rq);
+	for (size = 0; size < BLK_LAT_HIST_SIZES - 1; size++)
+		if (bytes <= blk_lat_hist_size_max[size])
+			break;
+
+	bucket = 0;
+	if (value >> BLK_LAT_HIST_MIN_SHIFT)
+		bucket = min_t(int, ilog2(value) - BLK_LAT_HIST_MIN_SHIFT + 1,
+			       BLK_LAT_HIST_BKTS - 1);
+
+	this_cpu_inc(q->lat_hist->buckets[op][size][bucket]);
+}
+
+/*
+ * Sum the per-cpu histograms of @q into @hist.  Like diskstats, this
+ * doesn't synchronize with the CPUs still counting.
+ */
+void blk_lat_hist_sum(struct request_queue *q, struct blk_lat_hist *hist)
+{
+	int op, size, bucket, cpu;
+
+	memset(hist, 0, sizeof(*hist));
+	if (!q->lat_hist)
+		return;
+
+	for_each_possible_cpu(cpu) {
+		struct blk_lat_hist *h = per_cpu_ptr(q->lat_hist, cpu);
+
+		for (op = 0; op < BLK_LAT_HIST_OPS; op++)
+			for (size = 0; size < BLK_LAT_HIST_SIZES; size++)
+				for (bucket = 0; bucket < BLK_LAT_HIST_BKTS;
+				     bucket++)
+					hist->buckets[op][size][bucket] +=
+						h->buckets[op][size][bucket];
+	}
+}
+
+/*
+ * Only queues that see requests get histograms, stacking drivers on bio
+ * based queues would just waste the memory.  The histograms are best
+ * effort: if they can't be allocated, the queue works without them.
+ */
+void blk_lat_hist_init(struct request_queue *q)
+{
+	if (q->lat_hist || (!q->request_fn && !q->mq_ops))
+		return;
+
+	q->lat_hist = alloc_percpu(struct blk_lat_hist);
+}
+
+void blk_lat_hist_exit(struct request_queue *q)
+{
+	free_percpu(q->lat_hist);
+	q->lat_hist = NULL;
+}
+
+void __blk_stat_add(struct request *rq)
+{
+	struct request_queue *q = rq->q;
+	struct blk_rq_stat *stat;
+	unsigned long flags;
+	u64 now, value;
+	int bucket;
+
+	now = ktime_get_ns();
+	value = now > rq->issue_time_ns ? now - rq->issue_time_ns : 0;
+	rq->issue_time_ns = 0;
+
+	if (q->lat_hist && test_bit(QUEUE_FLAG_LAT_HIST, &q->queue_flags))
+		blk_lat_hist_add(q, rq, value);
+
+	wbt_stat_add(q->rq_wb, rq, value);
+
+	if (!q->stat_cpu || !timer_pending(&q->stat_timer))
+		return;
+
+	bucket = blk_stat_rq_bucket(rq);
+	if (bucket < 0)
+		return;
+
+	/* completions may nest, e.g. a hardirq one inside a softirq one */
+	local_irq_save(flags);
+	stat = this_cpu_ptr(q->stat_cpu) + bucket;
+	blk_stat_add_sample(stat, value);
+	local_irq_restore(flags);
+}
+
+/*
+ * Close the window.  The per-cpu buckets are read and reset without
+ * synchronizing with the CPUs that update them; a sample racing with the
+ * fold may be lost, which an estimate can live with.
+ */
+static void blk_stat_timer_fn(unsigned long data)
+{
+	struct request_queue *q = (struct request_queue *) data;
+	int bucket, cpu;
+
+	for (bucket = 0; bucket < BLK_MQ_POLL_STATS_BKTS; bucket++) {
+		struct blk_rq_stat win;
+
+		blk_stat_reset(&win);
+		for_each_possible_cpu(cpu) {
+			struct blk_rq_stat *stat;
+
+			stat = per_cpu_ptr(q->stat_cpu, cpu) + bucket;
+			blk_stat_sum(&win, stat);
+			blk_stat_reset(stat);
+		}
+
+		if (win.nr_samples)
+			q->poll_stat[bucket] = win;
+	}
+}
+
+/*
+ * Open a sampling window, unless one is already open.
+ */
+void blk_stat_activate(struct request_queue *q)
+{
+	if (!timer_pending(&q->stat_timer))
+		mod_timer(&q->stat_timer,
+			  jiffies + msecs_to_jiffies(BLK_STAT_WIN_MSECS));
+}
+
+/*
+ * Start stamping requests with their issue time.  Returns false if that
+ * was not done before, in which case there can't be any samples yet.
+ */
+bool blk_stat_enable(struct request_queue *q)
+{
+	if (test_bit(QUEUE_FLAG_STATS, &q->queue_flags))
+		return true;
+
+	spin_lock_irq(q->queue_lock);
+	queue_flag_set(QUEUE_FLAG_STATS, q);
+	spin_unlock_irq(q->queue_lock);
+	return false;
+}
+
+int blk_stat_init(struct request_queue *q)
+{
+	int bucket, cpu;
+
+	q->stat_cpu = __alloc_percpu(BLK_MQ_POLL_STATS_BKTS *
+				     sizeof(struct blk_rq_stat),
+				     __alignof__(struct blk_rq_stat));
+	if (!q->stat_cpu)
+		return -ENOMEM;
+
+	for (bucket = 0; bucket < BLK_MQ_POLL_STATS_BKTS; bucket++) {
+		for_each_possible_cpu(cpu)
+			blk_stat_reset(per_cpu_ptr(q->stat_cpu, cpu) + bucket);
+		blk_stat_reset(&q->poll_stat[bucket]);
+	}
+
+	setup_timer(&q->stat_timer, blk_stat_timer_fn, (unsigned long) q);
+	return 0;
+}
+
+void blk_stat_exit(struct request_queue *q)
+{
+	if (!q->stat_cpu)
+		return;
+
+	del_timer_sync(&q->stat_timer);
+	free_percpu(q->stat_cpu);
+	q->stat_cpu = NULL;
+}
@@ -0,0 +1,47 @@
+#ifndef BLK_STAT_H
+#define BLK_STAT_H
+
+#include <linux/ktime.h>
+#include <linux/blkdev.h>
+
+/* length of a sampling window, see blk_stat_activate() */
+#define BLK_STAT_WIN_MSECS	100
+
+void blk_stat_reset(struct blk_rq_stat *stat);
+void blk_stat_sum(struct blk_rq_stat *dst, const struct blk_rq_stat *src);
+void blk_stat_add_sample(struct blk_rq_stat *stat, u64 value);
+
+int blk_stat_init(struct request_queue *q);
+void blk_stat_exit(struct request_queue *q);
+bool blk_stat_enable(struct request_queue *q);
+void blk_stat_activate(struct request_queue *q);
+int blk_stat_rq_bucket(const struct request *rq);
+void __blk_stat_add(struct request *rq);
+
+void blk_lat_hist_init(struct request_queue *q);
+void blk_lat_hist_exit(struct request_queue *q);
+void blk_lat_hist_sum(struct request_queue *q, struct blk_lat_hist *hist);
+u64 blk_lat_hist_bucket_max(int bucket);
+extern const u32 blk_lat_hist_size_max[BLK_LAT_HIST_SIZES];
+extern const char *const blk_lat_hist_op_name[BLK_LAT_HIST_OPS];
+extern const char *const blk_lat_hist_size_name[BLK_LAT_HIST_SIZES];
+
+static inline void blk_stat_set_issue(struct request *rq)
+{
+	if (rq->q->queue_flags & ((1UL << QUEUE_FLAG_STATS) |
+				  (1UL << QUEUE_FLAG_LAT_HIST)))
+		rq->issue_time_ns = ktime_get_ns();
+}
+
+/*
+ * Called when the hardware completes @rq.  Clears the issue stamp, so a
+ * request is only sampled once even if it passes through several
+ * completion paths.
+ */
+static inline void blk_stat_add(struct request *rq)
+{
+	if (rq->issue_time_ns)
+		__blk_stat_add(rq);
+}
+
+#endif
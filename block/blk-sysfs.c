@@ -13,6 +13,8 @@
 
 #include "blk.h"
 #include "blk-mq.h"
+#include "blk-wbt.h"
+#include "blk-stat.h"
 
 struct queue_sysfs_entry {
 	struct attribute attr;
@@ -192,6 +194,28 @@ static ssize_t queue_write_same_max_show(struct request_queue *q, char *page)
 		(unsigned long long)q->limits.max_write_same_sectors << 9);
 }
 
+static ssize_t queue_chunk_sectors_show(struct request_queue *q, char *page)
+{
+	return queue_var_show(q->limits.chunk_sectors, page);
+}
+
+static ssize_t queue_zoned_show(struct request_queue *q, char *page)
+{
+	switch (blk_queue_zoned_model(q)) {
+	case BLK_ZONED_HA:
+		return sprintf(page, "host-aware\n");
+	case BLK_ZONED_HM:
+		return sprintf(page, "host-managed\n");
+	default:
+		return sprintf(page, "none\n");
+	}
+}
+
+static ssize_t queue_nr_zones_show(struct request_queue *q, char *page)
+{
+	return queue_var_show(blk_queue_nr_zones(q), page);
+}
+
 
 static ssize_t
 queue_max_sectors_store(struct request_queue *q, const char *page, size_t count)
@@ -255,6 +279,7 @@ queue_store_##name(struct request_queue *q, const char *page, size_t count) \
 QUEUE_SYSFS_BIT_FNS(nonrot, NONROT, 1);
 QUEUE_SYSFS_BIT_FNS(random, ADD_RANDOM, 0);
 QUEUE_SYSFS_BIT_FNS(iostats, IO_STAT, 0);
+QUEUE_SYSFS_BIT_FNS(lat_stats, LAT_HIST, 0);
 #undef QUEUE_SYSFS_BIT_FNS
 
 static ssize_t queue_nomerges_show(struct request_queue *q, char *page)
@@ -347,6 +372,250 @@ static ssize_t queue_poll_store(struct request_queue *q, const char *page,
 	return ret;
 }
 
+static ssize_t queue_poll_delay_show(struct request_queue *q, char *page)
+{
+	int val;
+
+	if (!q->mq_ops || q->poll_nsec == -1)
+		val = -1;
+	else
+		val = q->poll_nsec / 1000;
+
+	return sprintf(page, "%d\n", val);
+}
+
+static ssize_t queue_poll_delay_store(struct request_queue *q,
+				      const char *page, size_t count)
+{
+	int err, val;
+
+	if (!q->mq_ops || !q->mq_ops->poll)
+		return -EINVAL;
+
+	err = kstrtoint(page, 10, &val);
+	if (err < 0)
+		return err;
+
+	if (val == -1)
+		q->poll_nsec = -1;
+	else if (val >= 0 && val <= INT_MAX / 1000)
+		q->poll_nsec = val * 1000;
+	else
+		return -EINVAL;
+
+	return count;
+}
+
+static ssize_t queue_poll_stat_show(struct request_queue *q, char *page)
+{
+	ssize_t ret = 0;
+	int bucket;
+
+	if (!q->stat_cpu)
+		return 0;
+
+	for (bucket = 0; bucket < BLK_MQ_POLL_STATS_BKTS; bucket++) {
+		struct blk_rq_stat *stat = &q->poll_stat[bucket];
+
+		ret += sprintf(page + ret, "%s %5u: samples=%u",
+			       bucket & 1 ? "write" : "read ",
+			       1U << (9 + bucket / 2), stat->nr_samples);
+		if (stat->nr_samples)
+			ret += sprintf(page + ret,
+				       ", mean=%llu, min=%llu, max=%llu",
+				       stat->mean, stat->min, stat->max);
+		ret += sprintf(page + ret, "\n");
+	}
+
+	return ret;
+}
+
+/*
+ * One file per operation: all of them at once could take up to 16 lines
+ * of 24 20-digit counters, which doesn't fit a page.
+ */
+static ssize_t __queue_lat_hist_show(struct request_queue *q, char *page,
+				     int op)
+{
+	struct blk_lat_hist *hist;
+	ssize_t ret = 0;
+	int size, bucket;
+
+	/* size class name, counters with a space each, newline */
+	BUILD_BUG_ON(BLK_LAT_HIST_SIZES *
+		     (4 + BLK_LAT_HIST_BKTS * 21 + 1) > PAGE_SIZE);
+
+	if (!q->lat_hist)
+		return 0;
+
+	hist = kmalloc(sizeof(*hist), GFP_KERNEL);
+	if (!hist)
+		return -ENOMEM;
+	blk_lat_hist_sum(q, hist);
+
+	for (size = 0; size < BLK_LAT_HIST_SIZES; size++) {
+		ret += scnprintf(page + ret, PAGE_SIZE - ret, "%s",
+				 blk_lat_hist_size_name[size]);
+		for (bucket = 0; bucket < BLK_LAT_HIST_BKTS; bucket++)
+			ret += scnprintf(page + ret, PAGE_SIZE - ret, " %llu",
+					 hist->buckets[op][size][bucket]);
+		ret += scnprintf(page + ret, PAGE_SIZE - ret, "\n");
+	}
+
+	kfree(hist);
+	return ret;
+}
+
+#define QUEUE_LAT_HIST_SHOW(name, op)					\
+static ssize_t								\
+queue_show_lat_hist_##name(struct request_queue *q, char *page)		\
+{									\
+	return __queue_lat_hist_show(q, page, BLK_LAT_HIST_##op);	\
+}
+
+QUEUE_LAT_HIST_SHOW(read, READ);
+QUEUE_LAT_HIST_SHOW(write, WRITE);
+QUEUE_LAT_HIST_SHOW(discard, DISCARD);
+QUEUE_LAT_HIST_SHOW(flush, FLUSH);
+#undef QUEUE_LAT_HIST_SHOW
+
+/*
+ * The latency, in usecs, under which @per10k / 10000 of the samples in
+ * @buckets completed, rounded up to a bucket boundary.  The open ended
+ * last bucket reports its lower bound.
+ */
+static u64 lat_hist_percentile(const u64 *buckets, u64 total,
+			       unsigned int per10k)
+{
+	u64 want = div_u64(total * per10k + 9999, 10000);
+	u64 sum = 0;
+	int bucket;
+
+	for (bucket = 0; bucket < BLK_LAT_HIST_BKTS - 1; bucket++) {
+		sum += buckets[bucket];
+		if (sum >= want)
+			break;
+	}
+	if (bucket == BLK_LAT_HIST_BKTS - 1)
+		bucket--;
+
+	return div_u64(blk_lat_hist_bucket_max(bucket), NSEC_PER_USEC);
+}
+
+static ssize_t queue_lat_percentiles_show(struct request_queue *q, char *page)
+{
+	static const unsigned int per10k[] = { 5000, 9000, 9900, 9990 };
+	static const char *const names[] = { "p50", "p90", "p99", "p99.9" };
+	struct blk_lat_hist *hist;
+	ssize_t ret = 0;
+	int op, size, bucket, i;
+
+	if (!q->lat_hist)
+		return 0;
+
+	hist = kmalloc(sizeof(*hist), GFP_KERNEL);
+	if (!hist)
+		return -ENOMEM;
+	blk_lat_hist_sum(q, hist);
+
+	for (op = 0; op < BLK_LAT_HIST_OPS; op++) {
+		for (size = 0; size < BLK_LAT_HIST_SIZES; size++) {
+			const u64 *buckets = hist->buckets[op][size];
+			u64 total = 0;
+
+			for (bucket = 0; bucket < BLK_LAT_HIST_BKTS; bucket++)
+				total += buckets[bucket];
+
+			ret += scnprintf(page + ret, PAGE_SIZE - ret,
+					 "%s %s samples=%llu",
+					 blk_lat_hist_op_name[op],
+					 blk_lat_hist_size_name[size], total);
+			for (i = 0; i < ARRAY_SIZE(per10k); i++)
+				ret += scnprintf(page + ret, PAGE_SIZE - ret,
+					" %s=%llu", names[i], total ?
+					lat_hist_percentile(buckets, total,
+							    per10k[i]) : 0);
+			ret += scnprintf(page + ret, PAGE_SIZE - ret, "\n");
+		}
+	}
+
+	kfree(hist);
+	return ret;
+}
+
+struct lat_hist_raw {
+	struct blk_lat_hist_header hdr;
+	struct blk_lat_hist hist;
+};
+
+static ssize_t queue_lat_hist_raw_read(struct file *filp, struct kobject *kobj,
+				       struct bin_attribute *attr, char *buf,
+				       loff_t off, size_t count)
+{
+	struct request_queue *q =
+		container_of(kobj, struct request_queue, kobj);
+	struct lat_hist_raw *raw;
+
+	if (off >= sizeof(*raw))
+		return 0;
+	count = min_t(size_t, count, sizeof(*raw) - off);
+
+	raw = kzalloc(sizeof(*raw), GFP_KERNEL);
+	if (!raw)
+		return -ENOMEM;
+
+	raw->hdr.version = BLK_LAT_HIST_VERSION;
+	raw->hdr.nr_ops = BLK_LAT_HIST_OPS;
+	raw->hdr.nr_sizes = BLK_LAT_HIST_SIZES;
+	raw->hdr.nr_buckets = BLK_LAT_HIST_BKTS;
+	raw->hdr.min_shift = BLK_LAT_HIST_MIN_SHIFT;
+	memcpy(raw->hdr.size_max, blk_lat_hist_size_max,
+	       sizeof(raw->hdr.size_max));
+	blk_lat_hist_sum(q, &raw->hist);
+
+	memcpy(buf, (char *)raw + off, count);
+	kfree(raw);
+	return count;
+}
+
+static struct bin_attribute queue_lat_hist_raw_attr = {
+	.attr = {.name = "lat_hist_raw", .mode = S_IRUGO },
+	.size = sizeof(struct lat_hist_raw),
+	.read = queue_lat_hist_raw_read,
+};
+
+static ssize_t queue_wb_lat_show(struct request_queue *q, char *page)
+{
+	if (!q->rq_wb)
+		return -EINVAL;
+
+	return sprintf(page, "%llu\n", div_u64(q->rq_wb->min_lat_nsec, 1000));
+}
+
+static ssize_t queue_wb_lat_store(struct request_queue *q, const char *page,
+				  size_t count)
+{
+	s64 val;
+	int ret;
+
+	if (!q->rq_wb)
+		return -EINVAL;
+
+	ret = kstrtoll(page, 10, &val);
+	if (ret < 0)
+		return ret;
+
+	if (val == -1)
+		val = wbt_default_latency_nsec(q);
+	else if (val >= 0)
+		val *= 1000ULL;
+	else
+		return -EINVAL;
+
+	wbt_set_min_lat(q->rq_wb, val);
+	return count;
+}
+
 static ssize_t queue_wc_show(struct request_queue *q, char *page)
 {
 	if (test_bit(QUEUE_FLAG_WC, &q->queue_flags))
@@ -479,6 +748,21 @@ static struct queue_sysfs_entry queue_write_same_max_entry = {
 	.show = queue_write_same_max_show,
 };
 
+static struct queue_sysfs_entry queue_chunk_sectors_entry = {
+	.attr = {.name = "chunk_sectors", .mode = S_IRUGO },
+	.show = queue_chunk_sectors_show,
+};
+
+static struct queue_sysfs_entry queue_zoned_entry = {
+	.attr = {.name = "zoned", .mode = S_IRUGO },
+	.show = queue_zoned_show,
+};
+
+static struct queue_sysfs_entry queue_nr_zones_entry = {
+	.attr = {.name = "nr_zones", .mode = S_IRUGO },
+	.show = queue_nr_zones_show,
+};
+
 static struct queue_sysfs_entry queue_nonrot_entry = {
 	.attr = {.name = "rotational", .mode = S_IRUGO | S_IWUSR },
 	.show = queue_show_nonrot,
@@ -515,6 +799,54 @@ static struct queue_sysfs_entry queue_poll_entry = {
 	.store = queue_poll_store,
 };
 
+static struct queue_sysfs_entry queue_poll_delay_entry = {
+	.attr = {.name = "io_poll_delay", .mode = S_IRUGO | S_IWUSR },
+	.show = queue_poll_delay_show,
+	.store = queue_poll_delay_store,
+};
+
+static struct queue_sysfs_entry queue_poll_stat_entry = {
+	.attr = {.name = "io_poll_stat", .mode = S_IRUGO },
+	.show = queue_poll_stat_show,
+};
+
+static struct queue_sysfs_entry queue_lat_stats_entry = {
+	.attr = {.name = "lat_stats", .mode = S_IRUGO | S_IWUSR },
+	.show = queue_show_lat_stats,
+	.store = queue_store_lat_stats,
+};
+
+static struct queue_sysfs_entry queue_lat_hist_read_entry = {
+	.attr = {.name = "lat_hist_read", .mode = S_IRUGO },
+	.show = queue_show_lat_hist_read,
+};
+
+static struct queue_sysfs_entry queue_lat_hist_write_entry = {
+	.attr = {.name = "lat_hist_write", .mode = S_IRUGO },
+	.show = queue_show_lat_hist_write,
+};
+
+static struct queue_sysfs_entry queue_lat_hist_discard_entry = {
+	.attr = {.name = "lat_hist_discard", .mode = S_IRUGO },
+	.show = queue_show_lat_hist_discard,
+};
+
+static struct queue_sysfs_entry queue_lat_hist_flush_entry = {
+	.attr = {.name = "lat_hist_flush", .mode = S_IRUGO },
+	.show = queue_show_lat_hist_flush,
+};
+
+static struct queue_sysfs_entry queue_lat_percentiles_entry = {
+	.attr = {.name = "lat_percentiles", .mode = S_IRUGO },
+	.show = queue_lat_percentiles_show,
+};
+
+static struct queue_sysfs_entry queue_wb_lat_entry = {
+	.attr = {.name = "wbt_lat_usec", .mode = S_IRUGO | S_IWUSR },
+	.show = queue_wb_lat_show,
+	.store = queue_wb_lat_store,
+};
+
 static struct queue_sysfs_entry queue_wc_entry = {
 	.attr = {.name = "write_cache", .mode = S_IRUGO | S_IWUSR },
 	.show = queue_wc_show,
@@ -545,12 +877,24 @@ static struct attribute *default_attrs[] = {
 	&queue_discard_max_hw_entry.attr,
 	&queue_discard_zeroes_data_entry.attr,
 	&queue_write_same_max_entry.attr,
+	&queue_chunk_sectors_entry.attr,
+	&queue_zoned_entry.attr,
+	&queue_nr_zones_entry.attr,
 	&queue_nonrot_entry.attr,
 	&queue_nomerges_entry.attr,
 	&queue_rq_affinity_entry.attr,
 	&queue_iostats_entry.attr,
 	&queue_random_entry.attr,
 	&queue_poll_entry.attr,
+	&queue_poll_delay_entry.attr,
+	&queue_wb_lat_entry.attr,
+	&queue_poll_stat_entry.attr,
+	&queue_lat_stats_entry.attr,
+	&queue_lat_hist_read_entry.attr,
+	&queue_lat_hist_write_entry.attr,
+	&queue_lat_hist_discard_entry.attr,
+	&queue_lat_hist_flush_entry.attr,
+	&queue_lat_percentiles_entry.attr,
 	&queue_wc_entry.attr,
 	&queue_dax_entry.attr,
 	NULL,
@@ -627,6 +971,8 @@ static void blk_release_queue(struct kobject *kobj)
 	struct request_queue *q =
 		container_of(kobj, struct request_queue, kobj);
 
+	wbt_exit(q);
+	blk_lat_hist_exit(q);
 	bdi_exit(&q->backing_dev_info);
 	blkcg_exit_queue(q);
 
@@ -652,6 +998,8 @@ static void blk_release_queue(struct kobject *kobj)
 	if (q->bio_split)
 		bioset_free(q->bio_split);
 
+	blk_queue_free_zone_bitmaps(q);
+
 	ida_simple_remove(&blk_queue_ida, q->id);
 	call_rcu(&q->rcu_head, blk_free_queue_rcu);
 }
@@ -695,18 +1043,31 @@ int blk_register_queue(struct gendisk *disk)
 	if (ret)
 		return ret;
 
+	blk_lat_hist_init(q);
+
 	ret = kobject_add(&q->kobj, kobject_get(&dev->kobj), "%s", "queue");
 	if (ret < 0) {
 		blk_trace_remove_sysfs(dev);
 		return ret;
 	}
 
+	ret = sysfs_create_bin_file(&q->kobj, &queue_lat_hist_raw_attr);
+	if (ret) {
+		kobject_del(&q->kobj);
+		blk_trace_remove_sysfs(dev);
+		kobject_put(&dev->kobj);
+		return ret;
+	}
+
 	kobject_uevent(&q->kobj, KOBJ_ADD);
 
-	if (q->mq_ops)
+	if (q->mq_ops) {
 		blk_mq_register_disk(disk);
+		/* the driver has set the queue up by now, rotational or not */
+		wbt_init(q);
+	}
 
-	if (!q->request_fn)
+	if (!q->elevator)
 		return 0;
 
 	ret = elv_register_queue(q);
@@ -731,9 +1092,10 @@ void blk_unregister_queue(struct gendisk *disk)
 	if (q->mq_ops)
 		blk_mq_unregister_disk(disk);
 
-	if (q->request_fn)
+	if (q->elevator && q->elevator->registered)
 		elv_unregister_queue(q);
 
+	sysfs_remove_bin_file(&q->kobj, &queue_lat_hist_raw_attr);
 	kobject_uevent(&q->kobj, KOBJ_REMOVE);
 	kobject_del(&q->kobj);
 	blk_trace_remove_sysfs(disk_to_dev(disk));
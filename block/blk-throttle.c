@@ -21,6 +21,9 @@ static int throtl_quantum = 32;
 /* Throttling is performed over 100ms slice and after that slice is renewed */
 static unsigned long throtl_slice = HZ/10;	/* 100 ms */
 
+/* Completions a window needs for its latency to count, see throtl_lat_timer_fn() */
+#define THROTL_LAT_MIN_SAMPLES	5
+
 static struct blkcg_policy blkcg_policy_throtl;
 
 /* A workqueue to queue throttle related work */
@@ -133,6 +136,19 @@ struct throtl_grp {
 	/* When did we start a new slice */
 	unsigned long slice_start[2];
 	unsigned long slice_end[2];
+
+	/*
+	 * Latency target, see throtl_lat_timer_fn().  Bios issued by this
+	 * group are tracked from the time they leave it until they complete.
+	 */
+	u64 lat_target;			/* ns, 0 if none */
+	unsigned int lat_max_depth;	/* tracked bios in flight allowed */
+	int lat_scale_step;
+	atomic_t lat_inflight;
+	atomic_t lat_win_nr;		/* completions in the current window */
+	atomic64_t lat_win_sum;		/* and their total latency, ns */
+	u64 lat_avg;			/* mean latency of the last window, ns */
+	u64 lat_missed;			/* windows that missed lat_target */
 };
 
 struct throtl_data
@@ -147,6 +163,12 @@ struct throtl_data
 
 	/* Work for dispatching throttled bios */
 	struct work_struct dispatch_work;
+
+	/* groups with a latency target, and the timer closing their windows */
+	unsigned int nr_lat_groups;
+	struct timer_list lat_timer;
+	/* kicks capped groups when their bios complete */
+	struct work_struct lat_work;
 };
 
 static void throtl_pending_timer_fn(unsigned long arg);
@@ -338,6 +360,7 @@ static struct blkg_policy_data *throtl_pd_alloc(gfp_t gfp, int node)
 	tg->bps[WRITE] = -1;
 	tg->iops[READ] = -1;
 	tg->iops[WRITE] = -1;
+	tg->lat_max_depth = UINT_MAX;
 
 	return &tg->pd;
 }
@@ -392,6 +415,13 @@ static void throtl_pd_online(struct blkg_policy_data *pd)
 	tg_update_has_rules(pd_to_tg(pd));
 }
 
+static void tg_set_lat_target(struct throtl_grp *tg, u64 target);
+
+static void throtl_pd_offline(struct blkg_policy_data *pd)
+{
+	tg_set_lat_target(pd_to_tg(pd), 0);
+}
+
 static void throtl_pd_free(struct blkg_policy_data *pd)
 {
 	struct throtl_grp *tg = pd_to_tg(pd);
@@ -751,6 +781,18 @@ static bool tg_with_in_bps_limit(struct throtl_grp *tg, struct bio *bio,
 	return 0;
 }
 
+/* jiffies until the current latency window closes */
+static unsigned long throtl_lat_window_left(struct throtl_data *td)
+{
+	unsigned long expires = td->lat_timer.expires;
+
+	if (!timer_pending(&td->lat_timer))
+		return throtl_slice;
+	if (time_after(expires, jiffies))
+		return expires - jiffies;
+	return 1;
+}
+
 /*
  * Returns whether one can dispatch a bio or not. Also returns approx number
  * of jiffies to wait before this bio is with-in IO rate and can be dispatched
@@ -770,6 +812,19 @@ static bool tg_may_dispatch(struct throtl_grp *tg, struct bio *bio,
 	BUG_ON(tg->service_queue.nr_queued[rw] &&
 	       bio != throtl_peek_queued(&tg->service_queue.queued[rw]));
 
+	/*
+	 * A group scaled down for the sake of others' latency targets may
+	 * only have so many of its own bios in flight.  The completion that
+	 * frees up a slot kicks it, see blk_throtl_bio_endio(), and the cap
+	 * is recomputed when the latency window closes, so wait until then.
+	 */
+	if (bio->bi_cg_private == tg &&
+	    atomic_read(&tg->lat_inflight) >= tg->lat_max_depth) {
+		if (wait)
+			*wait = throtl_lat_window_left(tg->td);
+		return false;
+	}
+
 	/* If tg->bps = -1, then BW is unlimited */
 	if (tg->bps[rw] == -1 && tg->iops[rw] == -1) {
 		if (wait)
@@ -817,6 +872,12 @@ static void throtl_charge_bio(struct throtl_grp *tg, struct bio *bio)
 	tg->bytes_disp[rw] += bio->bi_iter.bi_size;
 	tg->io_disp[rw]++;
 
+	/* the bio leaves the group that issued it, see blk_throtl_bio_endio() */
+	if (bio->bi_cg_private == tg && !bio->bi_issue_time) {
+		bio->bi_issue_time = ktime_get_ns();
+		atomic_inc(&tg->lat_inflight);
+	}
+
 	/*
 	 * REQ_THROTTLED is used to prevent the same bio to be throttled
 	 * more than once as a throttled bio will go through blk-throtl the
@@ -1362,6 +1423,220 @@ out_finish:
 	return ret ?: nbytes;
 }
 
+/*
+ * Is @tg of lower priority than a group with latency target @target?  It
+ * is if it has no target, or a looser one.
+ */
+static bool tg_lat_below(struct throtl_grp *tg, u64 target)
+{
+	return !tg->lat_target || tg->lat_target > target;
+}
+
+/*
+ * The in-flight cap of @tg was raised or some of its bios completed:
+ * recompute when its queued bios may go.  Must be called with queue_lock
+ * held.
+ */
+static void tg_lat_kick(struct throtl_grp *tg)
+{
+	if (!(tg->flags & THROTL_TG_PENDING))
+		return;
+
+	tg_update_disptime(tg);
+	throtl_schedule_next_dispatch(tg->service_queue.parent_sq, true);
+}
+
+static void throtl_lat_work_fn(struct work_struct *work)
+{
+	struct throtl_data *td = container_of(work, struct throtl_data,
+					      lat_work);
+	struct request_queue *q = td->queue;
+	struct blkcg_gq *blkg;
+
+	spin_lock_irq(q->queue_lock);
+	list_for_each_entry(blkg, &q->blkg_list, q_node) {
+		struct throtl_grp *tg = blkg_to_tg(blkg);
+
+		if (tg->lat_scale_step &&
+		    atomic_read(&tg->lat_inflight) < tg->lat_max_depth)
+			tg_lat_kick(tg);
+	}
+	spin_unlock_irq(q->queue_lock);
+}
+
+/**
+ * throtl_lat_timer_fn - close a latency window
+ * @arg: the throtl_data of interest
+ *
+ * Latency targets let groups with latency sensitive IO share a device with
+ * batch IO without capping the latter to a fixed rate.  Every throtl_slice,
+ * the mean completion latency of each group with a target is compared to
+ * its target.  If a group missed it, the groups of lower priority, i.e.
+ * without a target or with a looser one, get one step deeper into
+ * throttling: the number of their bios in flight is capped at the queue
+ * depth halved once per step.  Each window in which no group of higher
+ * priority missed its target takes a group one step back up, until it is
+ * no longer capped.  The tightest target that was missed decides who gets
+ * throttled.
+ *
+ * Groups are compared across the whole device, regardless of where they
+ * are in the hierarchy.
+ */
+static void throtl_lat_timer_fn(unsigned long arg)
+{
+	struct throtl_data *td = (void *)arg;
+	struct request_queue *q = td->queue;
+	unsigned long depth = max_t(unsigned long, q->nr_requests, 1);
+	int max_step = ilog2(depth);
+	u64 missed = U64_MAX;
+	struct blkcg_gq *blkg;
+	bool scaled = false;
+
+	spin_lock_irq(q->queue_lock);
+
+	list_for_each_entry(blkg, &q->blkg_list, q_node) {
+		struct throtl_grp *tg = blkg_to_tg(blkg);
+		unsigned int nr = atomic_xchg(&tg->lat_win_nr, 0);
+		u64 sum = atomic64_xchg(&tg->lat_win_sum, 0);
+
+		if (nr)
+			tg->lat_avg = div_u64(sum, nr);
+		if (!tg->lat_target || nr < THROTL_LAT_MIN_SAMPLES)
+			continue;
+		if (tg->lat_avg > tg->lat_target) {
+			tg->lat_missed++;
+			missed = min(missed, tg->lat_target);
+		}
+	}
+
+	list_for_each_entry(blkg, &q->blkg_list, q_node) {
+		struct throtl_grp *tg = blkg_to_tg(blkg);
+		int step = tg->lat_scale_step;
+
+		if (missed != U64_MAX && tg_lat_below(tg, missed)) {
+			if (step < max_step)
+				step++;
+		} else if (step) {
+			step--;
+		}
+
+		if (step != tg->lat_scale_step) {
+			tg->lat_scale_step = step;
+			tg->lat_max_depth = step ? max(depth >> step, 1UL) :
+					    UINT_MAX;
+			throtl_log(&tg->service_queue,
+				   "latency step=%d depth=%u avg=%lluus",
+				   step, tg->lat_max_depth,
+				   div_u64(tg->lat_avg, NSEC_PER_USEC));
+			tg_lat_kick(tg);
+		}
+		if (step)
+			scaled = true;
+	}
+
+	if (td->nr_lat_groups || scaled)
+		mod_timer(&td->lat_timer, jiffies + throtl_slice);
+
+	spin_unlock_irq(q->queue_lock);
+}
+
+/* Must be called with queue_lock held */
+static void tg_set_lat_target(struct throtl_grp *tg, u64 target)
+{
+	struct throtl_data *td = tg->td;
+
+	if (!tg->lat_target == !target) {
+		tg->lat_target = target;
+		return;
+	}
+
+	tg->lat_target = target;
+	if (target) {
+		td->nr_lat_groups++;
+		if (!timer_pending(&td->lat_timer))
+			mod_timer(&td->lat_timer, jiffies + throtl_slice);
+	} else {
+		td->nr_lat_groups--;
+	}
+}
+
+static u64 tg_prfill_latency(struct seq_file *sf, struct blkg_policy_data *pd,
+			     int off)
+{
+	struct throtl_grp *tg = pd_to_tg(pd);
+	const char *dname = blkg_dev_name(pd->blkg);
+
+	if (!dname || !tg->lat_target)
+		return 0;
+
+	seq_printf(sf, "%s target=%llu\n", dname,
+		   div_u64(tg->lat_target, NSEC_PER_USEC));
+	return 0;
+}
+
+static int tg_print_latency(struct seq_file *sf, void *v)
+{
+	blkcg_print_blkgs(sf, css_to_blkcg(seq_css(sf)), tg_prfill_latency,
+			  &blkcg_policy_throtl, seq_cft(sf)->private, false);
+	return 0;
+}
+
+static ssize_t tg_set_latency(struct kernfs_open_file *of,
+			      char *buf, size_t nbytes, loff_t off)
+{
+	struct blkcg *blkcg = css_to_blkcg(of_css(of));
+	struct blkg_conf_ctx ctx;
+	struct throtl_grp *tg;
+	char tok[27];		/* target=18446744073709551616 */
+	u64 v = 0;
+	char *p;
+	int ret;
+
+	ret = blkg_conf_prep(blkcg, &blkcg_policy_throtl, buf, &ctx);
+	if (ret)
+		return ret;
+
+	tg = blkg_to_tg(ctx.blkg);
+
+	ret = -EINVAL;
+	if (sscanf(ctx.body, "%26s", tok) != 1)
+		goto out_finish;
+	p = tok;
+	strsep(&p, "=");
+	if (!p || strcmp(tok, "target"))
+		goto out_finish;
+	if (strcmp(p, "max")) {
+		if (kstrtoull(p, 10, &v))
+			goto out_finish;
+		ret = -ERANGE;
+		if (!v || v > U64_MAX / NSEC_PER_USEC)
+			goto out_finish;
+	}
+
+	tg_set_lat_target(tg, v * NSEC_PER_USEC);
+	ret = 0;
+out_finish:
+	blkg_conf_finish(&ctx);
+	return ret ?: nbytes;
+}
+
+static size_t throtl_pd_stat(struct blkg_policy_data *pd, char *buf,
+			     size_t size)
+{
+	struct throtl_grp *tg = pd_to_tg(pd);
+	char depth[11] = "max";
+
+	if (!tg->lat_target && !tg->lat_scale_step)
+		return 0;
+
+	if (tg->lat_max_depth != UINT_MAX)
+		snprintf(depth, sizeof(depth), "%u", tg->lat_max_depth);
+
+	return scnprintf(buf, size, " lat_avg=%llu lat_missed=%llu depth=%s",
+			 div_u64(tg->lat_avg, NSEC_PER_USEC), tg->lat_missed,
+			 depth);
+}
+
 static struct cftype throtl_files[] = {
 	{
 		.name = "max",
@@ -1369,6 +1644,12 @@ static struct cftype throtl_files[] = {
 		.seq_show = tg_print_max,
 		.write = tg_set_max,
 	},
+	{
+		.name = "latency",
+		.flags = CFTYPE_NOT_ON_ROOT,
+		.seq_show = tg_print_latency,
+		.write = tg_set_latency,
+	},
 	{ }	/* terminate */
 };
 
@@ -1377,6 +1658,8 @@ static void throtl_shutdown_wq(struct request_queue *q)
 	struct throtl_data *td = q->td;
 
 	cancel_work_sync(&td->dispatch_work);
+	del_timer_sync(&td->lat_timer);
+	cancel_work_sync(&td->lat_work);
 }
 
 static struct blkcg_policy blkcg_policy_throtl = {
@@ -1386,7 +1669,9 @@ static struct blkcg_policy blkcg_policy_throtl = {
 	.pd_alloc_fn		= throtl_pd_alloc,
 	.pd_init_fn		= throtl_pd_init,
 	.pd_online_fn		= throtl_pd_online,
+	.pd_offline_fn		= throtl_pd_offline,
 	.pd_free_fn		= throtl_pd_free,
+	.pd_stat_fn		= throtl_pd_stat,
 };
 
 bool blk_throtl_bio(struct request_queue *q, struct blkcg_gq *blkg,
@@ -1400,8 +1685,12 @@ bool blk_throtl_bio(struct request_queue *q, struct blkcg_gq *blkg,
 
 	WARN_ON_ONCE(!rcu_read_lock_held());
 
-	/* see throtl_charge_bio() */
-	if ((bio->bi_opf & REQ_THROTTLED) || !tg->has_rules[rw])
+	/*
+	 * See throtl_charge_bio().  While latency targets are set on the
+	 * device, every bio is tracked.
+	 */
+	if ((bio->bi_opf & REQ_THROTTLED) ||
+	    (!tg->has_rules[rw] && !READ_ONCE(tg->td->nr_lat_groups)))
 		goto out;
 
 	spin_lock_irq(q->queue_lock);
@@ -1409,6 +1698,12 @@ bool blk_throtl_bio(struct request_queue *q, struct blkcg_gq *blkg,
 	if (unlikely(blk_queue_bypass(q)))
 		goto out_unlock;
 
+	/* a bio is tracked by the first device it goes through */
+	if (tg->td->nr_lat_groups && !bio->bi_cg_private) {
+		bio->bi_cg_private = tg;
+		blkg_get(tg_to_blkg(tg));
+	}
+
 	sq = &tg->service_queue;
 
 	while (true) {
@@ -1484,6 +1779,60 @@ out:
 	return throttled;
 }
 
+static void __blk_throtl_bio_done(struct bio *bio, bool completed)
+{
+	struct throtl_grp *tg = bio->bi_cg_private;
+
+	if (!tg)
+		return;
+	bio->bi_cg_private = NULL;
+
+	if (bio->bi_issue_time) {
+		u64 now = ktime_get_ns();
+
+		if (completed && now > bio->bi_issue_time) {
+			atomic64_add(now - bio->bi_issue_time,
+				     &tg->lat_win_sum);
+			atomic_inc(&tg->lat_win_nr);
+		}
+		bio->bi_issue_time = 0;
+		/*
+		 * Completions can't take the queue_lock, which the legacy
+		 * request path may hold around bio_endio(): leave the kick
+		 * of a group that was at its cap to a work item.
+		 */
+		if (atomic_dec_return(&tg->lat_inflight) + 1 ==
+		    READ_ONCE(tg->lat_max_depth))
+			queue_work(kthrotld_workqueue, &tg->td->lat_work);
+	}
+
+	blkg_put(tg_to_blkg(tg));
+}
+
+/**
+ * blk_throtl_bio_endio - account the completion of a bio
+ * @bio: the completed bio
+ *
+ * Called from bio_endio().  Account the completion latency of @bio to the
+ * group which issued it, if it was tracked.
+ */
+void blk_throtl_bio_endio(struct bio *bio)
+{
+	__blk_throtl_bio_done(bio, true);
+}
+
+/**
+ * blk_throtl_bio_release - stop tracking a bio
+ * @bio: the bio being freed or reset
+ *
+ * Called when @bio is freed or reset without having completed, to drop
+ * the reference on the group that issued it.
+ */
+void blk_throtl_bio_release(struct bio *bio)
+{
+	__blk_throtl_bio_done(bio, false);
+}
+
 /*
  * Dispatch all bios from all children tg's queued on @parent_sq.  On
  * return, @parent_sq is guaranteed to not have any active children tg's
@@ -1559,6 +1908,8 @@ int blk_throtl_init(struct request_queue *q)
 
 	INIT_WORK(&td->dispatch_work, blk_throtl_dispatch_work_fn);
 	throtl_service_queue_init(&td->service_queue);
+	setup_timer(&td->lat_timer, throtl_lat_timer_fn, (unsigned long)td);
+	INIT_WORK(&td->lat_work, throtl_lat_work_fn);
 
 	q->td = td;
 	td->queue = q;
@@ -0,0 +1,466 @@
+/*
+ * Writeback throttling
+ *
+ * Background writeback can fill the device queue with hundreds of
+ * buffered writes, and a synchronous read then waits behind all of them.
+ * Dirty memory limits don't help there, as they say nothing about how
+ * much of that memory is in flight at once.
+ *
+ * This limits the number of buffered writes in flight on a queue, and
+ * adjusts the limit to how reads fare.  Time is cut into windows.  When
+ * a window closes, the fastest read completed in it is compared with a
+ * target latency (wbt_lat_usec in sysfs): if even that read missed the
+ * target, writes are crowding reads out and the limit is scaled down,
+ * and the window is made shorter so the next verdict comes sooner.  If
+ * reads met the target, or there were no reads but writes were going
+ * on, the limit is scaled up again, in steps, up to most of the queue
+ * depth.
+ *
+ * Three limits derive from the scale step.  Background and periodic
+ * writeback (REQ_BACKGROUND) gets the lowest one, as it does when reads
+ * were issued or completed recently; other buffered writes get twice
+ * that, and the highest one is for reclaim.  O_DIRECT writes, sync
+ * writes (REQ_SYNC, which covers fsync and journal commits), flushes,
+ * FUA writes and everything that is not a write are not throttled.
+ *
+ * Completion latencies come from blk-stat, see blk-stat.c, so only
+ * blk-mq queues are throttled.
+ */
+#include <linux/kernel.h>
+#include <linux/blkdev.h>
+#include <linux/blk-mq.h>
+#include <linux/percpu.h>
+#include <linux/swap.h>
+#include <linux/math64.h>
+
+#include "blk-stat.h"
+#include "blk-wbt.h"
+
+#define CREATE_TRACE_POINTS
+#include <trace/events/wbt.h>
+
+enum {
+	/* starting depth, scale steps are relative to this */
+	RWB_DEF_DEPTH	= 16,
+
+	/* 100ms windows */
+	RWB_WINDOW_NSEC	= 100 * 1000 * 1000ULL,
+
+	/* windows without samples before the step drifts back to 0 */
+	RWB_UNKNOWN_BUMP = 5,
+};
+
+static inline bool rwb_enabled(struct rq_wb *rwb)
+{
+	return rwb && rwb->wb_normal != 0;
+}
+
+/*
+ * Reads issued or completed in the last window: keep writes down.
+ */
+static bool close_io(struct rq_wb *rwb)
+{
+	const unsigned long now = jiffies;
+
+	return time_before(now, rwb->last_issue + HZ / 10) ||
+		time_before(now, rwb->last_comp + HZ / 10);
+}
+
+static unsigned int get_limit(struct rq_wb *rwb, unsigned long rw)
+{
+	/* the limits may have been cleared under us */
+	if (!rwb_enabled(rwb))
+		return UINT_MAX;
+
+	if (current_is_kswapd())
+		return rwb->wb_max;
+	if ((rw & REQ_BACKGROUND) || close_io(rwb))
+		return rwb->wb_background;
+	return rwb->wb_normal;
+}
+
+/*
+ * Returns true if the limit of wb_max was reached, can't scale up further.
+ */
+static bool calc_wb_limits(struct rq_wb *rwb)
+{
+	unsigned int queue_depth = max(rwb->queue->nr_requests, 1UL);
+	unsigned int depth;
+	bool ret = false;
+
+	if (!rwb->min_lat_nsec) {
+		rwb->wb_max = rwb->wb_normal = rwb->wb_background = 0;
+		return false;
+	}
+
+	/*
+	 * Scale down for positive steps, up for negative ones, but never
+	 * beyond 3/4 of the queue depth so reads always find a tag.
+	 */
+	depth = min_t(unsigned int, RWB_DEF_DEPTH, queue_depth);
+	if (rwb->scale_step > 0)
+		depth = 1 + ((depth - 1) >> min(31, rwb->scale_step));
+	else if (rwb->scale_step < 0) {
+		unsigned int maxd = max(3 * queue_depth / 4, 1U);
+
+		depth = 1 + ((depth - 1) << min(31, -rwb->scale_step));
+		if (depth >= maxd) {
+			depth = maxd;
+			ret = true;
+		}
+	}
+
+	rwb->wb_max = depth;
+	rwb->wb_normal = (depth + 1) / 2;
+	rwb->wb_background = (depth + 3) / 4;
+	return ret;
+}
+
+static void rwb_wake_all(struct rq_wb *rwb)
+{
+	if (waitqueue_active(&rwb->wait))
+		wake_up_all(&rwb->wait);
+}
+
+void __wbt_done(struct rq_wb *rwb)
+{
+	unsigned int inflight, limit;
+
+	inflight = atomic_dec_return(&rwb->inflight);
+
+	if (unlikely(!rwb_enabled(rwb))) {
+		rwb_wake_all(rwb);
+		return;
+	}
+
+	/*
+	 * Let waiters pile up a little rather than waking them one write at
+	 * a time.
+	 */
+	limit = close_io(rwb) ? rwb->wb_background : rwb->wb_normal;
+	if (inflight && inflight >= limit)
+		return;
+
+	rwb_wake_all(rwb);
+}
+
+void __wbt_stat_add(struct rq_wb *rwb, struct request *rq, u64 value)
+{
+	int ddir = rq_data_dir(rq);
+	unsigned long flags;
+
+	if (req_op(rq) != REQ_OP_READ && req_op(rq) != REQ_OP_WRITE)
+		return;
+
+	if (ddir == READ)
+		rwb->last_comp = jiffies;
+
+	local_irq_save(flags);
+	blk_stat_add_sample(this_cpu_ptr(rwb->stat) + ddir, value);
+	local_irq_restore(flags);
+}
+
+static void rwb_arm_timer(struct rq_wb *rwb)
+{
+	unsigned long expires;
+
+	/*
+	 * While throttled, shorten the window by the square root of the
+	 * step, so a device that recovered is noticed sooner.
+	 */
+	if (rwb->scale_step > 0)
+		rwb->cur_win_nsec = div_u64(rwb->win_nsec << 4,
+					int_sqrt((rwb->scale_step + 1) << 8));
+	else
+		rwb->cur_win_nsec = rwb->win_nsec;
+
+	expires = jiffies + max(nsecs_to_jiffies(rwb->cur_win_nsec), 1UL);
+	mod_timer(&rwb->window_timer, expires);
+}
+
+static void scale_up(struct rq_wb *rwb)
+{
+	if (rwb->scaled_max)
+		return;
+
+	rwb->scale_step--;
+	rwb->unknown_cnt = 0;
+	rwb->scaled_max = calc_wb_limits(rwb);
+	rwb_wake_all(rwb);
+
+	trace_wbt_step(&rwb->queue->backing_dev_info, "step up",
+		       rwb->scale_step, rwb->cur_win_nsec, rwb->wb_background,
+		       rwb->wb_normal, rwb->wb_max);
+}
+
+static void scale_down(struct rq_wb *rwb)
+{
+	/* already down to one write at a time */
+	if (rwb->scale_step > 0 && rwb->wb_max == 1)
+		return;
+
+	rwb->scale_step++;
+	rwb->unknown_cnt = 0;
+	rwb->scaled_max = false;
+	calc_wb_limits(rwb);
+
+	trace_wbt_step(&rwb->queue->backing_dev_info, "step down",
+		       rwb->scale_step, rwb->cur_win_nsec, rwb->wb_background,
+		       rwb->wb_normal, rwb->wb_max);
+}
+
+/*
+ * Fold and reset the per-cpu samples of the window.  A sample racing with
+ * this may be lost, as in blk-stat.
+ */
+static void rwb_collect_stat(struct rq_wb *rwb, struct blk_rq_stat *stat)
+{
+	int cpu, ddir;
+
+	for (ddir = READ; ddir <= WRITE; ddir++) {
+		blk_stat_reset(&stat[ddir]);
+		for_each_possible_cpu(cpu) {
+			struct blk_rq_stat *s = per_cpu_ptr(rwb->stat, cpu) + ddir;
+
+			blk_stat_sum(&stat[ddir], s);
+			blk_stat_reset(s);
+		}
+	}
+}
+
+static int latency_exceeded(struct rq_wb *rwb, struct blk_rq_stat *stat)
+{
+	struct backing_dev_info *bdi = &rwb->queue->backing_dev_info;
+
+	if (!stat[READ].nr_samples) {
+		if (stat[WRITE].nr_samples || atomic_read(&rwb->inflight))
+			return WBT_LAT_UNKNOWN_WRITES;
+		return WBT_LAT_UNKNOWN;
+	}
+
+	trace_wbt_stat(bdi, stat);
+
+	/*
+	 * The minimum, not the mean: a big read may legitimately take longer
+	 * than the target, but if not even the fastest one made it, reads
+	 * are being held up.
+	 */
+	if (stat[READ].min > rwb->min_lat_nsec) {
+		trace_wbt_lat(bdi, stat[READ].min);
+		return WBT_LAT_EXCEEDED;
+	}
+
+	return WBT_LAT_OK;
+}
+
+static void wb_timer_fn(unsigned long data)
+{
+	struct rq_wb *rwb = (struct rq_wb *) data;
+	struct request_queue *q = rwb->queue;
+	struct blk_rq_stat stat[2];
+	unsigned int inflight;
+	int status;
+
+	/* serializes against wbt_set_min_lat() */
+	spin_lock_irq(q->queue_lock);
+
+	if (!rwb_enabled(rwb))
+		goto out;
+
+	rwb_collect_stat(rwb, stat);
+	status = latency_exceeded(rwb, stat);
+	inflight = atomic_read(&rwb->inflight);
+
+	trace_wbt_timer(&rwb->queue->backing_dev_info, status,
+			rwb->scale_step, inflight);
+
+	switch (status) {
+	case WBT_LAT_EXCEEDED:
+		scale_down(rwb);
+		break;
+	case WBT_LAT_OK:
+	case WBT_LAT_UNKNOWN_WRITES:
+		scale_up(rwb);
+		break;
+	case WBT_LAT_UNKNOWN:
+		/* idle for a while: drift back to the default depth */
+		if (++rwb->unknown_cnt < RWB_UNKNOWN_BUMP)
+			break;
+		if (rwb->scale_step > 0)
+			scale_up(rwb);
+		else if (rwb->scale_step < 0)
+			scale_down(rwb);
+		break;
+	}
+
+	/* keep going while there is state to age, or writes to watch */
+	if (rwb->scale_step || inflight)
+		rwb_arm_timer(rwb);
+out:
+	spin_unlock_irq(q->queue_lock);
+}
+
+static bool atomic_inc_below(atomic_t *v, unsigned int below)
+{
+	unsigned int cur = atomic_read(v);
+
+	for (;;) {
+		unsigned int old;
+
+		if (cur >= below)
+			return false;
+		old = atomic_cmpxchg(v, cur, cur + 1);
+		if (old == cur)
+			break;
+		cur = old;
+	}
+
+	return true;
+}
+
+static void __wbt_wait(struct rq_wb *rwb, unsigned long rw)
+{
+	DEFINE_WAIT(wait);
+
+	if (atomic_inc_below(&rwb->inflight, get_limit(rwb, rw)))
+		return;
+
+	do {
+		prepare_to_wait(&rwb->wait, &wait, TASK_UNINTERRUPTIBLE);
+		if (atomic_inc_below(&rwb->inflight, get_limit(rwb, rw)))
+			break;
+		io_schedule();
+	} while (1);
+
+	finish_wait(&rwb->wait, &wait);
+}
+
+static bool wbt_should_throttle(struct bio *bio)
+{
+	if (bio_op(bio) != REQ_OP_WRITE)
+		return false;
+
+	/*
+	 * O_DIRECT, WB_SYNC_ALL writeback and journal commits are all
+	 * REQ_SYNC, and someone is waiting on them, as on flushes and FUA
+	 * writes.  Only asynchronous buffered writeback is throttled.
+	 */
+	if (bio->bi_opf & (REQ_SYNC | REQ_PREFLUSH | REQ_FUA))
+		return false;
+
+	return true;
+}
+
+/**
+ * wbt_wait - wait for room for a buffered write
+ * @rwb:	the queue's writeback throttling state, may be %NULL
+ * @bio:	bio about to get a request
+ *
+ * Called before a request is allocated for @bio, may sleep.  Returns true
+ * if @bio was counted as in flight, in which case the request it ends up
+ * in must be passed to wbt_track(), or __wbt_done() called if it gets none.
+ */
+bool wbt_wait(struct rq_wb *rwb, struct bio *bio)
+{
+	if (!rwb_enabled(rwb))
+		return false;
+
+	if (bio_op(bio) == REQ_OP_READ)
+		rwb->last_issue = jiffies;
+
+	if (!wbt_should_throttle(bio))
+		return false;
+
+	__wbt_wait(rwb, bio->bi_opf);
+
+	if (!timer_pending(&rwb->window_timer))
+		rwb_arm_timer(rwb);
+
+	return true;
+}
+
+u64 wbt_default_latency_nsec(struct request_queue *q)
+{
+	/* 2ms for flash, 75ms for disks */
+	if (blk_queue_nonrot(q))
+		return 2000000ULL;
+	return 75000000ULL;
+}
+
+/*
+ * Set the read latency target, 0 disables throttling.  The scaling state
+ * is reset under the queue_lock, which keeps the window timer out, and a
+ * window in progress starts over, so the samples taken under the old
+ * target aren't judged against the new one.
+ */
+void wbt_set_min_lat(struct rq_wb *rwb, u64 nsec)
+{
+	struct request_queue *q = rwb->queue;
+	struct blk_rq_stat stat[2];
+
+	spin_lock_irq(q->queue_lock);
+	rwb->min_lat_nsec = nsec;
+	rwb->scale_step = 0;
+	rwb->scaled_max = false;
+	rwb->unknown_cnt = 0;
+	calc_wb_limits(rwb);
+	if (timer_pending(&rwb->window_timer)) {
+		rwb_collect_stat(rwb, stat);
+		rwb_arm_timer(rwb);
+	}
+	spin_unlock_irq(q->queue_lock);
+
+	rwb_wake_all(rwb);
+}
+
+int wbt_init(struct request_queue *q)
+{
+	struct rq_wb *rwb;
+	int cpu;
+
+	if (!q->mq_ops || q->rq_wb)
+		return -EINVAL;
+
+	rwb = kzalloc(sizeof(*rwb), GFP_KERNEL);
+	if (!rwb)
+		return -ENOMEM;
+
+	rwb->stat = __alloc_percpu(2 * sizeof(struct blk_rq_stat),
+				   __alignof__(struct blk_rq_stat));
+	if (!rwb->stat) {
+		kfree(rwb);
+		return -ENOMEM;
+	}
+	for_each_possible_cpu(cpu) {
+		blk_stat_reset(per_cpu_ptr(rwb->stat, cpu) + READ);
+		blk_stat_reset(per_cpu_ptr(rwb->stat, cpu) + WRITE);
+	}
+
+	atomic_set(&rwb->inflight, 0);
+	init_waitqueue_head(&rwb->wait);
+	setup_timer(&rwb->window_timer, wb_timer_fn, (unsigned long) rwb);
+	rwb->queue = q;
+	rwb->win_nsec = RWB_WINDOW_NSEC;
+	rwb->cur_win_nsec = RWB_WINDOW_NSEC;
+	rwb->last_issue = rwb->last_comp = jiffies - HZ;
+	wbt_set_min_lat(rwb, wbt_default_latency_nsec(q));
+
+	/* reads and writes need their issue stamp for the samples */
+	blk_stat_enable(q);
+
+	q->rq_wb = rwb;
+	return 0;
+}
+
+void wbt_exit(struct request_queue *q)
+{
+	struct rq_wb *rwb = q->rq_wb;
+
+	if (!rwb)
+		return;
+
+	q->rq_wb = NULL;
+	del_timer_sync(&rwb->window_timer);
+	free_percpu(rwb->stat);
+	kfree(rwb);
+}
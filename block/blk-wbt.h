@@ -0,0 +1,121 @@
+#ifndef BLK_WBT_H
+#define BLK_WBT_H
+
+#include <linux/kernel.h>
+#include <linux/atomic.h>
+#include <linux/wait.h>
+#include <linux/timer.h>
+#include <linux/ktime.h>
+#include <linux/blkdev.h>
+
+enum {
+	WBT_LAT_OK,		/* reads met the target */
+	WBT_LAT_EXCEEDED,	/* the fastest read missed the target */
+	WBT_LAT_UNKNOWN_WRITES,	/* no reads, writes are going on */
+	WBT_LAT_UNKNOWN,	/* no reads, no writes */
+};
+
+struct rq_wb {
+	/*
+	 * Writes allowed in flight: background writeback, other buffered
+	 * writes, and writes issued while reads are not around.  These and
+	 * the scaling state below change under the queue_lock.
+	 */
+	unsigned int wb_background;
+	unsigned int wb_normal;
+	unsigned int wb_max;
+
+	int scale_step;		/* > 0: throttled below the default */
+	bool scaled_max;	/* can't scale up any further */
+
+	u64 win_nsec;		/* default window size */
+	u64 cur_win_nsec;	/* current window size */
+	u64 min_lat_nsec;	/* read latency target, 0 if disabled */
+	unsigned int unknown_cnt;
+
+	unsigned long last_issue;	/* last read issued, jiffies */
+	unsigned long last_comp;	/* last read completed, jiffies */
+
+	atomic_t inflight;
+	wait_queue_head_t wait;
+
+	struct timer_list window_timer;
+	struct blk_rq_stat __percpu *stat;	/* [READ], [WRITE] */
+
+	struct request_queue *queue;
+};
+
+#ifdef CONFIG_BLK_WBT
+
+int wbt_init(struct request_queue *q);
+void wbt_exit(struct request_queue *q);
+bool wbt_wait(struct rq_wb *rwb, struct bio *bio);
+void __wbt_done(struct rq_wb *rwb);
+void __wbt_stat_add(struct rq_wb *rwb, struct request *rq, u64 value);
+void wbt_set_min_lat(struct rq_wb *rwb, u64 nsec);
+u64 wbt_default_latency_nsec(struct request_queue *q);
+
+/*
+ * @tracked is what wbt_wait() returned for the bio @rq was allocated for.
+ */
+static inline void wbt_track(struct request *rq, bool tracked)
+{
+	if (tracked)
+		rq->cmd_flags |= REQ_WBT;
+}
+
+/*
+ * Called when @rq is freed, whether it completed or was merged away.
+ */
+static inline void wbt_done(struct rq_wb *rwb, struct request *rq)
+{
+	if (rq->cmd_flags & REQ_WBT) {
+		rq->cmd_flags &= ~REQ_WBT;
+		__wbt_done(rwb);
+	}
+}
+
+static inline void wbt_stat_add(struct rq_wb *rwb, struct request *rq,
+				u64 value)
+{
+	if (rwb)
+		__wbt_stat_add(rwb, rq, value);
+}
+
+#else
+
+static inline int wbt_init(struct request_queue *q)
+{
+	return -EINVAL;
+}
+static inline void wbt_exit(struct request_queue *q)
+{
+}
+static inline bool wbt_wait(struct rq_wb *rwb, struct bio *bio)
+{
+	return false;
+}
+static inline void __wbt_done(struct rq_wb *rwb)
+{
+}
+static inline void wbt_track(struct request *rq, bool tracked)
+{
+}
+static inline void wbt_done(struct rq_wb *rwb, struct request *rq)
+{
+}
+static inline void wbt_stat_add(struct rq_wb *rwb, struct request *rq,
+				u64 value)
+{
+}
+static inline void wbt_set_min_lat(struct rq_wb *rwb, u64 nsec)
+{
+}
+static inline u64 wbt_default_latency_nsec(struct request_queue *q)
+{
+	return 0;
+}
+
+#endif /* CONFIG_BLK_WBT */
+
+#endif
@@ -0,0 +1,399 @@
+/*
+ * Zoned block device handling
+ *
+ * A zoned block device is split into zones of blk_queue_zone_sectors()
+ * sectors each, but for a possibly smaller last zone.  Sequential zones
+ * have a write pointer that writes must start at; the driver (or the
+ * device) keeps track of it and the block layer only has to make sure
+ * that writes to a zone reach the driver in the order they were issued,
+ * see blk_req_zone_write_trylock().
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation.
+ */
+#include <linux/kernel.h>
+#include <linux/module.h>
+#include <linux/blkdev.h>
+#include <linux/blk-mq.h>
+#include <linux/slab.h>
+#include <linux/uaccess.h>
+
+#include "blk.h"
+
+/* Most zones handed out by one ->report_zones() call or BLKREPORTZONE */
+#define BLK_ZONED_REPORT_MAX	1024U
+
+/*
+ * Number of zones of @bdev, which may be a partition.
+ */
+static unsigned int blkdev_nr_zones(struct block_device *bdev)
+{
+	struct request_queue *q = bdev_get_queue(bdev);
+	sector_t nr_sects = part_nr_sects_read(bdev->bd_part);
+	unsigned int zone_sectors = blk_queue_zone_sectors(q);
+
+	if (!zone_sectors)
+		return 0;
+
+	return (nr_sects + zone_sectors - 1) >> ilog2(zone_sectors);
+}
+
+/**
+ * blkdev_report_zones - Get zones information
+ * @bdev:	Target block device
+ * @sector:	Sector from which to report zones
+ * @zones:	Array of zone structures where to return the zones information
+ * @nr_zones:	Number of zone structures in the zone array
+ * @gfp_mask:	Memory allocation flags (for bio_alloc)
+ *
+ * Description:
+ *    Get zone information starting from the zone containing @sector.
+ *    The number of zone information reported may be less than the number
+ *    requested by @nr_zones. The number of zones actually reported is
+ *    returned in @nr_zones.  Zone start and write pointer sectors are
+ *    relative to @bdev, only zones entirely within a partition are
+ *    reported for it.
+ */
+int blkdev_report_zones(struct block_device *bdev, sector_t sector,
+			struct blk_zone *zones, unsigned int *nr_zones,
+			gfp_t gfp_mask)
+{
+	struct request_queue *q = bdev_get_queue(bdev);
+	struct gendisk *disk = bdev->bd_disk;
+	sector_t offset = get_start_sect(bdev);
+	sector_t nr_sects = part_nr_sects_read(bdev->bd_part);
+	unsigned int i, n = 0;
+	int ret;
+
+	if (!blk_queue_is_zoned(q))
+		return -EOPNOTSUPP;
+
+	if (!disk->fops->report_zones)
+		return -EOPNOTSUPP;
+
+	if (!*nr_zones || sector >= nr_sects) {
+		*nr_zones = 0;
+		return 0;
+	}
+
+	ret = disk->fops->report_zones(disk, sector + offset, zones,
+				       nr_zones, gfp_mask);
+	if (ret)
+		return ret;
+
+	for (i = 0; i < *nr_zones; i++) {
+		struct blk_zone *zone = &zones[i];
+
+		/* An unaligned partition may start in the middle of a zone */
+		if (zone->start < offset)
+			continue;
+		if (zone->start + zone->len > offset + nr_sects)
+			break;
+
+		zone->start -= offset;
+		if (zone->cond != BLK_ZONE_COND_NOT_WP)
+			zone->wp -= offset;
+		if (n != i)
+			zones[n] = *zone;
+		n++;
+	}
+	*nr_zones = n;
+
+	return 0;
+}
+EXPORT_SYMBOL_GPL(blkdev_report_zones);
+
+/**
+ * blkdev_reset_zones - Reset zones write pointer
+ * @bdev:	Target block device
+ * @sector:	Start sector of the first zone to reset
+ * @nr_sectors:	Number of sectors, at least the length of one zone
+ * @gfp_mask:	Memory allocation flags (for bio_alloc)
+ *
+ * Description:
+ *    Reset the write pointer of the zones contained in the range
+ *    @sector..@sector+@nr_sectors. Specifying the entire disk sector range
+ *    is valid, but the specified range should not contain conventional zones.
+ */
+int blkdev_reset_zones(struct block_device *bdev, sector_t sector,
+		       sector_t nr_sectors, gfp_t gfp_mask)
+{
+	struct request_queue *q = bdev_get_queue(bdev);
+	sector_t zone_sectors = blk_queue_zone_sectors(q);
+	sector_t nr_sects = part_nr_sects_read(bdev->bd_part);
+	sector_t end_sector = sector + nr_sectors;
+	struct bio *bio = NULL;
+	int ret;
+
+	if (!blk_queue_is_zoned(q))
+		return -EOPNOTSUPP;
+
+	if (bdev_read_only(bdev))
+		return -EPERM;
+
+	if (!nr_sectors || end_sector > nr_sects || end_sector < sector)
+		return -EINVAL;
+
+	/*
+	 * Check alignment (handle eventual smaller last zone).  The reset
+	 * goes to the disk's zone, so a partition must start on a zone too.
+	 */
+	if ((get_start_sect(bdev) + sector) & (zone_sectors - 1))
+		return -EINVAL;
+
+	if ((nr_sectors & (zone_sectors - 1)) && end_sector != nr_sects)
+		return -EINVAL;
+
+	while (sector < end_sector) {
+		struct bio *next = bio_alloc(gfp_mask, 0);
+
+		next->bi_bdev = bdev;
+		next->bi_iter.bi_sector = sector;
+		bio_set_op_attrs(next, REQ_OP_ZONE_RESET, 0);
+
+		if (bio) {
+			bio_chain(bio, next);
+			submit_bio(bio);
+		}
+		bio = next;
+
+		sector += zone_sectors;
+
+		/* This may take a while, so be nice to others */
+		cond_resched();
+	}
+
+	ret = submit_bio_wait(bio);
+	bio_put(bio);
+
+	return ret;
+}
+EXPORT_SYMBOL_GPL(blkdev_reset_zones);
+
+/*
+ * BLKREPORTZONE ioctl processing.
+ * Called from blkdev_ioctl.
+ */
+int blkdev_report_zones_ioctl(struct block_device *bdev, fmode_t mode,
+			      unsigned int cmd, unsigned long arg)
+{
+	void __user *argp = (void __user *)arg;
+	struct request_queue *q;
+	struct blk_zone_report rep;
+	struct blk_zone *zones;
+	int ret;
+
+	if (!argp)
+		return -EINVAL;
+
+	q = bdev_get_queue(bdev);
+	if (!q)
+		return -ENXIO;
+
+	if (!blk_queue_is_zoned(q))
+		return -ENOTTY;
+
+	if (!capable(CAP_SYS_ADMIN))
+		return -EACCES;
+
+	if (copy_from_user(&rep, argp, sizeof(struct blk_zone_report)))
+		return -EFAULT;
+
+	rep.nr_zones = min3(rep.nr_zones, blkdev_nr_zones(bdev),
+			    BLK_ZONED_REPORT_MAX);
+	if (!rep.nr_zones)
+		return -EINVAL;
+
+	zones = kcalloc(rep.nr_zones, sizeof(struct blk_zone), GFP_KERNEL);
+	if (!zones)
+		return -ENOMEM;
+
+	ret = blkdev_report_zones(bdev, rep.sector, zones, &rep.nr_zones,
+				  GFP_KERNEL);
+	if (ret)
+		goto out;
+
+	if (copy_to_user(argp, &rep, sizeof(struct blk_zone_report))) {
+		ret = -EFAULT;
+		goto out;
+	}
+
+	if (rep.nr_zones &&
+	    copy_to_user(argp + sizeof(struct blk_zone_report), zones,
+			 sizeof(struct blk_zone) * rep.nr_zones))
+		ret = -EFAULT;
+
+out:
+	kfree(zones);
+
+	return ret;
+}
+
+/*
+ * BLKRESETZONE ioctl processing.
+ * Called from blkdev_ioctl.
+ */
+int blkdev_reset_zones_ioctl(struct block_device *bdev, fmode_t mode,
+			     unsigned int cmd, unsigned long arg)
+{
+	void __user *argp = (void __user *)arg;
+	struct request_queue *q;
+	struct blk_zone_range zrange;
+
+	if (!argp)
+		return -EINVAL;
+
+	q = bdev_get_queue(bdev);
+	if (!q)
+		return -ENXIO;
+
+	if (!blk_queue_is_zoned(q))
+		return -ENOTTY;
+
+	if (!capable(CAP_SYS_ADMIN))
+		return -EACCES;
+
+	if (!(mode & FMODE_WRITE))
+		return -EBADF;
+
+	if (copy_from_user(&zrange, argp, sizeof(struct blk_zone_range)))
+		return -EFAULT;
+
+	return blkdev_reset_zones(bdev, zrange.sector, zrange.nr_sectors,
+				  GFP_KERNEL);
+}
+
+/**
+ * blk_req_zone_write_trylock - take the write lock of a request's zone
+ * @rq: write request to a sequential zone
+ *
+ * Returns true if @rq now holds, or already held, the write lock of the
+ * zone it starts in, false if another write to that zone holds it.  The
+ * lock is released by blk_req_zone_write_unlock(), which the block layer
+ * calls when the request is freed; a requeued request keeps it.
+ */
+bool blk_req_zone_write_trylock(struct request *rq)
+{
+	unsigned int zno = blk_queue_zone_no(rq->q, blk_rq_pos(rq));
+
+	if (rq->cmd_flags & REQ_ZONE_WRITE_LOCKED)
+		return true;
+
+	if (test_and_set_bit_lock(zno, rq->q->seq_zones_wlock))
+		return false;
+
+	rq->cmd_flags |= REQ_ZONE_WRITE_LOCKED;
+	return true;
+}
+EXPORT_SYMBOL_GPL(blk_req_zone_write_trylock);
+
+void __blk_req_zone_write_unlock(struct request *rq)
+{
+	rq->cmd_flags &= ~REQ_ZONE_WRITE_LOCKED;
+	if (rq->q->seq_zones_wlock)
+		WARN_ON_ONCE(!test_and_clear_bit_unlock(
+			blk_queue_zone_no(rq->q, blk_rq_pos(rq)),
+			rq->q->seq_zones_wlock));
+}
+EXPORT_SYMBOL_GPL(__blk_req_zone_write_unlock);
+
+void blk_queue_free_zone_bitmaps(struct request_queue *q)
+{
+	kfree(q->seq_zones_bitmap);
+	q->seq_zones_bitmap = NULL;
+	kfree(q->seq_zones_wlock);
+	q->seq_zones_wlock = NULL;
+}
+
+static unsigned long *blk_alloc_zone_bitmap(struct request_queue *q,
+					    unsigned int nr_zones)
+{
+	return kzalloc_node(BITS_TO_LONGS(nr_zones) * sizeof(unsigned long),
+			    GFP_NOIO, q->node);
+}
+
+/**
+ * blk_revalidate_disk_zones - (re)read the zone layout of a zoned disk
+ * @disk: gendisk of a zoned queue, with its capacity set
+ *
+ * Counts the zones of @disk, finds out which of them are sequential with
+ * ->report_zones() and sets up the per-zone write locks.  Drivers call it
+ * once the zone size (the queue chunk_sectors) and capacity are set, and
+ * again whenever they change.
+ */
+int blk_revalidate_disk_zones(struct gendisk *disk)
+{
+	struct request_queue *q = disk->queue;
+	unsigned int zone_sectors = blk_queue_zone_sectors(q);
+	sector_t capacity = get_capacity(disk);
+	unsigned long *seq_zones_bitmap = NULL, *seq_zones_wlock = NULL;
+	unsigned int nr_zones = 0, z = 0;
+	struct blk_zone *zones = NULL;
+	sector_t sector = 0;
+	int ret = 0;
+
+	if (blk_queue_is_zoned(q)) {
+		if (!zone_sectors || !is_power_of_2(zone_sectors) ||
+		    !disk->fops->report_zones)
+			return -EINVAL;
+
+		nr_zones = (capacity + zone_sectors - 1) >> ilog2(zone_sectors);
+
+		ret = -ENOMEM;
+		seq_zones_bitmap = blk_alloc_zone_bitmap(q, nr_zones);
+		if (!seq_zones_bitmap)
+			goto out;
+		if (q->mq_ops) {
+			seq_zones_wlock = blk_alloc_zone_bitmap(q, nr_zones);
+			if (!seq_zones_wlock)
+				goto out;
+		}
+		zones = kcalloc(BLK_ZONED_REPORT_MAX, sizeof(struct blk_zone),
+				GFP_KERNEL);
+		if (!zones)
+			goto out;
+
+		ret = 0;
+		while (sector < capacity && z < nr_zones) {
+			unsigned int i, nrz = BLK_ZONED_REPORT_MAX;
+
+			ret = disk->fops->report_zones(disk, sector, zones,
+						       &nrz, GFP_NOIO);
+			if (ret)
+				goto out;
+			if (!nrz)
+				break;
+
+			for (i = 0; i < nrz && z < nr_zones; i++, z++) {
+				if (zones[i].type != BLK_ZONE_TYPE_CONVENTIONAL)
+					set_bit(z, seq_zones_bitmap);
+			}
+			sector = zones[nrz - 1].start + zones[nrz - 1].len;
+		}
+
+		if (z != nr_zones) {
+			pr_warn("%s: %u zones reported, expected %u\n",
+				disk->disk_name, z, nr_zones);
+			ret = -EIO;
+			goto out;
+		}
+	}
+
+	/*
+	 * Swap in the new layout with no request in flight, so that no zone
+	 * write lock is held while the bitmaps change under it.
+	 */
+	blk_mq_freeze_queue(q);
+	q->nr_zones = nr_zones;
+	swap(q->seq_zones_bitmap, seq_zones_bitmap);
+	swap(q->seq_zones_wlock, seq_zones_wlock);
+	blk_mq_unfreeze_queue(q);
+
+out:
+	kfree(zones);
+	kfree(seq_zones_wlock);
+	kfree(seq_zones_bitmap);
+	return ret;
+}
+EXPORT_SYMBOL_GPL(blk_revalidate_disk_zones);
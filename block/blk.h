@@ -116,6 +116,7 @@ void blk_account_io_done(struct request *req);
 enum rq_atomic_flags {
 	REQ_ATOM_COMPLETE = 0,
 	REQ_ATOM_STARTED,
+	REQ_ATOM_POLL_SLEPT,
 };
 
 /*
@@ -294,10 +295,23 @@ static inline struct io_context *create_io_context(gfp_t gfp_mask, int node)
 extern void blk_throtl_drain(struct request_queue *q);
 extern int blk_throtl_init(struct request_queue *q);
 extern void blk_throtl_exit(struct request_queue *q);
+extern void blk_throtl_bio_endio(struct bio *bio);
+extern void blk_throtl_bio_release(struct bio *bio);
 #else /* CONFIG_BLK_DEV_THROTTLING */
 static inline void blk_throtl_drain(struct request_queue *q) { }
 static inline int blk_throtl_init(struct request_queue *q) { return 0; }
 static inline void blk_throtl_exit(struct request_queue *q) { }
+static inline void blk_throtl_bio_endio(struct bio *bio) { }
+static inline void blk_throtl_bio_release(struct bio *bio) { }
 #endif /* CONFIG_BLK_DEV_THROTTLING */
 
+/*
+ * Internal zoned device interface
+ */
+#ifdef CONFIG_BLK_DEV_ZONED
+extern void blk_queue_free_zone_bitmaps(struct request_queue *q);
+#else /* CONFIG_BLK_DEV_ZONED */
+static inline void blk_queue_free_zone_bitmaps(struct request_queue *q) { }
+#endif /* CONFIG_BLK_DEV_ZONED */
+
 #endif /* BLK_INTERNAL_H */
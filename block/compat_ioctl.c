@@ -692,6 +692,8 @@ long compat_blkdev_ioctl(struct file *file, unsigned cmd, unsigned long arg)
 	case BLKDISCARD:
 	case BLKSECDISCARD:
 	case BLKZEROOUT:
+	case BLKREPORTZONE:
+	case BLKRESETZONE:
 	/*
 	 * the ones below are implemented in blkdev_locked_ioctl,
 	 * but we call blkdev_ioctl, which gets the lock for us
@@ -40,6 +40,7 @@
 #include <trace/events/block.h>
 
 #include "blk.h"
+#include "blk-mq-sched.h"
 
 static DEFINE_SPINLOCK(elv_list_lock);
 static LIST_HEAD(elv_list);
@@ -96,7 +97,8 @@ static void elevator_put(struct elevator_type *e)
 	module_put(e->elevator_owner);
 }
 
-static struct elevator_type *elevator_get(const char *name, bool try_loading)
+static struct elevator_type *elevator_get(const char *name, bool try_loading,
+					  bool mq)
 {
 	struct elevator_type *e;
 
@@ -110,6 +112,10 @@ static struct elevator_type *elevator_get(const char *name, bool try_loading)
 		e = elevator_find(name);
 	}
 
+	/* legacy and blk-mq schedulers can't stand in for each other */
+	if (e && e->uses_mq != mq)
+		e = NULL;
+
 	if (e && !try_module_get(e->elevator_owner))
 		e = NULL;
 
@@ -150,6 +156,12 @@ void __init load_default_elevator_module(void)
 
 static struct kobj_type elv_ktype;
 
+/*
+ * The elevator_queue pins the module of @e for as long as it lives, and
+ * drops that reference on release.  The caller keeps its own reference
+ * from elevator_get() either way, so it can put it whether or not the
+ * scheduler's init function failed, and however far that function got.
+ */
 struct elevator_queue *elevator_alloc(struct request_queue *q,
 				  struct elevator_type *e)
 {
@@ -159,6 +171,7 @@ struct elevator_queue *elevator_alloc(struct request_queue *q,
 	if (unlikely(!eq))
 		return NULL;
 
+	__module_get(e->elevator_owner);
 	eq->type = e;
 	kobject_init(&eq->kobj, &elv_ktype);
 	mutex_init(&eq->sysfs_lock);
@@ -197,7 +210,7 @@ int elevator_init(struct request_queue *q, char *name)
 	q->boundary_rq = NULL;
 
 	if (name) {
-		e = elevator_get(name, true);
+		e = elevator_get(name, true, false);
 		if (!e)
 			return -EINVAL;
 	}
@@ -208,25 +221,24 @@ int elevator_init(struct request_queue *q, char *name)
 	 * off async and request_module() isn't allowed from async.
 	 */
 	if (!e && *chosen_elevator) {
-		e = elevator_get(chosen_elevator, false);
+		e = elevator_get(chosen_elevator, false, false);
 		if (!e)
 			printk(KERN_ERR "I/O scheduler %s not found\n",
 							chosen_elevator);
 	}
 
 	if (!e) {
-		e = elevator_get(CONFIG_DEFAULT_IOSCHED, false);
+		e = elevator_get(CONFIG_DEFAULT_IOSCHED, false, false);
 		if (!e) {
 			printk(KERN_ERR
 				"Default I/O scheduler not found. " \
 				"Using noop.\n");
-			e = elevator_get("noop", false);
+			e = elevator_get("noop", false, false);
 		}
 	}
 
 	err = e->ops.elevator_init_fn(q, e);
-	if (err)
-		elevator_put(e);
+	elevator_put(e);
 	return err;
 }
 EXPORT_SYMBOL(elevator_init);
@@ -234,7 +246,10 @@ EXPORT_SYMBOL(elevator_init);
 void elevator_exit(struct elevator_queue *e)
 {
 	mutex_lock(&e->sysfs_lock);
-	if (e->type->ops.elevator_exit_fn)
+	if (e->type->uses_mq) {
+		if (e->type->mq_ops.exit_sched)
+			e->type->mq_ops.exit_sched(e);
+	} else if (e->type->ops.elevator_exit_fn)
 		e->type->ops.elevator_exit_fn(e);
 	mutex_unlock(&e->sysfs_lock);
 
@@ -512,6 +527,15 @@ void elv_merge_requests(struct request_queue *q, struct request *rq,
 	struct elevator_queue *e = q->elevator;
 	const int next_sorted = next->cmd_flags & REQ_SORTED;
 
+	if (e->type->uses_mq) {
+		struct blk_mq_hw_ctx *hctx;
+
+		hctx = q->mq_ops->map_queue(q, rq->mq_ctx->cpu);
+		if (e->type->mq_ops.requests_merged)
+			e->type->mq_ops.requests_merged(hctx, rq, next);
+		return;
+	}
+
 	if (next_sorted && e->type->ops.elevator_merge_req_fn)
 		e->type->ops.elevator_merge_req_fn(q, rq, next);
 
@@ -684,6 +708,11 @@ struct request *elv_latter_request(struct request_queue *q, struct request *rq)
 {
 	struct elevator_queue *e = q->elevator;
 
+	if (e->type->uses_mq) {
+		if (e->type->mq_ops.latter_request)
+			return e->type->mq_ops.latter_request(q, rq);
+		return NULL;
+	}
 	if (e->type->ops.elevator_latter_req_fn)
 		return e->type->ops.elevator_latter_req_fn(q, rq);
 	return NULL;
@@ -693,6 +722,11 @@ struct request *elv_former_request(struct request_queue *q, struct request *rq)
 {
 	struct elevator_queue *e = q->elevator;
 
+	if (e->type->uses_mq) {
+		if (e->type->mq_ops.former_request)
+			return e->type->mq_ops.former_request(q, rq);
+		return NULL;
+	}
 	if (e->type->ops.elevator_former_req_fn)
 		return e->type->ops.elevator_former_req_fn(q, rq);
 	return NULL;
@@ -943,6 +977,45 @@ fail_init:
 	return err;
 }
 
+/*
+ * blk-mq variant of elevator_switch().  The queue is frozen across the
+ * switch, so no request can be sitting in the old scheduler and there is
+ * nothing to drain.  @new_e may be NULL to run the queue without a
+ * scheduler.  If the new scheduler fails to initialize, the queue is left
+ * without one rather than going back to the old one.
+ */
+static int elevator_switch_mq(struct request_queue *q,
+			      struct elevator_type *new_e)
+{
+	int err = 0;
+
+	blk_mq_freeze_queue(q);
+	blk_mq_sched_quiesce(q);
+
+	if (q->elevator) {
+		if (q->elevator->registered)
+			elv_unregister_queue(q);
+		blk_mq_exit_sched(q, q->elevator);
+	}
+
+	if (new_e) {
+		err = blk_mq_init_sched(q, new_e);
+		if (!err && q->mq_sysfs_init_done) {
+			err = elv_register_queue(q);
+			if (err)
+				blk_mq_exit_sched(q, q->elevator);
+		}
+	}
+
+	blk_mq_sched_unquiesce(q);
+	blk_mq_unfreeze_queue(q);
+
+	if (!err)
+		blk_add_trace_msg(q, "elv switch: %s",
+				  new_e ? new_e->elevator_name : "none");
+	return err;
+}
+
 /*
  * Switch this queue to the given IO scheduler.
  */
@@ -950,23 +1023,37 @@ static int __elevator_change(struct request_queue *q, const char *name)
 {
 	char elevator_name[ELV_NAME_MAX];
 	struct elevator_type *e;
+	int err;
 
-	if (!q->elevator)
+	if (!q->elevator && !q->mq_ops)
 		return -ENXIO;
 
 	strlcpy(elevator_name, name, sizeof(elevator_name));
-	e = elevator_get(strstrip(elevator_name), true);
+
+	if (q->mq_ops && !strcmp(strstrip(elevator_name), "none")) {
+		if (!q->elevator)
+			return 0;
+		return elevator_switch_mq(q, NULL);
+	}
+
+	e = elevator_get(strstrip(elevator_name), true, !!q->mq_ops);
 	if (!e) {
 		printk(KERN_ERR "elevator: type %s not found\n", elevator_name);
 		return -EINVAL;
 	}
 
-	if (!strcmp(elevator_name, q->elevator->type->elevator_name)) {
+	if (q->elevator &&
+	    !strcmp(elevator_name, q->elevator->type->elevator_name)) {
 		elevator_put(e);
 		return 0;
 	}
 
-	return elevator_switch(q, e);
+	if (q->mq_ops)
+		err = elevator_switch_mq(q, e);
+	else
+		err = elevator_switch(q, e);
+	elevator_put(e);
+	return err;
 }
 
 int elevator_change(struct request_queue *q, const char *name)
@@ -987,7 +1074,7 @@ ssize_t elv_iosched_store(struct request_queue *q, const char *name,
 {
 	int ret;
 
-	if (!q->elevator)
+	if (!q->elevator && !q->mq_ops)
 		return count;
 
 	ret = __elevator_change(q, name);
@@ -1001,24 +1088,30 @@ ssize_t elv_iosched_store(struct request_queue *q, const char *name,
 ssize_t elv_iosched_show(struct request_queue *q, char *name)
 {
 	struct elevator_queue *e = q->elevator;
-	struct elevator_type *elv;
+	struct elevator_type *elv = NULL;
 	struct elevator_type *__e;
 	int len = 0;
 
-	if (!q->elevator || !blk_queue_stackable(q))
+	if ((!q->elevator && !q->mq_ops) || !blk_queue_stackable(q))
 		return sprintf(name, "none\n");
 
-	elv = e->type;
+	if (e)
+		elv = e->type;
 
 	spin_lock(&elv_list_lock);
 	list_for_each_entry(__e, &elv_list, list) {
-		if (!strcmp(elv->elevator_name, __e->elevator_name))
+		if (__e->uses_mq != !!q->mq_ops)
+			continue;
+		if (elv && !strcmp(elv->elevator_name, __e->elevator_name))
 			len += sprintf(name+len, "[%s] ", elv->elevator_name);
 		else
 			len += sprintf(name+len, "%s ", __e->elevator_name);
 	}
 	spin_unlock(&elv_list_lock);
 
+	if (q->mq_ops)
+		len += sprintf(name+len, elv ? "none" : "[none]");
+
 	len += sprintf(len+name, "\n");
 	return len;
 }
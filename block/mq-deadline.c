@@ -0,0 +1,659 @@
+/*
+ *  MQ Deadline i/o scheduler - the deadline scheduler, adapted to the
+ *  blk-mq scheduling framework.
+ *
+ *  Each hardware queue is scheduled on its own: it has its own sort lists,
+ *  FIFOs and batch state, so hardware queues don't contend on a shared
+ *  lock.  The tunables are per device.
+ *
+ *  On zoned block devices, at most one write per sequential zone is
+ *  dispatched at a time, so that writes reach the device in LBA order.
+ *  That only holds within one set of FIFOs and sort lists: a write held
+ *  on another hardware queue could overtake it.  Since requests are
+ *  dispatched on the hardware queue they were allocated on, zoned queues
+ *  with more than one hardware queue are refused.
+ */
+#include <linux/kernel.h>
+#include <linux/fs.h>
+#include <linux/blkdev.h>
+#include <linux/blk-mq.h>
+#include <linux/elevator.h>
+#include <linux/bio.h>
+#include <linux/module.h>
+#include <linux/slab.h>
+#include <linux/init.h>
+#include <linux/compiler.h>
+#include <linux/rbtree.h>
+#include <linux/hashtable.h>
+
+#include "blk.h"
+#include "blk-mq.h"
+#include "blk-mq-sched.h"
+
+/*
+ * See Documentation/block/deadline-iosched.txt
+ */
+static const int read_expire = HZ / 2;  /* max time before a read is submitted. */
+static const int write_expire = 5 * HZ; /* ditto for writes, these limits are SOFT! */
+static const int writes_starved = 2;    /* max times reads can starve a write */
+static const int fifo_batch = 16;       /* # of sequential requests treated as one
+				     by the above parameters. For throughput. */
+
+/*
+ * settings that change how the i/o scheduler behaves, shared by all
+ * hardware queues of the device
+ */
+struct dd_tunables {
+	int fifo_expire[2];
+	int fifo_batch;
+	int writes_starved;
+	int front_merges;
+};
+
+#define DD_HASH_BITS	6
+
+/*
+ * per hardware queue state
+ */
+struct deadline_data {
+	spinlock_t lock;
+	struct dd_tunables *tun;
+
+	/*
+	 * requests are present on both sort_list and fifo_list
+	 */
+	struct rb_root sort_list[2];
+	struct list_head fifo_list[2];
+
+	/*
+	 * mergeable requests, hashed by end sector for back merges
+	 */
+	DECLARE_HASHTABLE(hash, DD_HASH_BITS);
+
+	/*
+	 * next in sort order. read, write or both are NULL
+	 */
+	struct request *next_rq[2];
+	unsigned int batching;		/* number of sequential requests made */
+	unsigned int starved;		/* times reads have starved writes */
+};
+
+static inline struct rb_root *
+deadline_rb_root(struct deadline_data *dd, struct request *rq)
+{
+	return &dd->sort_list[rq_data_dir(rq)];
+}
+
+/*
+ * get the request after `rq' in sector-sorted order
+ */
+static inline struct request *
+deadline_latter_request(struct request *rq)
+{
+	struct rb_node *node = rb_next(&rq->rb_node);
+
+	if (node)
+		return rb_entry_rq(node);
+
+	return NULL;
+}
+
+static void
+deadline_add_rq_rb(struct deadline_data *dd, struct request *rq)
+{
+	struct rb_root *root = deadline_rb_root(dd, rq);
+
+	elv_rb_add(root, rq);
+}
+
+static inline void
+deadline_del_rq_rb(struct deadline_data *dd, struct request *rq)
+{
+	const int data_dir = rq_data_dir(rq);
+
+	if (dd->next_rq[data_dir] == rq)
+		dd->next_rq[data_dir] = deadline_latter_request(rq);
+
+	elv_rb_del(deadline_rb_root(dd, rq), rq);
+}
+
+static void dd_rqhash_add(struct deadline_data *dd, struct request *rq)
+{
+	hash_add(dd->hash, &rq->hash, rq_end_sector(rq));
+	rq->cmd_flags |= REQ_HASHED;
+}
+
+static void dd_rqhash_del(struct request *rq)
+{
+	if (ELV_ON_HASH(rq)) {
+		hash_del(&rq->hash);
+		rq->cmd_flags &= ~REQ_HASHED;
+	}
+}
+
+static struct request *dd_rqhash_find(struct deadline_data *dd, sector_t offset)
+{
+	struct request *rq;
+
+	hash_for_each_possible(dd->hash, rq, hash, offset) {
+		if (rq_end_sector(rq) == offset)
+			return rq;
+	}
+
+	return NULL;
+}
+
+/*
+ * add rq to rbtree, merge hash and fifo
+ */
+static void
+deadline_add_request(struct deadline_data *dd, struct request *rq)
+{
+	const int data_dir = rq_data_dir(rq);
+
+	deadline_add_rq_rb(dd, rq);
+	if (rq_mergeable(rq))
+		dd_rqhash_add(dd, rq);
+
+	/*
+	 * set expire time and add to fifo list
+	 */
+	rq->fifo_time = jiffies + dd->tun->fifo_expire[data_dir];
+	list_add_tail(&rq->queuelist, &dd->fifo_list[data_dir]);
+}
+
+/*
+ * remove rq from rbtree, merge hash and fifo.
+ */
+static void deadline_remove_request(struct deadline_data *dd,
+				    struct request *rq)
+{
+	rq_fifo_clear(rq);
+	deadline_del_rq_rb(dd, rq);
+	dd_rqhash_del(rq);
+}
+
+/*
+ * move an entry out of the scheduler, for dispatch
+ */
+static void
+deadline_move_request(struct deadline_data *dd, struct request *rq)
+{
+	const int data_dir = rq_data_dir(rq);
+
+	dd->next_rq[READ] = NULL;
+	dd->next_rq[WRITE] = NULL;
+	dd->next_rq[data_dir] = deadline_latter_request(rq);
+
+	deadline_remove_request(dd, rq);
+}
+
+/*
+ * For a zoned block device, return the oldest write whose zone has no write
+ * in flight, or NULL if there is none.  Otherwise the oldest request.
+ */
+static struct request *
+deadline_fifo_request(struct deadline_data *dd, int data_dir)
+{
+	struct request *rq;
+
+	if (list_empty(&dd->fifo_list[data_dir]))
+		return NULL;
+
+	rq = rq_entry_fifo(dd->fifo_list[data_dir].next);
+	if (data_dir == READ || !blk_queue_is_zoned(rq->q))
+		return rq;
+
+	list_for_each_entry(rq, &dd->fifo_list[WRITE], queuelist) {
+		if (blk_req_can_dispatch_to_zone(rq))
+			return rq;
+	}
+
+	return NULL;
+}
+
+/*
+ * The next request in sort order, skipping writes to zones that have a
+ * write in flight on zoned block devices.
+ */
+static struct request *
+deadline_next_request(struct deadline_data *dd, int data_dir)
+{
+	struct request *rq = dd->next_rq[data_dir];
+
+	if (!rq || data_dir == READ || !blk_queue_is_zoned(rq->q))
+		return rq;
+
+	while (rq && !blk_req_can_dispatch_to_zone(rq))
+		rq = deadline_latter_request(rq);
+
+	return rq;
+}
+
+/*
+ * deadline_check_fifo returns 0 if there are no expired requests on the fifo,
+ * 1 otherwise. Requires !list_empty(&dd->fifo_list[data_dir])
+ */
+static inline int deadline_check_fifo(struct deadline_data *dd, int ddir)
+{
+	struct request *rq = rq_entry_fifo(dd->fifo_list[ddir].next);
+
+	/*
+	 * rq is expired!
+	 */
+	if (time_after_eq(jiffies, (unsigned long)rq->fifo_time))
+		return 1;
+
+	return 0;
+}
+
+/*
+ * __dd_dispatch_request selects the best request according to
+ * read/write expire, fifo_batch, etc
+ */
+static struct request *__dd_dispatch_request(struct deadline_data *dd)
+{
+	const int reads = !list_empty(&dd->fifo_list[READ]);
+	const int writes = !list_empty(&dd->fifo_list[WRITE]);
+	struct request *rq, *next_rq;
+	int data_dir;
+
+	/*
+	 * batches are currently reads XOR writes
+	 */
+	rq = deadline_next_request(dd, WRITE);
+	if (!rq)
+		rq = deadline_next_request(dd, READ);
+
+	if (rq && dd->batching < dd->tun->fifo_batch)
+		/* we have a next request are still entitled to batch */
+		goto dispatch_request;
+
+	/*
+	 * at this point we are not running a batch. select the appropriate
+	 * data direction (read / write)
+	 */
+
+	if (reads) {
+		BUG_ON(RB_EMPTY_ROOT(&dd->sort_list[READ]));
+
+		if (writes && (dd->starved++ >= dd->tun->writes_starved))
+			goto dispatch_writes;
+
+		data_dir = READ;
+
+		goto dispatch_find_request;
+	}
+
+	/*
+	 * there are either no reads or writes have been starved
+	 */
+
+	if (writes) {
+dispatch_writes:
+		BUG_ON(RB_EMPTY_ROOT(&dd->sort_list[WRITE]));
+
+		dd->starved = 0;
+
+		data_dir = WRITE;
+
+		goto dispatch_find_request;
+	}
+
+	return NULL;
+
+dispatch_find_request:
+	/*
+	 * we are not running a batch, find best request for selected data_dir
+	 */
+	next_rq = deadline_next_request(dd, data_dir);
+	if (deadline_check_fifo(dd, data_dir) || !next_rq) {
+		/*
+		 * A deadline has expired, the last request was in the other
+		 * direction, or we have run out of higher-sectored requests.
+		 * Start again from the request with the earliest expiry time.
+		 */
+		rq = deadline_fifo_request(dd, data_dir);
+	} else {
+		/*
+		 * The last req was the same dir and we have a next request in
+		 * sort order. No expired requests so continue on from here.
+		 */
+		rq = next_rq;
+	}
+
+	/*
+	 * For a zoned block device, if we only have writes queued and none of
+	 * them can be dispatched, rq will be NULL.  The completion of the
+	 * write holding the zone will run the queue again.
+	 */
+	if (!rq)
+		return NULL;
+
+	dd->batching = 0;
+
+dispatch_request:
+	/*
+	 * rq is the selected appropriate request.  Another hardware queue
+	 * may have dispatched a write to the same zone since it was picked.
+	 */
+	if (blk_req_needs_zone_write_lock(rq) &&
+	    !blk_req_zone_write_trylock(rq))
+		return NULL;
+
+	dd->batching++;
+	deadline_move_request(dd, rq);
+
+	return rq;
+}
+
+static struct request *dd_dispatch_request(struct blk_mq_hw_ctx *hctx)
+{
+	struct deadline_data *dd = hctx->sched_data;
+	struct request *rq;
+
+	spin_lock(&dd->lock);
+	rq = __dd_dispatch_request(dd);
+	spin_unlock(&dd->lock);
+
+	return rq;
+}
+
+/*
+ * A write to a sequential zone completed: writes to that zone that were held
+ * back, possibly on other hardware queues, can go now.
+ */
+static void dd_completed_request(struct blk_mq_hw_ctx *hctx,
+				 struct request *rq)
+{
+	if (rq->cmd_flags & REQ_ZONE_WRITE_LOCKED) {
+		blk_req_zone_write_unlock(rq);
+		blk_mq_run_hw_queues(rq->q, true);
+	}
+}
+
+static bool dd_has_work(struct blk_mq_hw_ctx *hctx)
+{
+	struct deadline_data *dd = hctx->sched_data;
+
+	return !list_empty_careful(&dd->fifo_list[READ]) ||
+		!list_empty_careful(&dd->fifo_list[WRITE]);
+}
+
+static void dd_insert_requests(struct blk_mq_hw_ctx *hctx,
+			       struct list_head *list)
+{
+	struct deadline_data *dd = hctx->sched_data;
+
+	spin_lock(&dd->lock);
+	while (!list_empty(list)) {
+		struct request *rq;
+
+		rq = list_first_entry(list, struct request, queuelist);
+		list_del_init(&rq->queuelist);
+		deadline_add_request(dd, rq);
+	}
+	spin_unlock(&dd->lock);
+}
+
+/*
+ * @next was merged into @rq, and is about to be freed
+ */
+static void dd_requests_merged(struct blk_mq_hw_ctx *hctx, struct request *rq,
+			       struct request *next)
+{
+	struct deadline_data *dd = hctx->sched_data;
+
+	/*
+	 * if next expires before rq, assign its expire time to rq
+	 * and move into next position (next will be deleted) in fifo
+	 */
+	if (!list_empty(&rq->queuelist) && !list_empty(&next->queuelist)) {
+		if (time_before((unsigned long)next->fifo_time,
+				(unsigned long)rq->fifo_time)) {
+			list_move(&rq->queuelist, &next->queuelist);
+			rq->fifo_time = next->fifo_time;
+		}
+	}
+
+	/* the end sector of rq moved, rehash */
+	dd_rqhash_del(rq);
+	dd_rqhash_add(dd, rq);
+
+	deadline_remove_request(dd, next);
+}
+
+static bool dd_bio_merge(struct blk_mq_hw_ctx *hctx, struct bio *bio)
+{
+	struct request_queue *q = hctx->queue;
+	struct deadline_data *dd = hctx->sched_data;
+	struct request *rq, *free = NULL;
+	bool merged = false;
+
+	spin_lock(&dd->lock);
+
+	/*
+	 * check for back merge
+	 */
+	rq = dd_rqhash_find(dd, bio->bi_iter.bi_sector);
+	if (rq && blk_mq_sched_try_merge(q, rq, bio, &free) ==
+		  ELEVATOR_BACK_MERGE) {
+		/* the end sector moved, rehash */
+		if (!free) {
+			dd_rqhash_del(rq);
+			dd_rqhash_add(dd, rq);
+		}
+		merged = true;
+		goto out;
+	}
+
+	/*
+	 * check for front merge
+	 */
+	if (dd->tun->front_merges) {
+		sector_t sector = bio_end_sector(bio);
+
+		rq = elv_rb_find(&dd->sort_list[bio_data_dir(bio)], sector);
+		if (rq && blk_mq_sched_try_merge(q, rq, bio, &free) ==
+			  ELEVATOR_FRONT_MERGE) {
+			/* the start sector moved, reposition request */
+			if (!free) {
+				elv_rb_del(deadline_rb_root(dd, rq), rq);
+				deadline_add_rq_rb(dd, rq);
+			}
+			merged = true;
+		}
+	}
+out:
+	spin_unlock(&dd->lock);
+
+	if (free)
+		blk_mq_free_request(free);
+	return merged;
+}
+
+static int dd_init_hctx(struct blk_mq_hw_ctx *hctx, unsigned int hctx_idx)
+{
+	struct elevator_queue *eq = hctx->queue->elevator;
+	struct deadline_data *dd;
+
+	/* the hardware queues of a zoned device can't grow, see above */
+	if (blk_queue_is_zoned(hctx->queue) && hctx_idx)
+		return -EINVAL;
+
+	dd = kzalloc_node(sizeof(*dd), GFP_KERNEL, hctx->numa_node);
+	if (!dd)
+		return -ENOMEM;
+
+	spin_lock_init(&dd->lock);
+	dd->tun = eq->elevator_data;
+	INIT_LIST_HEAD(&dd->fifo_list[READ]);
+	INIT_LIST_HEAD(&dd->fifo_list[WRITE]);
+	dd->sort_list[READ] = RB_ROOT;
+	dd->sort_list[WRITE] = RB_ROOT;
+	hash_init(dd->hash);
+
+	hctx->sched_data = dd;
+	return 0;
+}
+
+static void dd_exit_hctx(struct blk_mq_hw_ctx *hctx, unsigned int hctx_idx)
+{
+	struct deadline_data *dd = hctx->sched_data;
+
+	BUG_ON(!list_empty(&dd->fifo_list[READ]));
+	BUG_ON(!list_empty(&dd->fifo_list[WRITE]));
+
+	kfree(dd);
+}
+
+static void dd_exit_queue(struct elevator_queue *e)
+{
+	kfree(e->elevator_data);
+}
+
+/*
+ * initialize the tunables, the per hardware queue data is set up by
+ * dd_init_hctx().
+ */
+static int dd_init_queue(struct request_queue *q, struct elevator_type *e)
+{
+	struct dd_tunables *tun;
+	struct elevator_queue *eq;
+
+	if (blk_queue_is_zoned(q) && q->nr_hw_queues > 1) {
+		pr_warn("mq-deadline: zoned devices need a single hardware queue\n");
+		return -EINVAL;
+	}
+
+	eq = elevator_alloc(q, e);
+	if (!eq)
+		return -ENOMEM;
+
+	tun = kzalloc_node(sizeof(*tun), GFP_KERNEL, q->node);
+	if (!tun) {
+		kobject_put(&eq->kobj);
+		return -ENOMEM;
+	}
+	eq->elevator_data = tun;
+
+	tun->fifo_expire[READ] = read_expire;
+	tun->fifo_expire[WRITE] = write_expire;
+	tun->writes_starved = writes_starved;
+	tun->front_merges = 1;
+	tun->fifo_batch = fifo_batch;
+
+	q->elevator = eq;
+	return 0;
+}
+
+/*
+ * sysfs parts below
+ */
+
+static ssize_t
+deadline_var_show(int var, char *page)
+{
+	return sprintf(page, "%d\n", var);
+}
+
+static ssize_t
+deadline_var_store(int *var, const char *page, size_t count)
+{
+	char *p = (char *) page;
+
+	*var = simple_strtol(p, &p, 10);
+	return count;
+}
+
+#define SHOW_FUNCTION(__FUNC, __VAR, __CONV)				\
+static ssize_t __FUNC(struct elevator_queue *e, char *page)		\
+{									\
+	struct dd_tunables *tun = e->elevator_data;			\
+	int __data = __VAR;						\
+	if (__CONV)							\
+		__data = jiffies_to_msecs(__data);			\
+	return deadline_var_show(__data, (page));			\
+}
+SHOW_FUNCTION(deadline_read_expire_show, tun->fifo_expire[READ], 1);
+SHOW_FUNCTION(deadline_write_expire_show, tun->fifo_expire[WRITE], 1);
+SHOW_FUNCTION(deadline_writes_starved_show, tun->writes_starved, 0);
+SHOW_FUNCTION(deadline_front_merges_show, tun->front_merges, 0);
+SHOW_FUNCTION(deadline_fifo_batch_show, tun->fifo_batch, 0);
+#undef SHOW_FUNCTION
+
+#define STORE_FUNCTION(__FUNC, __PTR, MIN, MAX, __CONV)			\
+static ssize_t __FUNC(struct elevator_queue *e, const char *page, size_t count)	\
+{									\
+	struct dd_tunables *tun = e->elevator_data;			\
+	int __data;							\
+	int ret = deadline_var_store(&__data, (page), count);		\
+	if (__data < (MIN))						\
+		__data = (MIN);						\
+	else if (__data > (MAX))					\
+		__data = (MAX);						\
+	if (__CONV)							\
+		*(__PTR) = msecs_to_jiffies(__data);			\
+	else								\
+		*(__PTR) = __data;					\
+	return ret;							\
+}
+STORE_FUNCTION(deadline_read_expire_store, &tun->fifo_expire[READ], 0, INT_MAX, 1);
+STORE_FUNCTION(deadline_write_expire_store, &tun->fifo_expire[WRITE], 0, INT_MAX, 1);
+STORE_FUNCTION(deadline_writes_starved_store, &tun->writes_starved, INT_MIN, INT_MAX, 0);
+STORE_FUNCTION(deadline_front_merges_store, &tun->front_merges, 0, 1, 0);
+STORE_FUNCTION(deadline_fifo_batch_store, &tun->fifo_batch, 0, INT_MAX, 0);
+#undef STORE_FUNCTION
+
+#define DD_ATTR(name) \
+	__ATTR(name, S_IRUGO|S_IWUSR, deadline_##name##_show, \
+				      deadline_##name##_store)
+
+static struct elv_fs_entry deadline_attrs[] = {
+	DD_ATTR(read_expire),
+	DD_ATTR(write_expire),
+	DD_ATTR(writes_starved),
+	DD_ATTR(front_merges),
+	DD_ATTR(fifo_batch),
+	__ATTR_NULL
+};
+
+static struct elevator_type mq_deadline = {
+	.mq_ops = {
+		.init_sched		= dd_init_queue,
+		.exit_sched		= dd_exit_queue,
+		.init_hctx		= dd_init_hctx,
+		.exit_hctx		= dd_exit_hctx,
+		.bio_merge		= dd_bio_merge,
+		.former_request		= elv_rb_former_request,
+		.latter_request		= elv_rb_latter_request,
+		.requests_merged	= dd_requests_merged,
+		.insert_requests	= dd_insert_requests,
+		.dispatch_request	= dd_dispatch_request,
+		.has_work		= dd_has_work,
+		.completed_request	= dd_completed_request,
+	},
+
+	.uses_mq = true,
+	.elevator_attrs = deadline_attrs,
+	.elevator_name = "mq-deadline",
+	.elevator_owner = THIS_MODULE,
+};
+
+static int __init deadline_init(void)
+{
+	return elv_register(&mq_deadline);
+}
+
+static void __exit deadline_exit(void)
+{
+	elv_unregister(&mq_deadline);
+}
+
+module_init(deadline_init);
+module_exit(deadline_exit);
+
+MODULE_AUTHOR("Jens Axboe");
+MODULE_LICENSE("GPL");
+MODULE_DESCRIPTION("MQ deadline IO scheduler");
+MODULE_ALIAS("mq-deadline-iosched");
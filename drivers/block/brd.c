@@ -30,12 +30,32 @@
 #define PAGE_SECTORS		(1 << PAGE_SECTORS_SHIFT)
 
 /*
- * Each block ramdisk device has a radix_tree brd_pages of pages that stores
- * the pages containing the block device's contents. A brd page's ->index is
- * its offset in PAGE_SIZE units. This is similar to, but in no way connected
- * with, the kernel's pagecache or buffer cache (which sit above our block
- * device).
+ * Each block ramdisk device stores its contents in chunks of
+ * 2^brd_chunk_order pages (rd_chunk_size KB), allocated and zeroed on the
+ * first write to them, on rd_node if set.  A chunk is physically contiguous
+ * but split into order-0 pages, so each of its pages can be mapped and
+ * refcounted on its own for DAX.  When memory is too fragmented for a
+ * whole chunk, the pages of that chunk are allocated one at a time on
+ * first write instead, and the chunk is never allocated whole afterwards.
+ * This is similar to, but in no way connected with, the kernel's pagecache
+ * or buffer cache (which sit above our block device).
+ *
+ * The chunks are kept in BRD_NR_SHARDS radix trees, chunk n in shard
+ * n % BRD_NR_SHARDS at index n / BRD_NR_SHARDS, so that writers to
+ * different areas of the device don't serialize on one lock to allocate
+ * their backing store.  The first page of a chunk has the chunk number in
+ * its ->index.  Pages allocated one at a time go into a second tree of
+ * the same shard, indexed by their page number, which is also their
+ * ->index.
  */
+#define BRD_NR_SHARDS		16
+
+struct brd_shard {
+	spinlock_t		lock;
+	struct radix_tree_root	chunks;
+	struct radix_tree_root	pages;	/* of chunks allocated piecemeal */
+} ____cacheline_aligned_in_smp;
+
 struct brd_device {
 	int		brd_number;
 
@@ -44,20 +64,32 @@ struct brd_device {
 	struct list_head	brd_list;
 
 	/*
-	 * Backing store of pages and lock to protect it. This is the contents
-	 * of the block device.
+	 * Backing store of chunks and locks to protect it. This is the
+	 * contents of the block device.
 	 */
-	spinlock_t		brd_lock;
-	struct radix_tree_root	brd_pages;
+	struct brd_shard	brd_shards[BRD_NR_SHARDS];
 };
 
+static unsigned int brd_chunk_order;
+static int rd_node = NUMA_NO_NODE;
+
+#define CHUNK_PAGES		(1UL << brd_chunk_order)
+#define CHUNK_SECTORS_SHIFT	(PAGE_SECTORS_SHIFT + brd_chunk_order)
+
+static inline struct brd_shard *brd_chunk_shard(struct brd_device *brd,
+						pgoff_t chunk)
+{
+	return &brd->brd_shards[chunk % BRD_NR_SHARDS];
+}
+
 /*
- * Look up and return a brd's page for a given sector.
+ * Look up and return the first page of a brd's chunk for a given sector.
  */
 static DEFINE_MUTEX(brd_mutex);
-static struct page *brd_lookup_page(struct brd_device *brd, sector_t sector)
+static struct page *brd_lookup_chunk(struct brd_device *brd, sector_t sector)
 {
-	pgoff_t idx;
+	pgoff_t chunk = sector >> CHUNK_SECTORS_SHIFT;
+	struct brd_shard *shard = brd_chunk_shard(brd, chunk);
 	struct page *page;
 
 	/*
@@ -72,8 +104,31 @@ static struct page *brd_lookup_page(struct brd_device *brd, sector_t sector)
 	 * here, only deletes).
 	 */
 	rcu_read_lock();
-	idx = sector >> PAGE_SECTORS_SHIFT; /* sector to page index */
-	page = radix_tree_lookup(&brd->brd_pages, idx);
+	page = radix_tree_lookup(&shard->chunks, chunk / BRD_NR_SHARDS);
+	rcu_read_unlock();
+
+	BUG_ON(page && page->index != chunk);
+
+	return page;
+}
+
+/*
+ * Look up and return a brd's page for a given sector.
+ */
+static struct page *brd_lookup_page(struct brd_device *brd, sector_t sector)
+{
+	pgoff_t idx = sector >> PAGE_SECTORS_SHIFT;
+	struct page *page = brd_lookup_chunk(brd, sector);
+	struct brd_shard *shard;
+
+	if (page)
+		return page + (idx & (CHUNK_PAGES - 1));
+	if (!brd_chunk_order)
+		return NULL;
+
+	shard = brd_chunk_shard(brd, idx >> brd_chunk_order);
+	rcu_read_lock();
+	page = radix_tree_lookup(&shard->pages, idx);
 	rcu_read_unlock();
 
 	BUG_ON(page && page->index != idx);
@@ -81,16 +136,112 @@ static struct page *brd_lookup_page(struct brd_device *brd, sector_t sector)
 	return page;
 }
 
+/*
+ * Whether some pages of @chunk were allocated one at a time.  Called under
+ * the shard lock, or in an RCU read side section for a hint.
+ */
+static bool brd_chunk_piecemeal(struct brd_shard *shard, pgoff_t chunk)
+{
+	struct page *page;
+
+	if (!radix_tree_gang_lookup(&shard->pages, (void **)&page,
+				    chunk << brd_chunk_order, 1))
+		return false;
+	return page->index >> brd_chunk_order == chunk;
+}
+
+static void brd_free_chunk(struct page *page)
+{
+	unsigned long i;
+
+	for (i = 0; i < CHUNK_PAGES; i++)
+		__free_page(page + i);
+}
+
+/*
+ * Insert the newly allocated chunk @page, unless some pages of it have been
+ * allocated one at a time meanwhile.  Returns the first page of the chunk
+ * now in the tree, or NULL if there is none.
+ */
+static struct page *brd_insert_chunk(struct brd_shard *shard, pgoff_t chunk,
+				     struct page *page)
+{
+	struct page *ret = page;
+
+	if (radix_tree_preload(GFP_NOIO)) {
+		brd_free_chunk(page);
+		return NULL;
+	}
+
+	spin_lock(&shard->lock);
+	page->index = chunk;
+	if (brd_chunk_order && brd_chunk_piecemeal(shard, chunk)) {
+		brd_free_chunk(page);
+		ret = NULL;
+	} else if (radix_tree_insert(&shard->chunks, chunk / BRD_NR_SHARDS,
+				     page)) {
+		brd_free_chunk(page);
+		ret = radix_tree_lookup(&shard->chunks, chunk / BRD_NR_SHARDS);
+		BUG_ON(!ret);
+		BUG_ON(ret->index != chunk);
+	}
+	spin_unlock(&shard->lock);
+
+	radix_tree_preload_end();
+
+	return ret;
+}
+
+/*
+ * Insert the single page @page for page number @idx, unless its whole
+ * chunk has been allocated meanwhile.  Returns the page now in the tree,
+ * or NULL.
+ */
+static struct page *brd_insert_single(struct brd_shard *shard, pgoff_t idx,
+				      struct page *page)
+{
+	pgoff_t chunk = idx >> brd_chunk_order;
+	struct page *ret;
+
+	if (radix_tree_preload(GFP_NOIO)) {
+		__free_page(page);
+		return NULL;
+	}
+
+	spin_lock(&shard->lock);
+	page->index = idx;
+	ret = radix_tree_lookup(&shard->chunks, chunk / BRD_NR_SHARDS);
+	if (ret) {
+		__free_page(page);
+		ret += idx & (CHUNK_PAGES - 1);
+	} else if (radix_tree_insert(&shard->pages, idx, page)) {
+		__free_page(page);
+		ret = radix_tree_lookup(&shard->pages, idx);
+		BUG_ON(!ret);
+		BUG_ON(ret->index != idx);
+	} else {
+		ret = page;
+	}
+	spin_unlock(&shard->lock);
+
+	radix_tree_preload_end();
+
+	return ret;
+}
+
 /*
  * Look up and return a brd's page for a given sector.
- * If one does not exist, allocate an empty page, and insert that. Then
- * return it.
+ * If its chunk does not exist, allocate an empty one, and insert that,
+ * or just the page if the chunk can't be had. Then return the page.
  */
 static struct page *brd_insert_page(struct brd_device *brd, sector_t sector)
 {
-	pgoff_t idx;
+	pgoff_t idx = sector >> PAGE_SECTORS_SHIFT;
+	pgoff_t chunk = sector >> CHUNK_SECTORS_SHIFT;
+	struct brd_shard *shard = brd_chunk_shard(brd, chunk);
 	struct page *page;
 	gfp_t gfp_flags;
+	bool piecemeal = false;
 
 	page = brd_lookup_page(brd, sector);
 	if (page)
@@ -109,42 +260,38 @@ static struct page *brd_insert_page(struct brd_device *brd, sector_t sector)
 #ifndef CONFIG_BLK_DEV_RAM_DAX
 	gfp_flags |= __GFP_HIGHMEM;
 #endif
-	page = alloc_page(gfp_flags);
-	if (!page)
-		return NULL;
-
-	if (radix_tree_preload(GFP_NOIO)) {
-		__free_page(page);
-		return NULL;
-	}
-
-	spin_lock(&brd->brd_lock);
-	idx = sector >> PAGE_SECTORS_SHIFT;
-	page->index = idx;
-	if (radix_tree_insert(&brd->brd_pages, idx, page)) {
-		__free_page(page);
-		page = radix_tree_lookup(&brd->brd_pages, idx);
-		BUG_ON(!page);
-		BUG_ON(page->index != idx);
+	if (brd_chunk_order) {
+		rcu_read_lock();
+		piecemeal = brd_chunk_piecemeal(shard, chunk);
+		rcu_read_unlock();
 	}
-	spin_unlock(&brd->brd_lock);
 
-	radix_tree_preload_end();
+	if (!piecemeal) {
+		gfp_t chunk_gfp = gfp_flags;
 
-	return page;
-}
-
-static void brd_free_page(struct brd_device *brd, sector_t sector)
-{
-	struct page *page;
-	pgoff_t idx;
+		/*
+		 * GFP_NOIO can't compact memory, so a whole chunk may well
+		 * not be available.  Don't try hard, the pages can be had
+		 * one at a time.
+		 */
+		if (brd_chunk_order)
+			chunk_gfp |= __GFP_NORETRY | __GFP_NOWARN;
+		page = alloc_pages_node(rd_node, chunk_gfp, brd_chunk_order);
+		if (page) {
+			if (brd_chunk_order)
+				split_page(page, brd_chunk_order);
+			page = brd_insert_chunk(shard, chunk, page);
+			if (page)
+				return page + (idx & (CHUNK_PAGES - 1));
+		}
+		if (!brd_chunk_order)
+			return NULL;
+	}
 
-	spin_lock(&brd->brd_lock);
-	idx = sector >> PAGE_SECTORS_SHIFT;
-	page = radix_tree_delete(&brd->brd_pages, idx);
-	spin_unlock(&brd->brd_lock);
-	if (page)
-		__free_page(page);
+	page = alloc_pages_node(rd_node, gfp_flags, 0);
+	if (!page)
+		return NULL;
+	return brd_insert_single(shard, idx, page);
 }
 
 static void brd_zero_page(struct brd_device *brd, sector_t sector)
@@ -157,30 +304,36 @@ static void brd_zero_page(struct brd_device *brd, sector_t sector)
 }
 
 /*
- * Free all backing store pages and radix tree. This must only be called when
- * there are no other users of the device.
+ * Free all backing store chunks and radix trees. This must only be called
+ * when there are no other users of the device.
  */
 #define FREE_BATCH 16
-static void brd_free_pages(struct brd_device *brd)
+static void brd_free_tree(struct radix_tree_root *root, bool chunks)
 {
-	unsigned long pos = 0;
 	struct page *pages[FREE_BATCH];
+	unsigned long pos = 0;
 	int nr_pages;
 
 	do {
 		int i;
 
-		nr_pages = radix_tree_gang_lookup(&brd->brd_pages,
-				(void **)pages, pos, FREE_BATCH);
+		nr_pages = radix_tree_gang_lookup(root, (void **)pages, pos,
+						  FREE_BATCH);
 
 		for (i = 0; i < nr_pages; i++) {
+			unsigned long index = pages[i]->index;
 			void *ret;
 
-			BUG_ON(pages[i]->index < pos);
-			pos = pages[i]->index;
-			ret = radix_tree_delete(&brd->brd_pages, pos);
+			if (chunks)
+				index /= BRD_NR_SHARDS;
+			BUG_ON(index < pos);
+			pos = index;
+			ret = radix_tree_delete(root, pos);
 			BUG_ON(!ret || ret != pages[i]);
-			__free_page(pages[i]);
+			if (chunks)
+				brd_free_chunk(pages[i]);
+			else
+				__free_page(pages[i]);
 		}
 
 		pos++;
@@ -193,6 +346,16 @@ static void brd_free_pages(struct brd_device *brd)
 	} while (nr_pages == FREE_BATCH);
 }
 
+static void brd_free_pages(struct brd_device *brd)
+{
+	int shard_nr;
+
+	for (shard_nr = 0; shard_nr < BRD_NR_SHARDS; shard_nr++) {
+		brd_free_tree(&brd->brd_shards[shard_nr].chunks, true);
+		brd_free_tree(&brd->brd_shards[shard_nr].pages, false);
+	}
+}
+
 /*
  * copy_to_brd_setup must be called before copy_to_brd. It may sleep.
  */
@@ -219,12 +382,10 @@ static void discard_from_brd(struct brd_device *brd,
 		/*
 		 * Don't want to actually discard pages here because
 		 * re-allocating the pages can result in writeback
-		 * deadlocks under heavy load.
+		 * deadlocks under heavy load, and a page is only part
+		 * of a chunk anyway.
 		 */
-		if (0)
-			brd_free_page(brd, sector);
-		else
-			brd_zero_page(brd, sector);
+		brd_zero_page(brd, sector);
 		sector += PAGE_SIZE >> SECTOR_SHIFT;
 		n -= PAGE_SIZE;
 	}
@@ -380,6 +541,7 @@ static long brd_direct_access(struct block_device *bdev, sector_t sector,
 {
 	struct brd_device *brd = bdev->bd_disk->private_data;
 	struct page *page;
+	unsigned long pg;
 
 	if (!brd)
 		return -ENODEV;
@@ -389,7 +551,11 @@ static long brd_direct_access(struct block_device *bdev, sector_t sector,
 	*kaddr = page_address(page);
 	*pfn = page_to_pfn_t(page);
 
-	return PAGE_SIZE;
+	/* The rest of a whole chunk follows in memory */
+	if (!brd_lookup_chunk(brd, sector))
+		return PAGE_SIZE;
+	pg = (sector >> PAGE_SECTORS_SHIFT) & (CHUNK_PAGES - 1);
+	return (CHUNK_PAGES - pg) << PAGE_SHIFT;
 }
 #else
 #define brd_direct_access NULL
@@ -451,6 +617,13 @@ static int max_part = 1;
 module_param(max_part, int, S_IRUGO);
 MODULE_PARM_DESC(max_part, "Num Minors to reserve between devices");
 
+static int rd_chunk_size = 2048;
+module_param(rd_chunk_size, int, S_IRUGO);
+MODULE_PARM_DESC(rd_chunk_size, "Allocation unit of the backing store in kbytes, rounded down to a power of two (default: 2048)");
+
+module_param(rd_node, int, S_IRUGO);
+MODULE_PARM_DESC(rd_node, "NUMA node to allocate the backing store on (default: any)");
+
 MODULE_LICENSE("GPL");
 MODULE_ALIAS_BLOCKDEV_MAJOR(RAMDISK_MAJOR);
 MODULE_ALIAS("rd");
@@ -476,15 +649,19 @@ static struct brd_device *brd_alloc(int i)
 {
 	struct brd_device *brd;
 	struct gendisk *disk;
+	int shard;
 
-	brd = kzalloc(sizeof(*brd), GFP_KERNEL);
+	brd = kzalloc_node(sizeof(*brd), GFP_KERNEL, rd_node);
 	if (!brd)
 		goto out;
 	brd->brd_number		= i;
-	spin_lock_init(&brd->brd_lock);
-	INIT_RADIX_TREE(&brd->brd_pages, GFP_ATOMIC);
+	for (shard = 0; shard < BRD_NR_SHARDS; shard++) {
+		spin_lock_init(&brd->brd_shards[shard].lock);
+		INIT_RADIX_TREE(&brd->brd_shards[shard].chunks, GFP_ATOMIC);
+		INIT_RADIX_TREE(&brd->brd_shards[shard].pages, GFP_ATOMIC);
+	}
 
-	brd->brd_queue = blk_alloc_queue(GFP_KERNEL);
+	brd->brd_queue = blk_alloc_queue_node(GFP_KERNEL, rd_node);
 	if (!brd->brd_queue)
 		goto out_free_dev;
 
@@ -507,7 +684,7 @@ static struct brd_device *brd_alloc(int i)
 #ifdef CONFIG_BLK_DEV_RAM_DAX
 	queue_flag_set_unlocked(QUEUE_FLAG_DAX, brd->brd_queue);
 #endif
-	disk = brd->brd_disk = alloc_disk(max_part);
+	disk = brd->brd_disk = alloc_disk_node(max_part, rd_node);
 	if (!disk)
 		goto out_free_queue;
 	disk->major		= RAMDISK_MAJOR;
@@ -607,6 +784,17 @@ static int __init brd_init(void)
 	if (unlikely(!max_part))
 		max_part = 1;
 
+	if (rd_chunk_size > (int)(PAGE_SIZE >> 10))
+		brd_chunk_order = min_t(unsigned int, MAX_ORDER - 1,
+					ilog2(rd_chunk_size) - (PAGE_SHIFT - 10));
+
+	if (rd_node != NUMA_NO_NODE &&
+	    (rd_node < 0 || rd_node >= MAX_NUMNODES || !node_online(rd_node))) {
+		pr_warn("brd: node %d not online, allocating on any node\n",
+			rd_node);
+		rd_node = NUMA_NO_NODE;
+	}
+
 	for (i = 0; i < rd_nr; i++) {
 		brd = brd_alloc(i);
 		if (!brd)
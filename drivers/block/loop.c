@@ -213,10 +213,13 @@ static void __loop_update_dio(struct loop_device *lo, bool dio)
 	 */
 	blk_mq_freeze_queue(lo->lo_queue);
 	lo->use_dio = use_dio;
-	if (use_dio)
+	if (use_dio) {
+		queue_flag_clear_unlocked(QUEUE_FLAG_NOMERGES, lo->lo_queue);
 		lo->lo_flags |= LO_FLAGS_DIRECT_IO;
-	else
+	} else {
+		queue_flag_set_unlocked(QUEUE_FLAG_NOMERGES, lo->lo_queue);
 		lo->lo_flags &= ~LO_FLAGS_DIRECT_IO;
+	}
 	blk_mq_unfreeze_queue(lo->lo_queue);
 }
 
@@ -447,21 +450,38 @@ static int lo_req_flush(struct loop_device *lo, struct request *rq)
 
 static inline void handle_partial_read(struct loop_cmd *cmd, long bytes)
 {
+	struct bio *bio;
+
 	if (bytes < 0 || op_is_write(req_op(cmd->rq)))
 		return;
 
-	if (unlikely(bytes < blk_rq_bytes(cmd->rq))) {
-		struct bio *bio = cmd->rq->bio;
+	if (likely(bytes >= blk_rq_bytes(cmd->rq)))
+		return;
 
+	/* zero everything past the short read, which may span bios */
+	__rq_for_each_bio(bio, cmd->rq) {
+		if (bytes >= bio->bi_iter.bi_size) {
+			bytes -= bio->bi_iter.bi_size;
+			continue;
+		}
 		bio_advance(bio, bytes);
 		zero_fill_bio(bio);
+		bytes = 0;
 	}
 }
 
-static void lo_rw_aio_complete(struct kiocb *iocb, long ret, long ret2)
+static void lo_rw_aio_do_completion(struct loop_cmd *cmd)
 {
-	struct loop_cmd *cmd = container_of(iocb, struct loop_cmd, iocb);
-	struct request *rq = cmd->rq;
+	long ret;
+
+	/* both the submitter and the completion must be done with @cmd */
+	if (!atomic_dec_and_test(&cmd->ref))
+		return;
+
+	/* only now is the result of the aio completion known to be stored */
+	ret = cmd->ret;
+	kfree(cmd->bvec);
+	cmd->bvec = NULL;
 
 	handle_partial_read(cmd, ret);
 
@@ -470,7 +490,15 @@ static void lo_rw_aio_complete(struct kiocb *iocb, long ret, long ret2)
 	else if (ret < 0)
 		ret = -EIO;
 
-	blk_mq_complete_request(rq, ret);
+	blk_mq_complete_request(cmd->rq, ret);
+}
+
+static void lo_rw_aio_complete(struct kiocb *iocb, long ret, long ret2)
+{
+	struct loop_cmd *cmd = container_of(iocb, struct loop_cmd, iocb);
+
+	cmd->ret = ret;
+	lo_rw_aio_do_completion(cmd);
 }
 
 static int lo_rw_aio(struct loop_device *lo, struct loop_cmd *cmd,
@@ -478,22 +506,49 @@ static int lo_rw_aio(struct loop_device *lo, struct loop_cmd *cmd,
 {
 	struct iov_iter iter;
 	struct bio_vec *bvec;
-	struct bio *bio = cmd->rq->bio;
+	struct request *rq = cmd->rq;
+	struct bio *bio = rq->bio;
 	struct file *file = lo->lo_backing_file;
+	unsigned int offset;
+	int nr_bvec = 0;
 	int ret;
 
-	/* nomerge for loop request queue */
-	WARN_ON(cmd->rq->bio != cmd->rq->biotail);
+	if (rq->bio != rq->biotail) {
+		struct req_iterator rq_iter;
+		struct bio_vec tmp;
+
+		/*
+		 * Adjacent requests were merged, so the data lives in the
+		 * bvec tables of several bios.  Gather it into one table so
+		 * the backing file sees a single, larger IO.
+		 */
+		__rq_for_each_bio(bio, rq)
+			nr_bvec += bio_segments(bio);
+		bvec = kmalloc_array(nr_bvec, sizeof(struct bio_vec),
+				     GFP_NOIO);
+		if (!bvec)
+			return -EIO;
+		cmd->bvec = bvec;
+
+		rq_for_each_segment(tmp, rq, rq_iter)
+			*bvec++ = tmp;
+		bvec = cmd->bvec;
+		offset = 0;
+	} else {
+		/*
+		 * This bio may be started from the middle of the 'bvec'
+		 * because of bio splitting, so offset from the bvec must
+		 * be passed to iov iterator
+		 */
+		offset = bio->bi_iter.bi_bvec_done;
+		bvec = __bvec_iter_bvec(bio->bi_io_vec, bio->bi_iter);
+		nr_bvec = bio_segments(bio);
+	}
+	atomic_set(&cmd->ref, 2);
 
-	bvec = __bvec_iter_bvec(bio->bi_io_vec, bio->bi_iter);
 	iov_iter_bvec(&iter, ITER_BVEC | rw, bvec,
-		      bio_segments(bio), blk_rq_bytes(cmd->rq));
-	/*
-	 * This bio may be started from the middle of the 'bvec'
-	 * because of bio splitting, so offset from the bvec must
-	 * be passed to iov iterator
-	 */
-	iter.iov_offset = bio->bi_iter.bi_bvec_done;
+		      nr_bvec, blk_rq_bytes(rq));
+	iter.iov_offset = offset;
 
 	cmd->iocb.ki_pos = pos;
 	cmd->iocb.ki_filp = file;
@@ -505,6 +560,8 @@ static int lo_rw_aio(struct loop_device *lo, struct loop_cmd *cmd,
 	else
 		ret = file->f_op->read_iter(&cmd->iocb, &iter);
 
+	lo_rw_aio_do_completion(cmd);
+
 	if (ret != -EIOCBQUEUED)
 		cmd->iocb.ki_complete(&cmd->iocb, ret, 0);
 	return 0;
@@ -775,12 +832,64 @@ static ssize_t loop_attr_dio_show(struct loop_device *lo, char *buf)
 	return sprintf(buf, "%s\n", dio ? "1" : "0");
 }
 
+static ssize_t loop_attr_nr_hw_queues_show(struct loop_device *lo, char *buf)
+{
+	return sprintf(buf, "%u\n", lo->tag_set.nr_hw_queues);
+}
+
+/* follows writes to queue/nr_requests, which resize every hw queue */
+static ssize_t loop_attr_hw_queue_depth_show(struct loop_device *lo,
+					     char *buf)
+{
+	return sprintf(buf, "%lu\n", lo->lo_queue->nr_requests);
+}
+
+struct loop_inflight_data {
+	struct loop_device *lo;
+	unsigned int *inflight;
+};
+
+static void loop_count_inflight(struct request *rq, void *data, bool reserved)
+{
+	struct loop_inflight_data *d = data;
+	struct request_queue *q = d->lo->lo_queue;
+
+	if (rq->q != q)
+		return;
+	d->inflight[q->mq_ops->map_queue(q, rq->mq_ctx->cpu)->queue_num]++;
+}
+
+/* commands issued to each hw queue and not completed yet */
+static ssize_t loop_attr_hw_queue_inflight_show(struct loop_device *lo,
+						char *buf)
+{
+	unsigned int i, nr = lo->tag_set.nr_hw_queues;
+	struct loop_inflight_data d = { .lo = lo };
+	ssize_t len = 0;
+
+	d.inflight = kcalloc(nr, sizeof(*d.inflight), GFP_KERNEL);
+	if (!d.inflight)
+		return -ENOMEM;
+
+	blk_mq_tagset_busy_iter(&lo->tag_set, loop_count_inflight, &d);
+	for (i = 0; i < nr; i++)
+		len += sprintf(buf + len, "%s%u", i ? " " : "",
+			       d.inflight[i]);
+	len += sprintf(buf + len, "\n");
+
+	kfree(d.inflight);
+	return len;
+}
+
 LOOP_ATTR_RO(backing_file);
 LOOP_ATTR_RO(offset);
 LOOP_ATTR_RO(sizelimit);
 LOOP_ATTR_RO(autoclear);
 LOOP_ATTR_RO(partscan);
 LOOP_ATTR_RO(dio);
+LOOP_ATTR_RO(nr_hw_queues);
+LOOP_ATTR_RO(hw_queue_depth);
+LOOP_ATTR_RO(hw_queue_inflight);
 
 static struct attribute *loop_attrs[] = {
 	&loop_attr_backing_file.attr,
@@ -789,6 +898,9 @@ static struct attribute *loop_attrs[] = {
 	&loop_attr_autoclear.attr,
 	&loop_attr_partscan.attr,
 	&loop_attr_dio.attr,
+	&loop_attr_nr_hw_queues.attr,
+	&loop_attr_hw_queue_depth.attr,
+	&loop_attr_hw_queue_inflight.attr,
 	NULL,
 };
 
@@ -840,18 +952,55 @@ static void loop_config_discard(struct loop_device *lo)
 
 static void loop_unprepare_queue(struct loop_device *lo)
 {
-	flush_kthread_worker(&lo->worker);
-	kthread_stop(lo->worker_task);
+	unsigned int i;
+
+	for (i = 0; i < lo->nr_workers; i++) {
+		flush_kthread_worker(&lo->workers[i].worker);
+		kthread_stop(lo->workers[i].task);
+	}
+	kfree(lo->workers);
+	lo->workers = NULL;
+	lo->nr_workers = 0;
 }
 
+/*
+ * Each hw queue gets its own worker, so commands issued from different
+ * CPUs are handled in parallel.  With several queues, a worker prefers
+ * the CPUs mapped to its queue.
+ */
 static int loop_prepare_queue(struct loop_device *lo)
 {
-	init_kthread_worker(&lo->worker);
-	lo->worker_task = kthread_run(kthread_worker_fn,
-			&lo->worker, "loop%d", lo->lo_number);
-	if (IS_ERR(lo->worker_task))
+	unsigned int nr = lo->tag_set.nr_hw_queues;
+	struct task_struct *task;
+	unsigned int i;
+
+	lo->workers = kcalloc(nr, sizeof(*lo->workers), GFP_KERNEL);
+	if (!lo->workers)
 		return -ENOMEM;
-	set_user_nice(lo->worker_task, MIN_NICE);
+
+	for (i = 0; i < nr; i++) {
+		struct loop_worker *w = &lo->workers[i];
+
+		init_kthread_worker(&w->worker);
+		if (nr == 1)
+			task = kthread_create(kthread_worker_fn, &w->worker,
+					      "loop%d", lo->lo_number);
+		else
+			task = kthread_create(kthread_worker_fn, &w->worker,
+					      "loop%d/%u", lo->lo_number, i);
+		if (IS_ERR(task)) {
+			loop_unprepare_queue(lo);
+			return -ENOMEM;
+		}
+		if (nr > 1)
+			set_cpus_allowed_ptr(task,
+					lo->lo_queue->queue_hw_ctx[i]->cpumask);
+		set_user_nice(task, MIN_NICE);
+		wake_up_process(task);
+
+		w->task = task;
+		lo->nr_workers++;
+	}
 	return 0;
 }
 
@@ -921,6 +1070,7 @@ static int loop_set_fd(struct loop_device *lo, fmode_t mode,
 	set_device_ro(bdev, (lo_flags & LO_FLAGS_READ_ONLY) != 0);
 
 	lo->use_dio = false;
+	queue_flag_set_unlocked(QUEUE_FLAG_NOMERGES, lo->lo_queue);
 	lo->lo_blocksize = lo_blocksize;
 	lo->lo_device = bdev;
 	lo->lo_flags = lo_flags;
@@ -1596,6 +1746,12 @@ module_param(max_loop, int, S_IRUGO);
 MODULE_PARM_DESC(max_loop, "Maximum number of loop devices");
 module_param(max_part, int, S_IRUGO);
 MODULE_PARM_DESC(max_part, "Maximum number of partitions per loop device");
+static unsigned int nr_hw_queues = 1;
+module_param(nr_hw_queues, uint, S_IRUGO);
+MODULE_PARM_DESC(nr_hw_queues, "Number of hw queues, each with its own worker, per loop device (default: 1)");
+static unsigned int hw_queue_depth = 128;
+module_param(hw_queue_depth, uint, S_IRUGO);
+MODULE_PARM_DESC(hw_queue_depth, "Initial queue depth of each hw queue, changed later through queue/nr_requests (default: 128)");
 MODULE_LICENSE("GPL");
 MODULE_ALIAS_BLOCKDEV_MAJOR(LOOP_MAJOR);
 
@@ -1658,7 +1814,7 @@ static int loop_queue_rq(struct blk_mq_hw_ctx *hctx,
 		break;
 	}
 
-	queue_kthread_work(&lo->worker, &cmd->work);
+	queue_kthread_work(&lo->workers[hctx->queue_num].worker, &cmd->work);
 
 	return BLK_MQ_RQ_QUEUE_OK;
 }
@@ -1734,8 +1890,8 @@ static int loop_add(struct loop_device **l, int i)
 
 	err = -ENOMEM;
 	lo->tag_set.ops = &loop_mq_ops;
-	lo->tag_set.nr_hw_queues = 1;
-	lo->tag_set.queue_depth = 128;
+	lo->tag_set.nr_hw_queues = nr_hw_queues;
+	lo->tag_set.queue_depth = hw_queue_depth;
 	lo->tag_set.numa_node = NUMA_NO_NODE;
 	lo->tag_set.cmd_size = sizeof(struct loop_cmd);
 	lo->tag_set.flags = BLK_MQ_F_SHOULD_MERGE | BLK_MQ_F_SG_MERGE;
@@ -1753,8 +1909,9 @@ static int loop_add(struct loop_device **l, int i)
 	lo->lo_queue->queuedata = lo;
 
 	/*
-	 * It doesn't make sense to enable merge because the I/O
-	 * submitted to backing file is handled page by page.
+	 * Buffered I/O to the backing file is handled page by page, so
+	 * merging only pays off with direct I/O, which submits the whole
+	 * request at once.  __loop_update_dio() enables it then.
 	 */
 	queue_flag_set_unlocked(QUEUE_FLAG_NOMERGES, lo->lo_queue);
 
@@ -1948,6 +2105,11 @@ static int __init loop_init(void)
 	struct loop_device *lo;
 	int err;
 
+	/* loop-control can add devices as soon as it is registered */
+	nr_hw_queues = clamp_t(unsigned int, nr_hw_queues, 1, nr_cpu_ids);
+	hw_queue_depth = clamp_t(unsigned int, hw_queue_depth, 1,
+				 BLK_MQ_MAX_DEPTH);
+
 	err = misc_register(&loop_misc);
 	if (err < 0)
 		return err;
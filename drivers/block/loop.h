@@ -26,6 +26,11 @@ enum {
 
 struct loop_func_table;
 
+struct loop_worker {
+	struct kthread_worker	worker;
+	struct task_struct	*task;
+};
+
 struct loop_device {
 	int		lo_number;
 	atomic_t	lo_refcnt;
@@ -56,8 +61,8 @@ struct loop_device {
 	spinlock_t		lo_lock;
 	int			lo_state;
 	struct mutex		lo_ctl_mutex;
-	struct kthread_worker	worker;
-	struct task_struct	*worker_task;
+	struct loop_worker	*workers;	/* one per hw queue */
+	unsigned int		nr_workers;
 	bool			use_dio;
 
 	struct request_queue	*lo_queue;
@@ -70,7 +75,10 @@ struct loop_cmd {
 	struct request *rq;
 	struct list_head list;
 	bool use_aio;           /* use AIO interface to handle I/O */
+	atomic_t ref;		/* only for aio */
+	long ret;
 	struct kiocb iocb;
+	struct bio_vec *bvec;	/* only for merged requests */
 };
 
 /* Support for loadable transfer modules */
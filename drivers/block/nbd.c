@@ -31,28 +31,40 @@
 #include <linux/slab.h>
 #include <net/sock.h>
 #include <linux/net.h>
-#include <linux/kthread.h>
 #include <linux/types.h>
 #include <linux/debugfs.h>
+#include <linux/blk-mq.h>
 
 #include <asm/uaccess.h>
 #include <asm/types.h>
 
 #include <linux/nbd.h>
 
+/*
+ * A device may be connected to the server through several sockets.  Each
+ * connection backs one hardware queue: requests are sent on the socket of
+ * the queue they were issued on, and the server answers on that same
+ * socket, where a receiver of its own waits for the replies.
+ */
+struct nbd_sock {
+	struct socket *sock;
+	struct mutex tx_lock;	/* serializes requests sent on the socket */
+
+	/* statistics, see the "connections" debugfs file */
+	atomic_t inflight;	/* sent, waiting for a reply */
+	u64 sent;		/* under tx_lock */
+	u64 received;		/* by the receiver only */
+};
+
 struct nbd_device {
 	u32 flags;
-	struct socket * sock;	/* If == NULL, device is not ready, yet	*/
+	struct nbd_sock **socks;	/* set up before NBD_DO_IT */
+	int num_connections;
 	int magic;
 
-	spinlock_t queue_lock;
-	struct list_head queue_head;	/* Requests waiting result */
-	struct request *active_req;
-	wait_queue_head_t active_wq;
-	struct list_head waiting_queue;	/* Requests to be sent */
-	wait_queue_head_t waiting_wq;
+	struct blk_mq_tag_set tag_set;
 
-	struct mutex tx_lock;
+	struct mutex config_lock;
 	struct gendisk *disk;
 	int blksize;
 	loff_t bytesize;
@@ -60,17 +72,27 @@ struct nbd_device {
 	bool timedout;
 	bool disconnect; /* a disconnect has been requested by user */
 
-	struct timer_list timeout_timer;
-	/* protects initialization and shutdown of the socket */
-	spinlock_t sock_lock;
-	struct task_struct *task_recv;
-	struct task_struct *task_send;
+	struct task_struct *task_recv;	/* runs NBD_DO_IT */
+	atomic_t recv_threads;
+	wait_queue_head_t recv_wq;
 
 #if IS_ENABLED(CONFIG_DEBUG_FS)
 	struct dentry *dbg_dir;
 #endif
 };
 
+/* per request */
+struct nbd_cmd {
+	struct nbd_device *nbd;
+	int index;		/* connection it was sent on, or -1 */
+};
+
+struct recv_thread_args {
+	struct work_struct work;
+	struct nbd_device *nbd;
+	int index;
+};
+
 #if IS_ENABLED(CONFIG_DEBUG_FS)
 static struct dentry *nbd_dbg_dir;
 #endif
@@ -79,21 +101,13 @@ static struct dentry *nbd_dbg_dir;
 
 #define NBD_MAGIC 0x68797548
 
+/* request timeout while none is set, which only checks back on the request */
+#define NBD_DEFAULT_TIMEOUT	(30 * HZ)
+
 static unsigned int nbds_max = 16;
 static struct nbd_device *nbd_dev;
 static int max_part;
-
-/*
- * Use just one lock (or at most 1 per NIC). Two arguments for this:
- * 1. Each NIC is essentially a synchronization point for all servers
- *    accessed through that NIC so there's no need to have more locks
- *    than NICs anyway.
- * 2. More locks lead to more "Dirty cache line bouncing" which will slow
- *    down each lock to the point where they're actually slower than just
- *    a single lock.
- * Thanks go to Jens Axboe and Al Viro for their LKML emails explaining this!
- */
-static DEFINE_SPINLOCK(nbd_lock);
+static struct workqueue_struct *recv_workqueue;
 
 static inline struct device *nbd_to_dev(struct nbd_device *nbd)
 {
@@ -153,68 +167,75 @@ static int nbd_size_set(struct nbd_device *nbd, struct block_device *bdev,
 	return 0;
 }
 
-static void nbd_end_request(struct nbd_device *nbd, struct request *req)
+static void nbd_end_request(struct nbd_cmd *cmd)
 {
-	int error = req->errors ? -EIO : 0;
-	struct request_queue *q = req->q;
-	unsigned long flags;
+	struct nbd_device *nbd = cmd->nbd;
+	struct request *req = blk_mq_rq_from_pdu(cmd);
 
 	dev_dbg(nbd_to_dev(nbd), "request %p: %s\n", req,
-		error ? "failed" : "done");
+		req->errors ? "failed" : "done");
 
-	spin_lock_irqsave(q->queue_lock, flags);
-	__blk_end_request_all(req, error);
-	spin_unlock_irqrestore(q->queue_lock, flags);
+	blk_mq_complete_request(req, req->errors);
 }
 
-/*
- * Forcibly shutdown the socket causing all listeners to error
- */
-static void sock_shutdown(struct nbd_device *nbd)
+static void nbd_complete_rq(struct request *req)
 {
-	spin_lock_irq(&nbd->sock_lock);
-
-	if (!nbd->sock) {
-		spin_unlock_irq(&nbd->sock_lock);
-		return;
-	}
+	struct nbd_cmd *cmd = blk_mq_rq_to_pdu(req);
 
-	dev_warn(disk_to_dev(nbd->disk), "shutting down socket\n");
-	kernel_sock_shutdown(nbd->sock, SHUT_RDWR);
-	sockfd_put(nbd->sock);
-	nbd->sock = NULL;
-	spin_unlock_irq(&nbd->sock_lock);
+	if (cmd->index >= 0)
+		atomic_dec(&cmd->nbd->socks[cmd->index]->inflight);
 
-	del_timer(&nbd->timeout_timer);
+	blk_mq_end_request(req, req->errors ? -EIO : 0);
 }
 
-static void nbd_xmit_timeout(unsigned long arg)
+/*
+ * Forcibly shutdown the sockets causing all listeners to error
+ */
+static void sock_shutdown(struct nbd_device *nbd)
 {
-	struct nbd_device *nbd = (struct nbd_device *)arg;
-	unsigned long flags;
+	int i;
 
-	if (list_empty(&nbd->queue_head))
+	if (!nbd->num_connections)
 		return;
 
-	spin_lock_irqsave(&nbd->sock_lock, flags);
+	dev_warn(disk_to_dev(nbd->disk), "shutting down sockets\n");
+	for (i = 0; i < nbd->num_connections; i++)
+		kernel_sock_shutdown(nbd->socks[i]->sock, SHUT_RDWR);
+}
 
-	nbd->timedout = true;
+static enum blk_eh_timer_return nbd_xmit_timeout(struct request *req,
+						 bool reserved)
+{
+	struct nbd_cmd *cmd = blk_mq_rq_to_pdu(req);
+	struct nbd_device *nbd = cmd->nbd;
 
-	if (nbd->sock)
-		kernel_sock_shutdown(nbd->sock, SHUT_RDWR);
+	/* no timeout set, wait for the server forever */
+	if (!nbd->xmit_timeout)
+		return BLK_EH_RESET_TIMER;
 
-	spin_unlock_irqrestore(&nbd->sock_lock, flags);
+	/*
+	 * The receiver of the request's connection may be copying its reply
+	 * into the request right now, so it can't be completed from here.
+	 * Shut the sockets down instead: the receivers bail out, and once
+	 * they are all gone nbd_clear_que() fails what is still in flight.
+	 * Until then, keep the request alive.
+	 */
+	if (!nbd->timedout) {
+		dev_err(nbd_to_dev(nbd), "Connection timed out, shutting down connection\n");
+		nbd->timedout = true;
+	}
+	sock_shutdown(nbd);
 
-	dev_err(nbd_to_dev(nbd), "Connection timed out, shutting down connection\n");
+	return BLK_EH_RESET_TIMER;
 }
 
 /*
  *  Send or receive packet.
  */
-static int sock_xmit(struct nbd_device *nbd, int send, void *buf, int size,
-		int msg_flags)
+static int sock_xmit(struct nbd_device *nbd, int index, int send, void *buf,
+		     int size, int msg_flags)
 {
-	struct socket *sock = nbd->sock;
+	struct socket *sock = nbd->socks[index]->sock;
 	int result;
 	struct msghdr msg;
 	struct kvec iov;
@@ -255,34 +276,31 @@ static int sock_xmit(struct nbd_device *nbd, int send, void *buf, int size,
 
 	tsk_restore_flags(current, pflags, PF_MEMALLOC);
 
-	if (!send && nbd->xmit_timeout)
-		mod_timer(&nbd->timeout_timer, jiffies + nbd->xmit_timeout);
-
 	return result;
 }
 
-static inline int sock_send_bvec(struct nbd_device *nbd, struct bio_vec *bvec,
-		int flags)
+static inline int sock_send_bvec(struct nbd_device *nbd, int index,
+				 struct bio_vec *bvec, int flags)
 {
 	int result;
 	void *kaddr = kmap(bvec->bv_page);
-	result = sock_xmit(nbd, 1, kaddr + bvec->bv_offset,
+	result = sock_xmit(nbd, index, 1, kaddr + bvec->bv_offset,
 			   bvec->bv_len, flags);
 	kunmap(bvec->bv_page);
 	return result;
 }
 
-/* always call with the tx_lock held */
-static int nbd_send_req(struct nbd_device *nbd, struct request *req)
+/* always call with the tx_lock of the connection held */
+static int nbd_send_cmd(struct nbd_device *nbd, struct nbd_cmd *cmd, int index)
 {
+	struct request *req = blk_mq_rq_from_pdu(cmd);
 	int result, flags;
 	struct nbd_request request;
 	unsigned long size = blk_rq_bytes(req);
+	u32 tag = blk_mq_unique_tag(req);
 	u32 type;
 
-	if (req->cmd_type == REQ_TYPE_DRV_PRIV)
-		type = NBD_CMD_DISC;
-	else if (req_op(req) == REQ_OP_DISCARD)
+	if (req_op(req) == REQ_OP_DISCARD)
 		type = NBD_CMD_TRIM;
 	else if (req_op(req) == REQ_OP_FLUSH)
 		type = NBD_CMD_FLUSH;
@@ -294,16 +312,16 @@ static int nbd_send_req(struct nbd_device *nbd, struct request *req)
 	memset(&request, 0, sizeof(request));
 	request.magic = htonl(NBD_REQUEST_MAGIC);
 	request.type = htonl(type);
-	if (type != NBD_CMD_FLUSH && type != NBD_CMD_DISC) {
+	if (type != NBD_CMD_FLUSH) {
 		request.from = cpu_to_be64((u64)blk_rq_pos(req) << 9);
 		request.len = htonl(size);
 	}
-	memcpy(request.handle, &req, sizeof(req));
+	memcpy(request.handle, &tag, sizeof(tag));
 
 	dev_dbg(nbd_to_dev(nbd), "request %p: sending control (%s@%llu,%uB)\n",
 		req, nbdcmd_to_ascii(type),
 		(unsigned long long)blk_rq_pos(req) << 9, blk_rq_bytes(req));
-	result = sock_xmit(nbd, 1, &request, sizeof(request),
+	result = sock_xmit(nbd, index, 1, &request, sizeof(request),
 			(type == NBD_CMD_WRITE) ? MSG_MORE : 0);
 	if (result <= 0) {
 		dev_err(disk_to_dev(nbd->disk),
@@ -324,7 +342,7 @@ static int nbd_send_req(struct nbd_device *nbd, struct request *req)
 				flags = MSG_MORE;
 			dev_dbg(nbd_to_dev(nbd), "request %p: sending %d bytes data\n",
 				req, bvec.bv_len);
-			result = sock_send_bvec(nbd, &bvec, flags);
+			result = sock_send_bvec(nbd, index, &bvec, flags);
 			if (result <= 0) {
 				dev_err(disk_to_dev(nbd->disk),
 					"Send data failed (result %d)\n",
@@ -336,48 +354,29 @@ static int nbd_send_req(struct nbd_device *nbd, struct request *req)
 	return 0;
 }
 
-static struct request *nbd_find_request(struct nbd_device *nbd,
-					struct request *xreq)
-{
-	struct request *req, *tmp;
-	int err;
-
-	err = wait_event_interruptible(nbd->active_wq, nbd->active_req != xreq);
-	if (unlikely(err))
-		return ERR_PTR(err);
-
-	spin_lock(&nbd->queue_lock);
-	list_for_each_entry_safe(req, tmp, &nbd->queue_head, queuelist) {
-		if (req != xreq)
-			continue;
-		list_del_init(&req->queuelist);
-		spin_unlock(&nbd->queue_lock);
-		return req;
-	}
-	spin_unlock(&nbd->queue_lock);
-
-	return ERR_PTR(-ENOENT);
-}
-
-static inline int sock_recv_bvec(struct nbd_device *nbd, struct bio_vec *bvec)
+static inline int sock_recv_bvec(struct nbd_device *nbd, int index,
+				 struct bio_vec *bvec)
 {
 	int result;
 	void *kaddr = kmap(bvec->bv_page);
-	result = sock_xmit(nbd, 0, kaddr + bvec->bv_offset, bvec->bv_len,
-			MSG_WAITALL);
+	result = sock_xmit(nbd, index, 0, kaddr + bvec->bv_offset,
+			   bvec->bv_len, MSG_WAITALL);
 	kunmap(bvec->bv_page);
 	return result;
 }
 
 /* NULL returned = something went wrong, inform userspace */
-static struct request *nbd_read_stat(struct nbd_device *nbd)
+static struct nbd_cmd *nbd_read_stat(struct nbd_device *nbd, int index)
 {
 	int result;
 	struct nbd_reply reply;
-	struct request *req;
+	struct nbd_cmd *cmd;
+	struct request *req = NULL;
+	u16 hwq;
+	u32 tag;
 
 	reply.magic = 0;
-	result = sock_xmit(nbd, 0, &reply, sizeof(reply), MSG_WAITALL);
+	result = sock_xmit(nbd, index, 0, &reply, sizeof(reply), MSG_WAITALL);
 	if (result <= 0) {
 		dev_err(disk_to_dev(nbd->disk),
 			"Receive control failed (result %d)\n", result);
@@ -390,22 +389,30 @@ static struct request *nbd_read_stat(struct nbd_device *nbd)
 		return ERR_PTR(-EPROTO);
 	}
 
-	req = nbd_find_request(nbd, *(struct request **)reply.handle);
-	if (IS_ERR(req)) {
-		result = PTR_ERR(req);
-		if (result != -ENOENT)
-			return ERR_PTR(result);
-
-		dev_err(disk_to_dev(nbd->disk), "Unexpected reply (%p)\n",
-			reply.handle);
+	memcpy(&tag, reply.handle, sizeof(tag));
+	hwq = blk_mq_unique_tag_to_hwq(tag);
+	if (hwq < nbd->tag_set.nr_hw_queues)
+		req = blk_mq_tag_to_rq(nbd->tag_set.tags[hwq],
+				       blk_mq_unique_tag_to_tag(tag));
+	if (!req || !blk_mq_request_started(req)) {
+		dev_err(disk_to_dev(nbd->disk), "Unexpected reply (%d) %p\n",
+			tag, req);
 		return ERR_PTR(-EBADR);
 	}
+	cmd = blk_mq_rq_to_pdu(req);
+	if (cmd->index != index) {
+		dev_err(disk_to_dev(nbd->disk),
+			"Reply for a request sent on connection %d\n",
+			cmd->index);
+		return ERR_PTR(-EPROTO);
+	}
+	nbd->socks[index]->received++;
 
 	if (ntohl(reply.error)) {
 		dev_err(disk_to_dev(nbd->disk), "Other side returned error (%d)\n",
 			ntohl(reply.error));
 		req->errors++;
-		return req;
+		return cmd;
 	}
 
 	dev_dbg(nbd_to_dev(nbd), "request %p: got reply\n", req);
@@ -414,18 +421,18 @@ static struct request *nbd_read_stat(struct nbd_device *nbd)
 		struct bio_vec bvec;
 
 		rq_for_each_segment(bvec, req, iter) {
-			result = sock_recv_bvec(nbd, &bvec);
+			result = sock_recv_bvec(nbd, index, &bvec);
 			if (result <= 0) {
 				dev_err(disk_to_dev(nbd->disk), "Receive data failed (result %d)\n",
 					result);
 				req->errors++;
-				return req;
+				return cmd;
 			}
 			dev_dbg(nbd_to_dev(nbd), "request %p: got %d bytes data\n",
 				req, bvec.bv_len);
 		}
 	}
-	return req;
+	return cmd;
 }
 
 static ssize_t pid_show(struct device *dev,
@@ -442,154 +449,113 @@ static struct device_attribute pid_attr = {
 	.show = pid_show,
 };
 
-static int nbd_thread_recv(struct nbd_device *nbd, struct block_device *bdev)
+static void recv_work(struct work_struct *work)
 {
-	struct request *req;
-	int ret;
+	struct recv_thread_args *args = container_of(work,
+						     struct recv_thread_args,
+						     work);
+	struct nbd_device *nbd = args->nbd;
+	struct nbd_cmd *cmd;
 
 	BUG_ON(nbd->magic != NBD_MAGIC);
 
-	sk_set_memalloc(nbd->sock->sk);
-
-	ret = device_create_file(disk_to_dev(nbd->disk), &pid_attr);
-	if (ret) {
-		dev_err(disk_to_dev(nbd->disk), "device_create_file failed!\n");
-		return ret;
-	}
-
-	nbd_size_update(nbd, bdev);
-
 	while (1) {
-		req = nbd_read_stat(nbd);
-		if (IS_ERR(req)) {
-			ret = PTR_ERR(req);
+		cmd = nbd_read_stat(nbd, args->index);
+		if (IS_ERR(cmd))
 			break;
-		}
 
-		nbd_end_request(nbd, req);
+		nbd_end_request(cmd);
 	}
 
-	nbd_size_clear(nbd, bdev);
+	/*
+	 * The requests of the other connections could still be served, but
+	 * the device goes down as a whole, as it did with a single socket.
+	 */
+	sock_shutdown(nbd);
 
-	device_remove_file(disk_to_dev(nbd->disk), &pid_attr);
-	return ret;
+	atomic_dec(&nbd->recv_threads);
+	wake_up(&nbd->recv_wq);
 }
 
-static void nbd_clear_que(struct nbd_device *nbd)
+static void nbd_clear_req(struct request *req, void *data, bool reserved)
 {
-	struct request *req;
+	struct nbd_cmd *cmd;
 
+	if (!blk_mq_request_started(req))
+		return;
+	cmd = blk_mq_rq_to_pdu(req);
+	req->errors++;
+	nbd_end_request(cmd);
+}
+
+static void nbd_clear_que(struct nbd_device *nbd)
+{
 	BUG_ON(nbd->magic != NBD_MAGIC);
 
-	/*
-	 * Because we have set nbd->sock to NULL under the tx_lock, all
-	 * modifications to the list must have completed by now.  For
-	 * the same reason, the active_req must be NULL.
-	 *
-	 * As a consequence, we don't need to take the spin lock while
-	 * purging the list here.
-	 */
-	BUG_ON(nbd->sock);
-	BUG_ON(nbd->active_req);
+	blk_mq_stop_hw_queues(nbd->disk->queue);
+	blk_mq_tagset_busy_iter(&nbd->tag_set, nbd_clear_req, NULL);
+	blk_mq_start_hw_queues(nbd->disk->queue);
+	dev_dbg(disk_to_dev(nbd->disk), "queue cleared\n");
+}
 
-	while (!list_empty(&nbd->queue_head)) {
-		req = list_entry(nbd->queue_head.next, struct request,
-				 queuelist);
-		list_del_init(&req->queuelist);
-		req->errors++;
-		nbd_end_request(nbd, req);
-	}
+/*
+ * Drop the sockets.  Requests in flight hold on to their connection until
+ * they are freed, so wait for them first.
+ */
+static void nbd_clear_sock(struct nbd_device *nbd)
+{
+	int i;
 
-	while (!list_empty(&nbd->waiting_queue)) {
-		req = list_entry(nbd->waiting_queue.next, struct request,
-				 queuelist);
-		list_del_init(&req->queuelist);
-		req->errors++;
-		nbd_end_request(nbd, req);
+	if (!nbd->num_connections)
+		return;
+
+	blk_mq_freeze_queue(nbd->disk->queue);
+	for (i = 0; i < nbd->num_connections; i++) {
+		sockfd_put(nbd->socks[i]->sock);
+		kfree(nbd->socks[i]);
 	}
-	dev_dbg(disk_to_dev(nbd->disk), "queue cleared\n");
+	kfree(nbd->socks);
+	nbd->socks = NULL;
+	nbd->num_connections = 0;
+	blk_mq_unfreeze_queue(nbd->disk->queue);
 }
 
-
-static void nbd_handle_req(struct nbd_device *nbd, struct request *req)
+static int nbd_handle_cmd(struct nbd_cmd *cmd, int index)
 {
+	struct request *req = blk_mq_rq_from_pdu(cmd);
+	struct nbd_device *nbd = cmd->nbd;
+	struct nbd_sock *nsock;
+	int ret;
+
 	if (req->cmd_type != REQ_TYPE_FS)
-		goto error_out;
+		return -EIO;
 
 	if (rq_data_dir(req) == WRITE &&
 	    (nbd->flags & NBD_FLAG_READ_ONLY)) {
 		dev_err(disk_to_dev(nbd->disk),
 			"Write on read-only\n");
-		goto error_out;
+		return -EIO;
 	}
 
-	req->errors = 0;
-
-	mutex_lock(&nbd->tx_lock);
-	if (unlikely(!nbd->sock)) {
-		mutex_unlock(&nbd->tx_lock);
-		dev_err(disk_to_dev(nbd->disk),
-			"Attempted send on closed socket\n");
-		goto error_out;
+	/* the sockets may still change until the device is started */
+	if (!nbd->task_recv || index >= nbd->num_connections) {
+		dev_err_ratelimited(disk_to_dev(nbd->disk),
+				    "Attempted send on closed socket\n");
+		return -EIO;
 	}
 
-	nbd->active_req = req;
-
-	if (nbd->xmit_timeout && list_empty_careful(&nbd->queue_head))
-		mod_timer(&nbd->timeout_timer, jiffies + nbd->xmit_timeout);
-
-	if (nbd_send_req(nbd, req) != 0) {
+	nsock = nbd->socks[index];
+	mutex_lock(&nsock->tx_lock);
+	cmd->index = index;
+	atomic_inc(&nsock->inflight);
+	ret = nbd_send_cmd(nbd, cmd, index);
+	if (ret)
 		dev_err(disk_to_dev(nbd->disk), "Request send failed\n");
-		req->errors++;
-		nbd_end_request(nbd, req);
-	} else {
-		spin_lock(&nbd->queue_lock);
-		list_add_tail(&req->queuelist, &nbd->queue_head);
-		spin_unlock(&nbd->queue_lock);
-	}
-
-	nbd->active_req = NULL;
-	mutex_unlock(&nbd->tx_lock);
-	wake_up_all(&nbd->active_wq);
-
-	return;
-
-error_out:
-	req->errors++;
-	nbd_end_request(nbd, req);
-}
-
-static int nbd_thread_send(void *data)
-{
-	struct nbd_device *nbd = data;
-	struct request *req;
-
-	nbd->task_send = current;
-
-	set_user_nice(current, MIN_NICE);
-	while (!kthread_should_stop() || !list_empty(&nbd->waiting_queue)) {
-		/* wait for something to do */
-		wait_event_interruptible(nbd->waiting_wq,
-					 kthread_should_stop() ||
-					 !list_empty(&nbd->waiting_queue));
-
-		/* extract request */
-		if (list_empty(&nbd->waiting_queue))
-			continue;
-
-		spin_lock_irq(&nbd->queue_lock);
-		req = list_entry(nbd->waiting_queue.next, struct request,
-				 queuelist);
-		list_del_init(&req->queuelist);
-		spin_unlock_irq(&nbd->queue_lock);
-
-		/* handle request */
-		nbd_handle_req(nbd, req);
-	}
-
-	nbd->task_send = NULL;
+	else
+		nsock->sent++;
+	mutex_unlock(&nsock->tx_lock);
 
-	return 0;
+	return ret;
 }
 
 /*
@@ -599,59 +565,68 @@ static int nbd_thread_send(void *data)
  *   { printk( "Warning: Ignoring result!\n"); nbd_end_request( req ); }
  */
 
-static void nbd_request_handler(struct request_queue *q)
-		__releases(q->queue_lock) __acquires(q->queue_lock)
+static int nbd_queue_rq(struct blk_mq_hw_ctx *hctx,
+			const struct blk_mq_queue_data *bd)
 {
-	struct request *req;
-	
-	while ((req = blk_fetch_request(q)) != NULL) {
-		struct nbd_device *nbd;
+	struct nbd_cmd *cmd = blk_mq_rq_to_pdu(bd->rq);
 
-		spin_unlock_irq(q->queue_lock);
+	BUG_ON(cmd->nbd->magic != NBD_MAGIC);
 
-		nbd = req->rq_disk->private_data;
+	dev_dbg(nbd_to_dev(cmd->nbd), "request %p: dequeued (flags=%x)\n",
+		bd->rq, bd->rq->cmd_type);
 
-		BUG_ON(nbd->magic != NBD_MAGIC);
-
-		dev_dbg(nbd_to_dev(nbd), "request %p: dequeued (flags=%x)\n",
-			req, req->cmd_type);
-
-		if (unlikely(!nbd->sock)) {
-			dev_err_ratelimited(disk_to_dev(nbd->disk),
-					    "Attempted send on closed socket\n");
-			req->errors++;
-			nbd_end_request(nbd, req);
-			spin_lock_irq(q->queue_lock);
-			continue;
-		}
-
-		spin_lock_irq(&nbd->queue_lock);
-		list_add_tail(&req->queuelist, &nbd->waiting_queue);
-		spin_unlock_irq(&nbd->queue_lock);
-
-		wake_up(&nbd->waiting_wq);
-
-		spin_lock_irq(q->queue_lock);
+	cmd->index = -1;
+	bd->rq->errors = 0;
+	blk_mq_start_request(bd->rq);
+	if (nbd_handle_cmd(cmd, hctx->queue_num) != 0) {
+		bd->rq->errors++;
+		nbd_end_request(cmd);
 	}
+
+	return BLK_MQ_RQ_QUEUE_OK;
 }
 
-static int nbd_set_socket(struct nbd_device *nbd, struct socket *sock)
+static int nbd_add_socket(struct nbd_device *nbd, struct block_device *bdev,
+			  unsigned long arg)
 {
-	int ret = 0;
+	struct nbd_sock **socks;
+	struct nbd_sock *nsock;
+	struct socket *sock;
+	int err;
 
-	spin_lock_irq(&nbd->sock_lock);
+	sock = sockfd_lookup(arg, &err);
+	if (!sock)
+		return err;
 
-	if (nbd->sock) {
-		ret = -EBUSY;
-		goto out;
+	/* connections are fixed while the device runs */
+	if (nbd->task_recv) {
+		err = -EBUSY;
+		goto out_put;
 	}
 
-	nbd->sock = sock;
+	err = -ENOMEM;
+	socks = krealloc(nbd->socks, (nbd->num_connections + 1) *
+			 sizeof(struct nbd_sock *), GFP_KERNEL);
+	if (!socks)
+		goto out_put;
+	nbd->socks = socks;
 
-out:
-	spin_unlock_irq(&nbd->sock_lock);
+	nsock = kzalloc(sizeof(*nsock), GFP_KERNEL);
+	if (!nsock)
+		goto out_put;
 
-	return ret;
+	nsock->sock = sock;
+	mutex_init(&nsock->tx_lock);
+	atomic_set(&nsock->inflight, 0);
+	socks[nbd->num_connections++] = nsock;
+
+	if (max_part)
+		bdev->bd_invalidated = 1;
+	return 0;
+
+out_put:
+	sockfd_put(sock);
+	return err;
 }
 
 /* Reset all properties of an NBD device */
@@ -665,7 +640,6 @@ static void nbd_reset(struct nbd_device *nbd)
 	nbd->flags = 0;
 	nbd->xmit_timeout = 0;
 	queue_flag_clear_unlocked(QUEUE_FLAG_DISCARD, nbd->disk->queue);
-	del_timer_sync(&nbd->timeout_timer);
 }
 
 static void nbd_bdev_reset(struct block_device *bdev)
@@ -690,59 +664,149 @@ static void nbd_parse_flags(struct nbd_device *nbd, struct block_device *bdev)
 		blk_queue_write_cache(nbd->disk->queue, false, false);
 }
 
+static void send_disconnects(struct nbd_device *nbd)
+{
+	struct nbd_request request = {
+		.magic = htonl(NBD_REQUEST_MAGIC),
+		.type = htonl(NBD_CMD_DISC),
+	};
+	int i, ret;
+
+	for (i = 0; i < nbd->num_connections; i++) {
+		struct nbd_sock *nsock = nbd->socks[i];
+
+		mutex_lock(&nsock->tx_lock);
+		ret = sock_xmit(nbd, i, 1, &request, sizeof(request), 0);
+		if (ret <= 0)
+			dev_err(disk_to_dev(nbd->disk),
+				"Send disconnect failed %d\n", ret);
+		mutex_unlock(&nsock->tx_lock);
+	}
+}
+
 static int nbd_dev_dbg_init(struct nbd_device *nbd);
 static void nbd_dev_dbg_close(struct nbd_device *nbd);
 
-/* Must be called with tx_lock held */
+/*
+ * Serve the device until all connections are gone.  Called with the
+ * config_lock held, which is dropped meanwhile.
+ */
+static int nbd_start_device(struct nbd_device *nbd, struct block_device *bdev)
+{
+	struct recv_thread_args *args;
+	int num_connections = nbd->num_connections;
+	int error, i;
+
+	if (nbd->task_recv)
+		return -EBUSY;
+	if (!num_connections)
+		return -EINVAL;
+
+	args = kcalloc(num_connections, sizeof(*args), GFP_KERNEL);
+	if (!args)
+		return -ENOMEM;
+
+	/* We have to claim the device under the lock */
+	nbd->task_recv = current;
+	mutex_unlock(&nbd->config_lock);
+
+	nbd_parse_flags(nbd, bdev);
+
+	blk_mq_update_nr_hw_queues(&nbd->tag_set, num_connections);
+	if (nbd->tag_set.nr_hw_queues < num_connections)
+		dev_warn(disk_to_dev(nbd->disk),
+			 "only %u of %d connections are used\n",
+			 nbd->tag_set.nr_hw_queues, num_connections);
+
+	error = device_create_file(disk_to_dev(nbd->disk), &pid_attr);
+	if (error) {
+		dev_err(disk_to_dev(nbd->disk), "device_create_file failed!\n");
+		goto out;
+	}
+
+	nbd_size_update(nbd, bdev);
+	nbd_dev_dbg_init(nbd);
+
+	for (i = 0; i < num_connections; i++) {
+		sk_set_memalloc(nbd->socks[i]->sock->sk);
+		atomic_inc(&nbd->recv_threads);
+		INIT_WORK(&args[i].work, recv_work);
+		args[i].nbd = nbd;
+		args[i].index = i;
+		queue_work(recv_workqueue, &args[i].work);
+	}
+
+	if (wait_event_interruptible(nbd->recv_wq,
+				     atomic_read(&nbd->recv_threads) == 0))
+		sock_shutdown(nbd);
+	for (i = 0; i < num_connections; i++)
+		flush_work(&args[i].work);
+
+	nbd_dev_dbg_close(nbd);
+	nbd_size_clear(nbd, bdev);
+	device_remove_file(disk_to_dev(nbd->disk), &pid_attr);
+out:
+	mutex_lock(&nbd->config_lock);
+	nbd->task_recv = NULL;
+
+	sock_shutdown(nbd);
+	nbd_clear_que(nbd);
+	kill_bdev(bdev);
+	nbd_bdev_reset(bdev);
+	nbd_clear_sock(nbd);
+
+	if (nbd->disconnect) /* user requested, ignore socket errors */
+		error = 0;
+	if (nbd->timedout)
+		error = -ETIMEDOUT;
+
+	nbd_reset(nbd);
+	kfree(args);
+
+	return error;
+}
+
+/* Must be called with config_lock held */
 
 static int __nbd_ioctl(struct block_device *bdev, struct nbd_device *nbd,
 		       unsigned int cmd, unsigned long arg)
 {
 	switch (cmd) {
 	case NBD_DISCONNECT: {
-		struct request sreq;
-
 		dev_info(disk_to_dev(nbd->disk), "NBD_DISCONNECT\n");
-		if (!nbd->sock)
+		if (!nbd->num_connections)
 			return -EINVAL;
 
-		mutex_unlock(&nbd->tx_lock);
+		mutex_unlock(&nbd->config_lock);
 		fsync_bdev(bdev);
-		mutex_lock(&nbd->tx_lock);
-		blk_rq_init(NULL, &sreq);
-		sreq.cmd_type = REQ_TYPE_DRV_PRIV;
+		mutex_lock(&nbd->config_lock);
 
 		/* Check again after getting mutex back.  */
-		if (!nbd->sock)
+		if (!nbd->num_connections)
 			return -EINVAL;
 
 		nbd->disconnect = true;
 
-		nbd_send_req(nbd, &sreq);
+		send_disconnects(nbd);
 		return 0;
 	}
- 
+
 	case NBD_CLEAR_SOCK:
 		sock_shutdown(nbd);
+		/*
+		 * A running device clears its queue and drops its sockets
+		 * once the receivers are gone.  Failing requests here would
+		 * race with a receiver still reading a reply into them.
+		 */
+		if (nbd->task_recv)
+			return 0;
 		nbd_clear_que(nbd);
-		BUG_ON(!list_empty(&nbd->queue_head));
-		BUG_ON(!list_empty(&nbd->waiting_queue));
 		kill_bdev(bdev);
+		nbd_clear_sock(nbd);
 		return 0;
 
-	case NBD_SET_SOCK: {
-		int err;
-		struct socket *sock = sockfd_lookup(arg, &err);
-
-		if (!sock)
-			return err;
-
-		err = nbd_set_socket(nbd, sock);
-		if (!err && max_part)
-			bdev->bd_invalidated = 1;
-
-		return err;
-	}
+	case NBD_SET_SOCK:
+		return nbd_add_socket(nbd, bdev, arg);
 
 	case NBD_SET_BLKSIZE: {
 		loff_t bsize = div_s64(nbd->bytesize, arg);
@@ -759,63 +823,16 @@ static int __nbd_ioctl(struct block_device *bdev, struct nbd_device *nbd,
 
 	case NBD_SET_TIMEOUT:
 		nbd->xmit_timeout = arg * HZ;
-		if (arg)
-			mod_timer(&nbd->timeout_timer,
-				  jiffies + nbd->xmit_timeout);
-		else
-			del_timer_sync(&nbd->timeout_timer);
-
+		blk_queue_rq_timeout(nbd->disk->queue,
+				     arg ? arg * HZ : NBD_DEFAULT_TIMEOUT);
 		return 0;
 
 	case NBD_SET_FLAGS:
 		nbd->flags = arg;
 		return 0;
 
-	case NBD_DO_IT: {
-		struct task_struct *thread;
-		int error;
-
-		if (nbd->task_recv)
-			return -EBUSY;
-		if (!nbd->sock)
-			return -EINVAL;
-
-		/* We have to claim the device under the lock */
-		nbd->task_recv = current;
-		mutex_unlock(&nbd->tx_lock);
-
-		nbd_parse_flags(nbd, bdev);
-
-		thread = kthread_run(nbd_thread_send, nbd, "%s",
-				     nbd_name(nbd));
-		if (IS_ERR(thread)) {
-			mutex_lock(&nbd->tx_lock);
-			nbd->task_recv = NULL;
-			return PTR_ERR(thread);
-		}
-
-		nbd_dev_dbg_init(nbd);
-		error = nbd_thread_recv(nbd, bdev);
-		nbd_dev_dbg_close(nbd);
-		kthread_stop(thread);
-
-		mutex_lock(&nbd->tx_lock);
-		nbd->task_recv = NULL;
-
-		sock_shutdown(nbd);
-		nbd_clear_que(nbd);
-		kill_bdev(bdev);
-		nbd_bdev_reset(bdev);
-
-		if (nbd->disconnect) /* user requested, ignore socket errors */
-			error = 0;
-		if (nbd->timedout)
-			error = -ETIMEDOUT;
-
-		nbd_reset(nbd);
-
-		return error;
-	}
+	case NBD_DO_IT:
+		return nbd_start_device(nbd, bdev);
 
 	case NBD_CLEAR_QUE:
 		/*
@@ -824,13 +841,16 @@ static int __nbd_ioctl(struct block_device *bdev, struct nbd_device *nbd,
 		 */
 		return 0;
 
-	case NBD_PRINT_DEBUG:
-		dev_info(disk_to_dev(nbd->disk),
-			"next = %p, prev = %p, head = %p\n",
-			nbd->queue_head.next, nbd->queue_head.prev,
-			&nbd->queue_head);
+	case NBD_PRINT_DEBUG: {
+		int i;
+
+		for (i = 0; i < nbd->num_connections; i++)
+			dev_info(disk_to_dev(nbd->disk),
+				 "connection %d: %d requests in flight\n", i,
+				 atomic_read(&nbd->socks[i]->inflight));
 		return 0;
 	}
+	}
 	return -ENOTTY;
 }
 
@@ -845,9 +865,9 @@ static int nbd_ioctl(struct block_device *bdev, fmode_t mode,
 
 	BUG_ON(nbd->magic != NBD_MAGIC);
 
-	mutex_lock(&nbd->tx_lock);
+	mutex_lock(&nbd->config_lock);
 	error = __nbd_ioctl(bdev, nbd, cmd, arg);
-	mutex_unlock(&nbd->tx_lock);
+	mutex_unlock(&nbd->config_lock);
 
 	return error;
 }
@@ -867,8 +887,6 @@ static int nbd_dbg_tasks_show(struct seq_file *s, void *unused)
 
 	if (nbd->task_recv)
 		seq_printf(s, "recv: %d\n", task_pid_nr(nbd->task_recv));
-	if (nbd->task_send)
-		seq_printf(s, "send: %d\n", task_pid_nr(nbd->task_send));
 
 	return 0;
 }
@@ -885,6 +903,37 @@ static const struct file_operations nbd_dbg_tasks_ops = {
 	.release = single_release,
 };
 
+static int nbd_dbg_connections_show(struct seq_file *s, void *unused)
+{
+	struct nbd_device *nbd = s->private;
+	int i;
+
+	mutex_lock(&nbd->config_lock);
+	for (i = 0; i < nbd->num_connections; i++) {
+		struct nbd_sock *nsock = nbd->socks[i];
+
+		seq_printf(s, "%d: inflight %d sent %llu received %llu\n", i,
+			   atomic_read(&nsock->inflight),
+			   (unsigned long long)nsock->sent,
+			   (unsigned long long)nsock->received);
+	}
+	mutex_unlock(&nbd->config_lock);
+
+	return 0;
+}
+
+static int nbd_dbg_connections_open(struct inode *inode, struct file *file)
+{
+	return single_open(file, nbd_dbg_connections_show, inode->i_private);
+}
+
+static const struct file_operations nbd_dbg_connections_ops = {
+	.open = nbd_dbg_connections_open,
+	.read = seq_read,
+	.llseek = seq_lseek,
+	.release = single_release,
+};
+
 static int nbd_dbg_flags_show(struct seq_file *s, void *unused)
 {
 	struct nbd_device *nbd = s->private;
@@ -934,6 +983,8 @@ static int nbd_dev_dbg_init(struct nbd_device *nbd)
 	nbd->dbg_dir = dir;
 
 	debugfs_create_file("tasks", 0444, dir, nbd, &nbd_dbg_tasks_ops);
+	debugfs_create_file("connections", 0444, dir, nbd,
+			    &nbd_dbg_connections_ops);
 	debugfs_create_u64("size_bytes", 0444, dir, &nbd->bytesize);
 	debugfs_create_u32("timeout", 0444, dir, &nbd->xmit_timeout);
 	debugfs_create_u32("blocksize", 0444, dir, &nbd->blksize);
@@ -987,6 +1038,24 @@ static void nbd_dbg_close(void)
 
 #endif
 
+static int nbd_init_request(void *data, struct request *rq,
+			    unsigned int hctx_idx, unsigned int request_idx,
+			    unsigned int numa_node)
+{
+	struct nbd_cmd *cmd = blk_mq_rq_to_pdu(rq);
+
+	cmd->nbd = data;
+	return 0;
+}
+
+static struct blk_mq_ops nbd_mq_ops = {
+	.queue_rq	= nbd_queue_rq,
+	.map_queue	= blk_mq_map_queue,
+	.init_request	= nbd_init_request,
+	.complete	= nbd_complete_rq,
+	.timeout	= nbd_xmit_timeout,
+};
+
 /*
  * And here should be modules and kernel interface 
  *  (Just smiley confuses emacs :-)
@@ -1030,18 +1099,50 @@ static int __init nbd_init(void)
 	if (!nbd_dev)
 		return -ENOMEM;
 
+	recv_workqueue = alloc_workqueue("knbd-recv",
+					 WQ_MEM_RECLAIM | WQ_HIGHPRI |
+					 WQ_UNBOUND, 0);
+	if (!recv_workqueue)
+		goto out_free_nbd;
+
 	for (i = 0; i < nbds_max; i++) {
+		struct nbd_device *nbd = &nbd_dev[i];
 		struct gendisk *disk = alloc_disk(1 << part_shift);
-		if (!disk)
+		if (!disk) {
+			err = -ENOMEM;
 			goto out;
-		nbd_dev[i].disk = disk;
+		}
+		nbd->disk = disk;
+
+		/*
+		 * One hardware queue until the connections are known, see
+		 * NBD_DO_IT.
+		 */
+		nbd->tag_set.ops = &nbd_mq_ops;
+		nbd->tag_set.nr_hw_queues = 1;
+		nbd->tag_set.queue_depth = 128;
+		nbd->tag_set.numa_node = NUMA_NO_NODE;
+		nbd->tag_set.cmd_size = sizeof(struct nbd_cmd);
+		nbd->tag_set.flags = BLK_MQ_F_SHOULD_MERGE |
+			BLK_MQ_F_SG_MERGE | BLK_MQ_F_BLOCKING;
+		nbd->tag_set.driver_data = nbd;
+		nbd->tag_set.timeout = NBD_DEFAULT_TIMEOUT;
+
+		err = blk_mq_alloc_tag_set(&nbd->tag_set);
+		if (err) {
+			put_disk(disk);
+			goto out;
+		}
+
 		/*
 		 * The new linux 2.5 block layer implementation requires
 		 * every gendisk to have its very own request_queue struct.
 		 * These structs are big so we dynamically allocate them.
 		 */
-		disk->queue = blk_init_queue(nbd_request_handler, &nbd_lock);
-		if (!disk->queue) {
+		disk->queue = blk_mq_init_queue(&nbd->tag_set);
+		if (IS_ERR(disk->queue)) {
+			err = PTR_ERR(disk->queue);
+			blk_mq_free_tag_set(&nbd->tag_set);
 			put_disk(disk);
 			goto out;
 		}
@@ -1069,16 +1170,9 @@ static int __init nbd_init(void)
 	for (i = 0; i < nbds_max; i++) {
 		struct gendisk *disk = nbd_dev[i].disk;
 		nbd_dev[i].magic = NBD_MAGIC;
-		INIT_LIST_HEAD(&nbd_dev[i].waiting_queue);
-		spin_lock_init(&nbd_dev[i].queue_lock);
-		spin_lock_init(&nbd_dev[i].sock_lock);
-		INIT_LIST_HEAD(&nbd_dev[i].queue_head);
-		mutex_init(&nbd_dev[i].tx_lock);
-		init_timer(&nbd_dev[i].timeout_timer);
-		nbd_dev[i].timeout_timer.function = nbd_xmit_timeout;
-		nbd_dev[i].timeout_timer.data = (unsigned long)&nbd_dev[i];
-		init_waitqueue_head(&nbd_dev[i].active_wq);
-		init_waitqueue_head(&nbd_dev[i].waiting_wq);
+		mutex_init(&nbd_dev[i].config_lock);
+		atomic_set(&nbd_dev[i].recv_threads, 0);
+		init_waitqueue_head(&nbd_dev[i].recv_wq);
 		disk->major = NBD_MAJOR;
 		disk->first_minor = i << part_shift;
 		disk->fops = &nbd_fops;
@@ -1092,8 +1186,11 @@ static int __init nbd_init(void)
 out:
 	while (i--) {
 		blk_cleanup_queue(nbd_dev[i].disk->queue);
+		blk_mq_free_tag_set(&nbd_dev[i].tag_set);
 		put_disk(nbd_dev[i].disk);
 	}
+	destroy_workqueue(recv_workqueue);
+out_free_nbd:
 	kfree(nbd_dev);
 	return err;
 }
@@ -1110,9 +1207,11 @@ static void __exit nbd_cleanup(void)
 		if (disk) {
 			del_gendisk(disk);
 			blk_cleanup_queue(disk->queue);
+			blk_mq_free_tag_set(&nbd_dev[i].tag_set);
 			put_disk(disk);
 		}
 	}
+	destroy_workqueue(recv_workqueue);
 	unregister_blkdev(NBD_MAJOR, "nbd");
 	kfree(nbd_dev);
 	printk(KERN_INFO "nbd: unregistered device at major %d\n", NBD_MAJOR);
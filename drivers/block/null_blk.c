@@ -9,6 +9,7 @@
 #include <linux/blk-mq.h>
 #include <linux/hrtimer.h>
 #include <linux/lightnvm.h>
+#include <linux/vmalloc.h>
 
 struct nullb_cmd {
 	struct list_head list;
@@ -19,6 +20,7 @@ struct nullb_cmd {
 	unsigned int tag;
 	struct nullb_queue *nq;
 	struct hrtimer timer;
+	int error;
 };
 
 struct nullb_queue {
@@ -42,6 +44,12 @@ struct nullb {
 	struct nullb_queue *queues;
 	unsigned int nr_queues;
 	char disk_name[DISK_NAME_LEN];
+
+	/* zoned mode: zone state, protected by zone_lock */
+	spinlock_t zone_lock;
+	struct blk_zone *zones;
+	unsigned int nr_zones;
+	sector_t zone_size_sects;
 };
 
 static LIST_HEAD(nullb_list);
@@ -144,6 +152,18 @@ static bool use_per_node_hctx = false;
 module_param(use_per_node_hctx, bool, S_IRUGO);
 MODULE_PARM_DESC(use_per_node_hctx, "Use per-node allocation for hardware context queues. Default: false");
 
+static bool zoned;
+module_param(zoned, bool, S_IRUGO);
+MODULE_PARM_DESC(zoned, "Make device as a host-managed zoned block device. Default: false");
+
+static unsigned long zone_size = 256;
+module_param(zone_size, ulong, S_IRUGO);
+MODULE_PARM_DESC(zone_size, "Zone size in MB when block device is zoned. Must be power-of-two: Default: 256");
+
+static unsigned int zone_nr_conv;
+module_param(zone_nr_conv, uint, S_IRUGO);
+MODULE_PARM_DESC(zone_nr_conv, "Number of conventional zones when block device is zoned. Default: 0");
+
 static void put_tag(struct nullb_queue *nq, unsigned int tag)
 {
 	clear_bit_unlock(tag, nq->tag_map);
@@ -182,6 +202,7 @@ static struct nullb_cmd *__alloc_cmd(struct nullb_queue *nq)
 		cmd = &nq->cmds[tag];
 		cmd->tag = tag;
 		cmd->nq = nq;
+		cmd->error = 0;
 		if (irqmode == NULL_IRQ_TIMER) {
 			hrtimer_init(&cmd->timer, CLOCK_MONOTONIC,
 				     HRTIMER_MODE_REL);
@@ -224,13 +245,14 @@ static void end_cmd(struct nullb_cmd *cmd)
 
 	switch (queue_mode)  {
 	case NULL_Q_MQ:
-		blk_mq_end_request(cmd->rq, 0);
+		blk_mq_end_request(cmd->rq, cmd->error);
 		return;
 	case NULL_Q_RQ:
 		INIT_LIST_HEAD(&cmd->rq->queuelist);
-		blk_end_request_all(cmd->rq, 0);
+		blk_end_request_all(cmd->rq, cmd->error);
 		break;
 	case NULL_Q_BIO:
+		cmd->bio->bi_error = cmd->error;
 		bio_endio(cmd->bio);
 		break;
 	}
@@ -269,8 +291,90 @@ static void null_softirq_done_fn(struct request *rq)
 		end_cmd(rq->special);
 }
 
+/*
+ * Zoned mode: sequential zones are emulated by tracking their write
+ * pointer.  Like on a host-managed drive, a write that doesn't start at
+ * the write pointer of its zone, or that would run past the end of the
+ * zone, fails.
+ */
+static int null_zone_write(struct nullb *nullb, sector_t sector,
+			   unsigned int nr_sectors)
+{
+	unsigned int zno = sector >> ilog2(nullb->zone_size_sects);
+	struct blk_zone *zone = &nullb->zones[zno];
+	int ret = 0;
+
+	if (zone->type == BLK_ZONE_TYPE_CONVENTIONAL)
+		return 0;
+
+	spin_lock(&nullb->zone_lock);
+	if (zone->cond == BLK_ZONE_COND_FULL ||
+	    sector != zone->wp ||
+	    sector + nr_sectors > zone->start + zone->len) {
+		ret = -EIO;
+		goto out;
+	}
+
+	if (zone->cond == BLK_ZONE_COND_EMPTY)
+		zone->cond = BLK_ZONE_COND_IMP_OPEN;
+	zone->wp += nr_sectors;
+	if (zone->wp == zone->start + zone->len)
+		zone->cond = BLK_ZONE_COND_FULL;
+out:
+	spin_unlock(&nullb->zone_lock);
+	return ret;
+}
+
+static int null_zone_reset(struct nullb *nullb, sector_t sector)
+{
+	unsigned int zno = sector >> ilog2(nullb->zone_size_sects);
+	struct blk_zone *zone = &nullb->zones[zno];
+
+	if (zone->type == BLK_ZONE_TYPE_CONVENTIONAL)
+		return -EIO;
+
+	spin_lock(&nullb->zone_lock);
+	zone->cond = BLK_ZONE_COND_EMPTY;
+	zone->wp = zone->start;
+	spin_unlock(&nullb->zone_lock);
+	return 0;
+}
+
+static int null_zone_cmd(struct nullb_cmd *cmd)
+{
+	struct nullb *nullb;
+	unsigned int nr_sectors;
+	sector_t sector;
+	int op;
+
+	if (queue_mode == NULL_Q_BIO) {
+		nullb = cmd->bio->bi_bdev->bd_disk->private_data;
+		op = bio_op(cmd->bio);
+		sector = cmd->bio->bi_iter.bi_sector;
+		nr_sectors = bio_sectors(cmd->bio);
+	} else {
+		nullb = cmd->rq->q->queuedata;
+		op = req_op(cmd->rq);
+		sector = blk_rq_pos(cmd->rq);
+		nr_sectors = blk_rq_sectors(cmd->rq);
+	}
+
+	switch (op) {
+	case REQ_OP_WRITE:
+	case REQ_OP_WRITE_SAME:
+		return null_zone_write(nullb, sector, nr_sectors);
+	case REQ_OP_ZONE_RESET:
+		return null_zone_reset(nullb, sector);
+	default:
+		return 0;
+	}
+}
+
 static inline void null_handle_cmd(struct nullb_cmd *cmd)
 {
+	if (zoned)
+		cmd->error = null_zone_cmd(cmd);
+
 	/* Complete IO by inline, softirq or timer */
 	switch (irqmode) {
 	case NULL_IRQ_SOFTIRQ:
@@ -314,6 +418,10 @@ static blk_qc_t null_queue_bio(struct request_queue *q, struct bio *bio)
 	struct nullb_queue *nq = nullb_to_queue(nullb);
 	struct nullb_cmd *cmd;
 
+	/* Keep writes within a zone, the way request based queues do */
+	if (zoned)
+		blk_queue_split(q, &bio, q->bio_split);
+
 	cmd = alloc_cmd(nq, 1);
 	cmd->bio = bio;
 
@@ -362,6 +470,7 @@ static int null_queue_rq(struct blk_mq_hw_ctx *hctx,
 	}
 	cmd->rq = bd->rq;
 	cmd->nq = hctx->driver_data;
+	cmd->error = 0;
 
 	blk_mq_start_request(bd->rq);
 
@@ -369,6 +478,17 @@ static int null_queue_rq(struct blk_mq_hw_ctx *hctx,
 	return BLK_MQ_RQ_QUEUE_OK;
 }
 
+/*
+ * Completions are delivered inline, from softirq or from the timer, so
+ * there is never anything to reap.  Implementing ->poll still lets
+ * blk_poll() spin, or hybrid sleep, on HIPRI IO the way it would on a
+ * polled device; with irqmode=2 the completion time is completion_nsec.
+ */
+static int null_poll(struct blk_mq_hw_ctx *hctx, unsigned int tag)
+{
+	return 0;
+}
+
 static void null_init_queue(struct nullb *nullb, struct nullb_queue *nq)
 {
 	BUG_ON(!nullb);
@@ -396,6 +516,7 @@ static struct blk_mq_ops null_mq_ops = {
 	.map_queue      = blk_mq_map_queue,
 	.init_hctx	= null_init_hctx,
 	.complete	= null_softirq_done_fn,
+	.poll		= null_poll,
 };
 
 static void cleanup_queue(struct nullb_queue *nq)
@@ -428,6 +549,7 @@ static void null_del_dev(struct nullb *nullb)
 	if (!use_lightnvm)
 		put_disk(nullb->disk);
 	cleanup_queues(nullb);
+	vfree(nullb->zones);
 	kfree(nullb);
 }
 
@@ -577,12 +699,80 @@ static void null_release(struct gendisk *disk, fmode_t mode)
 {
 }
 
+static int null_report_zones(struct gendisk *disk, sector_t sector,
+			     struct blk_zone *zones, unsigned int *nr_zones,
+			     gfp_t gfp_mask)
+{
+	struct nullb *nullb = disk->private_data;
+	unsigned int zno, nrz = 0;
+
+	if (!nullb->zones)
+		return -EOPNOTSUPP;
+
+	zno = sector >> ilog2(nullb->zone_size_sects);
+	if (zno < nullb->nr_zones) {
+		nrz = min_t(unsigned int, *nr_zones, nullb->nr_zones - zno);
+		spin_lock(&nullb->zone_lock);
+		memcpy(zones, &nullb->zones[zno], nrz * sizeof(struct blk_zone));
+		spin_unlock(&nullb->zone_lock);
+	}
+	*nr_zones = nrz;
+
+	return 0;
+}
+
 static const struct block_device_operations null_fops = {
 	.owner =	THIS_MODULE,
 	.open =		null_open,
 	.release =	null_release,
+	.report_zones =	null_report_zones,
 };
 
+/*
+ * Split the device into zones of zone_size MB, the first zone_nr_conv of
+ * them conventional and the others sequential write required, all empty.
+ */
+static int null_zone_init(struct nullb *nullb, sector_t capacity)
+{
+	sector_t sector = 0;
+	unsigned int i;
+
+	nullb->zone_size_sects = zone_size << (20 - 9);
+	nullb->nr_zones = (capacity + nullb->zone_size_sects - 1) >>
+				ilog2(nullb->zone_size_sects);
+	nullb->zones = vzalloc_node(nullb->nr_zones * sizeof(struct blk_zone),
+				    home_node);
+	if (!nullb->zones)
+		return -ENOMEM;
+
+	if (zone_nr_conv >= nullb->nr_zones) {
+		zone_nr_conv = nullb->nr_zones - 1;
+		pr_info("null_blk: changed the number of conventional zones to %u\n",
+			zone_nr_conv);
+	}
+
+	for (i = 0; i < nullb->nr_zones; i++) {
+		struct blk_zone *zone = &nullb->zones[i];
+
+		zone->start = zone->wp = sector;
+		zone->len = min_t(sector_t, nullb->zone_size_sects,
+				  capacity - sector);
+		if (i < zone_nr_conv) {
+			zone->type = BLK_ZONE_TYPE_CONVENTIONAL;
+			zone->cond = BLK_ZONE_COND_NOT_WP;
+		} else {
+			zone->type = BLK_ZONE_TYPE_SEQWRITE_REQ;
+			zone->cond = BLK_ZONE_COND_EMPTY;
+		}
+		sector += nullb->zone_size_sects;
+	}
+
+	nullb->q->limits.zoned = BLK_ZONED_HM;
+	blk_queue_chunk_sectors(nullb->q, nullb->zone_size_sects);
+
+	return 0;
+}
+
 static int setup_commands(struct nullb_queue *nq)
 {
 	struct nullb_cmd *cmd;
@@ -654,6 +844,7 @@ static int null_add_dev(void)
 	}
 
 	spin_lock_init(&nullb->lock);
+	spin_lock_init(&nullb->zone_lock);
 
 	if (queue_mode == NULL_Q_MQ && use_per_node_hctx)
 		submit_queues = nr_online_nodes;
@@ -740,6 +931,14 @@ static int null_add_dev(void)
 	disk->queue		= nullb->q;
 	strncpy(disk->disk_name, nullb->disk_name, DISK_NAME_LEN);
 
+	if (zoned) {
+		rv = null_zone_init(nullb, get_capacity(disk));
+		if (!rv)
+			rv = blk_revalidate_disk_zones(disk);
+		if (rv)
+			goto out_put_disk;
+	}
+
 	add_disk(disk);
 
 done:
@@ -749,6 +948,9 @@ done:
 
 	return 0;
 
+out_put_disk:
+	put_disk(disk);
+	vfree(nullb->zones);
 out_cleanup_lightnvm:
 	if (use_lightnvm)
 		nvm_unregister(nullb->disk_name);
@@ -783,6 +985,16 @@ static int __init null_init(void)
 		bs = 4096;
 	}
 
+	if (zoned && !IS_ENABLED(CONFIG_BLK_DEV_ZONED)) {
+		pr_err("null_blk: CONFIG_BLK_DEV_ZONED not enabled\n");
+		return -EINVAL;
+	}
+
+	if (zoned && (use_lightnvm || !is_power_of_2(zone_size))) {
+		pr_err("null_blk: zoned mode needs a power-of-two zone_size and no LightNVM\n");
+		return -EINVAL;
+	}
+
 	if (use_lightnvm && queue_mode != NULL_Q_MQ) {
 		pr_warn("null_blk: LightNVM only supported for blk-mq\n");
 		pr_warn("null_blk: defaults queue mode to blk-mq\n");
@@ -800,6 +1012,14 @@ static int __init null_init(void)
 	else if (!submit_queues)
 		submit_queues = 1;
 
+	/* mq-deadline keeps the writes of a zone in order on one queue only */
+	if (zoned && queue_mode == NULL_Q_MQ &&
+	    (submit_queues > 1 || use_per_node_hctx)) {
+		pr_warn("null_blk: zoned mode uses a single submit queue\n");
+		submit_queues = 1;
+		use_per_node_hctx = false;
+	}
+
 	mutex_init(&lock);
 
 	null_major = register_blkdev(0, "nullb");
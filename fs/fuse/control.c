@@ -10,6 +10,7 @@
 
 #include <linux/init.h>
 #include <linux/module.h>
+#include <linux/seq_file.h>
 
 #define FUSE_CTL_SUPER_MAGIC 0x65735543
 
@@ -170,6 +171,52 @@ static ssize_t fuse_conn_congestion_threshold_write(struct file *file,
 	return ret;
 }
 
+/*
+ * One line per used CPU input queue: cpu, requests pending now, requests
+ * queued, read and stolen so far, average and maximum time the read
+ * requests spent queued in microseconds
+ */
+static int fuse_conn_queues_show(struct seq_file *m, void *v)
+{
+	struct fuse_conn *fc = fuse_ctl_file_conn_get(m->private);
+	int cpu;
+
+	if (!fc)
+		return 0;
+
+	for_each_possible_cpu(cpu) {
+		struct fuse_iqueue_cpu *cq = per_cpu_ptr(fc->iq.cpu_queues, cpu);
+		unsigned depth;
+		u64 queued, read, stolen, wait_ns, max_wait_ns;
+
+		spin_lock(&cq->lock);
+		depth = cq->depth;
+		queued = cq->queued;
+		read = cq->read;
+		stolen = cq->stolen;
+		wait_ns = cq->wait_ns;
+		max_wait_ns = cq->max_wait_ns;
+		spin_unlock(&cq->lock);
+
+		if (!queued)
+			continue;
+		if (read)
+			wait_ns = div64_u64(wait_ns, read);
+		seq_printf(m, "%d %u %llu %llu %llu %llu %llu\n", cpu, depth,
+			   queued, read, stolen,
+			   div_u64(wait_ns, NSEC_PER_USEC),
+			   div_u64(max_wait_ns, NSEC_PER_USEC));
+	}
+	fuse_conn_put(fc);
+
+	return 0;
+}
+
+static int fuse_conn_queues_open(struct inode *inode, struct file *file)
+{
+	return single_open(file, fuse_conn_queues_show, file);
+}
+
 static const struct file_operations fuse_ctl_abort_ops = {
 	.open = nonseekable_open,
 	.write = fuse_conn_abort_write,
@@ -182,6 +229,13 @@ static const struct file_operations fuse_ctl_waiting_ops = {
 	.llseek = no_llseek,
 };
 
+static const struct file_operations fuse_ctl_queues_ops = {
+	.open = fuse_conn_queues_open,
+	.read = seq_read,
+	.llseek = seq_lseek,
+	.release = single_release,
+};
+
 static const struct file_operations fuse_conn_max_background_ops = {
 	.open = nonseekable_open,
 	.read = fuse_conn_max_background_read,
@@ -260,7 +314,9 @@ int fuse_ctl_add_conn(struct fuse_conn *fc)
 				 1, NULL, &fuse_conn_max_background_ops) ||
 	    !fuse_ctl_add_dentry(parent, fc, "congestion_threshold",
 				 S_IFREG | 0600, 1, NULL,
-				 &fuse_conn_congestion_threshold_ops))
+				 &fuse_conn_congestion_threshold_ops) ||
+	    !fuse_ctl_add_dentry(parent, fc, "queues", S_IFREG | 0400, 1,
+				 NULL, &fuse_ctl_queues_ops))
 		goto err;
 
 	return 0;
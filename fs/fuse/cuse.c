@@ -498,17 +498,21 @@ static int cuse_channel_open(struct inode *inode, struct file *file)
 	if (!cc)
 		return -ENOMEM;
 
-	fuse_conn_init(&cc->fc);
-
-	fud = fuse_dev_alloc(&cc->fc);
-	if (!fud) {
+	rc = fuse_conn_init(&cc->fc);
+	if (rc) {
 		kfree(cc);
-		return -ENOMEM;
+		return rc;
 	}
 
 	INIT_LIST_HEAD(&cc->list);
 	cc->fc.release = cuse_fc_release;
 
+	fud = fuse_dev_alloc(&cc->fc);
+	if (!fud) {
+		fuse_conn_put(&cc->fc);
+		return -ENOMEM;
+	}
+
 	cc->fc.initialized = 1;
 	rc = cuse_send_init(cc);
 	if (rc) {
@@ -299,18 +299,212 @@ static unsigned len_args(unsigned numargs, struct fuse_arg *args)
 	return nbytes;
 }
 
+/* Unique ID for interrupts and forgets, called with fiq->waitq.lock held */
 static u64 fuse_get_unique(struct fuse_iqueue *fiq)
 {
-	return ++fiq->reqctr;
+	return (++fiq->reqctr << FUSE_IQ_CPU_SHIFT) | FUSE_IQ_SHARED;
 }
 
-static void queue_request(struct fuse_iqueue *fiq, struct fuse_req *req)
+static struct fuse_iqueue_cpu *fuse_iq_cpu(struct fuse_iqueue *fiq, int cpu)
 {
+	return per_cpu_ptr(fiq->cpu_queues, cpu);
+}
+
+/*
+ * Next CPU in @mask after @prev, going round from @start and stopping
+ * before getting back to it.  Returns nr_cpu_ids at the end.
+ */
+static int fuse_iq_next_cpu(const struct cpumask *mask, int start, int prev)
+{
+	int next = cpumask_next(prev, mask);
+
+	if (prev < start)
+		return next < start ? next : nr_cpu_ids;
+	if (next < nr_cpu_ids)
+		return next;
+	next = cpumask_first(mask);
+	return next < start ? next : nr_cpu_ids;
+}
+
+#define for_each_fiq_cpu_from(cpu, mask, start)				\
+	for ((cpu) = fuse_iq_next_cpu((mask), (start), (start));	\
+	     (cpu) < nr_cpu_ids;					\
+	     (cpu) = fuse_iq_next_cpu((mask), (start), (cpu)))
+
+static int forget_pending(struct fuse_iqueue *fiq)
+{
+	return fiq->forget_list_head.next != NULL;
+}
+
+static int request_pending(struct fuse_iqueue *fiq)
+{
+	return !cpumask_empty(fiq->pending_mask) ||
+		!list_empty(&fiq->interrupts) || forget_pending(fiq);
+}
+
+/*
+ * Wake up a reader for something just queued on @cpu's queue or on the
+ * shared lists.  Prefer a reader sleeping on @cpu, else kick an idle
+ * one elsewhere, which will then steal the request.
+ */
+static void fuse_iqueue_wake(struct fuse_iqueue *fiq, int cpu)
+{
+	struct fuse_iqueue_cpu *cq = fuse_iq_cpu(fiq, cpu);
+	int i;
+
+	/* Pairs with the barriers in fuse_iqueue_wait() and fuse_dev_poll() */
+	smp_mb();
+	if (waitqueue_active(&fiq->waitq))
+		wake_up(&fiq->waitq);
+	if (waitqueue_active(&cq->waitq)) {
+		wake_up(&cq->waitq);
+		return;
+	}
+	/* Bits are only cleared by the sleepers, see fuse_iqueue_wait() */
+	for_each_fiq_cpu_from(i, fiq->idle_mask, cpu) {
+		cq = fuse_iq_cpu(fiq, i);
+		if (waitqueue_active(&cq->waitq)) {
+			wake_up(&cq->waitq);
+			return;
+		}
+	}
+}
+
+/*
+ * Wait on @cpu's queue for something to read.  The idle bit is set after
+ * getting on the wait queue and before checking for work, so a waker
+ * that misses us in the mask has made its work visible to us.
+ */
+static int fuse_iqueue_wait(struct fuse_iqueue *fiq, int cpu)
+{
+	struct fuse_iqueue_cpu *cq = fuse_iq_cpu(fiq, cpu);
+	DEFINE_WAIT(wait);
+	int err = 0;
+
+	for (;;) {
+		prepare_to_wait_exclusive(&cq->waitq, &wait, TASK_INTERRUPTIBLE);
+		cpumask_set_cpu(cpu, fiq->idle_mask);
+		smp_mb__after_atomic();
+		if (!fiq->connected || request_pending(fiq))
+			break;
+		if (signal_pending(current)) {
+			err = -ERESTARTSYS;
+			break;
+		}
+		schedule();
+	}
+	finish_wait(&cq->waitq, &wait);
+
+	/*
+	 * The last sleeper to leave clears the idle bit.  Check again after
+	 * clearing it: another reader may have just gone to sleep here and
+	 * set the bit before we cleared it.
+	 */
+	if (!waitqueue_active(&cq->waitq)) {
+		cpumask_clear_cpu(cpu, fiq->idle_mask);
+		smp_mb__after_atomic();
+		if (waitqueue_active(&cq->waitq))
+			cpumask_set_cpu(cpu, fiq->idle_mask);
+	}
+
+	/* Don't swallow an exclusive wakeup meant for a reader */
+	if (err && request_pending(fiq))
+		fuse_iqueue_wake(fiq, cpu);
+
+	return err;
+}
+
+/*
+ * Add a request to the input queue of the current CPU.  A zero @unique
+ * allocates a new ID.  Returns false if the connection is gone.
+ */
+static bool queue_request(struct fuse_iqueue *fiq, struct fuse_req *req,
+			  u64 unique)
+{
+	int cpu = raw_smp_processor_id();
+	struct fuse_iqueue_cpu *cq = fuse_iq_cpu(fiq, cpu);
+
 	req->in.h.len = sizeof(struct fuse_in_header) +
 		len_args(req->in.numargs, (struct fuse_arg *) req->in.args);
-	list_add_tail(&req->list, &fiq->pending);
-	wake_up_locked(&fiq->waitq);
+
+	spin_lock(&cq->lock);
+	if (!fiq->connected) {
+		spin_unlock(&cq->lock);
+		return false;
+	}
+	if (!unique)
+		unique = (++cq->reqctr << FUSE_IQ_CPU_SHIFT) | cpu;
+	req->in.h.unique = unique;
+	req->iq_cpu = cpu;
+	req->queue_time = ktime_get_ns();
+	if (list_empty(&cq->pending))
+		cpumask_set_cpu(cpu, fiq->pending_mask);
+	list_add_tail(&req->list, &cq->pending);
+	cq->depth++;
+	cq->queued++;
+	spin_unlock(&cq->lock);
+
+	fuse_iqueue_wake(fiq, cpu);
 	kill_fasync(&fiq->fasync, SIGIO, POLL_IN);
+	return true;
+}
+
+/* Called with the queue's lock held */
+static void fuse_iqueue_unlink(struct fuse_iqueue *fiq,
+			       struct fuse_iqueue_cpu *cq, struct fuse_req *req)
+{
+	list_del_init(&req->list);
+	cq->depth--;
+	if (list_empty(&cq->pending))
+		cpumask_clear_cpu(req->iq_cpu, fiq->pending_mask);
+}
+
+/* Take the oldest request off @qcpu's queue for a reader on @cpu */
+static struct fuse_req *fuse_iqueue_take(struct fuse_iqueue *fiq, int qcpu,
+					 int cpu)
+{
+	struct fuse_iqueue_cpu *cq = fuse_iq_cpu(fiq, qcpu);
+	struct fuse_req *req = NULL;
+	u64 wait;
+
+	if (list_empty(&cq->pending))
+		return NULL;
+
+	spin_lock(&cq->lock);
+	if (!list_empty(&cq->pending)) {
+		req = list_first_entry(&cq->pending, struct fuse_req, list);
+		clear_bit(FR_PENDING, &req->flags);
+		fuse_iqueue_unlink(fiq, cq, req);
+
+		wait = ktime_get_ns() - req->queue_time;
+		cq->read++;
+		cq->wait_ns += wait;
+		if (wait > cq->max_wait_ns)
+			cq->max_wait_ns = wait;
+		if (qcpu != cpu)
+			cq->stolen++;
+	}
+	spin_unlock(&cq->lock);
+
+	return req;
+}
+
+/* Own queue first, then steal from the others */
+static struct fuse_req *fuse_iqueue_dequeue(struct fuse_iqueue *fiq, int cpu)
+{
+	struct fuse_req *req;
+	int i;
+
+	req = fuse_iqueue_take(fiq, cpu, cpu);
+	if (req)
+		return req;
+
+	for_each_fiq_cpu_from(i, fiq->pending_mask, cpu) {
+		req = fuse_iqueue_take(fiq, i, cpu);
+		if (req)
+			return req;
+	}
+	return NULL;
 }
 
 void fuse_queue_forget(struct fuse_conn *fc, struct fuse_forget_link *forget,
@@ -325,12 +519,13 @@ void fuse_queue_forget(struct fuse_conn *fc, struct fuse_forget_link *forget,
 	if (fiq->connected) {
 		fiq->forget_list_tail->next = forget;
 		fiq->forget_list_tail = forget;
-		wake_up_locked(&fiq->waitq);
+		spin_unlock(&fiq->waitq.lock);
+		fuse_iqueue_wake(fiq, raw_smp_processor_id());
 		kill_fasync(&fiq->fasync, SIGIO, POLL_IN);
 	} else {
+		spin_unlock(&fiq->waitq.lock);
 		kfree(forget);
 	}
-	spin_unlock(&fiq->waitq.lock);
 }
 
 static void flush_bg_queue(struct fuse_conn *fc)
@@ -343,10 +538,11 @@ static void flush_bg_queue(struct fuse_conn *fc)
 		req = list_entry(fc->bg_queue.next, struct fuse_req, list);
 		list_del(&req->list);
 		fc->active_background++;
-		spin_lock(&fiq->waitq.lock);
-		req->in.h.unique = fuse_get_unique(fiq);
-		queue_request(fiq, req);
-		spin_unlock(&fiq->waitq.lock);
+		/*
+		 * Can't fail: the input queue is only disconnected under
+		 * fc->lock, after the background queue has been flushed
+		 */
+		queue_request(fiq, req, 0);
 	}
 }
 
@@ -398,18 +594,23 @@ static void request_end(struct fuse_conn *fc, struct fuse_req *req)
 
 static void queue_interrupt(struct fuse_iqueue *fiq, struct fuse_req *req)
 {
+	bool queued = false;
+
 	spin_lock(&fiq->waitq.lock);
 	if (list_empty(&req->intr_entry)) {
 		list_add_tail(&req->intr_entry, &fiq->interrupts);
-		wake_up_locked(&fiq->waitq);
+		queued = true;
 	}
 	spin_unlock(&fiq->waitq.lock);
+	if (queued)
+		fuse_iqueue_wake(fiq, raw_smp_processor_id());
 	kill_fasync(&fiq->fasync, SIGIO, POLL_IN);
 }
 
 static void request_wait_answer(struct fuse_conn *fc, struct fuse_req *req)
 {
 	struct fuse_iqueue *fiq = &fc->iq;
+	struct fuse_iqueue_cpu *cq;
 	int err;
 
 	if (!fc->no_interrupt) {
@@ -433,16 +634,17 @@ static void request_wait_answer(struct fuse_conn *fc, struct fuse_req *req)
 		if (!err)
 			return;
 
-		spin_lock(&fiq->waitq.lock);
+		cq = fuse_iq_cpu(fiq, req->iq_cpu);
+		spin_lock(&cq->lock);
 		/* Request is not yet in userspace, bail out */
 		if (test_bit(FR_PENDING, &req->flags)) {
-			list_del(&req->list);
-			spin_unlock(&fiq->waitq.lock);
+			fuse_iqueue_unlink(fiq, cq, req);
+			spin_unlock(&cq->lock);
 			__fuse_put_request(req);
 			req->out.h.error = -EINTR;
 			return;
 		}
-		spin_unlock(&fiq->waitq.lock);
+		spin_unlock(&cq->lock);
 	}
 
 	/*
@@ -457,18 +659,13 @@ static void __fuse_request_send(struct fuse_conn *fc, struct fuse_req *req)
 	struct fuse_iqueue *fiq = &fc->iq;
 
 	BUG_ON(test_bit(FR_BACKGROUND, &req->flags));
-	spin_lock(&fiq->waitq.lock);
-	if (!fiq->connected) {
-		spin_unlock(&fiq->waitq.lock);
+	/* acquire extra reference, since request is still needed
+	   after request_end() */
+	__fuse_get_request(req);
+	if (!queue_request(fiq, req, 0)) {
+		__fuse_put_request(req);
 		req->out.h.error = -ENOTCONN;
 	} else {
-		req->in.h.unique = fuse_get_unique(fiq);
-		queue_request(fiq, req);
-		/* acquire extra reference, since request is still needed
-		   after request_end() */
-		__fuse_get_request(req);
-		spin_unlock(&fiq->waitq.lock);
-
 		request_wait_answer(fc, req);
 		/* Pairs with smp_wmb() in request_end() */
 		smp_rmb();
@@ -596,19 +793,13 @@ EXPORT_SYMBOL_GPL(fuse_request_send_background);
 static int fuse_request_send_notify_reply(struct fuse_conn *fc,
 					  struct fuse_req *req, u64 unique)
 {
-	int err = -ENODEV;
 	struct fuse_iqueue *fiq = &fc->iq;
 
 	__clear_bit(FR_ISREPLY, &req->flags);
-	req->in.h.unique = unique;
-	spin_lock(&fiq->waitq.lock);
-	if (fiq->connected) {
-		queue_request(fiq, req);
-		err = 0;
-	}
-	spin_unlock(&fiq->waitq.lock);
+	if (!queue_request(fiq, req, unique))
+		return -ENODEV;
 
-	return err;
+	return 0;
 }
 
 void fuse_force_forget(struct file *file, u64 nodeid)
@@ -1034,17 +1225,6 @@ static int fuse_copy_args(struct fuse_copy_state *cs, unsigned numargs,
 	return err;
 }
 
-static int forget_pending(struct fuse_iqueue *fiq)
-{
-	return fiq->forget_list_head.next != NULL;
-}
-
-static int request_pending(struct fuse_iqueue *fiq)
-{
-	return !list_empty(&fiq->pending) || !list_empty(&fiq->interrupts) ||
-		forget_pending(fiq);
-}
-
 /*
  * Transfer an interrupt request to userspace
  *
@@ -1202,7 +1382,9 @@ __releases(fiq->waitq.lock)
 /*
  * Read a single request into the userspace filesystem's buffer.  This
  * function waits until a request is available, then removes it from
- * the pending list and copies request data to userspace buffer.  If
+ * the pending list and copies request data to userspace buffer.
+ * Requests queued on the reader's CPU are served first, then those of
+ * other CPUs, so a daemon thread per CPU mostly stays local.  If
  * no reply is needed (FORGET) or request has been aborted or there
  * was an error during the copying then it's finished by calling
  * request_end().  Otherwise add it to the processing list, and set
@@ -1218,42 +1400,47 @@ static ssize_t fuse_dev_do_read(struct fuse_dev *fud, struct file *file,
 	struct fuse_req *req;
 	struct fuse_in *in;
 	unsigned reqsize;
+	int cpu;
 
  restart:
-	spin_lock(&fiq->waitq.lock);
-	err = -EAGAIN;
-	if ((file->f_flags & O_NONBLOCK) && fiq->connected &&
-	    !request_pending(fiq))
-		goto err_unlock;
+	cpu = raw_smp_processor_id();
+	for (;;) {
+		if (!fiq->connected)
+			return -ENODEV;
+
+		if (!list_empty(&fiq->interrupts) || forget_pending(fiq)) {
+			spin_lock(&fiq->waitq.lock);
+			if (!list_empty(&fiq->interrupts)) {
+				req = list_entry(fiq->interrupts.next,
+						 struct fuse_req, intr_entry);
+				return fuse_read_interrupt(fiq, cs, nbytes,
+							   req);
+			}
 
-	err = wait_event_interruptible_exclusive_locked(fiq->waitq,
-				!fiq->connected || request_pending(fiq));
-	if (err)
-		goto err_unlock;
+			if (forget_pending(fiq)) {
+				if (cpumask_empty(fiq->pending_mask) ||
+				    fiq->forget_batch-- > 0)
+					return fuse_read_forget(fc, fiq, cs,
+								nbytes);
 
-	err = -ENODEV;
-	if (!fiq->connected)
-		goto err_unlock;
+				if (fiq->forget_batch <= -8)
+					fiq->forget_batch = 16;
+			}
+			spin_unlock(&fiq->waitq.lock);
+		}
 
-	if (!list_empty(&fiq->interrupts)) {
-		req = list_entry(fiq->interrupts.next, struct fuse_req,
-				 intr_entry);
-		return fuse_read_interrupt(fiq, cs, nbytes, req);
-	}
+		req = fuse_iqueue_dequeue(fiq, cpu);
+		if (req)
+			break;
 
-	if (forget_pending(fiq)) {
-		if (list_empty(&fiq->pending) || fiq->forget_batch-- > 0)
-			return fuse_read_forget(fc, fiq, cs, nbytes);
+		if (file->f_flags & O_NONBLOCK)
+			return -EAGAIN;
 
-		if (fiq->forget_batch <= -8)
-			fiq->forget_batch = 16;
+		err = fuse_iqueue_wait(fiq, cpu);
+		if (err)
+			return err;
 	}
 
-	req = list_entry(fiq->pending.next, struct fuse_req, list);
-	clear_bit(FR_PENDING, &req->flags);
-	list_del_init(&req->list);
-	spin_unlock(&fiq->waitq.lock);
-
 	in = &req->in;
 	reqsize = in->h.len;
 	/* If request is too large, reply with an error and restart the read */
@@ -1304,10 +1491,6 @@ out_end:
 	spin_unlock(&fpq->lock);
 	request_end(fc, req);
 	return err;
-
- err_unlock:
-	spin_unlock(&fiq->waitq.lock);
-	return err;
 }
 
 static int fuse_dev_open(struct inode *inode, struct file *file)
@@ -2035,6 +2218,8 @@ static unsigned fuse_dev_poll(struct file *file, poll_table *wait)
 
 	fiq = &fud->fc->iq;
 	poll_wait(file, &fiq->waitq, wait);
+	/* Pairs with smp_mb() in fuse_iqueue_wake() */
+	smp_mb();
 
 	spin_lock(&fiq->waitq.lock);
 	if (!fiq->connected)
@@ -2107,6 +2292,7 @@ void fuse_abort_conn(struct fuse_conn *fc)
 		struct fuse_req *req, *next;
 		LIST_HEAD(to_end1);
 		LIST_HEAD(to_end2);
+		int cpu;
 
 		fc->connected = 0;
 		fc->blocked = 0;
@@ -2134,11 +2320,21 @@ void fuse_abort_conn(struct fuse_conn *fc)
 
 		spin_lock(&fiq->waitq.lock);
 		fiq->connected = 0;
-		list_splice_init(&fiq->pending, &to_end2);
+		for_each_possible_cpu(cpu) {
+			struct fuse_iqueue_cpu *cq = fuse_iq_cpu(fiq, cpu);
+
+			spin_lock(&cq->lock);
+			list_splice_tail_init(&cq->pending, &to_end2);
+			cq->depth = 0;
+			cpumask_clear_cpu(cpu, fiq->pending_mask);
+			spin_unlock(&cq->lock);
+		}
 		while (forget_pending(fiq))
 			kfree(dequeue_forget(fiq, 1, NULL));
 		wake_up_all_locked(&fiq->waitq);
 		spin_unlock(&fiq->waitq.lock);
+		for_each_possible_cpu(cpu)
+			wake_up_all(&fuse_iq_cpu(fiq, cpu)->waitq);
 		kill_fasync(&fiq->fasync, SIGIO, POLL_IN);
 		end_polls(fc);
 		wake_up_all(&fc->blocked_waitq);
@@ -2238,7 +2434,30 @@ static long fuse_dev_ioctl(struct file *file, unsigned int cmd,
 				fput(old);
 			}
 		}
+	} else if (cmd == FUSE_DEV_IOC_BACKING_OPEN) {
+		struct fuse_dev *fud = fuse_get_dev(file);
+		struct fuse_backing_map map;
+
+		err = -EPERM;
+		if (!fud)
+			goto out;
+
+		err = -EFAULT;
+		if (!copy_from_user(&map, (void __user *) arg, sizeof(map)))
+			err = fuse_backing_open(fud->fc, &map);
+	} else if (cmd == FUSE_DEV_IOC_BACKING_CLOSE) {
+		struct fuse_dev *fud = fuse_get_dev(file);
+		u32 backing_id;
+
+		err = -EPERM;
+		if (!fud)
+			goto out;
+
+		err = -EFAULT;
+		if (!get_user(backing_id, (__u32 __user *) arg))
+			err = fuse_backing_close(fud->fc, backing_id);
 	}
+ out:
 	return err;
 }
 
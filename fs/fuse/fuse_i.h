@@ -23,6 +23,9 @@
 #include <linux/poll.h>
 #include <linux/workqueue.h>
 #include <linux/kref.h>
+#include <linux/idr.h>
+#include <linux/cpumask.h>
+#include <linux/percpu.h>
 
 /** Max number of pages that can be used in a single read request */
 #define FUSE_MAX_PAGES_PER_REQ 32
@@ -34,7 +37,7 @@
 #define FUSE_NAME_MAX 1024
 
 /** Number of dentries for each connection in the control filesystem */
-#define FUSE_CTL_NUM_DENTRIES 5
+#define FUSE_CTL_NUM_DENTRIES 6
 
 /** If the FUSE_DEFAULT_PERMISSIONS flag is given, the filesystem
     module will check permissions based on the file mode.  Otherwise no
@@ -150,6 +153,12 @@ struct fuse_file {
 	/** FOPEN_* flags returned by open */
 	u32 open_flags;
 
+	/** Backing file ID returned by open with FOPEN_PASSTHROUGH */
+	u32 backing_id;
+
+	/** File that reads, writes and mmap are passed through to */
+	struct file *backing_file;
+
 	/** Entry on inode's write_files list */
 	struct list_head write_entry;
 
@@ -319,6 +328,12 @@ struct fuse_req {
 	/** Unique ID for the interrupt request */
 	u64 intr_unique;
 
+	/** CPU whose input queue the request was added to */
+	int iq_cpu;
+
+	/** Time the request was queued, for the input queue statistics */
+	u64 queue_time;
+
 	/* Request flags, updated with test/set/clear_bit() */
 	unsigned long flags;
 
@@ -389,18 +404,72 @@ struct fuse_req {
 	struct file *stolen_file;
 };
 
+/*
+ * Request unique IDs carry the number of the input queue that allocated
+ * them in the low bits, so that the per-CPU counters never collide.
+ * Interrupts and forgets are numbered from the shared slot.
+ */
+#define FUSE_IQ_CPU_SHIFT 16
+#define FUSE_IQ_SHARED ((1 << FUSE_IQ_CPU_SHIFT) - 1)
+
+/**
+ * Per-CPU input queue
+ *
+ * Requests are added to the queue of the CPU they are issued on, and
+ * daemon threads read from the queue of the CPU they run on, stealing
+ * from other queues when their own is empty.
+ */
+struct fuse_iqueue_cpu {
+	/** Protects the fields below, except waitq */
+	spinlock_t lock;
+
+	/** The list of pending requests */
+	struct list_head pending;
+
+	/** Readers running on this CPU sleep here */
+	wait_queue_head_t waitq;
+
+	/** The next unique request id of this queue */
+	u64 reqctr;
+
+	/** Number of requests on the pending list */
+	unsigned depth;
+
+	/** Requests ever added to this queue */
+	u64 queued;
+
+	/** Requests handed to readers */
+	u64 read;
+
+	/** Of those, requests taken by readers running on another CPU */
+	u64 stolen;
+
+	/** Total and maximum time read requests spent on the pending list */
+	u64 wait_ns;
+	u64 max_wait_ns;
+};
+
 struct fuse_iqueue {
 	/** Connection established */
 	unsigned connected;
 
-	/** Readers of the connection are waiting on this */
+	/**
+	 * Protects the shared lists below; pollers of the connection
+	 * are waiting on this
+	 */
 	wait_queue_head_t waitq;
 
-	/** The next unique request id */
+	/** The next unique id for interrupts and forgets */
 	u64 reqctr;
 
-	/** The list of pending requests */
-	struct list_head pending;
+	/** Per-CPU queues of pending requests */
+	struct fuse_iqueue_cpu __percpu *cpu_queues;
+
+	/** CPUs whose queue has pending requests */
+	cpumask_var_t pending_mask;
+
+	/** CPUs whose queue may have readers sleeping on it */
+	cpumask_var_t idle_mask;
 
 	/** Pending interrupts */
 	struct list_head interrupts;
@@ -547,6 +616,9 @@ struct fuse_conn {
 	/** allow parallel lookups and readdir (default is serialized) */
 	unsigned parallel_dirops:1;
 
+	/** Pass file I/O through to backing files.  Only set in INIT */
+	unsigned passthrough:1;
+
 	/*
 	 * The following bitfields are only for optimization purposes
 	 * and hence races in setting them will not cause malfunction
@@ -665,6 +737,9 @@ struct fuse_conn {
 
 	/** List of device instances belonging to this connection */
 	struct list_head devices;
+
+	/** Backing files registered for passthrough, protected by lock */
+	struct idr backing_files_map;
 };
 
 static inline struct fuse_conn *get_fuse_conn_super(struct super_block *sb)
@@ -870,7 +945,7 @@ struct fuse_conn *fuse_conn_get(struct fuse_conn *fc);
 /**
  * Initialize fuse_conn
  */
-void fuse_conn_init(struct fuse_conn *fc);
+int fuse_conn_init(struct fuse_conn *fc);
 
 /**
  * Release reference to fuse_conn
@@ -966,4 +1041,14 @@ void fuse_set_initialized(struct fuse_conn *fc);
 void fuse_unlock_inode(struct inode *inode);
 void fuse_lock_inode(struct inode *inode);
 
+/* passthrough.c */
+int fuse_backing_open(struct fuse_conn *fc, struct fuse_backing_map *map);
+int fuse_backing_close(struct fuse_conn *fc, u32 backing_id);
+void fuse_backing_files_free(struct fuse_conn *fc);
+void fuse_passthrough_setup(struct fuse_conn *fc, struct fuse_file *ff);
+ssize_t fuse_passthrough_read_iter(struct kiocb *iocb, struct iov_iter *to);
+ssize_t fuse_passthrough_write_iter(struct kiocb *iocb,
+				    struct iov_iter *from);
+int fuse_passthrough_mmap(struct file *file, struct vm_area_struct *vma);
+
 #endif /* _FS_FUSE_I_H */
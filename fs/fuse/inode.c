@@ -581,14 +581,42 @@ static int fuse_show_options(struct seq_file *m, struct dentry *root)
 	return 0;
 }
 
-static void fuse_iqueue_init(struct fuse_iqueue *fiq)
+static void fuse_iqueue_free(struct fuse_iqueue *fiq)
 {
+	free_cpumask_var(fiq->idle_mask);
+	free_cpumask_var(fiq->pending_mask);
+	free_percpu(fiq->cpu_queues);
+}
+
+static int fuse_iqueue_init(struct fuse_iqueue *fiq)
+{
+	int cpu;
+
+	BUILD_BUG_ON(NR_CPUS >= FUSE_IQ_SHARED);
+
 	memset(fiq, 0, sizeof(struct fuse_iqueue));
 	init_waitqueue_head(&fiq->waitq);
-	INIT_LIST_HEAD(&fiq->pending);
 	INIT_LIST_HEAD(&fiq->interrupts);
 	fiq->forget_list_tail = &fiq->forget_list_head;
+
+	fiq->cpu_queues = alloc_percpu(struct fuse_iqueue_cpu);
+	if (!fiq->cpu_queues ||
+	    !zalloc_cpumask_var(&fiq->pending_mask, GFP_KERNEL) ||
+	    !zalloc_cpumask_var(&fiq->idle_mask, GFP_KERNEL)) {
+		fuse_iqueue_free(fiq);
+		return -ENOMEM;
+	}
+
+	for_each_possible_cpu(cpu) {
+		struct fuse_iqueue_cpu *cq = per_cpu_ptr(fiq->cpu_queues, cpu);
+
+		spin_lock_init(&cq->lock);
+		INIT_LIST_HEAD(&cq->pending);
+		init_waitqueue_head(&cq->waitq);
+	}
 	fiq->connected = 1;
+
+	return 0;
 }
 
 static void fuse_pqueue_init(struct fuse_pqueue *fpq)
@@ -600,19 +628,25 @@ static void fuse_pqueue_init(struct fuse_pqueue *fpq)
 	fpq->connected = 1;
 }
 
-void fuse_conn_init(struct fuse_conn *fc)
+int fuse_conn_init(struct fuse_conn *fc)
 {
+	int err;
+
 	memset(fc, 0, sizeof(*fc));
+	err = fuse_iqueue_init(&fc->iq);
+	if (err)
+		return err;
+
 	spin_lock_init(&fc->lock);
 	init_rwsem(&fc->killsb);
 	atomic_set(&fc->count, 1);
 	atomic_set(&fc->dev_count, 1);
 	init_waitqueue_head(&fc->blocked_waitq);
 	init_waitqueue_head(&fc->reserved_req_waitq);
-	fuse_iqueue_init(&fc->iq);
 	INIT_LIST_HEAD(&fc->bg_queue);
 	INIT_LIST_HEAD(&fc->entry);
 	INIT_LIST_HEAD(&fc->devices);
+	idr_init(&fc->backing_files_map);
 	atomic_set(&fc->num_waiting, 0);
 	fc->max_background = FUSE_DEFAULT_MAX_BACKGROUND;
 	fc->congestion_threshold = FUSE_DEFAULT_CONGESTION_THRESHOLD;
@@ -623,6 +657,8 @@ void fuse_conn_init(struct fuse_conn *fc)
 	fc->connected = 1;
 	fc->attr_version = 1;
 	get_random_bytes(&fc->scramble_key, sizeof(fc->scramble_key));
+
+	return 0;
 }
 EXPORT_SYMBOL_GPL(fuse_conn_init);
 
@@ -631,6 +667,8 @@ void fuse_conn_put(struct fuse_conn *fc)
 	if (atomic_dec_and_test(&fc->count)) {
 		if (fc->destroy_req)
 			fuse_request_free(fc->destroy_req);
+		fuse_iqueue_free(&fc->iq);
+		fuse_backing_files_free(fc);
 		fc->release(fc);
 	}
 }
@@ -910,6 +948,11 @@ static void process_init_reply(struct fuse_conn *fc, struct fuse_req *req)
 				fc->writeback_cache = 1;
 			if (arg->flags & FUSE_PARALLEL_DIROPS)
 				fc->parallel_dirops = 1;
+			if (arg->flags & FUSE_PASSTHROUGH) {
+				fc->passthrough = 1;
+				/* Backing files mustn't be stacked themselves */
+				fc->sb->s_stack_depth = 1;
+			}
 			if (arg->time_gran && arg->time_gran <= 1000000000)
 				fc->sb->s_time_gran = arg->time_gran;
 		} else {
@@ -941,7 +984,7 @@ static void fuse_send_init(struct fuse_conn *fc, struct fuse_req *req)
 		FUSE_FLOCK_LOCKS | FUSE_HAS_IOCTL_DIR | FUSE_AUTO_INVAL_DATA |
 		FUSE_DO_READDIRPLUS | FUSE_READDIRPLUS_AUTO | FUSE_ASYNC_DIO |
 		FUSE_WRITEBACK_CACHE | FUSE_NO_OPEN_SUPPORT |
-		FUSE_PARALLEL_DIROPS;
+		FUSE_PARALLEL_DIROPS | FUSE_PASSTHROUGH;
 	req->in.h.opcode = FUSE_INIT;
 	req->in.numargs = 1;
 	req->in.args[0].size = sizeof(*arg);
@@ -1089,7 +1132,11 @@ static int fuse_fill_super(struct super_block *sb, void *data, int silent)
 	if (!fc)
 		goto err_fput;
 
-	fuse_conn_init(fc);
+	err = fuse_conn_init(fc);
+	if (err) {
+		kfree(fc);
+		goto err_fput;
+	}
 	fc->release = fuse_free_conn;
 
 	fud = fuse_dev_alloc(fc);
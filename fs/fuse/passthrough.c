@@ -0,0 +1,303 @@
+/*
+  FUSE: Filesystem in Userspace
+  Passthrough of file I/O to backing files
+
+  This program can be distributed under the terms of the GNU GPL.
+  See the file COPYING.
+*/
+
+#include "fuse_i.h"
+
+#include <linux/file.h>
+#include <linux/fs.h>
+#include <linux/cred.h>
+#include <linux/uio.h>
+#include <linux/mm.h>
+
+/*
+ * Register an open file of the daemon as backing file.  The returned ID
+ * can then be passed in the reply of OPEN or CREATE with
+ * FOPEN_PASSTHROUGH.  The file is accessed with the daemon's credentials
+ * at the time it was opened, so only a privileged daemon may do this.
+ */
+int fuse_backing_open(struct fuse_conn *fc, struct fuse_backing_map *map)
+{
+	struct file *file;
+	int res;
+
+	res = -EPERM;
+	if (!fc->passthrough || !capable(CAP_SYS_ADMIN))
+		goto out;
+
+	res = -EINVAL;
+	if (map->flags || map->padding)
+		goto out;
+
+	res = -EBADF;
+	file = fget(map->fd);
+	if (!file)
+		goto out;
+
+	res = -EINVAL;
+	if (!S_ISREG(file_inode(file)->i_mode) ||
+	    !file->f_op->read_iter || !file->f_op->write_iter)
+		goto out_fput;
+
+	/* The access mode is checked here, the I/O paths don't check it */
+	res = -EBADF;
+	if (!(file->f_mode & FMODE_READ))
+		goto out_fput;
+
+	/* No passthrough to overlayfs, ecryptfs or another passthrough fuse */
+	res = -ELOOP;
+	if (file_inode(file)->i_sb->s_stack_depth)
+		goto out_fput;
+
+	idr_preload(GFP_KERNEL);
+	spin_lock(&fc->lock);
+	res = idr_alloc_cyclic(&fc->backing_files_map, file, 1, 0, GFP_ATOMIC);
+	spin_unlock(&fc->lock);
+	idr_preload_end();
+	if (res < 0)
+		goto out_fput;
+
+	return res;
+
+out_fput:
+	fput(file);
+out:
+	return res;
+}
+
+/*
+ * Drop a backing file registration.  Files already opened with it keep
+ * their own reference.
+ */
+int fuse_backing_close(struct fuse_conn *fc, u32 backing_id)
+{
+	struct file *file;
+
+	if (!fc->passthrough || !capable(CAP_SYS_ADMIN))
+		return -EPERM;
+
+	spin_lock(&fc->lock);
+	file = idr_find(&fc->backing_files_map, backing_id);
+	if (file)
+		idr_remove(&fc->backing_files_map, backing_id);
+	spin_unlock(&fc->lock);
+	if (!file)
+		return -ENOENT;
+
+	fput(file);
+	return 0;
+}
+
+static int fuse_backing_put(int id, void *p, void *data)
+{
+	fput(p);
+	return 0;
+}
+
+/* Called on the last reference to the connection */
+void fuse_backing_files_free(struct fuse_conn *fc)
+{
+	idr_for_each(&fc->backing_files_map, fuse_backing_put, NULL);
+	idr_destroy(&fc->backing_files_map);
+}
+
+/*
+ * Look up the backing file of an open with FOPEN_PASSTHROUGH.  If the ID
+ * is unknown the file is left to go through the daemon as usual.
+ */
+void fuse_passthrough_setup(struct fuse_conn *fc, struct fuse_file *ff)
+{
+	struct file *file = NULL;
+
+	if (!fc->passthrough)
+		return;
+
+	spin_lock(&fc->lock);
+	if (ff->backing_id)
+		file = idr_find(&fc->backing_files_map, ff->backing_id);
+	if (file)
+		get_file(file);
+	spin_unlock(&fc->lock);
+
+	ff->backing_file = file;
+}
+
+/*
+ * Other opens of the inode may go through the daemon and the fuse page
+ * cache.  Write back what they have dirtied in the range before going to
+ * the backing file.
+ */
+static int fuse_passthrough_flush_cache(struct file *file, loff_t pos,
+					size_t count)
+{
+	struct address_space *mapping = file->f_mapping;
+
+	if (!mapping->nrpages)
+		return 0;
+	return filemap_write_and_wait_range(mapping, pos, pos + count - 1);
+}
+
+ssize_t fuse_passthrough_read_iter(struct kiocb *iocb, struct iov_iter *to)
+{
+	struct file *file = iocb->ki_filp;
+	struct fuse_file *ff = file->private_data;
+	struct file *backing_file = ff->backing_file;
+	const struct cred *old_cred;
+	ssize_t ret;
+
+	if (!iov_iter_count(to))
+		return 0;
+
+	ret = fuse_passthrough_flush_cache(file, iocb->ki_pos,
+					   iov_iter_count(to));
+	if (ret)
+		return ret;
+
+	old_cred = override_creds(backing_file->f_cred);
+	ret = vfs_iter_read(backing_file, to, &iocb->ki_pos);
+	revert_creds(old_cred);
+
+	fuse_invalidate_atime(file_inode(file));
+
+	return ret;
+}
+
+ssize_t fuse_passthrough_write_iter(struct kiocb *iocb, struct iov_iter *from)
+{
+	struct file *file = iocb->ki_filp;
+	struct inode *inode = file_inode(file);
+	struct fuse_file *ff = file->private_data;
+	struct file *backing_file = ff->backing_file;
+	const struct cred *old_cred;
+	struct kiocb kiocb;
+	int flags = iocb->ki_flags;
+	loff_t pos;
+	ssize_t ret;
+
+	if (!(backing_file->f_mode & FMODE_WRITE))
+		return -EBADF;
+
+	if (!iov_iter_count(from))
+		return 0;
+
+	inode_lock(inode);
+	/*
+	 * Appends go to the end of the backing file, whatever the fuse
+	 * inode's size says, so check the limits against that position.
+	 */
+	if (flags & IOCB_APPEND)
+		iocb->ki_pos = i_size_read(file_inode(backing_file));
+	iocb->ki_flags &= ~IOCB_APPEND;
+	ret = generic_write_checks(iocb, from);
+	iocb->ki_flags = flags;
+	if (ret <= 0)
+		goto out;
+
+	ret = file_remove_privs(file);
+	if (ret)
+		goto out;
+
+	pos = iocb->ki_pos;
+	ret = fuse_passthrough_flush_cache(file, pos, iov_iter_count(from));
+	if (ret)
+		goto out;
+
+	/* O_SYNC, O_DSYNC and RWF_DSYNC of the caller apply */
+	init_sync_kiocb(&kiocb, backing_file);
+	kiocb.ki_pos = pos;
+	kiocb.ki_flags |= flags & (IOCB_DSYNC | IOCB_SYNC);
+
+	old_cred = override_creds(backing_file->f_cred);
+	file_start_write(backing_file);
+	ret = backing_file->f_op->write_iter(&kiocb, from);
+	file_end_write(backing_file);
+	revert_creds(old_cred);
+	BUG_ON(ret == -EIOCBQUEUED);
+
+	if (ret > 0) {
+		iocb->ki_pos = kiocb.ki_pos;
+		/* Drop what other opens have cached of the old data */
+		if (file->f_mapping->nrpages)
+			invalidate_inode_pages2_range(file->f_mapping,
+					pos >> PAGE_SHIFT,
+					(iocb->ki_pos - 1) >> PAGE_SHIFT);
+		/* Size is known, mode and times must be fetched again */
+		fuse_write_update_size(inode, iocb->ki_pos);
+	}
+	fuse_invalidate_attr(inode);
+out:
+	inode_unlock(inode);
+
+	return ret;
+}
+
+/*
+ * Map the backing file instead.  Its pages are then shared with all the
+ * other users of the backing file, and the fuse inode's page cache is
+ * not involved.
+ */
+int fuse_passthrough_mmap(struct file *file, struct vm_area_struct *vma)
+{
+	struct fuse_file *ff = file->private_data;
+	struct file *backing_file = ff->backing_file;
+	const struct cred *old_cred;
+	unsigned long vm_flags;
+	int ret;
+
+	if (!backing_file->f_op->mmap)
+		return -ENODEV;
+
+	if (WARN_ON(file != vma->vm_file))
+		return -EIO;
+
+	/* The access checks of mmap were done against the fuse file */
+	if (!(backing_file->f_mode & FMODE_READ))
+		return -EACCES;
+	if ((vma->vm_flags & VM_SHARED) &&
+	    !(backing_file->f_mode & FMODE_WRITE)) {
+		if (vma->vm_flags & VM_WRITE)
+			return -EACCES;
+		vma->vm_flags &= ~VM_MAYWRITE;
+	}
+
+	/*
+	 * vma_link() will deny writes to, and map writably, the backing
+	 * file rather than the fuse file, so it must allow both just as
+	 * mmap_region() makes sure for the file it was called on.
+	 */
+	vm_flags = vma->vm_flags;
+	if (vm_flags & VM_DENYWRITE) {
+		ret = deny_write_access(backing_file);
+		if (ret)
+			return ret;
+	}
+	if (vm_flags & VM_SHARED) {
+		ret = mapping_map_writable(backing_file->f_mapping);
+		if (ret)
+			goto allow_write;
+	}
+
+	vma->vm_file = get_file(backing_file);
+
+	old_cred = override_creds(backing_file->f_cred);
+	ret = backing_file->f_op->mmap(backing_file, vma);
+	revert_creds(old_cred);
+
+	if (ret) {
+		vma->vm_file = file;
+		fput(backing_file);
+	} else {
+		fput(file);
+	}
+
+	if (vm_flags & VM_SHARED)
+		mapping_unmap_writable(backing_file->f_mapping);
+allow_write:
+	if (vm_flags & VM_DENYWRITE)
+		allow_write_access(backing_file);
+	return ret;
+}
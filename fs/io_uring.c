@@ -0,0 +1,1872 @@
+/*
+ * Shared application/kernel submission and completion ring pairs, for
+ * supporting fast and efficient asynchronous IO.
+ *
+ * The application fills in submission queue entries (sqes) in a shared
+ * array, places their indices in the SQ ring and bumps the SQ tail.  The
+ * kernel consumes entries from the SQ head and posts a completion queue
+ * entry (cqe) per request in the CQ ring, bumping the CQ tail.  Both rings
+ * and the sqe array are mmap'ed by the application, so a batch of IO needs
+ * at most one io_uring_enter() call, and none at all with SQ polling.
+ *
+ * Memory ordering: the kernel reads the SQ tail with an acquire and
+ * publishes the SQ head with a release once the sqes have been copied.
+ * The application must order its sqe and array stores before the SQ tail
+ * store, and read the SQ head with an acquire before reusing a slot.  On
+ * the completion side, cqe stores are ordered before the CQ tail store by
+ * a release; the application reads the CQ tail with an acquire, and must
+ * not publish a new CQ head before it is done with the cqes it consumed.
+ *
+ * Requests are issued from the submitting context when that cannot block
+ * for long: O_DIRECT reads and writes complete through ->ki_complete, and
+ * polls are armed on the file's wait queue.  Everything else - buffered
+ * reads and writes, fsync - is handed to a per-ring workqueue whose
+ * workers borrow the submitter's mm and credentials for the duration of
+ * the request.  The SQ polling thread runs with both all along.
+ *
+ * See Documentation/filesystems/io_uring.txt.
+ */
+#include <linux/kernel.h>
+#include <linux/init.h>
+#include <linux/errno.h>
+#include <linux/syscalls.h>
+#include <linux/compat.h>
+#include <linux/uio.h>
+
+#include <linux/sched.h>
+#include <linux/fs.h>
+#include <linux/file.h>
+#include <linux/cred.h>
+#include <linux/mm.h>
+#include <linux/mman.h>
+#include <linux/mmu_context.h>
+#include <linux/percpu.h>
+#include <linux/slab.h>
+#include <linux/workqueue.h>
+#include <linux/kthread.h>
+#include <linux/blkdev.h>
+#include <linux/bvec.h>
+#include <linux/anon_inodes.h>
+#include <linux/uaccess.h>
+#include <linux/poll.h>
+#include <linux/hugetlb.h>
+#include <linux/percpu-refcount.h>
+#include <linux/sizes.h>
+
+#include <uapi/linux/io_uring.h>
+
+#include "internal.h"
+
+#define IORING_MAX_ENTRIES	4096
+#define IORING_MAX_FIXED_FILES	1024
+
+struct io_uring {
+	u32 head ____cacheline_aligned_in_smp;
+	u32 tail ____cacheline_aligned_in_smp;
+};
+
+struct io_sq_ring {
+	struct io_uring		r;
+	u32			ring_mask;
+	u32			ring_entries;
+	u32			dropped;
+	u32			flags;
+	u32			array[];
+};
+
+struct io_cq_ring {
+	struct io_uring		r;
+	u32			ring_mask;
+	u32			ring_entries;
+	u32			overflow;
+	struct io_uring_cqe	cqes[] ____cacheline_aligned_in_smp;
+};
+
+struct io_mapped_ubuf {
+	u64		ubuf;
+	size_t		len;
+	struct bio_vec	*bvec;
+	unsigned int	nr_bvecs;
+};
+
+struct io_ring_ctx {
+	struct percpu_ref	refs;
+	unsigned int		flags;
+	bool			compat;
+	bool			account_mem;
+
+	/* submission side, serialised by uring_lock */
+	struct mutex		uring_lock;
+	struct io_sq_ring	*sq_ring;
+	unsigned		cached_sq_head;
+	unsigned		sq_entries;
+	unsigned		sq_mask;
+	unsigned		sq_thread_idle;
+	struct io_uring_sqe	*sq_sqes;
+
+	struct workqueue_struct	*sqo_wq;
+	struct task_struct	*sqo_thread;	/* if using sq thread polling */
+	struct mm_struct	*sqo_mm;
+	wait_queue_head_t	sqo_wait;
+	const struct cred	*creds;		/* of the ring's creator */
+	unsigned long		fsize_limit;	/* and its RLIMIT_FSIZE */
+
+	/* completion side, serialised by completion_lock */
+	spinlock_t		completion_lock;
+	struct io_cq_ring	*cq_ring;
+	unsigned		cached_cq_tail;
+	unsigned		cq_entries;
+	unsigned		cq_mask;
+	wait_queue_head_t	wait;		/* io_uring_enter() waiters */
+	wait_queue_head_t	cq_wait;	/* poll() on the ring fd */
+	struct list_head	poll_list;	/* armed IORING_OP_POLL_ADD */
+
+	/* registered files and buffers, changed only while quiesced */
+	struct file		**user_files;
+	unsigned		nr_user_files;
+	struct io_mapped_ubuf	*user_bufs;
+	unsigned		nr_user_bufs;
+
+	struct user_struct	*user;
+	struct completion	ctx_done;
+};
+
+struct io_poll_iocb {
+	struct file		*file;
+	wait_queue_head_t	*head;
+	unsigned int		events;
+	bool			canceled;
+	wait_queue_t		wait;
+};
+
+struct io_kiocb {
+	union {
+		struct kiocb		rw;
+		struct io_poll_iocb	poll;
+	};
+	struct io_ring_ctx	*ctx;
+	struct file		*file;
+	struct list_head	list;		/* ctx->poll_list */
+	struct work_struct	work;
+	atomic_t		refs;
+	unsigned int		flags;
+#define REQ_F_FIXED_FILE	1		/* ctx owns file */
+	u64			user_data;
+	/* copied, the ring slot may be reused as soon as the head moves */
+	struct io_uring_sqe	sqe;
+};
+
+static struct kmem_cache *req_cachep;
+
+static const struct file_operations io_uring_fops;
+
+static void io_ring_ctx_ref_free(struct percpu_ref *ref)
+{
+	struct io_ring_ctx *ctx = container_of(ref, struct io_ring_ctx, refs);
+
+	complete(&ctx->ctx_done);
+}
+
+static struct io_ring_ctx *io_ring_ctx_alloc(struct io_uring_params *p)
+{
+	struct io_ring_ctx *ctx;
+
+	ctx = kzalloc(sizeof(*ctx), GFP_KERNEL);
+	if (!ctx)
+		return NULL;
+
+	if (percpu_ref_init(&ctx->refs, io_ring_ctx_ref_free, 0, GFP_KERNEL)) {
+		kfree(ctx);
+		return NULL;
+	}
+
+	ctx->flags = p->flags;
+	/* known up front, io_ring_ctx_free() un-accounts the rings by them */
+	ctx->sq_entries = p->sq_entries;
+	ctx->cq_entries = p->cq_entries;
+	mutex_init(&ctx->uring_lock);
+	init_waitqueue_head(&ctx->sqo_wait);
+	spin_lock_init(&ctx->completion_lock);
+	init_waitqueue_head(&ctx->wait);
+	init_waitqueue_head(&ctx->cq_wait);
+	INIT_LIST_HEAD(&ctx->poll_list);
+	init_completion(&ctx->ctx_done);
+	return ctx;
+}
+
+static unsigned io_cqring_events(struct io_cq_ring *ring)
+{
+	return READ_ONCE(ring->r.tail) - READ_ONCE(ring->r.head);
+}
+
+/*
+ * Called with completion_lock held.  If the application has not made room
+ * in the CQ ring the event is dropped and counted in ->overflow.
+ */
+static void io_cqring_fill_event(struct io_ring_ctx *ctx, u64 user_data,
+				 long res)
+{
+	struct io_cq_ring *ring = ctx->cq_ring;
+	struct io_uring_cqe *cqe;
+	unsigned tail = ctx->cached_cq_tail;
+
+	/* ring->ring_entries is writable by the application, don't trust it */
+	if (tail - READ_ONCE(ring->r.head) == ctx->cq_entries) {
+		WRITE_ONCE(ring->overflow, ring->overflow + 1);
+		return;
+	}
+
+	cqe = &ring->cqes[tail & ctx->cq_mask];
+	WRITE_ONCE(cqe->user_data, user_data);
+	WRITE_ONCE(cqe->res, res);
+	WRITE_ONCE(cqe->flags, 0);
+	ctx->cached_cq_tail++;
+}
+
+static void io_commit_cqring(struct io_ring_ctx *ctx)
+{
+	struct io_cq_ring *ring = ctx->cq_ring;
+
+	/* order cqe stores with the tail update */
+	if (ctx->cached_cq_tail != READ_ONCE(ring->r.tail))
+		smp_store_release(&ring->r.tail, ctx->cached_cq_tail);
+}
+
+static void io_cqring_ev_posted(struct io_ring_ctx *ctx)
+{
+	if (waitqueue_active(&ctx->wait))
+		wake_up(&ctx->wait);
+	if (waitqueue_active(&ctx->cq_wait))
+		wake_up_interruptible(&ctx->cq_wait);
+}
+
+static void io_cqring_add_event(struct io_ring_ctx *ctx, u64 user_data,
+				long res)
+{
+	unsigned long flags;
+
+	spin_lock_irqsave(&ctx->completion_lock, flags);
+	io_cqring_fill_event(ctx, user_data, res);
+	io_commit_cqring(ctx);
+	spin_unlock_irqrestore(&ctx->completion_lock, flags);
+
+	io_cqring_ev_posted(ctx);
+}
+
+/*
+ * Every request pins the ring context; the pin fails once the ring is
+ * being torn down or quiesced for io_uring_register().
+ */
+static struct io_kiocb *io_get_req(struct io_ring_ctx *ctx)
+{
+	struct io_kiocb *req;
+
+	if (!percpu_ref_tryget_live(&ctx->refs))
+		return NULL;
+
+	req = kmem_cache_alloc(req_cachep, GFP_KERNEL);
+	if (!req) {
+		percpu_ref_put(&ctx->refs);
+		return NULL;
+	}
+
+	req->ctx = ctx;
+	req->file = NULL;
+	req->flags = 0;
+	atomic_set(&req->refs, 1);
+	INIT_LIST_HEAD(&req->list);
+	return req;
+}
+
+static void io_free_req(struct io_kiocb *req)
+{
+	struct io_ring_ctx *ctx = req->ctx;
+
+	if (req->file && !(req->flags & REQ_F_FIXED_FILE))
+		fput(req->file);
+	kmem_cache_free(req_cachep, req);
+	percpu_ref_put(&ctx->refs);
+}
+
+/* Only poll requests are ever shared, everything else just frees */
+static void io_put_req(struct io_kiocb *req)
+{
+	if (atomic_dec_and_test(&req->refs))
+		io_free_req(req);
+}
+
+static void io_complete_rw(struct kiocb *kiocb, long res, long res2)
+{
+	struct io_kiocb *req = container_of(kiocb, struct io_kiocb, rw);
+
+	io_cqring_add_event(req->ctx, req->user_data, res);
+	io_free_req(req);
+}
+
+static void io_rw_done(struct kiocb *kiocb, ssize_t ret)
+{
+	switch (ret) {
+	case -EIOCBQUEUED:
+		break;
+	case -ERESTARTSYS:
+	case -ERESTARTNOINTR:
+	case -ERESTARTNOHAND:
+	case -ERESTART_RESTARTBLOCK:
+		/*
+		 * We can't just restart the syscall, since previously
+		 * submitted sqes may already be in progress.  Just fail this
+		 * IO with EINTR.
+		 */
+		ret = -EINTR;
+		/* fall through */
+	default:
+		kiocb->ki_complete(kiocb, ret, 0);
+	}
+}
+
+/*
+ * Returns -EAGAIN if the request has to be issued from a context that is
+ * allowed to block.  Only O_DIRECT IO completes asynchronously through
+ * ->ki_complete; buffered IO would block the submitter in the page cache.
+ */
+static int io_prep_rw(struct io_kiocb *req, bool force_nonblock)
+{
+	const struct io_uring_sqe *sqe = &req->sqe;
+	struct kiocb *kiocb = &req->rw;
+	u32 rw_flags = sqe->rw_flags;
+
+	if (rw_flags & ~(RWF_HIPRI | RWF_DSYNC | RWF_SYNC))
+		return -EOPNOTSUPP;
+
+	kiocb->ki_filp = req->file;
+	kiocb->ki_pos = sqe->off;
+	kiocb->ki_flags = iocb_flags(kiocb->ki_filp);
+	kiocb->private = NULL;
+
+	if (rw_flags & RWF_HIPRI)
+		kiocb->ki_flags |= IOCB_HIPRI;
+	if (rw_flags & RWF_DSYNC)
+		kiocb->ki_flags |= IOCB_DSYNC;
+	if (rw_flags & RWF_SYNC)
+		kiocb->ki_flags |= (IOCB_DSYNC | IOCB_SYNC);
+
+	if (force_nonblock && !(kiocb->ki_flags & IOCB_DIRECT))
+		return -EAGAIN;
+
+	kiocb->ki_complete = io_complete_rw;
+	return 0;
+}
+
+static int io_import_fixed(struct io_ring_ctx *ctx, int rw,
+			   const struct io_uring_sqe *sqe,
+			   struct iov_iter *iter)
+{
+	size_t len = sqe->len;
+	struct io_mapped_ubuf *imu;
+	unsigned buf_index;
+	size_t offset;
+	u64 buf_addr;
+
+	if (unlikely(!ctx->user_bufs))
+		return -EFAULT;
+
+	buf_index = sqe->buf_index;
+	if (unlikely(buf_index >= ctx->nr_user_bufs))
+		return -EFAULT;
+
+	imu = &ctx->user_bufs[buf_index];
+	buf_addr = sqe->addr;
+
+	/* overflow */
+	if (buf_addr + len < buf_addr)
+		return -EFAULT;
+	/* not inside the mapped region */
+	if (buf_addr < imu->ubuf || buf_addr + len > imu->ubuf + imu->len)
+		return -EFAULT;
+
+	/*
+	 * May not be a start of buffer, set size appropriately
+	 * and advance us to the beginning.
+	 */
+	offset = buf_addr - imu->ubuf;
+	iov_iter_bvec(iter, ITER_BVEC | rw, imu->bvec, imu->nr_bvecs,
+		      offset + len);
+	if (offset)
+		iov_iter_advance(iter, offset);
+	return 0;
+}
+
+static int io_import_iovec(struct io_ring_ctx *ctx, int rw,
+			   struct io_kiocb *req, struct iovec **iovec,
+			   struct iov_iter *iter)
+{
+	const struct io_uring_sqe *sqe = &req->sqe;
+	void __user *buf = u64_to_user_ptr(sqe->addr);
+
+	if (sqe->opcode == IORING_OP_READ_FIXED ||
+	    sqe->opcode == IORING_OP_WRITE_FIXED) {
+		*iovec = NULL;
+		return io_import_fixed(ctx, rw, sqe, iter);
+	}
+
+#ifdef CONFIG_COMPAT
+	if (ctx->compat)
+		return compat_import_iovec(rw, buf, sqe->len, UIO_FASTIOV,
+					   iovec, iter);
+#endif
+
+	return import_iovec(rw, buf, sqe->len, UIO_FASTIOV, iovec, iter);
+}
+
+static int io_read(struct io_kiocb *req, bool force_nonblock)
+{
+	struct iovec inline_vecs[UIO_FASTIOV], *iovec = inline_vecs;
+	struct kiocb *kiocb = &req->rw;
+	struct iov_iter iter;
+	struct file *file;
+	ssize_t ret;
+
+	ret = io_prep_rw(req, force_nonblock);
+	if (ret)
+		return ret;
+	file = kiocb->ki_filp;
+
+	if (unlikely(!(file->f_mode & FMODE_READ)))
+		return -EBADF;
+	if (unlikely(!file->f_op->read_iter))
+		return -EINVAL;
+
+	ret = io_import_iovec(req->ctx, READ, req, &iovec, &iter);
+	if (ret)
+		return ret;
+
+	ret = rw_verify_area(READ, file, &kiocb->ki_pos, iov_iter_count(&iter));
+	if (ret >= 0) {
+		io_rw_done(kiocb, file->f_op->read_iter(kiocb, &iter));
+		ret = 0;
+	}
+	kfree(iovec);
+	return ret;
+}
+
+/*
+ * Workqueue workers and the SQ thread have no file size limit of their
+ * own, so apply the one the ring was created with, as
+ * generic_write_checks() would.
+ */
+static int io_write_check_fsize(struct io_kiocb *req, struct iov_iter *iter)
+{
+	struct file *file = req->rw.ki_filp;
+	unsigned long limit = req->ctx->fsize_limit;
+	loff_t pos = req->rw.ki_pos;
+
+	if (!(current->flags & PF_KTHREAD) || limit == RLIM_INFINITY ||
+	    !S_ISREG(file_inode(file)->i_mode))
+		return 0;
+
+	if (req->rw.ki_flags & IOCB_APPEND)
+		pos = i_size_read(file_inode(file));
+	if (pos >= limit)
+		return -EFBIG;
+	iov_iter_truncate(iter, limit - (unsigned long)pos);
+	return 0;
+}
+
+static int io_write(struct io_kiocb *req, bool force_nonblock)
+{
+	struct iovec inline_vecs[UIO_FASTIOV], *iovec = inline_vecs;
+	struct kiocb *kiocb = &req->rw;
+	struct iov_iter iter;
+	struct file *file;
+	ssize_t ret;
+
+	ret = io_prep_rw(req, force_nonblock);
+	if (ret)
+		return ret;
+	file = kiocb->ki_filp;
+
+	if (unlikely(!(file->f_mode & FMODE_WRITE)))
+		return -EBADF;
+	if (unlikely(!file->f_op->write_iter))
+		return -EINVAL;
+
+	ret = io_import_iovec(req->ctx, WRITE, req, &iovec, &iter);
+	if (ret)
+		return ret;
+
+	ret = io_write_check_fsize(req, &iter);
+	if (!ret)
+		ret = rw_verify_area(WRITE, file, &kiocb->ki_pos,
+				     iov_iter_count(&iter));
+	if (ret >= 0) {
+		/* the request, and its file reference, may be gone on return */
+		get_file(file);
+		file_start_write(file);
+		io_rw_done(kiocb, file->f_op->write_iter(kiocb, &iter));
+		file_end_write(file);
+		fput(file);
+		ret = 0;
+	}
+	kfree(iovec);
+	return ret;
+}
+
+static int io_nop(struct io_kiocb *req)
+{
+	io_cqring_add_event(req->ctx, req->user_data, 0);
+	io_free_req(req);
+	return 0;
+}
+
+static int io_fsync(struct io_kiocb *req, bool force_nonblock)
+{
+	const struct io_uring_sqe *sqe = &req->sqe;
+	loff_t end = sqe->off + sqe->len;
+	int ret;
+
+	if (unlikely(sqe->addr || sqe->ioprio || sqe->buf_index))
+		return -EINVAL;
+	if (unlikely(sqe->fsync_flags & ~IORING_FSYNC_DATASYNC))
+		return -EINVAL;
+
+	/* fsync always requires a blocking context */
+	if (force_nonblock)
+		return -EAGAIN;
+
+	ret = vfs_fsync_range(req->file, sqe->off, end > 0 ? end : LLONG_MAX,
+			      sqe->fsync_flags & IORING_FSYNC_DATASYNC);
+
+	io_cqring_add_event(req->ctx, req->user_data, ret);
+	io_free_req(req);
+	return 0;
+}
+
+/*
+ * Called with completion_lock held.  Detaches the poll request from its
+ * wait queue, unless a wakeup already did, and lets the work item post
+ * the -ECANCELED completion.
+ */
+static void io_poll_remove_one(struct io_kiocb *req)
+{
+	struct io_poll_iocb *poll = &req->poll;
+
+	spin_lock(&poll->head->lock);
+	WRITE_ONCE(poll->canceled, true);
+	if (!list_empty(&poll->wait.task_list)) {
+		list_del_init(&poll->wait.task_list);
+		queue_work(req->ctx->sqo_wq, &req->work);
+	}
+	spin_unlock(&poll->head->lock);
+
+	list_del_init(&req->list);
+}
+
+static void io_poll_remove_all(struct io_ring_ctx *ctx)
+{
+	struct io_kiocb *req, *next;
+
+	spin_lock_irq(&ctx->completion_lock);
+	list_for_each_entry_safe(req, next, &ctx->poll_list, list)
+		io_poll_remove_one(req);
+	spin_unlock_irq(&ctx->completion_lock);
+}
+
+/*
+ * Find a running poll command that matches one specified in sqe->addr,
+ * and remove it if found.
+ */
+static int io_poll_remove(struct io_kiocb *req)
+{
+	const struct io_uring_sqe *sqe = &req->sqe;
+	struct io_ring_ctx *ctx = req->ctx;
+	struct io_kiocb *poll_req, *next;
+	int ret = -ENOENT;
+
+	if (sqe->ioprio || sqe->off || sqe->len || sqe->buf_index ||
+	    sqe->poll_events)
+		return -EINVAL;
+
+	spin_lock_irq(&ctx->completion_lock);
+	list_for_each_entry_safe(poll_req, next, &ctx->poll_list, list) {
+		if (sqe->addr == poll_req->user_data) {
+			io_poll_remove_one(poll_req);
+			ret = 0;
+			break;
+		}
+	}
+	spin_unlock_irq(&ctx->completion_lock);
+
+	io_cqring_add_event(ctx, req->user_data, ret);
+	io_free_req(req);
+	return 0;
+}
+
+/*
+ * Runs after a wakeup or a cancellation.  The wakeup may not carry a
+ * mask, or may be for events we are not interested in, so re-check and
+ * re-arm on the wait queue if nothing is ready yet.
+ */
+static void io_poll_complete_work(struct work_struct *work)
+{
+	struct io_kiocb *req = container_of(work, struct io_kiocb, work);
+	struct io_poll_iocb *poll = &req->poll;
+	struct poll_table_struct pt = { ._key = poll->events };
+	struct io_ring_ctx *ctx = req->ctx;
+	unsigned int mask = 0;
+
+	if (!READ_ONCE(poll->canceled))
+		mask = poll->file->f_op->poll(poll->file, &pt) & poll->events;
+
+	spin_lock_irq(&ctx->completion_lock);
+	if (!mask && !READ_ONCE(poll->canceled)) {
+		add_wait_queue(poll->head, &poll->wait);
+		spin_unlock_irq(&ctx->completion_lock);
+		return;
+	}
+	list_del_init(&req->list);
+	io_cqring_fill_event(ctx, req->user_data,
+			     poll->canceled ? -ECANCELED : mask);
+	io_commit_cqring(ctx);
+	spin_unlock_irq(&ctx->completion_lock);
+
+	io_cqring_ev_posted(ctx);
+	io_put_req(req);
+}
+
+static int io_poll_wake(wait_queue_t *wait, unsigned mode, int sync,
+			void *key)
+{
+	struct io_poll_iocb *poll = container_of(wait, struct io_poll_iocb,
+						 wait);
+	struct io_kiocb *req = container_of(poll, struct io_kiocb, poll);
+	unsigned long mask = (unsigned long) key;
+
+	/* for instances that support it check for an event match first */
+	if (mask && !(mask & poll->events))
+		return 0;
+
+	list_del_init(&poll->wait.task_list);
+	queue_work(req->ctx->sqo_wq, &req->work);
+	return 1;
+}
+
+struct io_poll_table {
+	struct poll_table_struct pt;
+	struct io_kiocb *req;
+	int error;
+};
+
+static void io_poll_queue_proc(struct file *file, wait_queue_head_t *head,
+			       struct poll_table_struct *p)
+{
+	struct io_poll_table *pt = container_of(p, struct io_poll_table, pt);
+
+	/* only one wait queue per request is supported */
+	if (unlikely(pt->req->poll.head)) {
+		pt->error = -EINVAL;
+		return;
+	}
+
+	pt->error = 0;
+	pt->req->poll.head = head;
+	add_wait_queue(head, &pt->req->poll.wait);
+}
+
+static int io_poll_add(struct io_kiocb *req)
+{
+	const struct io_uring_sqe *sqe = &req->sqe;
+	struct io_poll_iocb *poll = &req->poll;
+	struct io_ring_ctx *ctx = req->ctx;
+	struct io_poll_table ipt;
+	unsigned int mask;
+
+	if (sqe->addr || sqe->ioprio || sqe->off || sqe->len || sqe->buf_index)
+		return -EINVAL;
+	if (!req->file->f_op->poll)
+		return -EBADF;
+
+	INIT_WORK(&req->work, io_poll_complete_work);
+	poll->file = req->file;
+	poll->head = NULL;
+	poll->canceled = false;
+	poll->events = sqe->poll_events | POLLERR | POLLHUP;
+
+	ipt.pt._qproc = io_poll_queue_proc;
+	ipt.pt._key = poll->events;
+	ipt.req = req;
+	ipt.error = -EINVAL;	/* ->poll() never called poll_wait() */
+
+	/* initialized the list so that we can do list_empty checks */
+	INIT_LIST_HEAD(&poll->wait.task_list);
+	init_waitqueue_func_entry(&poll->wait, io_poll_wake);
+
+	/*
+	 * Once armed, a wakeup can run io_poll_complete_work() and drop its
+	 * reference at any time, so hold our own until we are done here.
+	 */
+	atomic_inc(&req->refs);
+	mask = poll->file->f_op->poll(poll->file, &ipt.pt) & poll->events;
+
+	spin_lock_irq(&ctx->completion_lock);
+	if (poll->head) {
+		spin_lock(&poll->head->lock);
+		if (list_empty(&poll->wait.task_list)) {
+			/* already woken, the work item owns the request */
+			mask = 0;
+			ipt.error = 0;
+		} else if (mask || ipt.error) {
+			list_del_init(&poll->wait.task_list);
+		} else {
+			list_add_tail(&req->list, &ctx->poll_list);
+		}
+		spin_unlock(&poll->head->lock);
+	}
+	if (mask) {
+		io_cqring_fill_event(ctx, req->user_data, mask);
+		io_commit_cqring(ctx);
+	}
+	spin_unlock_irq(&ctx->completion_lock);
+
+	if (mask) {
+		/* completed inline, the work item will never run */
+		io_cqring_ev_posted(ctx);
+		io_put_req(req);
+		ipt.error = 0;
+	}
+	io_put_req(req);
+	return ipt.error;
+}
+
+/*
+ * Returns 0 if the request was completed or is in flight, -EAGAIN if it
+ * has to be retried from a blocking context, or another error that the
+ * caller posts as the completion result.
+ */
+static int __io_submit_sqe(struct io_kiocb *req, bool force_nonblock)
+{
+	switch (req->sqe.opcode) {
+	case IORING_OP_NOP:
+		return io_nop(req);
+	case IORING_OP_READV:
+		if (unlikely(req->sqe.buf_index))
+			return -EINVAL;
+		return io_read(req, force_nonblock);
+	case IORING_OP_WRITEV:
+		if (unlikely(req->sqe.buf_index))
+			return -EINVAL;
+		return io_write(req, force_nonblock);
+	case IORING_OP_READ_FIXED:
+		return io_read(req, force_nonblock);
+	case IORING_OP_WRITE_FIXED:
+		return io_write(req, force_nonblock);
+	case IORING_OP_FSYNC:
+		return io_fsync(req, force_nonblock);
+	case IORING_OP_POLL_ADD:
+		return io_poll_add(req);
+	case IORING_OP_POLL_REMOVE:
+		return io_poll_remove(req);
+	default:
+		return -EINVAL;
+	}
+}
+
+static void io_sq_wq_submit_work(struct work_struct *work)
+{
+	struct io_kiocb *req = container_of(work, struct io_kiocb, work);
+	struct io_ring_ctx *ctx = req->ctx;
+	struct mm_struct *mm = ctx->sqo_mm;
+	mm_segment_t old_fs = get_fs();
+	const struct cred *old_cred;
+	int ret = -EFAULT;
+
+	/* the submitter may have exited; don't resurrect its mm */
+	if (atomic_inc_not_zero(&mm->mm_users)) {
+		use_mm(mm);
+		set_fs(USER_DS);
+		old_cred = override_creds(ctx->creds);
+		ret = __io_submit_sqe(req, false);
+		revert_creds(old_cred);
+		set_fs(old_fs);
+		unuse_mm(mm);
+		mmput(mm);
+	}
+
+	if (ret) {
+		io_cqring_add_event(ctx, req->user_data, ret);
+		io_free_req(req);
+	}
+}
+
+static bool io_op_needs_file(const struct io_uring_sqe *sqe)
+{
+	return sqe->opcode != IORING_OP_NOP &&
+	       sqe->opcode != IORING_OP_POLL_REMOVE;
+}
+
+static int io_req_set_file(struct io_ring_ctx *ctx, struct io_kiocb *req,
+			   bool needs_fixed_file)
+{
+	const struct io_uring_sqe *sqe = &req->sqe;
+	int fd = sqe->fd;
+
+	if (!io_op_needs_file(sqe))
+		return 0;
+
+	if (sqe->flags & IOSQE_FIXED_FILE) {
+		if (unlikely(!ctx->user_files ||
+			     (unsigned) fd >= ctx->nr_user_files))
+			return -EBADF;
+		req->file = ctx->user_files[fd];
+		req->flags |= REQ_F_FIXED_FILE;
+	} else {
+		/* the SQ thread has no file table of its own */
+		if (needs_fixed_file)
+			return -EBADF;
+		req->file = fget(fd);
+		if (unlikely(!req->file))
+			return -EBADF;
+	}
+	return 0;
+}
+
+/*
+ * Returns -EAGAIN without consuming the sqe if no request could be
+ * allocated.  Any other failure is posted as a completion.
+ */
+static int io_submit_sqe(struct io_ring_ctx *ctx,
+			 const struct io_uring_sqe *sqe, bool needs_fixed_file)
+{
+	struct io_kiocb *req;
+	int ret;
+
+	req = io_get_req(ctx);
+	if (unlikely(!req))
+		return -EAGAIN;
+
+	memcpy(&req->sqe, sqe, sizeof(req->sqe));
+	req->user_data = req->sqe.user_data;
+
+	ret = -EINVAL;
+	if (unlikely(req->sqe.flags & ~IOSQE_FIXED_FILE))
+		goto err;
+
+	ret = io_req_set_file(ctx, req, needs_fixed_file);
+	if (ret)
+		goto err;
+
+	ret = __io_submit_sqe(req, true);
+	if (ret == -EAGAIN) {
+		INIT_WORK(&req->work, io_sq_wq_submit_work);
+		queue_work(ctx->sqo_wq, &req->work);
+		return 0;
+	}
+	if (!ret)
+		return 0;
+err:
+	io_cqring_add_event(ctx, req->user_data, ret);
+	io_free_req(req);
+	return 0;
+}
+
+static unsigned io_sqring_entries(struct io_ring_ctx *ctx)
+{
+	return smp_load_acquire(&ctx->sq_ring->r.tail) - ctx->cached_sq_head;
+}
+
+/*
+ * Returns the next sqe to submit, or NULL if the ring is empty.  The
+ * cached head lets us batch updates of the head the application sees;
+ * entries with an invalid index are skipped and counted in ->dropped.
+ */
+static const struct io_uring_sqe *io_get_sqe(struct io_ring_ctx *ctx)
+{
+	struct io_sq_ring *ring = ctx->sq_ring;
+	unsigned index;
+
+	while (io_sqring_entries(ctx)) {
+		index = READ_ONCE(ring->array[ctx->cached_sq_head &
+					     ctx->sq_mask]);
+		if (likely(index < ctx->sq_entries))
+			return &ctx->sq_sqes[index];
+
+		ctx->cached_sq_head++;
+		WRITE_ONCE(ring->dropped, ring->dropped + 1);
+	}
+	return NULL;
+}
+
+static void io_commit_sqring(struct io_ring_ctx *ctx)
+{
+	struct io_sq_ring *ring = ctx->sq_ring;
+
+	/* the sqes were copied, the application may now reuse the slots */
+	if (ctx->cached_sq_head != READ_ONCE(ring->r.head))
+		smp_store_release(&ring->r.head, ctx->cached_sq_head);
+}
+
+/* Called with uring_lock held. */
+static int io_ring_submit(struct io_ring_ctx *ctx, unsigned int to_submit,
+			  bool needs_fixed_file)
+{
+	const struct io_uring_sqe *sqe;
+	int submitted = 0, ret = 0;
+
+	while (submitted < to_submit) {
+		sqe = io_get_sqe(ctx);
+		if (!sqe)
+			break;
+		ret = io_submit_sqe(ctx, sqe, needs_fixed_file);
+		if (ret)
+			break;
+		ctx->cached_sq_head++;
+		submitted++;
+	}
+	io_commit_sqring(ctx);
+
+	return submitted ? submitted : ret;
+}
+
+/*
+ * The SQ thread keeps polling the SQ ring for sq_thread_idle jiffies after
+ * the last submission, then sets IORING_SQ_NEED_WAKEUP and sleeps until
+ * io_uring_enter(IORING_ENTER_SQ_WAKEUP) kicks it.
+ */
+static int io_sq_thread(void *data)
+{
+	struct io_ring_ctx *ctx = data;
+	struct mm_struct *mm = ctx->sqo_mm;
+	mm_segment_t old_fs = get_fs();
+	const struct cred *old_cred;
+	unsigned long timeout;
+	DEFINE_WAIT(wait);
+	bool mm_ok;
+
+	mm_ok = atomic_inc_not_zero(&mm->mm_users);
+	if (mm_ok) {
+		use_mm(mm);
+		set_fs(USER_DS);
+	}
+	old_cred = override_creds(ctx->creds);
+
+	timeout = jiffies + ctx->sq_thread_idle;
+	while (!kthread_should_stop()) {
+		unsigned int to_submit = mm_ok ? io_sqring_entries(ctx) : 0;
+
+		if (!to_submit) {
+			if (mm_ok && time_before(jiffies, timeout)) {
+				cond_resched();
+				continue;
+			}
+
+			prepare_to_wait(&ctx->sqo_wait, &wait,
+					TASK_INTERRUPTIBLE);
+
+			/* Tell userspace we may need a wakeup call */
+			WRITE_ONCE(ctx->sq_ring->flags,
+				   ctx->sq_ring->flags | IORING_SQ_NEED_WAKEUP);
+			/* pairs with the application's tail store and flags load */
+			smp_mb();
+
+			if (!mm_ok || !io_sqring_entries(ctx)) {
+				if (!kthread_should_stop()) {
+					if (signal_pending(current))
+						flush_signals(current);
+					schedule();
+				}
+				finish_wait(&ctx->sqo_wait, &wait);
+				WRITE_ONCE(ctx->sq_ring->flags,
+					   ctx->sq_ring->flags &
+					   ~IORING_SQ_NEED_WAKEUP);
+				timeout = jiffies + ctx->sq_thread_idle;
+				continue;
+			}
+			finish_wait(&ctx->sqo_wait, &wait);
+			WRITE_ONCE(ctx->sq_ring->flags,
+				   ctx->sq_ring->flags & ~IORING_SQ_NEED_WAKEUP);
+			to_submit = io_sqring_entries(ctx);
+		}
+
+		mutex_lock(&ctx->uring_lock);
+		io_ring_submit(ctx, min(to_submit, ctx->sq_entries), true);
+		mutex_unlock(&ctx->uring_lock);
+		cond_resched();
+		timeout = jiffies + ctx->sq_thread_idle;
+	}
+
+	revert_creds(old_cred);
+	if (mm_ok) {
+		set_fs(old_fs);
+		unuse_mm(mm);
+		mmput(mm);
+	}
+	return 0;
+}
+
+static int io_cqring_wait(struct io_ring_ctx *ctx, unsigned min_events,
+			  const sigset_t __user *sig, size_t sigsz)
+{
+	struct io_cq_ring *ring = ctx->cq_ring;
+	sigset_t ksigmask, sigsaved;
+	int ret;
+
+	if (io_cqring_events(ring) >= min_events)
+		return 0;
+
+	if (sig) {
+#ifdef CONFIG_COMPAT
+		if (ctx->compat) {
+			compat_sigset_t csigmask;
+
+			if (sigsz != sizeof(compat_sigset_t))
+				return -EINVAL;
+			if (copy_from_user(&csigmask, sig, sizeof(csigmask)))
+				return -EFAULT;
+			sigset_from_compat(&ksigmask, &csigmask);
+		} else
+#endif
+		{
+			if (sigsz != sizeof(sigset_t))
+				return -EINVAL;
+			if (copy_from_user(&ksigmask, sig, sizeof(ksigmask)))
+				return -EFAULT;
+		}
+		sigdelsetmask(&ksigmask, sigmask(SIGKILL) | sigmask(SIGSTOP));
+		sigsaved = current->blocked;
+		set_current_blocked(&ksigmask);
+	}
+
+	ret = wait_event_interruptible(ctx->wait,
+				       io_cqring_events(ring) >= min_events);
+
+	if (sig) {
+		/*
+		 * If we got interrupted, the signal handler has to run with
+		 * the caller's mask; restore it on the way out like
+		 * epoll_pwait() does.
+		 */
+		if (ret == -ERESTARTSYS) {
+			memcpy(&current->saved_sigmask, &sigsaved,
+			       sizeof(sigsaved));
+			set_restore_sigmask();
+		} else
+			set_current_blocked(&sigsaved);
+	}
+
+	if (ret == -ERESTARTSYS)
+		ret = -EINTR;
+	return ret;
+}
+
+static void io_sqe_files_unregister_all(struct io_ring_ctx *ctx)
+{
+	unsigned i;
+
+	for (i = 0; i < ctx->nr_user_files; i++)
+		fput(ctx->user_files[i]);
+	kfree(ctx->user_files);
+	ctx->user_files = NULL;
+	ctx->nr_user_files = 0;
+}
+
+static int io_sqe_files_unregister(struct io_ring_ctx *ctx)
+{
+	if (!ctx->user_files)
+		return -ENXIO;
+
+	io_sqe_files_unregister_all(ctx);
+	return 0;
+}
+
+static int io_sqe_files_register(struct io_ring_ctx *ctx, void __user *arg,
+				 unsigned nr_args)
+{
+	__s32 __user *fds = (__s32 __user *) arg;
+	struct file *file;
+	unsigned i;
+	int ret = 0;
+	__s32 fd;
+
+	if (ctx->user_files)
+		return -EBUSY;
+	if (!nr_args)
+		return -EINVAL;
+	if (nr_args > IORING_MAX_FIXED_FILES)
+		return -EMFILE;
+
+	ctx->user_files = kcalloc(nr_args, sizeof(struct file *), GFP_KERNEL);
+	if (!ctx->user_files)
+		return -ENOMEM;
+
+	for (i = 0; i < nr_args; i++) {
+		ret = -EFAULT;
+		if (copy_from_user(&fd, &fds[i], sizeof(fd)))
+			break;
+
+		ret = -EBADF;
+		file = fget(fd);
+		if (!file)
+			break;
+		/*
+		 * A ring holding a reference to itself, or to another ring
+		 * that holds one back, would never be released.
+		 */
+		if (file->f_op == &io_uring_fops) {
+			fput(file);
+			break;
+		}
+		ctx->user_files[ctx->nr_user_files++] = file;
+		ret = 0;
+	}
+
+	if (ret)
+		io_sqe_files_unregister_all(ctx);
+	return ret;
+}
+
+static unsigned long io_ring_bytes_to_pages(size_t bytes)
+{
+	return 1UL << get_order(bytes);
+}
+
+static size_t io_sq_ring_bytes(unsigned entries)
+{
+	return sizeof(struct io_sq_ring) + entries * sizeof(u32);
+}
+
+static size_t io_cq_ring_bytes(unsigned entries)
+{
+	return sizeof(struct io_cq_ring) +
+	       entries * sizeof(struct io_uring_cqe);
+}
+
+static unsigned long ring_pages(unsigned sq_entries, unsigned cq_entries)
+{
+	return io_ring_bytes_to_pages(io_sq_ring_bytes(sq_entries)) +
+	       io_ring_bytes_to_pages(io_cq_ring_bytes(cq_entries)) +
+	       io_ring_bytes_to_pages(sq_entries *
+				      sizeof(struct io_uring_sqe));
+}
+
+/*
+ * Ring and fixed buffer memory is pinned for the lifetime of the ring, so
+ * it is charged against RLIMIT_MEMLOCK like mlock()ed memory, unless the
+ * creator has CAP_IPC_LOCK.
+ */
+static int io_account_mem(struct user_struct *user, unsigned long nr_pages)
+{
+	unsigned long page_limit, cur_pages, new_pages;
+
+	/* Don't allow more pages than we can safely lock */
+	page_limit = rlimit(RLIMIT_MEMLOCK) >> PAGE_SHIFT;
+
+	do {
+		cur_pages = atomic_long_read(&user->locked_vm);
+		new_pages = cur_pages + nr_pages;
+		if (new_pages > page_limit)
+			return -ENOMEM;
+	} while (atomic_long_cmpxchg(&user->locked_vm, cur_pages,
+				     new_pages) != cur_pages);
+
+	return 0;
+}
+
+static void io_unaccount_mem(struct user_struct *user, unsigned long nr_pages)
+{
+	atomic_long_sub(nr_pages, &user->locked_vm);
+}
+
+static int io_sqe_buffer_unregister(struct io_ring_ctx *ctx)
+{
+	unsigned i, j;
+
+	if (!ctx->user_bufs)
+		return -ENXIO;
+
+	for (i = 0; i < ctx->nr_user_bufs; i++) {
+		struct io_mapped_ubuf *imu = &ctx->user_bufs[i];
+
+		for (j = 0; j < imu->nr_bvecs; j++)
+			put_page(imu->bvec[j].bv_page);
+
+		if (ctx->account_mem)
+			io_unaccount_mem(ctx->user, imu->nr_bvecs);
+		kfree(imu->bvec);
+		imu->nr_bvecs = 0;
+	}
+
+	kfree(ctx->user_bufs);
+	ctx->user_bufs = NULL;
+	ctx->nr_user_bufs = 0;
+	return 0;
+}
+
+static int io_copy_iov(struct io_ring_ctx *ctx, struct iovec *dst,
+		       void __user *arg, unsigned index)
+{
+	struct iovec __user *src;
+
+#ifdef CONFIG_COMPAT
+	if (ctx->compat) {
+		struct compat_iovec __user *ciovs;
+		struct compat_iovec ciov;
+
+		ciovs = (struct compat_iovec __user *) arg;
+		if (copy_from_user(&ciov, &ciovs[index], sizeof(ciov)))
+			return -EFAULT;
+
+		dst->iov_base = compat_ptr(ciov.iov_base);
+		dst->iov_len = ciov.iov_len;
+		return 0;
+	}
+#endif
+
+	src = (struct iovec __user *) arg;
+	if (copy_from_user(dst, &src[index], sizeof(*dst)))
+		return -EFAULT;
+	return 0;
+}
+
+/*
+ * Pin the pages of each buffer once, so that IORING_OP_READ_FIXED and
+ * IORING_OP_WRITE_FIXED can build a bvec iterator instead of going through
+ * get_user_pages() for every IO.  Only anonymous and hugetlbfs memory is
+ * accepted: pinning page cache pages would defeat truncate and writeback.
+ */
+static int io_sqe_buffer_register(struct io_ring_ctx *ctx, void __user *arg,
+				  unsigned nr_args)
+{
+	struct vm_area_struct **vmas = NULL;
+	struct page **pages = NULL;
+	int i, j, got_pages = 0;
+	int nr_pages = 0;
+	int ret = -EINVAL;
+
+	if (ctx->user_bufs)
+		return -EBUSY;
+	if (!nr_args || nr_args > UIO_MAXIOV)
+		return -EINVAL;
+
+	ctx->user_bufs = kcalloc(nr_args, sizeof(struct io_mapped_ubuf),
+				 GFP_KERNEL);
+	if (!ctx->user_bufs)
+		return -ENOMEM;
+
+	for (i = 0; i < nr_args; i++) {
+		struct io_mapped_ubuf *imu = &ctx->user_bufs[i];
+		unsigned long off, start, end, ubuf;
+		int pret;
+		struct iovec iov;
+		size_t size;
+
+		ret = io_copy_iov(ctx, &iov, arg, i);
+		if (ret)
+			goto err;
+
+		/*
+		 * Don't impose further limits on the size and buffer
+		 * constraints here, we'll -EINVAL later when IO is
+		 * submitted if they are wrong.
+		 */
+		ret = -EFAULT;
+		if (!iov.iov_base || !iov.iov_len)
+			goto err;
+
+		/* arbitrary limit, but we need something */
+		if (iov.iov_len > SZ_1G)
+			goto err;
+
+		ubuf = (unsigned long) iov.iov_base;
+		end = (ubuf + iov.iov_len + PAGE_SIZE - 1) >> PAGE_SHIFT;
+		start = ubuf >> PAGE_SHIFT;
+		nr_pages = end - start;
+
+		if (ctx->account_mem) {
+			ret = io_account_mem(ctx->user, nr_pages);
+			if (ret)
+				goto err;
+		}
+
+		ret = -ENOMEM;
+		if (!pages || nr_pages > got_pages) {
+			kfree(vmas);
+			kfree(pages);
+			pages = kmalloc_array(nr_pages, sizeof(struct page *),
+					      GFP_KERNEL);
+			vmas = kmalloc_array(nr_pages,
+					     sizeof(struct vm_area_struct *),
+					     GFP_KERNEL);
+			if (!pages || !vmas) {
+				got_pages = 0;
+				goto err_unaccount;
+			}
+			got_pages = nr_pages;
+		}
+
+		imu->bvec = kmalloc_array(nr_pages, sizeof(struct bio_vec),
+					  GFP_KERNEL);
+		if (!imu->bvec)
+			goto err_unaccount;
+
+		ret = 0;
+		down_read(&current->mm->mmap_sem);
+		pret = get_user_pages(ubuf, nr_pages, 1, 0, pages, vmas);
+		if (pret == nr_pages) {
+			/* don't support file backed memory */
+			for (j = 0; j < nr_pages; j++) {
+				struct vm_area_struct *vma = vmas[j];
+
+				if (vma->vm_file &&
+				    !is_file_hugepages(vma->vm_file)) {
+					ret = -EOPNOTSUPP;
+					break;
+				}
+			}
+		} else {
+			ret = pret < 0 ? pret : -EFAULT;
+		}
+		up_read(&current->mm->mmap_sem);
+		if (ret) {
+			/*
+			 * if we did partial map, or found file backed vmas,
+			 * release any pages we did get
+			 */
+			for (j = 0; j < pret; j++)
+				put_page(pages[j]);
+			kfree(imu->bvec);
+			imu->bvec = NULL;
+			goto err_unaccount;
+		}
+
+		off = ubuf & ~PAGE_MASK;
+		size = iov.iov_len;
+		for (j = 0; j < nr_pages; j++) {
+			size_t vec_len;
+
+			vec_len = min_t(size_t, size, PAGE_SIZE - off);
+			imu->bvec[j].bv_page = pages[j];
+			imu->bvec[j].bv_len = vec_len;
+			imu->bvec[j].bv_offset = off;
+			off = 0;
+			size -= vec_len;
+		}
+		/* store original address for later verification */
+		imu->ubuf = ubuf;
+		imu->len = iov.iov_len;
+		imu->nr_bvecs = nr_pages;
+
+		ctx->nr_user_bufs++;
+	}
+	kfree(pages);
+	kfree(vmas);
+	return 0;
+
+err_unaccount:
+	if (ctx->account_mem)
+		io_unaccount_mem(ctx->user, nr_pages);
+err:
+	kfree(pages);
+	kfree(vmas);
+	io_sqe_buffer_unregister(ctx);
+	return ret;
+}
+
+static void *io_mem_alloc(size_t size)
+{
+	gfp_t gfp_flags = GFP_KERNEL | __GFP_ZERO | __GFP_NOWARN | __GFP_COMP |
+				__GFP_NORETRY;
+
+	return (void *) __get_free_pages(gfp_flags, get_order(size));
+}
+
+static void io_mem_free(void *ptr)
+{
+	if (ptr)
+		put_page(virt_to_head_page(ptr));
+}
+
+static int io_allocate_scq_urings(struct io_ring_ctx *ctx,
+				  struct io_uring_params *p)
+{
+	struct io_sq_ring *sq_ring;
+	struct io_cq_ring *cq_ring;
+
+	sq_ring = io_mem_alloc(io_sq_ring_bytes(p->sq_entries));
+	if (!sq_ring)
+		return -ENOMEM;
+
+	ctx->sq_ring = sq_ring;
+	sq_ring->ring_mask = p->sq_entries - 1;
+	sq_ring->ring_entries = p->sq_entries;
+	ctx->sq_mask = sq_ring->ring_mask;
+
+	ctx->sq_sqes = io_mem_alloc(p->sq_entries *
+				    sizeof(struct io_uring_sqe));
+	if (!ctx->sq_sqes)
+		return -ENOMEM;
+
+	cq_ring = io_mem_alloc(io_cq_ring_bytes(p->cq_entries));
+	if (!cq_ring)
+		return -ENOMEM;
+
+	ctx->cq_ring = cq_ring;
+	cq_ring->ring_mask = p->cq_entries - 1;
+	cq_ring->ring_entries = p->cq_entries;
+	ctx->cq_mask = cq_ring->ring_mask;
+	return 0;
+}
+
+static void io_sq_thread_stop(struct io_ring_ctx *ctx)
+{
+	if (ctx->sqo_thread) {
+		kthread_stop(ctx->sqo_thread);
+		put_task_struct(ctx->sqo_thread);
+		ctx->sqo_thread = NULL;
+	}
+}
+
+static int io_sq_offload_start(struct io_ring_ctx *ctx,
+			       struct io_uring_params *p)
+{
+	int ret;
+
+	/* keep the mm_struct around; workers only pin it while in use */
+	atomic_inc(&current->mm->mm_count);
+	ctx->sqo_mm = current->mm;
+
+	ctx->sqo_wq = alloc_workqueue("io_ring-wq", WQ_UNBOUND | WQ_FREEZABLE,
+				      min(ctx->sq_entries - 1,
+					  2 * num_online_cpus()));
+	if (!ctx->sqo_wq) {
+		ret = -ENOMEM;
+		goto err;
+	}
+
+	if (ctx->flags & IORING_SETUP_SQPOLL) {
+		ret = -EPERM;
+		if (!capable(CAP_SYS_ADMIN))
+			goto err;
+
+		ctx->sq_thread_idle = msecs_to_jiffies(p->sq_thread_idle);
+		if (!ctx->sq_thread_idle)
+			ctx->sq_thread_idle = HZ;
+
+		if (p->flags & IORING_SETUP_SQ_AFF) {
+			ret = -EINVAL;
+			if (p->sq_thread_cpu >= nr_cpu_ids ||
+			    !cpu_online(p->sq_thread_cpu))
+				goto err;
+		}
+
+		ctx->sqo_thread = kthread_create(io_sq_thread, ctx,
+						 "io_uring-sq");
+		if (IS_ERR(ctx->sqo_thread)) {
+			ret = PTR_ERR(ctx->sqo_thread);
+			ctx->sqo_thread = NULL;
+			goto err;
+		}
+		get_task_struct(ctx->sqo_thread);
+		if (p->flags & IORING_SETUP_SQ_AFF)
+			kthread_bind(ctx->sqo_thread, p->sq_thread_cpu);
+		wake_up_process(ctx->sqo_thread);
+	} else if (p->flags & IORING_SETUP_SQ_AFF) {
+		/* Can't have SQ_AFF without SQPOLL */
+		ret = -EINVAL;
+		goto err;
+	}
+
+	return 0;
+err:
+	if (ctx->sqo_wq) {
+		destroy_workqueue(ctx->sqo_wq);
+		ctx->sqo_wq = NULL;
+	}
+	mmdrop(ctx->sqo_mm);
+	ctx->sqo_mm = NULL;
+	return ret;
+}
+
+static void io_ring_ctx_free(struct io_ring_ctx *ctx)
+{
+	io_sq_thread_stop(ctx);
+	if (ctx->sqo_wq)
+		destroy_workqueue(ctx->sqo_wq);
+	if (ctx->sqo_mm)
+		mmdrop(ctx->sqo_mm);
+	if (ctx->creds)
+		put_cred(ctx->creds);
+
+	io_sqe_buffer_unregister(ctx);
+	io_sqe_files_unregister(ctx);
+
+	io_mem_free(ctx->sq_ring);
+	io_mem_free(ctx->sq_sqes);
+	io_mem_free(ctx->cq_ring);
+
+	percpu_ref_exit(&ctx->refs);
+	if (ctx->account_mem)
+		io_unaccount_mem(ctx->user,
+				 ring_pages(ctx->sq_entries, ctx->cq_entries));
+	free_uid(ctx->user);
+	kfree(ctx);
+}
+
+static unsigned int io_uring_poll(struct file *file, poll_table *wait)
+{
+	struct io_ring_ctx *ctx = file->private_data;
+	unsigned int mask = 0;
+
+	poll_wait(file, &ctx->cq_wait, wait);
+	if (smp_load_acquire(&ctx->sq_ring->r.tail) - ctx->cached_sq_head !=
+	    ctx->sq_entries)
+		mask |= POLLOUT | POLLWRNORM;
+	if (READ_ONCE(ctx->cq_ring->r.head) != ctx->cached_cq_tail)
+		mask |= POLLIN | POLLRDNORM;
+
+	return mask;
+}
+
+static void io_ring_ctx_wait_and_kill(struct io_ring_ctx *ctx)
+{
+	mutex_lock(&ctx->uring_lock);
+	/* an interrupted io_uring_register() may have killed it already */
+	if (!percpu_ref_is_dying(&ctx->refs))
+		percpu_ref_kill(&ctx->refs);
+	mutex_unlock(&ctx->uring_lock);
+
+	/* armed polls would otherwise hold their references forever */
+	io_poll_remove_all(ctx);
+	wait_for_completion(&ctx->ctx_done);
+	io_ring_ctx_free(ctx);
+}
+
+static int io_uring_release(struct inode *inode, struct file *file)
+{
+	struct io_ring_ctx *ctx = file->private_data;
+
+	file->private_data = NULL;
+	io_ring_ctx_wait_and_kill(ctx);
+	return 0;
+}
+
+static int io_uring_mmap(struct file *file, struct vm_area_struct *vma)
+{
+	loff_t offset = (loff_t) vma->vm_pgoff << PAGE_SHIFT;
+	unsigned long sz = vma->vm_end - vma->vm_start;
+	struct io_ring_ctx *ctx = file->private_data;
+	unsigned long pfn;
+	struct page *page;
+	void *ptr;
+
+	switch (offset) {
+	case IORING_OFF_SQ_RING:
+		ptr = ctx->sq_ring;
+		break;
+	case IORING_OFF_SQES:
+		ptr = ctx->sq_sqes;
+		break;
+	case IORING_OFF_CQ_RING:
+		ptr = ctx->cq_ring;
+		break;
+	default:
+		return -EINVAL;
+	}
+
+	page = virt_to_head_page(ptr);
+	if (sz > (PAGE_SIZE << compound_order(page)))
+		return -EINVAL;
+
+	pfn = virt_to_phys(ptr) >> PAGE_SHIFT;
+	return remap_pfn_range(vma, vma->vm_start, pfn, sz, vma->vm_page_prot);
+}
+
+SYSCALL_DEFINE6(io_uring_enter, unsigned int, fd, u32, to_submit,
+		u32, min_complete, u32, flags, const sigset_t __user *, sig,
+		size_t, sigsz)
+{
+	struct io_ring_ctx *ctx;
+	long ret = -EBADF;
+	int submitted = 0;
+	struct fd f;
+
+	if (flags & ~(IORING_ENTER_GETEVENTS | IORING_ENTER_SQ_WAKEUP))
+		return -EINVAL;
+
+	f = fdget(fd);
+	if (!f.file)
+		return -EBADF;
+
+	ret = -EOPNOTSUPP;
+	if (f.file->f_op != &io_uring_fops)
+		goto out_fput;
+
+	ret = -ENXIO;
+	ctx = f.file->private_data;
+	if (!percpu_ref_tryget(&ctx->refs))
+		goto out_fput;
+
+	/*
+	 * For SQ polling, the thread will do all submissions and completions.
+	 * Just return the requested submit count, and wake the thread if
+	 * we were asked to.
+	 */
+	ret = 0;
+	if (ctx->flags & IORING_SETUP_SQPOLL) {
+		if (flags & IORING_ENTER_SQ_WAKEUP)
+			wake_up(&ctx->sqo_wait);
+		submitted = to_submit;
+	} else if (to_submit) {
+		to_submit = min(to_submit, ctx->sq_entries);
+
+		mutex_lock(&ctx->uring_lock);
+		submitted = io_ring_submit(ctx, to_submit, false);
+		mutex_unlock(&ctx->uring_lock);
+	}
+	if (flags & IORING_ENTER_GETEVENTS) {
+		min_complete = min(min_complete, ctx->cq_entries);
+		ret = io_cqring_wait(ctx, min_complete, sig, sigsz);
+	}
+
+	percpu_ref_put(&ctx->refs);
+out_fput:
+	fdput(f);
+	return submitted ? submitted : ret;
+}
+
+static const struct file_operations io_uring_fops = {
+	.release	= io_uring_release,
+	.mmap		= io_uring_mmap,
+	.poll		= io_uring_poll,
+};
+
+static int io_uring_get_fd(struct io_ring_ctx *ctx)
+{
+	struct file *file;
+	int ret;
+
+	ret = get_unused_fd_flags(O_RDWR | O_CLOEXEC);
+	if (ret < 0)
+		return ret;
+
+	file = anon_inode_getfile("[io_uring]", &io_uring_fops, ctx,
+				  O_RDWR | O_CLOEXEC);
+	if (IS_ERR(file)) {
+		put_unused_fd(ret);
+		return PTR_ERR(file);
+	}
+
+	fd_install(ret, file);
+	return ret;
+}
+
+static int io_uring_create(unsigned entries, struct io_uring_params *p,
+			   struct io_uring_params __user *params)
+{
+	struct user_struct *user;
+	struct io_ring_ctx *ctx;
+	bool account_mem;
+	int ret;
+
+	if (!entries || entries > IORING_MAX_ENTRIES)
+		return -EINVAL;
+
+	/*
+	 * Use twice as many entries for the CQ ring. It's possible for the
+	 * application to drive a higher depth than the size of the SQ ring,
+	 * since the sqes are only used at submission time. This allows for
+	 * some flexibility in overcommitting a bit.
+	 */
+	p->sq_entries = roundup_pow_of_two(entries);
+	p->cq_entries = 2 * p->sq_entries;
+
+	user = get_uid(current_user());
+	account_mem = !capable(CAP_IPC_LOCK);
+
+	if (account_mem) {
+		ret = io_account_mem(user,
+				     ring_pages(p->sq_entries, p->cq_entries));
+		if (ret) {
+			free_uid(user);
+			return ret;
+		}
+	}
+
+	ctx = io_ring_ctx_alloc(p);
+	if (!ctx) {
+		if (account_mem)
+			io_unaccount_mem(user, ring_pages(p->sq_entries,
+							  p->cq_entries));
+		free_uid(user);
+		return -ENOMEM;
+	}
+	ctx->compat = in_compat_syscall();
+	ctx->account_mem = account_mem;
+	ctx->user = user;
+	/* punted requests must pass the same permission checks */
+	ctx->creds = get_current_cred();
+	ctx->fsize_limit = rlimit(RLIMIT_FSIZE);
+
+	ret = io_allocate_scq_urings(ctx, p);
+	if (ret)
+		goto err;
+
+	ret = io_sq_offload_start(ctx, p);
+	if (ret)
+		goto err;
+
+	memset(&p->sq_off, 0, sizeof(p->sq_off));
+	p->sq_off.head = offsetof(struct io_sq_ring, r.head);
+	p->sq_off.tail = offsetof(struct io_sq_ring, r.tail);
+	p->sq_off.ring_mask = offsetof(struct io_sq_ring, ring_mask);
+	p->sq_off.ring_entries = offsetof(struct io_sq_ring, ring_entries);
+	p->sq_off.flags = offsetof(struct io_sq_ring, flags);
+	p->sq_off.dropped = offsetof(struct io_sq_ring, dropped);
+	p->sq_off.array = offsetof(struct io_sq_ring, array);
+
+	memset(&p->cq_off, 0, sizeof(p->cq_off));
+	p->cq_off.head = offsetof(struct io_cq_ring, r.head);
+	p->cq_off.tail = offsetof(struct io_cq_ring, r.tail);
+	p->cq_off.ring_mask = offsetof(struct io_cq_ring, ring_mask);
+	p->cq_off.ring_entries = offsetof(struct io_cq_ring, ring_entries);
+	p->cq_off.overflow = offsetof(struct io_cq_ring, overflow);
+	p->cq_off.cqes = offsetof(struct io_cq_ring, cqes);
+
+	/* copy out before the fd exists, there's no undoing fd_install() */
+	ret = -EFAULT;
+	if (copy_to_user(params, p, sizeof(*p)))
+		goto err;
+
+	ret = io_uring_get_fd(ctx);
+	if (ret < 0)
+		goto err;
+	return ret;
+err:
+	io_ring_ctx_wait_and_kill(ctx);
+	return ret;
+}
+
+/*
+ * Sets up an aio uring context, and returns the fd. Applications asks for a
+ * ring size, we return the actual sq/cq ring sizes (among other things) in the
+ * params structure passed in.
+ */
+SYSCALL_DEFINE2(io_uring_setup, u32, entries,
+		struct io_uring_params __user *, params)
+{
+	struct io_uring_params p;
+	int i;
+
+	if (copy_from_user(&p, params, sizeof(p)))
+		return -EFAULT;
+	for (i = 0; i < ARRAY_SIZE(p.resv); i++) {
+		if (p.resv[i])
+			return -EINVAL;
+	}
+
+	if (p.flags & ~(IORING_SETUP_SQPOLL | IORING_SETUP_SQ_AFF))
+		return -EINVAL;
+
+	return io_uring_create(entries, &p, params);
+}
+
+/*
+ * Registered files and buffers may be in use by any request in flight, so
+ * the ring is quiesced first: new submissions fail to take a reference
+ * while we wait for the existing ones to drain.
+ */
+static int __io_uring_register(struct io_ring_ctx *ctx, unsigned opcode,
+			       void __user *arg, unsigned nr_args)
+	__releases(ctx->uring_lock)
+	__acquires(ctx->uring_lock)
+{
+	int ret;
+
+	/*
+	 * We're inside the ring mutex, if the ref is already dying, then
+	 * someone else killed the ctx or is already going through
+	 * io_uring_register().
+	 */
+	if (percpu_ref_is_dying(&ctx->refs))
+		return -ENXIO;
+
+	percpu_ref_kill(&ctx->refs);
+
+	/*
+	 * Drop uring mutex before waiting for references to exit. If another
+	 * thread is currently inside io_uring_enter() it might need to grab
+	 * the uring_lock to make progress. If we hold it here across the drain
+	 * wait, then we can deadlock. It's safe to drop the mutex here, since
+	 * no new references will come in after we've killed the percpu ref.
+	 *
+	 * An armed poll or a punted read from a pipe can hold its reference
+	 * indefinitely, so let the wait be killed.  The ref can't be brought
+	 * back before it drops to zero, so the ring stays dead then; the
+	 * task is going away anyway, and release still waits for the
+	 * requests in flight.
+	 */
+	mutex_unlock(&ctx->uring_lock);
+	ret = wait_for_completion_killable(&ctx->ctx_done);
+	mutex_lock(&ctx->uring_lock);
+	if (ret)
+		return -EINTR;
+
+	switch (opcode) {
+	case IORING_REGISTER_BUFFERS:
+		ret = io_sqe_buffer_register(ctx, arg, nr_args);
+		break;
+	case IORING_UNREGISTER_BUFFERS:
+		ret = -EINVAL;
+		if (arg || nr_args)
+			break;
+		ret = io_sqe_buffer_unregister(ctx);
+		break;
+	case IORING_REGISTER_FILES:
+		ret = io_sqe_files_register(ctx, arg, nr_args);
+		break;
+	case IORING_UNREGISTER_FILES:
+		ret = -EINVAL;
+		if (arg || nr_args)
+			break;
+		ret = io_sqe_files_unregister(ctx);
+		break;
+	default:
+		ret = -EINVAL;
+		break;
+	}
+
+	/* bring the ctx back to life */
+	reinit_completion(&ctx->ctx_done);
+	percpu_ref_reinit(&ctx->refs);
+	return ret;
+}
+
+SYSCALL_DEFINE4(io_uring_register, unsigned int, fd, unsigned int, opcode,
+		void __user *, arg, unsigned int, nr_args)
+{
+	struct io_ring_ctx *ctx;
+	long ret = -EBADF;
+	struct fd f;
+
+	f = fdget(fd);
+	if (!f.file)
+		return -EBADF;
+
+	ret = -EOPNOTSUPP;
+	if (f.file->f_op != &io_uring_fops)
+		goto out_fput;
+
+	ctx = f.file->private_data;
+
+	mutex_lock(&ctx->uring_lock);
+	ret = __io_uring_register(ctx, opcode, arg, nr_args);
+	mutex_unlock(&ctx->uring_lock);
+out_fput:
+	fdput(f);
+	return ret;
+}
+
+static int __init io_uring_init(void)
+{
+	req_cachep = KMEM_CACHE(io_kiocb, SLAB_HWCACHE_ALIGN | SLAB_PANIC);
+	return 0;
+}
+__initcall(io_uring_init);
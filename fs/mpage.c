@@ -313,6 +313,34 @@ confused:
 	goto out;
 }
 
+/*
+ * Add a batch of pages at consecutive indices to the page cache and LRU in
+ * one go, then map and read them in order.  @nr_left is the number of
+ * pages left in the readahead list, counting from the first one in @pvec.
+ */
+static struct bio *
+mpage_readpages_batch(struct address_space *mapping, struct pagevec *pvec,
+		unsigned nr_left, struct bio *bio, sector_t *last_block_in_bio,
+		struct buffer_head *map_bh, unsigned long *first_logical_block,
+		get_block_t get_block, gfp_t gfp)
+{
+	pgoff_t first = pvec->pages[0]->index;
+	unsigned i, nr;
+
+	nr = add_to_page_cache_lru_batch(pvec, mapping, gfp);
+	for (i = 0; i < nr; i++) {
+		struct page *page = pvec->pages[i];
+
+		bio = do_mpage_readpage(bio, page,
+				nr_left - (page->index - first),
+				last_block_in_bio, map_bh,
+				first_logical_block, get_block, gfp);
+		put_page(page);
+	}
+	pagevec_reinit(pvec);
+	return bio;
+}
+
 /**
  * mpage_readpages - populate an address space with some pages & start reads against them
  * @mapping: the address_space
@@ -324,7 +352,8 @@ confused:
  * @get_block: The filesystem's block mapper function.
  *
  * This function walks the pages and the blocks within each page, building and
- * emitting large BIOs.
+ * emitting large BIOs.  Runs of small pages at consecutive indices are added
+ * to the page cache and the LRU a pagevec at a time, large pages one by one.
  *
  * If anything unusual happens, such as:
  *
@@ -361,30 +390,55 @@ mpage_readpages(struct address_space *mapping, struct list_head *pages,
 				unsigned nr_pages, get_block_t get_block)
 {
 	struct bio *bio = NULL;
-	unsigned page_idx;
+	unsigned page_idx, batch_idx = 0;
 	sector_t last_block_in_bio = 0;
 	struct buffer_head map_bh;
 	unsigned long first_logical_block = 0;
 	gfp_t gfp = readahead_gfp_mask(mapping);
+	struct pagevec pvec;
 
 	map_bh.b_state = 0;
 	map_bh.b_size = 0;
+	pagevec_init(&pvec, 0);
 	for (page_idx = 0; page_idx < nr_pages; page_idx++) {
 		struct page *page = lru_to_page(pages);
 
 		prefetchw(&page->flags);
 		list_del(&page->lru);
-		if (!add_to_page_cache_lru(page, mapping,
-					page->index,
-					gfp)) {
-			bio = do_mpage_readpage(bio, page,
-					nr_pages - page_idx,
+		if (pagevec_count(&pvec) &&
+		    (PageTransHuge(page) || page->index !=
+		     pvec.pages[pagevec_count(&pvec) - 1]->index + 1))
+			bio = mpage_readpages_batch(mapping, &pvec,
+					nr_pages - batch_idx, bio,
 					&last_block_in_bio, &map_bh,
-					&first_logical_block,
-					get_block, gfp);
+					&first_logical_block, get_block, gfp);
+
+		/* Large pages go in on their own, as in read_pages() */
+		if (PageTransHuge(page)) {
+			if (!add_to_page_cache_lru(page, mapping, page->index,
+						   gfp))
+				bio = do_mpage_readpage(bio, page,
+						nr_pages - page_idx,
+						&last_block_in_bio, &map_bh,
+						&first_logical_block,
+						get_block, gfp);
+			put_page(page);
+			continue;
 		}
-		put_page(page);
+
+		if (!pagevec_count(&pvec))
+			batch_idx = page_idx;
+		if (!pagevec_add(&pvec, page))
+			bio = mpage_readpages_batch(mapping, &pvec,
+					nr_pages - batch_idx, bio,
+					&last_block_in_bio, &map_bh,
+					&first_logical_block, get_block, gfp);
 	}
+	if (pagevec_count(&pvec))
+		bio = mpage_readpages_batch(mapping, &pvec,
+				nr_pages - batch_idx, bio,
+				&last_block_in_bio, &map_bh,
+				&first_logical_block, get_block, gfp);
 	BUG_ON(!list_empty(pages));
 	if (bio)
 		mpage_bio_submit(REQ_OP_READ, 0, bio);
@@ -489,7 +543,7 @@ static int __mpage_writepage(struct page *page, struct writeback_control *wbc,
 	struct buffer_head map_bh;
 	loff_t i_size = i_size_read(inode);
 	int ret = 0;
-	int op_flags = (wbc->sync_mode == WB_SYNC_ALL ?  WRITE_SYNC : 0);
+	int op_flags = wbc_to_write_flags(wbc);
 
 	if (page_has_buffers(page)) {
 		struct buffer_head *head = page_buffers(page);
@@ -704,8 +758,8 @@ mpage_writepages(struct address_space *mapping,
 
 		ret = write_cache_pages(mapping, wbc, __mpage_writepage, &mpd);
 		if (mpd.bio) {
-			int op_flags = (wbc->sync_mode == WB_SYNC_ALL ?
-				  WRITE_SYNC : 0);
+			int op_flags = wbc_to_write_flags(wbc);
+
 			mpage_bio_submit(REQ_OP_WRITE, op_flags, mpd.bio);
 		}
 	}
@@ -725,8 +779,8 @@ int mpage_writepage(struct page *page, get_block_t get_block,
 	};
 	int ret = __mpage_writepage(page, wbc, &mpd);
 	if (mpd.bio) {
-		int op_flags = (wbc->sync_mode == WB_SYNC_ALL ?
-			  WRITE_SYNC : 0);
+		int op_flags = wbc_to_write_flags(wbc);
+
 		mpage_bio_submit(REQ_OP_WRITE, op_flags, mpd.bio);
 	}
 	return ret;
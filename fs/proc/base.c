@@ -87,6 +87,8 @@
 #include <linux/slab.h>
 #include <linux/flex_array.h>
 #include <linux/posix-timers.h>
+#include <linux/khugepaged.h>
+#include <linux/ksm.h>
 #ifdef CONFIG_HARDWALL
 #include <asm/hardwall.h>
 #endif
@@ -2822,6 +2824,45 @@ static int proc_pid_personality(struct seq_file *m, struct pid_namespace *ns,
 	return err;
 }
 
+#ifdef CONFIG_TRANSPARENT_HUGEPAGE
+static int proc_pid_khugepaged_stat(struct seq_file *m,
+				    struct pid_namespace *ns,
+				    struct pid *pid, struct task_struct *task)
+{
+	struct mm_struct *mm;
+	int err = lock_trace(task);
+
+	if (err)
+		return err;
+	mm = get_task_mm(task);
+	if (mm) {
+		khugepaged_show_mm_stat(m, mm);
+		mmput(mm);
+	}
+	unlock_trace(task);
+	return 0;
+}
+#endif
+
+#ifdef CONFIG_KSM
+static int proc_pid_ksm_stat(struct seq_file *m, struct pid_namespace *ns,
+			     struct pid *pid, struct task_struct *task)
+{
+	struct mm_struct *mm;
+	int err = lock_trace(task);
+
+	if (err)
+		return err;
+	mm = get_task_mm(task);
+	if (mm) {
+		ksm_show_mm_stat(m, mm);
+		mmput(mm);
+	}
+	unlock_trace(task);
+	return 0;
+}
+#endif
+
 /*
  * Thread groups
  */
@@ -2913,6 +2954,12 @@ static const struct pid_entry tgid_base_stuff[] = {
 #ifdef CONFIG_TASK_IO_ACCOUNTING
 	ONE("io",	S_IRUSR, proc_tgid_io_accounting),
 #endif
+#ifdef CONFIG_TRANSPARENT_HUGEPAGE
+	ONE("khugepaged_stat", S_IRUSR, proc_pid_khugepaged_stat),
+#endif
+#ifdef CONFIG_KSM
+	ONE("ksm_stat",   S_IRUSR, proc_pid_ksm_stat),
+#endif
 #ifdef CONFIG_HARDWALL
 	ONE("hardwall",   S_IRUGO, proc_pid_hardwall),
 #endif
@@ -0,0 +1,126 @@
+/*
+ * Inline encryption contexts for bios, see block/blk-crypto.c
+ */
+#ifndef _LINUX_BLK_CRYPTO_H
+#define _LINUX_BLK_CRYPTO_H
+
+#include <linux/types.h>
+#include <linux/log2.h>
+#include <linux/blk_types.h>
+
+enum blk_crypto_mode_num {
+	BLK_ENCRYPTION_MODE_INVALID,
+	BLK_ENCRYPTION_MODE_AES_256_XTS,
+	BLK_ENCRYPTION_MODE_MAX,
+};
+
+#define BLK_CRYPTO_MAX_KEY_SIZE		64
+
+struct crypto_skcipher;
+struct mempool_s;
+struct request_queue;
+
+/**
+ * struct blk_crypto_key - an inline encryption key
+ * @mode: encryption algorithm
+ * @data_unit_size: data units are en/decrypted separately, with their data
+ *	unit number as IV; a power of two from 512 bytes to PAGE_SIZE
+ * @size: size of @raw in bytes
+ * @raw: the key itself
+ * @fallback_tfm: cipher for the software fallback
+ * @fallback_pool: cipher requests for the software fallback
+ *
+ * Set up with blk_crypto_init_key().  A key must outlive all bios using it.
+ */
+struct blk_crypto_key {
+	enum blk_crypto_mode_num mode;
+	unsigned int data_unit_size;
+	unsigned int size;
+	u8 raw[BLK_CRYPTO_MAX_KEY_SIZE];
+	struct crypto_skcipher *fallback_tfm;
+	struct mempool_s *fallback_pool;
+};
+
+/**
+ * struct bio_crypt_ctx - encryption context of a bio
+ * @bc_key: the key
+ * @bc_dun: data unit number of the first data unit of the bio
+ */
+struct bio_crypt_ctx {
+	const struct blk_crypto_key *bc_key;
+	u64 bc_dun;
+};
+
+#ifdef CONFIG_BLK_INLINE_ENCRYPTION
+
+int blk_crypto_init_key(struct blk_crypto_key *key, const u8 *raw,
+			unsigned int size, enum blk_crypto_mode_num mode,
+			unsigned int data_unit_size);
+void blk_crypto_free_key(struct blk_crypto_key *key);
+void blk_queue_inline_crypto(struct request_queue *q,
+			     enum blk_crypto_mode_num mode,
+			     unsigned int data_unit_sizes);
+bool blk_crypto_bio_prep(struct bio **bio_ptr);
+
+int bio_crypt_set_ctx(struct bio *bio, const struct blk_crypto_key *key,
+		      u64 dun, gfp_t gfp_mask);
+void bio_crypt_free_ctx(struct bio *bio);
+int bio_crypt_clone(struct bio *dst, struct bio *src, gfp_t gfp_mask);
+void bio_crypt_advance(struct bio *bio, unsigned int bytes);
+
+static inline bool bio_has_crypt_ctx(struct bio *bio)
+{
+	return bio->bi_crypt_context;
+}
+
+/*
+ * Can the data of @b2 directly follow the @b1_bytes of @b1 in one IO?
+ * Only if they are encrypted with the same key and consecutive data units,
+ * or not at all.
+ */
+static inline bool bio_crypt_ctx_mergeable(struct bio *b1,
+					   unsigned int b1_bytes,
+					   struct bio *b2)
+{
+	struct bio_crypt_ctx *bc1 = b1->bi_crypt_context;
+	struct bio_crypt_ctx *bc2 = b2->bi_crypt_context;
+
+	if (!bc1 || !bc2)
+		return !bc1 && !bc2;
+	if (bc1->bc_key != bc2->bc_key)
+		return false;
+	return bc1->bc_dun + (b1_bytes >> ilog2(bc1->bc_key->data_unit_size)) ==
+		bc2->bc_dun;
+}
+
+#else /* CONFIG_BLK_INLINE_ENCRYPTION */
+
+static inline bool blk_crypto_bio_prep(struct bio **bio_ptr)
+{
+	return true;
+}
+
+static inline void bio_crypt_free_ctx(struct bio *bio) { }
+static inline void bio_crypt_advance(struct bio *bio, unsigned int bytes) { }
+
+static inline int bio_crypt_clone(struct bio *dst, struct bio *src,
+				  gfp_t gfp_mask)
+{
+	return 0;
+}
+
+static inline bool bio_has_crypt_ctx(struct bio *bio)
+{
+	return false;
+}
+
+static inline bool bio_crypt_ctx_mergeable(struct bio *b1,
+					   unsigned int b1_bytes,
+					   struct bio *b2)
+{
+	return true;
+}
+
+#endif /* CONFIG_BLK_INLINE_ENCRYPTION */
+
+#endif /* _LINUX_BLK_CRYPTO_H */
@@ -60,12 +60,20 @@ struct bio {
 	 */
 	struct io_context	*bi_ioc;
 	struct cgroup_subsys_state *bi_css;
+#ifdef CONFIG_BLK_DEV_THROTTLING
+	/* issuing group and issue time, for latency targets */
+	void			*bi_cg_private;
+	u64			bi_issue_time;
+#endif
 #endif
 	union {
 #if defined(CONFIG_BLK_DEV_INTEGRITY)
 		struct bio_integrity_payload *bi_integrity; /* data integrity */
 #endif
 	};
+#ifdef CONFIG_BLK_INLINE_ENCRYPTION
+	struct bio_crypt_ctx	*bi_crypt_context;	/* see blk-crypto.h */
+#endif
 
 	unsigned short		bi_vcnt;	/* how many bio_vec's */
 
@@ -160,6 +168,7 @@ enum rq_flag_bits {
 	__REQ_RAHEAD,		/* read ahead, can fail anytime */
 	__REQ_THROTTLED,	/* This bio has already been subjected to
 				 * throttling rules. Don't do it again. */
+	__REQ_BACKGROUND,	/* background writeback */
 
 	/* request only flags */
 	__REQ_SORTED,		/* elevator knows about this request */
@@ -182,6 +191,8 @@ enum rq_flag_bits {
 	__REQ_PM,		/* runtime pm request */
 	__REQ_HASHED,		/* on IO scheduler merge hash */
 	__REQ_MQ_INFLIGHT,	/* track inflight for MQ */
+	__REQ_WBT,		/* counted by writeback throttling */
+	__REQ_ZONE_WRITE_LOCKED,	/* holds its zone's write lock */
 	__REQ_NR_BITS,		/* stops here */
 };
 
@@ -207,6 +218,7 @@ enum rq_flag_bits {
 
 #define REQ_RAHEAD		(1ULL << __REQ_RAHEAD)
 #define REQ_THROTTLED		(1ULL << __REQ_THROTTLED)
+#define REQ_BACKGROUND		(1ULL << __REQ_BACKGROUND)
 
 #define REQ_SORTED		(1ULL << __REQ_SORTED)
 #define REQ_SOFTBARRIER		(1ULL << __REQ_SOFTBARRIER)
@@ -228,6 +240,8 @@ enum rq_flag_bits {
 #define REQ_PM			(1ULL << __REQ_PM)
 #define REQ_HASHED		(1ULL << __REQ_HASHED)
 #define REQ_MQ_INFLIGHT		(1ULL << __REQ_MQ_INFLIGHT)
+#define REQ_WBT			(1ULL << __REQ_WBT)
+#define REQ_ZONE_WRITE_LOCKED	(1ULL << __REQ_ZONE_WRITE_LOCKED)
 
 enum req_op {
 	REQ_OP_READ,
@@ -236,6 +250,7 @@ enum req_op {
 	REQ_OP_SECURE_ERASE,	/* request to securely erase sectors */
 	REQ_OP_WRITE_SAME,	/* write same block many times */
 	REQ_OP_FLUSH,		/* request for cache flush */
+	REQ_OP_ZONE_RESET,	/* reset a zone write pointer */
 };
 
 #define REQ_OP_BITS 3
@@ -131,10 +131,15 @@ static inline spinlock_t *pmd_trans_huge_lock(pmd_t *pmd,
 	else
 		return NULL;
 }
+
+/*
+ * Transparent huge pages are HPAGE_PMD_ORDER, but large page cache pages
+ * (see mapping_large_pages()) can be of any order up to that.
+ */
 static inline int hpage_nr_pages(struct page *page)
 {
 	if (unlikely(PageTransHuge(page)))
-		return HPAGE_PMD_NR;
+		return 1 << compound_order(page);
 	return 1;
 }
 
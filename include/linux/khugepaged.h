@@ -3,6 +3,11 @@
 
 #include <linux/sched.h> /* MMF_VM_HUGEPAGE */
 
+struct seq_file;
+
+/* Highest per-mm scan priority settable via PR_SET_KHUGEPAGED_PRIO */
+#define KHUGEPAGED_PRIO_MAX	16
+
 #ifdef CONFIG_TRANSPARENT_HUGEPAGE
 extern struct attribute_group khugepaged_attr_group;
 
@@ -13,6 +18,13 @@ extern int __khugepaged_enter(struct mm_struct *mm);
 extern void __khugepaged_exit(struct mm_struct *mm);
 extern int khugepaged_enter_vma_merge(struct vm_area_struct *vma,
 				      unsigned long vm_flags);
+extern int khugepaged_madvise_collapse(struct vm_area_struct *vma,
+				       struct vm_area_struct **prev,
+				       unsigned long start, unsigned long end,
+				       bool async);
+extern int khugepaged_set_mm_priority(struct mm_struct *mm, int prio);
+extern int khugepaged_get_mm_priority(struct mm_struct *mm);
+extern void khugepaged_show_mm_stat(struct seq_file *m, struct mm_struct *mm);
 
 #define khugepaged_enabled()					       \
 	(transparent_hugepage_flags &				       \
@@ -70,6 +82,14 @@ static inline int khugepaged_enter_vma_merge(struct vm_area_struct *vma,
 {
 	return 0;
 }
+static inline int khugepaged_set_mm_priority(struct mm_struct *mm, int prio)
+{
+	return -EINVAL;
+}
+static inline int khugepaged_get_mm_priority(struct mm_struct *mm)
+{
+	return -EINVAL;
+}
 #endif /* CONFIG_TRANSPARENT_HUGEPAGE */
 
 #endif /* _LINUX_KHUGEPAGED_H */
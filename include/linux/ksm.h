@@ -15,6 +15,7 @@
 
 struct stable_node;
 struct mem_cgroup;
+struct seq_file;
 
 #ifdef CONFIG_KSM
 int ksm_madvise(struct vm_area_struct *vma, unsigned long start,
@@ -62,6 +63,7 @@ struct page *ksm_might_need_to_copy(struct page *page,
 
 int rmap_walk_ksm(struct page *page, struct rmap_walk_control *rwc);
 void ksm_migrate_page(struct page *newpage, struct page *oldpage);
+void ksm_show_mm_stat(struct seq_file *m, struct mm_struct *mm);
 
 #else  /* !CONFIG_KSM */
 
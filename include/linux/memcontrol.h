@@ -102,9 +102,17 @@ struct mem_cgroup_id {
 	atomic_t ref;
 };
 
+/*
+ * Statistics updates are batched in per-cpu deltas. Once a delta exceeds
+ * MEMCG_STAT_BATCH it is folded into the memcg's atomic local counter and
+ * into the hierarchical counters of the memcg and all its ancestors, so
+ * that reads never have to walk cpus or descendants.
+ */
+#define MEMCG_STAT_BATCH	32
+
 struct mem_cgroup_stat_cpu {
-	long count[MEMCG_NR_STAT];
-	unsigned long events[MEMCG_NR_EVENTS];
+	long count[MEMCG_NR_STAT];		/* unfolded deltas */
+	unsigned long events[MEMCG_NR_EVENTS];	/* unfolded deltas */
 	unsigned long nr_page_events;
 	unsigned long targets[MEM_CGROUP_NTARGETS];
 };
@@ -192,6 +200,19 @@ struct mem_cgroup {
 	/* Range enforcement for interrupt charges */
 	struct work_struct high_work;
 
+	/*
+	 * Asynchronous reclaim: once usage exceeds async_ratio percent of
+	 * the lower of high and max, async_work reclaims back below it.
+	 */
+	unsigned int async_ratio;
+	struct work_struct async_work;
+
+	/* Time spent and pages reclaimed off and on the charge path */
+	atomic64_t async_reclaim_ns;
+	atomic_long_t async_reclaim_pages;
+	atomic64_t direct_reclaim_ns;
+	atomic_long_t direct_reclaim_pages;
+
 	unsigned long soft_limit;
 
 	/* vmpressure notifications */
@@ -243,6 +264,12 @@ struct mem_cgroup {
 	 */
 	struct mem_cgroup_stat_cpu __percpu *stat;
 
+	/* Folded statistics: this memcg only, and its whole subtree */
+	atomic_long_t		stat_local[MEMCG_NR_STAT];
+	atomic_long_t		stat_tree[MEMCG_NR_STAT];
+	atomic_long_t		events_local[MEMCG_NR_EVENTS];
+	atomic_long_t		events_tree[MEMCG_NR_EVENTS];
+
 	unsigned long		socket_pressure;
 
 	/* Legacy tcp memory accounting */
@@ -282,6 +309,60 @@ static inline bool mem_cgroup_disabled(void)
 	return !cgroup_subsys_enabled(memory_cgrp_subsys);
 }
 
+void memcg_fold_stat(struct mem_cgroup *memcg, int idx, long val);
+void memcg_fold_events(struct mem_cgroup *memcg, int idx, unsigned long val);
+
+/*
+ * __mod_memcg_stat - update a memcg statistic with irqs disabled
+ * @memcg: the memory cgroup
+ * @idx: the statistic index
+ * @val: the delta (positive or negative)
+ */
+static inline void __mod_memcg_stat(struct mem_cgroup *memcg, int idx,
+				    int val)
+{
+	long x;
+
+	x = val + __this_cpu_read(memcg->stat->count[idx]);
+	if (unlikely(abs(x) > MEMCG_STAT_BATCH)) {
+		memcg_fold_stat(memcg, idx, x);
+		x = 0;
+	}
+	__this_cpu_write(memcg->stat->count[idx], x);
+}
+
+static inline void mod_memcg_stat(struct mem_cgroup *memcg, int idx, int val)
+{
+	unsigned long flags;
+
+	local_irq_save(flags);
+	__mod_memcg_stat(memcg, idx, val);
+	local_irq_restore(flags);
+}
+
+static inline void __count_memcg_events(struct mem_cgroup *memcg, int idx,
+					unsigned long count)
+{
+	unsigned long x;
+
+	x = count + __this_cpu_read(memcg->stat->events[idx]);
+	if (unlikely(x > MEMCG_STAT_BATCH)) {
+		memcg_fold_events(memcg, idx, x);
+		x = 0;
+	}
+	__this_cpu_write(memcg->stat->events[idx], x);
+}
+
+static inline void count_memcg_events(struct mem_cgroup *memcg, int idx,
+				      unsigned long count)
+{
+	unsigned long flags;
+
+	local_irq_save(flags);
+	__count_memcg_events(memcg, idx, count);
+	local_irq_restore(flags);
+}
+
 /**
  * mem_cgroup_events - count memory events against a cgroup
  * @memcg: the memory cgroup
@@ -292,7 +373,8 @@ static inline void mem_cgroup_events(struct mem_cgroup *memcg,
 		       enum mem_cgroup_events_index idx,
 		       unsigned int nr)
 {
-	this_cpu_add(memcg->stat->events[idx], nr);
+	/* rare, and userspace polls for them: fold right away */
+	memcg_fold_events(memcg, idx, nr);
 	cgroup_file_notify(&memcg->events_file);
 }
 
@@ -496,7 +578,7 @@ static inline void mem_cgroup_update_page_stat(struct page *page,
 	VM_BUG_ON(!(rcu_read_lock_held() || PageLocked(page)));
 
 	if (page->mem_cgroup)
-		this_cpu_add(page->mem_cgroup->stat->count[idx], val);
+		mod_memcg_stat(page->mem_cgroup, idx, val);
 }
 
 static inline void mem_cgroup_inc_page_stat(struct page *page,
@@ -530,10 +612,10 @@ static inline void mem_cgroup_count_vm_event(struct mm_struct *mm,
 
 	switch (idx) {
 	case PGFAULT:
-		this_cpu_inc(memcg->stat->events[MEM_CGROUP_EVENTS_PGFAULT]);
+		count_memcg_events(memcg, MEM_CGROUP_EVENTS_PGFAULT, 1);
 		break;
 	case PGMAJFAULT:
-		this_cpu_inc(memcg->stat->events[MEM_CGROUP_EVENTS_PGMAJFAULT]);
+		count_memcg_events(memcg, MEM_CGROUP_EVENTS_PGMAJFAULT, 1);
 		break;
 	default:
 		BUG();
@@ -830,7 +912,7 @@ static inline void memcg_kmem_update_page_stat(struct page *page,
 				enum mem_cgroup_stat_index idx, int val)
 {
 	if (memcg_kmem_enabled() && page->mem_cgroup)
-		this_cpu_add(page->mem_cgroup->stat->count[idx], val);
+		mod_memcg_stat(page->mem_cgroup, idx, val);
 }
 
 #else
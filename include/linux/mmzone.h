@@ -362,6 +362,9 @@ struct lruvec {
 /* LRU Isolation modes. */
 typedef unsigned __bitwise__ isolate_mode_t;
 
+#define NR_PCP_ORDERS		(PAGE_ALLOC_COSTLY_ORDER + 1)
+#define NR_PCP_LISTS		(MIGRATE_PCPTYPES * NR_PCP_ORDERS)
+
 enum zone_watermarks {
 	WMARK_MIN,
 	WMARK_LOW,
@@ -381,8 +384,12 @@ struct per_cpu_pages {
 	//batch=ڴ0.025%
 	int batch;		/* chunk size for buddy add/remove */
 
-	/* Lists of pages, one per migrate type stored on the pcp-lists */
-	struct list_head lists[MIGRATE_PCPTYPES];
+	/*
+	 * Lists of pages, one per migrate type and order stored on the
+	 * pcp-lists. Orders up to PAGE_ALLOC_COSTLY_ORDER are cached; count,
+	 * high and batch are all in units of base pages.
+	 */
+	struct list_head lists[NR_PCP_LISTS];
 };
 
 struct per_cpu_pageset {
@@ -25,6 +25,7 @@ enum mapping_flags {
 	AS_MM_ALL_LOCKS	= __GFP_BITS_SHIFT + 2,	/* under mm_take_all_locks() */
 	AS_UNEVICTABLE	= __GFP_BITS_SHIFT + 3,	/* e.g., ramdisk, SHM_LOCK */
 	AS_EXITING	= __GFP_BITS_SHIFT + 4, /* final truncate in progress */
+	AS_LARGE_PAGES	= __GFP_BITS_SHIFT + 5, /* may use large page cache pages */
 };
 
 static inline void mapping_set_error(struct address_space *mapping, int error)
@@ -64,6 +65,31 @@ static inline int mapping_exiting(struct address_space *mapping)
 	return test_bit(AS_EXITING, &mapping->flags);
 }
 
+/*
+ * Large page cache pages are compound pages of order 2 up to
+ * MAX_PAGECACHE_ORDER, inserted at every index they cover, and allocated
+ * by readahead for mappings whose filesystem opted in: its ->readpage
+ * and ->readpages must fill all hpage_nr_pages() of them.  They stay clean
+ * and unmapped: writes, page faults and reclaim split them back into small
+ * pages first, and truncation drops them whole.
+ */
+#ifdef CONFIG_TRANSPARENT_HUGE_PAGECACHE
+#define MAX_PAGECACHE_ORDER	min(HPAGE_PMD_ORDER, MAX_ORDER - 1)
+#else
+#define MAX_PAGECACHE_ORDER	0
+#endif
+
+static inline void mapping_set_large_pages(struct address_space *mapping)
+{
+	set_bit(AS_LARGE_PAGES, &mapping->flags);
+}
+
+static inline bool mapping_large_pages(struct address_space *mapping)
+{
+	return IS_ENABLED(CONFIG_TRANSPARENT_HUGE_PAGECACHE) &&
+		test_bit(AS_LARGE_PAGES, &mapping->flags);
+}
+
 static inline gfp_t mapping_gfp_mask(struct address_space * mapping)
 {
 	return (__force gfp_t)mapping->flags & __GFP_BITS_MASK;
@@ -191,14 +217,20 @@ static inline int page_cache_add_speculative(struct page *page, int count)
 }
 
 #ifdef CONFIG_NUMA
-extern struct page *__page_cache_alloc(gfp_t gfp);
+extern struct page *__page_cache_alloc_order(gfp_t gfp, unsigned int order);
 #else
-static inline struct page *__page_cache_alloc(gfp_t gfp)
+static inline struct page *__page_cache_alloc_order(gfp_t gfp,
+						    unsigned int order)
 {
-	return alloc_pages(gfp, 0);
+	return alloc_pages(gfp, order);
 }
 #endif
 
+static inline struct page *__page_cache_alloc(gfp_t gfp)
+{
+	return __page_cache_alloc_order(gfp, 0);
+}
+
 static inline struct page *page_cache_alloc(struct address_space *x)
 {
 	return __page_cache_alloc(mapping_gfp_mask(x));
@@ -632,6 +664,9 @@ int add_to_page_cache_locked(struct page *page, struct address_space *mapping,
 				pgoff_t index, gfp_t gfp_mask);
 int add_to_page_cache_lru(struct page *page, struct address_space *mapping,
 				pgoff_t index, gfp_t gfp_mask);
+struct pagevec;
+unsigned add_to_page_cache_lru_batch(struct pagevec *pvec,
+				struct address_space *mapping, gfp_t gfp_mask);
 extern void delete_from_page_cache(struct page *page);
 extern void __delete_from_page_cache(struct page *page, void *shadow);
 int replace_page_cache_page(struct page *old, struct page *new, gfp_t gfp_mask);
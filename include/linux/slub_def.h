@@ -35,6 +35,10 @@ enum stat_item {
 	CPU_PARTIAL_FREE,	/* Refill cpu partial on free */
 	CPU_PARTIAL_NODE,	/* Refill cpu partial from node partial */
 	CPU_PARTIAL_DRAIN,	/* Drain cpu partial to node partial */
+	CPU_ARRAY_ALLOC_HIT,	/* Allocation from cpu object array */
+	CPU_ARRAY_ALLOC_MISS,	/* Cpu object array empty on allocation */
+	CPU_ARRAY_FREE_HIT,	/* Free to cpu object array */
+	CPU_ARRAY_FLUSH,	/* Cpu object array full on free */
 	NR_SLUB_STAT_ITEMS };
 
 struct kmem_cache_cpu {
@@ -47,6 +51,17 @@ struct kmem_cache_cpu {
 #endif
 };
 
+/*
+ * Optional per cpu stack of free objects layered on top of the cpu slab.
+ * It is refilled from and flushed to the slabs in batches, only accessed
+ * with interrupts disabled on the owning cpu.
+ */
+struct kmem_cache_cpu_array {
+	unsigned int avail;	/* Number of objects in the array */
+	unsigned int limit;	/* Capacity of the array */
+	void *objects[];
+};
+
 /*
  * Word size structure that can be atomically updated or read and that
  * contains both the order and the number of objects that a slab of the
@@ -61,6 +76,7 @@ struct kmem_cache_order_objects {
  */
 struct kmem_cache {
 	struct kmem_cache_cpu __percpu *cpu_slab;
+	struct kmem_cache_cpu_array __percpu *cpu_array;
 	/* Used for retriving partial slabs etc */
 	unsigned long flags;
 	unsigned long min_partial;
@@ -68,6 +84,7 @@ struct kmem_cache {
 	int object_size;	/* The size of an object without meta data */
 	int offset;		/* Free pointer offset. */
 	int cpu_partial;	/* Number of per cpu partial objects to keep around */
+	unsigned int cpu_array_size;	/* Capacity of the per cpu object array */
 	struct kmem_cache_order_objects oo;
 
 	/* Allocation and freeing of slabs */
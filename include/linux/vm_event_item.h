@@ -27,6 +27,8 @@ enum vm_event_item { PGPGIN, PGPGOUT, PSWPIN, PSWPOUT,
 		FOR_ALL_ZONES(ALLOCSTALL),
 		FOR_ALL_ZONES(PGSCAN_SKIP),
 		PGFREE, PGACTIVATE, PGDEACTIVATE,
+		PGALLOC_PCP_HIGHORDER, PGALLOC_PCP_HIGHORDER_REFILL,
+		PGFREE_PCP_HIGHORDER,
 		PGFAULT, PGMAJFAULT,
 		PGLAZYFREED,
 		PGREFILL,
@@ -57,6 +59,8 @@ enum vm_event_item { PGPGIN, PGPGOUT, PSWPIN, PSWPOUT,
 		COMPACTISOLATED,
 		COMPACTSTALL, COMPACTFAIL, COMPACTSUCCESS,
 		KCOMPACTD_WAKE,
+		KCOMPACTD_PROACTIVE_WAKE, KCOMPACTD_PROACTIVE_MIGRATED,
+		KCOMPACTD_PROACTIVE_BACKOFF,
 #endif
 #ifdef CONFIG_HUGETLB_PAGE
 		HTLB_BUDDY_PGALLOC, HTLB_BUDDY_PGALLOC_FAIL,
@@ -125,6 +129,8 @@ enum vm_event_item {
   //freepageĸ__free_pages_ok  free_hot_cold_page
   PGFREE, 
   PGACTIVATE, PGDEACTIVATE,
+  PGALLOC_PCP_HIGHORDER, PGALLOC_PCP_HIGHORDER_REFILL,
+  PGFREE_PCP_HIGHORDER,
   //ϵͳpagefaultĴ handle_mm_fault мһ
   PGFAULT, 
   //ļΪpagefaultļcacheûв鵽ӦpageҪpageȻ
@@ -163,6 +169,8 @@ enum vm_event_item {
   COMPACTISOLATED,
   COMPACTSTALL, COMPACTFAIL, COMPACTSUCCESS,
   KCOMPACTD_WAKE,
+  KCOMPACTD_PROACTIVE_WAKE, KCOMPACTD_PROACTIVE_MIGRATED,
+  KCOMPACTD_PROACTIVE_BACKOFF,
   KCOMPACTD_MIGRATE_SCANNED, KCOMPACTD_FREE_SCANNED,
 
 
@@ -74,9 +74,16 @@ struct vmap_area {
 	//ӵ vmap_area_list
 	struct list_head list;          /* address sorted list */
 	struct llist_node purge_list;    /* "lazy purge" list */
-	//ָ vm_struct
-	struct vm_struct *vm;
-	struct rcu_head rcu_head;
+
+	/*
+	 * Busy areas point to their vm_struct, areas in the free tree keep
+	 * the largest free area size of their subtree instead.
+	 */
+	union {
+		//ָ vm_struct
+		struct vm_struct *vm;
+		unsigned long subtree_max_size;
+	};
 };
 
 /*
@@ -100,6 +100,20 @@ struct writeback_control {
 #endif
 };
 
+/*
+ * Flags for the write bios issued under @wbc.  Background and periodic
+ * writeback is marked, so the block layer can throttle it.
+ */
+static inline int wbc_to_write_flags(struct writeback_control *wbc)
+{
+	if (wbc->sync_mode == WB_SYNC_ALL)
+		return WRITE_SYNC;
+	else if (wbc->for_kupdate || wbc->for_background)
+		return REQ_BACKGROUND;
+
+	return 0;
+}
+
 /*
  * A wb_domain represents a domain that wb's (bdi_writeback's) belong to
  * and are measured against each other in.  There always is one global
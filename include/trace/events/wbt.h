@@ -0,0 +1,158 @@
+#undef TRACE_SYSTEM
+#define TRACE_SYSTEM wbt
+
+#if !defined(_TRACE_WBT_H) || defined(TRACE_HEADER_MULTI_READ)
+#define _TRACE_WBT_H
+
+#include <linux/tracepoint.h>
+#include <linux/backing-dev.h>
+#include <linux/blkdev.h>
+
+#define wbt_bdi_name(bdi)	((bdi)->dev ? dev_name((bdi)->dev) : "(unknown)")
+
+/**
+ * wbt_stat - completion latencies of a window
+ * @bdi:	device
+ * @stat:	read and write latencies, in ns
+ */
+TRACE_EVENT(wbt_stat,
+
+	TP_PROTO(struct backing_dev_info *bdi, struct blk_rq_stat *stat),
+
+	TP_ARGS(bdi, stat),
+
+	TP_STRUCT__entry(
+		__array(char, name, 32)
+		__field(u64, rmean)
+		__field(u64, rmin)
+		__field(u64, rmax)
+		__field(u32, rnr)
+		__field(u64, wmean)
+		__field(u64, wmin)
+		__field(u64, wmax)
+		__field(u32, wnr)
+	),
+
+	TP_fast_assign(
+		strncpy(__entry->name, wbt_bdi_name(bdi), 32);
+		__entry->rmean		= stat[READ].mean;
+		__entry->rmin		= stat[READ].min;
+		__entry->rmax		= stat[READ].max;
+		__entry->rnr		= stat[READ].nr_samples;
+		__entry->wmean		= stat[WRITE].mean;
+		__entry->wmin		= stat[WRITE].min;
+		__entry->wmax		= stat[WRITE].max;
+		__entry->wnr		= stat[WRITE].nr_samples;
+	),
+
+	TP_printk("%s: rmean=%llu, rmin=%llu, rmax=%llu, rsamples=%u, "
+		  "wmean=%llu, wmin=%llu, wmax=%llu, wsamples=%u",
+		  __entry->name, __entry->rmean, __entry->rmin, __entry->rmax,
+		  __entry->rnr, __entry->wmean, __entry->wmin, __entry->wmax,
+		  __entry->wnr)
+);
+
+/**
+ * wbt_lat - the fastest read of a window missed the target
+ * @bdi:	device
+ * @lat:	latency, in ns
+ */
+TRACE_EVENT(wbt_lat,
+
+	TP_PROTO(struct backing_dev_info *bdi, u64 lat),
+
+	TP_ARGS(bdi, lat),
+
+	TP_STRUCT__entry(
+		__array(char, name, 32)
+		__field(u64, lat)
+	),
+
+	TP_fast_assign(
+		strncpy(__entry->name, wbt_bdi_name(bdi), 32);
+		__entry->lat = div_u64(lat, 1000);
+	),
+
+	TP_printk("%s: latency %lluus", __entry->name,
+			(unsigned long long) __entry->lat)
+);
+
+/**
+ * wbt_step - the write limits were scaled
+ * @bdi:	device
+ * @msg:	"step up" or "step down"
+ * @step:	new scale step
+ * @window:	new window size, in ns
+ * @bg:	limit for background writeback
+ * @normal:	limit for other buffered writes
+ * @max:	limit while no reads are around
+ */
+TRACE_EVENT(wbt_step,
+
+	TP_PROTO(struct backing_dev_info *bdi, const char *msg,
+		 int step, unsigned long window, unsigned int bg,
+		 unsigned int normal, unsigned int max),
+
+	TP_ARGS(bdi, msg, step, window, bg, normal, max),
+
+	TP_STRUCT__entry(
+		__array(char, name, 32)
+		__field(const char *, msg)
+		__field(int, step)
+		__field(unsigned long, window)
+		__field(unsigned int, bg)
+		__field(unsigned int, normal)
+		__field(unsigned int, max)
+	),
+
+	TP_fast_assign(
+		strncpy(__entry->name, wbt_bdi_name(bdi), 32);
+		__entry->msg	= msg;
+		__entry->step	= step;
+		__entry->window	= div_u64(window, 1000);
+		__entry->bg	= bg;
+		__entry->normal	= normal;
+		__entry->max	= max;
+	),
+
+	TP_printk("%s: %s: step=%d, window=%luus, background=%u, normal=%u, max=%u",
+		  __entry->name, __entry->msg, __entry->step, __entry->window,
+		  __entry->bg, __entry->normal, __entry->max)
+);
+
+/**
+ * wbt_timer - a window closed
+ * @bdi:	device
+ * @status:	latency status of the window, WBT_LAT_*
+ * @step:	scale step
+ * @inflight:	tracked writes in flight
+ */
+TRACE_EVENT(wbt_timer,
+
+	TP_PROTO(struct backing_dev_info *bdi, unsigned int status,
+		 int step, unsigned int inflight),
+
+	TP_ARGS(bdi, status, step, inflight),
+
+	TP_STRUCT__entry(
+		__array(char, name, 32)
+		__field(unsigned int, status)
+		__field(int, step)
+		__field(unsigned int, inflight)
+	),
+
+	TP_fast_assign(
+		strncpy(__entry->name, wbt_bdi_name(bdi), 32);
+		__entry->status		= status;
+		__entry->step		= step;
+		__entry->inflight	= inflight;
+	),
+
+	TP_printk("%s: status=%u, step=%d, inflight=%u", __entry->name,
+		  __entry->status, __entry->step, __entry->inflight)
+);
+
+#endif /* _TRACE_WBT_H */
+
+/* This part must be outside protection */
+#include <trace/define_trace.h>
@@ -58,6 +58,9 @@
 					   overrides the coredump filter bits */
 #define MADV_DODUMP	17		/* Clear the MADV_DONTDUMP flag */
 
+#define MADV_COLLAPSE	18		/* Collapse range into hugepages now */
+#define MADV_COLLAPSE_ASYNC 19		/* Queue range for khugepaged collapse */
+
 /* compatibility flags */
 #define MAP_FILE	0
 
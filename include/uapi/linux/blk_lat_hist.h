@@ -0,0 +1,42 @@
+/*
+ * Block request completion latency histograms
+ *
+ * Layout of /sys/block/<disk>/queue/lat_hist_raw: a struct
+ * blk_lat_hist_header followed by nr_ops * nr_sizes * nr_buckets
+ * native endian __u64 counters, indexed [op][size][bucket].
+ *
+ * Bucket 0 counts completions faster than 2^min_shift ns, bucket n counts
+ * those that took [2^(min_shift + n - 1), 2^(min_shift + n)) ns, and the
+ * last bucket also counts anything slower.  Size class n counts requests
+ * of up to size_max[n] bytes that didn't fit a smaller class.
+ */
+#ifndef _UAPI_LINUX_BLK_LAT_HIST_H
+#define _UAPI_LINUX_BLK_LAT_HIST_H
+
+#include <linux/types.h>
+
+#define BLK_LAT_HIST_VERSION	1
+
+enum {
+	BLK_LAT_HIST_READ,
+	BLK_LAT_HIST_WRITE,
+	BLK_LAT_HIST_DISCARD,
+	BLK_LAT_HIST_FLUSH,
+	BLK_LAT_HIST_OPS,
+};
+
+#define BLK_LAT_HIST_SIZES	4
+#define BLK_LAT_HIST_BKTS	24
+#define BLK_LAT_HIST_MIN_SHIFT	10
+
+struct blk_lat_hist_header {
+	__u32 version;		/* BLK_LAT_HIST_VERSION */
+	__u32 nr_ops;
+	__u32 nr_sizes;
+	__u32 nr_buckets;
+	__u32 min_shift;
+	__u32 size_max[BLK_LAT_HIST_SIZES];
+	__u32 reserved;
+};
+
+#endif /* _UAPI_LINUX_BLK_LAT_HIST_H */
@@ -197,4 +197,8 @@ struct prctl_mm_map {
 # define PR_CAP_AMBIENT_LOWER		3
 # define PR_CAP_AMBIENT_CLEAR_ALL	4
 
+/* Control the order in which khugepaged scans this mm */
+#define PR_SET_KHUGEPAGED_PRIO		48
+#define PR_GET_KHUGEPAGED_PRIO		49
+
 #endif /* _LINUX_PRCTL_H */
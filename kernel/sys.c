@@ -47,6 +47,7 @@
 #include <linux/kprobes.h>
 #include <linux/user_namespace.h>
 #include <linux/binfmts.h>
+#include <linux/khugepaged.h>
 
 #include <linux/sched.h>
 #include <linux/rcupdate.h>
@@ -2254,6 +2255,16 @@ SYSCALL_DEFINE5(prctl, int, option, unsigned long, arg2, unsigned long, arg3,
 			me->mm->def_flags &= ~VM_NOHUGEPAGE;
 		up_write(&me->mm->mmap_sem);
 		break;
+	case PR_SET_KHUGEPAGED_PRIO:
+		if (arg3 || arg4 || arg5)
+			return -EINVAL;
+		error = khugepaged_set_mm_priority(me->mm, arg2);
+		break;
+	case PR_GET_KHUGEPAGED_PRIO:
+		if (arg2 || arg3 || arg4 || arg5)
+			return -EINVAL;
+		error = khugepaged_get_mm_priority(me->mm);
+		break;
 	case PR_MPX_ENABLE_MANAGEMENT:
 		if (arg2 || arg3 || arg4 || arg5)
 			return -EINVAL;
@@ -0,0 +1,232 @@
+/*
+ * Readahead page cache insertion benchmark
+ *
+ * Measures the per-page cost of readahead on the files named by the
+ * "files" parameter (block devices such as a ramdisk, or regular files on
+ * a memory backed filesystem), and the per-page cost of inserting pages
+ * into the page cache one at a time versus in pagevec batches on a tmpfs
+ * mapping.  Results are printed to the kernel log; best of "loops" runs.
+ *
+ *   modprobe brd rd_size=65536
+ *   modprobe test_readahead files=/dev/ram0 nr_pages=16384
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation.
+ */
+
+#define pr_fmt(fmt) KBUILD_MODNAME ": " fmt
+
+#include <linux/err.h>
+#include <linux/file.h>
+#include <linux/fs.h>
+#include <linux/kernel.h>
+#include <linux/math64.h>
+#include <linux/module.h>
+#include <linux/pagemap.h>
+#include <linux/pagevec.h>
+#include <linux/sched.h>
+#include <linux/shmem_fs.h>
+#include <linux/slab.h>
+#include <linux/timekeeping.h>
+
+static char *files[8] = { "/dev/ram0" };
+static int nr_files = 1;
+module_param_array(files, charp, &nr_files, 0444);
+MODULE_PARM_DESC(files, "Files to read ahead (default: /dev/ram0)");
+
+static unsigned int nr_pages = 4096;
+module_param(nr_pages, uint, 0444);
+MODULE_PARM_DESC(nr_pages, "Pages per run (default: 4096)");
+
+static unsigned int loops = 10;
+module_param(loops, uint, 0444);
+MODULE_PARM_DESC(loops, "Runs per measurement (default: 10)");
+
+static u64 per_page(u64 ns, unsigned long pages)
+{
+	return pages ? div64_u64(ns, pages) : 0;
+}
+
+/*
+ * Drop the cached pages of @file and time readahead of its first nr_pages
+ * pages.  FMODE_RANDOM makes page_cache_sync_readahead() read exactly the
+ * requested range, like fadvise(POSIX_FADV_WILLNEED).
+ */
+static int __init test_readahead_file(const char *path)
+{
+	struct address_space *mapping;
+	u64 best = U64_MAX;
+	unsigned long pages = 0;
+	struct file *file;
+	unsigned int i;
+
+	file = filp_open(path, O_RDONLY | O_LARGEFILE, 0);
+	if (IS_ERR(file)) {
+		pr_warn("%s: open failed: %ld\n", path, PTR_ERR(file));
+		return PTR_ERR(file);
+	}
+	mapping = file->f_mapping;
+	if (!mapping->a_ops->readpage && !mapping->a_ops->readpages) {
+		pr_warn("%s: no readahead support\n", path);
+		fput(file);
+		return -EINVAL;
+	}
+
+	spin_lock(&file->f_lock);
+	file->f_mode |= FMODE_RANDOM;
+	spin_unlock(&file->f_lock);
+
+	for (i = 0; i < loops; i++) {
+		unsigned long before;
+		u64 start, ns;
+
+		invalidate_mapping_pages(mapping, 0, -1);
+		before = mapping->nrpages;
+
+		start = ktime_get_ns();
+		page_cache_sync_readahead(mapping, &file->f_ra, file, 0,
+					  nr_pages);
+		ns = ktime_get_ns() - start;
+
+		if (mapping->nrpages > before) {
+			pages = mapping->nrpages - before;
+			best = min(best, per_page(ns, pages));
+		}
+		cond_resched();
+	}
+	invalidate_mapping_pages(mapping, 0, -1);
+	fput(file);
+
+	if (best == U64_MAX) {
+		pr_warn("%s: nothing was read\n", path);
+		return -EIO;
+	}
+	pr_info("%s: readahead of %lu pages: %llu ns/page\n",
+		path, pages, best);
+	return 0;
+}
+
+/*
+ * Insert nr_pages fresh pages into @mapping and remove them again, either
+ * one add_to_page_cache_lru() at a time or a pagevec at a time.  The pages
+ * stay locked until they are deleted, so nothing else gets to look at them.
+ * Returns the insertion time in ns per page.
+ */
+static u64 __init test_insert(struct address_space *mapping, bool batch)
+{
+	gfp_t gfp = mapping_gfp_mask(mapping) & ~__GFP_FS;
+	struct page **pages;
+	struct pagevec pvec;
+	unsigned int i, j, nr = 0;
+	u64 start, ns;
+
+	pages = kcalloc(nr_pages, sizeof(*pages), GFP_KERNEL);
+	if (!pages)
+		return 0;
+	for (i = 0; i < nr_pages; i++) {
+		pages[i] = __page_cache_alloc(gfp);
+		if (!pages[i])
+			break;
+		pages[i]->index = i;
+	}
+
+	start = ktime_get_ns();
+	if (!batch) {
+		for (j = 0; j < i; j++) {
+			if (add_to_page_cache_lru(pages[j], mapping, j, gfp)) {
+				put_page(pages[j]);
+				pages[j] = NULL;
+				continue;
+			}
+			nr++;
+		}
+	} else {
+		pagevec_init(&pvec, 0);
+		for (j = 0; j < i; j += PAGEVEC_SIZE) {
+			unsigned int k, n = min_t(unsigned int,
+						  PAGEVEC_SIZE, i - j);
+
+			for (k = 0; k < n; k++)
+				pagevec_add(&pvec, pages[j + k]);
+			nr += add_to_page_cache_lru_batch(&pvec, mapping, gfp);
+			/* Only the pages that were added are left in pvec */
+			for (k = 0; k < n; k++)
+				pages[j + k] = NULL;
+			for (k = 0; k < pagevec_count(&pvec); k++)
+				pages[pvec.pages[k]->index] = pvec.pages[k];
+			pagevec_reinit(&pvec);
+		}
+	}
+	ns = ktime_get_ns() - start;
+
+	for (j = 0; j < i; j++) {
+		if (!pages[j])
+			continue;
+		delete_from_page_cache(pages[j]);
+		unlock_page(pages[j]);
+		put_page(pages[j]);
+	}
+	kfree(pages);
+	return per_page(ns, nr);
+}
+
+static int __init test_readahead_tmpfs(void)
+{
+	u64 single = U64_MAX, batched = U64_MAX;
+	struct file *file;
+	unsigned int i;
+
+	file = shmem_file_setup("test_readahead", 0, 0);
+	if (IS_ERR(file))
+		return PTR_ERR(file);
+
+	for (i = 0; i < loops; i++) {
+		u64 ns;
+
+		ns = test_insert(file->f_mapping, false);
+		if (ns)
+			single = min(single, ns);
+		ns = test_insert(file->f_mapping, true);
+		if (ns)
+			batched = min(batched, ns);
+		cond_resched();
+	}
+	fput(file);
+
+	if (single == U64_MAX || batched == U64_MAX)
+		return -ENOMEM;
+	pr_info("tmpfs: insertion of %u pages: %llu ns/page single, %llu ns/page batched\n",
+		nr_pages, single, batched);
+	return 0;
+}
+
+static int __init test_readahead_init(void)
+{
+	int i, ret, failed = 0;
+
+	if (!nr_pages || !loops)
+		return -EINVAL;
+
+	ret = test_readahead_tmpfs();
+	if (ret)
+		failed++;
+
+	for (i = 0; i < nr_files; i++) {
+		ret = test_readahead_file(files[i]);
+		if (ret)
+			failed++;
+	}
+
+	return failed ? -EINVAL : 0;
+}
+
+static void __exit test_readahead_exit(void)
+{
+}
+
+module_init(test_readahead_init);
+module_exit(test_readahead_exit);
+
+MODULE_DESCRIPTION("Readahead page cache insertion benchmark");
+MODULE_LICENSE("GPL");
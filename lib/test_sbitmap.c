@@ -0,0 +1,216 @@
+/*
+ * sbitmap tag allocation benchmark
+ *
+ * Allocates and frees bits of one shared sbitmap_queue, the way blk-mq
+ * allocates and frees tags, first from a single thread and then from one
+ * thread bound to each online CPU.  Each thread keeps up to "hold" bits
+ * allocated at a time, like a submitter with requests in flight.  Results
+ * are printed to the kernel log; best of "loops" runs.
+ *
+ *   modprobe test_sbitmap depth=256 hold=8
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation.
+ */
+
+#define pr_fmt(fmt) KBUILD_MODNAME ": " fmt
+
+#include <linux/completion.h>
+#include <linux/cpu.h>
+#include <linux/err.h>
+#include <linux/kernel.h>
+#include <linux/kthread.h>
+#include <linux/math64.h>
+#include <linux/module.h>
+#include <linux/sbitmap.h>
+#include <linux/sched.h>
+#include <linux/slab.h>
+#include <linux/timekeeping.h>
+
+#define MAX_HOLD	32
+
+static unsigned int depth = 128;
+module_param(depth, uint, 0444);
+MODULE_PARM_DESC(depth, "Bits in the map (default: 128)");
+
+static unsigned int hold = 4;
+module_param(hold, uint, 0444);
+MODULE_PARM_DESC(hold, "Bits each thread keeps allocated, at most 32 (default: 4)");
+
+static unsigned int nr_ops = 1 << 20;
+module_param(nr_ops, uint, 0444);
+MODULE_PARM_DESC(nr_ops, "Allocations per thread and run (default: 1048576)");
+
+static unsigned int loops = 5;
+module_param(loops, uint, 0444);
+MODULE_PARM_DESC(loops, "Runs per measurement (default: 5)");
+
+struct bench_thread {
+	u64 ns;
+	unsigned long misses;
+};
+
+static struct sbitmap_queue bench_sbq;
+static struct bench_thread *bench_threads;
+static bool bench_go;
+static atomic_t bench_running;
+static struct completion bench_done;
+
+static int bench_thread_fn(void *data)
+{
+	struct bench_thread *t = data;
+	unsigned int held[MAX_HOLD], cpus[MAX_HOLD];
+	unsigned int i, head = 0, nr_held = 0;
+	u64 start;
+
+	while (!READ_ONCE(bench_go))
+		cond_resched();
+
+	start = ktime_get_ns();
+	for (i = 0; i < nr_ops; i++) {
+		unsigned int cpu;
+		int nr;
+
+		/* Free the oldest bit once the thread holds its share */
+		if (nr_held == hold) {
+			sbitmap_queue_clear(&bench_sbq, held[head], cpus[head]);
+			head = (head + 1) % hold;
+			nr_held--;
+		}
+
+		nr = sbitmap_queue_get(&bench_sbq, &cpu);
+		if (nr < 0) {
+			t->misses++;
+		} else {
+			held[(head + nr_held) % hold] = nr;
+			cpus[(head + nr_held) % hold] = cpu;
+			nr_held++;
+		}
+
+		if (!(i & 1023))
+			cond_resched();
+	}
+	t->ns = ktime_get_ns() - start;
+
+	while (nr_held--) {
+		sbitmap_queue_clear(&bench_sbq, held[head], cpus[head]);
+		head = (head + 1) % hold;
+	}
+
+	if (atomic_dec_and_test(&bench_running))
+		complete(&bench_done);
+	return 0;
+}
+
+/*
+ * Run one thread per CPU set in @mask and return the average time per
+ * allocation and free, in ns.
+ */
+static u64 bench_run(const struct cpumask *mask, unsigned long *misses)
+{
+	unsigned int cpu, nr_threads = 0;
+	u64 ns = 0;
+
+	memset(bench_threads, 0, nr_cpu_ids * sizeof(*bench_threads));
+	WRITE_ONCE(bench_go, false);
+	init_completion(&bench_done);
+	atomic_set(&bench_running, cpumask_weight(mask));
+
+	for_each_cpu(cpu, mask) {
+		struct task_struct *task;
+
+		task = kthread_create_on_node(bench_thread_fn,
+					      &bench_threads[cpu],
+					      cpu_to_node(cpu),
+					      "test_sbitmap/%u", cpu);
+		if (IS_ERR(task)) {
+			/* Nothing to wait for on behalf of this CPU */
+			if (atomic_dec_and_test(&bench_running))
+				complete(&bench_done);
+			continue;
+		}
+		kthread_bind(task, cpu);
+		wake_up_process(task);
+		nr_threads++;
+	}
+
+	WRITE_ONCE(bench_go, true);
+	wait_for_completion(&bench_done);
+
+	*misses = 0;
+	for_each_cpu(cpu, mask) {
+		ns += bench_threads[cpu].ns;
+		*misses += bench_threads[cpu].misses;
+	}
+	if (!nr_threads)
+		return 0;
+	return div64_u64(ns, (u64)nr_threads * nr_ops);
+}
+
+static void bench(const char *name, const struct cpumask *mask)
+{
+	unsigned int nr_threads = cpumask_weight(mask);
+	unsigned long misses = 0, best_misses = 0;
+	u64 best = U64_MAX;
+	unsigned int i;
+
+	for (i = 0; i < loops; i++) {
+		u64 ns = bench_run(mask, &misses);
+
+		if (ns && ns < best) {
+			best = ns;
+			best_misses = misses;
+		}
+	}
+	if (best == U64_MAX) {
+		pr_warn("%s: no thread ran\n", name);
+		return;
+	}
+
+	pr_info("%s: %u threads, %llu ns per get/put, %llu kops/s total, %lu allocation failures\n",
+		name, nr_threads, best,
+		div64_u64((u64)nr_threads * NSEC_PER_SEC, best * 1000),
+		best_misses);
+}
+
+static int __init test_sbitmap_init(void)
+{
+	int ret;
+
+	if (!depth || !hold || hold > MAX_HOLD || !nr_ops || !loops)
+		return -EINVAL;
+
+	bench_threads = kcalloc(nr_cpu_ids, sizeof(*bench_threads),
+				GFP_KERNEL);
+	if (!bench_threads)
+		return -ENOMEM;
+
+	ret = sbitmap_queue_init_node(&bench_sbq, depth, -1, false,
+				      GFP_KERNEL, NUMA_NO_NODE);
+	if (ret)
+		goto out_free;
+
+	pr_info("depth %u, %u bits per word, %u held per thread\n",
+		depth, 1U << bench_sbq.sb.shift, hold);
+
+	get_online_cpus();
+	bench("single", cpumask_of(raw_smp_processor_id()));
+	bench("all cpus", cpu_online_mask);
+	put_online_cpus();
+
+	sbitmap_queue_free(&bench_sbq);
+out_free:
+	kfree(bench_threads);
+	return ret;
+}
+
+static void __exit test_sbitmap_exit(void)
+{
+}
+
+module_init(test_sbitmap_init);
+module_exit(test_sbitmap_exit);
+
+MODULE_DESCRIPTION("sbitmap tag allocation benchmark");
+MODULE_LICENSE("GPL");
@@ -20,6 +20,7 @@
 #include <linux/kthread.h>
 #include <linux/freezer.h>
 #include <linux/page_owner.h>
+#include <linux/hugetlb.h>
 #include "internal.h"
 
 #ifdef CONFIG_COMPACTION
@@ -1325,6 +1326,107 @@ static inline bool is_via_compact_memory(int order)
 {
 	return order == -1;
 }
+
+/*
+ * Proactive compaction aims at keeping huge page sized blocks available
+ * ahead of demand, so fragmentation is measured against that order.
+ */
+#if defined CONFIG_TRANSPARENT_HUGEPAGE
+#define COMPACTION_HPAGE_ORDER	HPAGE_PMD_ORDER
+#elif defined CONFIG_HUGETLBFS
+#define COMPACTION_HPAGE_ORDER	HUGETLB_PAGE_ORDER
+#else
+#define COMPACTION_HPAGE_ORDER	(PMD_SHIFT - PAGE_SHIFT)
+#endif
+
+/* How often kcompactd checks the node fragmentation score */
+#define HPAGE_FRAG_CHECK_INTERVAL_MSEC	500
+
+/*
+ * A zero value disables proactive compaction, otherwise kcompactd keeps
+ * the node fragmentation score between the watermarks derived from it.
+ */
+unsigned int __read_mostly sysctl_compaction_proactiveness = 20;
+
+static inline bool kswapd_is_running(pg_data_t *pgdat)
+{
+	return pgdat->kswapd && (pgdat->kswapd->state == TASK_RUNNING);
+}
+
+/*
+ * Percentage of free memory in @zone that cannot satisfy an allocation of
+ * @order. The free lists are read without zone->lock, which is fine for a
+ * heuristic.
+ */
+static unsigned int extfrag_for_order(struct zone *zone, unsigned int order)
+{
+	unsigned long free_pages = 0, suitable_pages = 0;
+	unsigned int o;
+
+	for (o = 0; o < MAX_ORDER; o++) {
+		unsigned long pages = READ_ONCE(zone->free_area[o].nr_free) << o;
+
+		free_pages += pages;
+		if (o >= order)
+			suitable_pages += pages;
+	}
+
+	if (!free_pages)
+		return 0;
+
+	return div64_ul((free_pages - suitable_pages) * 100, free_pages);
+}
+
+/*
+ * The zone's external fragmentation for COMPACTION_HPAGE_ORDER, weighted
+ * by its share of the node so that small zones like ZONE_DMA do not
+ * dominate the node score.
+ */
+static unsigned int fragmentation_score_zone(struct zone *zone)
+{
+	unsigned long score;
+
+	score = zone->present_pages *
+			extfrag_for_order(zone, COMPACTION_HPAGE_ORDER);
+	return div64_ul(score, zone->zone_pgdat->node_present_pages + 1);
+}
+
+/* The node score is the sum of its zone scores, in the range [0, 100] */
+static unsigned int fragmentation_score_node(pg_data_t *pgdat)
+{
+	unsigned int score = 0;
+	int zoneid;
+
+	for (zoneid = 0; zoneid < MAX_NR_ZONES; zoneid++) {
+		struct zone *zone = &pgdat->node_zones[zoneid];
+
+		if (!populated_zone(zone))
+			continue;
+		score += fragmentation_score_zone(zone);
+	}
+
+	return score;
+}
+
+static unsigned int fragmentation_score_wmark(bool low)
+{
+	unsigned int wmark_low;
+
+	/*
+	 * Cap the low watermark to avoid excessive compaction activity in
+	 * case the proactiveness tunable is set close to 100.
+	 */
+	wmark_low = max(100U - sysctl_compaction_proactiveness, 5U);
+	return low ? wmark_low : min(wmark_low + 10, 100U);
+}
+
+static bool should_proactive_compact_node(pg_data_t *pgdat)
+{
+	if (!sysctl_compaction_proactiveness || kswapd_is_running(pgdat))
+		return false;
+
+	return fragmentation_score_node(pgdat) > fragmentation_score_wmark(false);
+}
 //compactǷԽҪ
 //ҪжǷܹ䵽cc->orderڴ
 //COMPACT_PARTIALʾ
@@ -1359,6 +1461,22 @@ static enum compact_result __compact_finished(struct zone *zone, struct compact_
 			return COMPACT_PARTIAL_SKIPPED;
 	}
 
+	/*
+	 * Proactive compaction has no allocation to satisfy: stop once the
+	 * zone is defragmented enough, or back off if kswapd is busy since
+	 * reclaim and compaction would just fight over the same pages.  The
+	 * zone's own fragmentation is what counts here, its weighted score
+	 * would let a small zone stop before it even started.
+	 */
+	if (cc->proactive_compaction) {
+		if (kswapd_is_running(zone->zone_pgdat))
+			return COMPACT_PARTIAL_SKIPPED;
+		if (extfrag_for_order(zone, COMPACTION_HPAGE_ORDER) >
+					fragmentation_score_wmark(true))
+			return COMPACT_CONTINUE;
+		return COMPACT_PARTIAL;
+	}
+
 	if (is_via_compact_memory(cc->order))
 		return COMPACT_CONTINUE;
 //Ϊʲôʹlow watermark?
@@ -1573,6 +1691,7 @@ static enum compact_result compact_zone(struct zone *zone, struct compact_contro
 
 	while ((ret = compact_finished(zone, cc, migratetype)) ==
 						COMPACT_CONTINUE) {
+		unsigned long nr_isolated;
 		int err;
 
 		switch (isolate_migratepages(zone, cc)) {
@@ -1594,9 +1713,12 @@ static enum compact_result compact_zone(struct zone *zone, struct compact_contro
 //ʼƶҳ棬ע⣬ڴ֮ǰûнͬһpageblockfreeҳisolateȥ
 //Ҳζſmigrateɹˣfreeҳֱmalloc
 //˵
+		nr_isolated = cc->nr_migratepages;
 		err = migrate_pages(&cc->migratepages, compaction_alloc,
 				compaction_free, (unsigned long)cc, cc->mode,
 				MR_COMPACTION);
+		if (err >= 0)
+			cc->nr_migrated += nr_isolated - err;
 
 		trace_mm_compaction_migratepages(cc->nr_migratepages, err,
 							&cc->migratepages);
@@ -1901,6 +2023,23 @@ int sysctl_extfrag_handler(struct ctl_table *table, int write,
 	return 0;
 }
 
+/* kcompactd has no timed wakeups while proactiveness is 0, kick it */
+int sysctl_compaction_proactiveness_handler(struct ctl_table *table,
+			int write, void __user *buffer, size_t *length,
+			loff_t *ppos)
+{
+	int ret, nid;
+
+	ret = proc_dointvec_minmax(table, write, buffer, length, ppos);
+	if (ret || !write || !sysctl_compaction_proactiveness)
+		return ret;
+
+	for_each_online_node(nid)
+		wake_up_interruptible(&NODE_DATA(nid)->kcompactd_wait);
+
+	return 0;
+}
+
 #if defined(CONFIG_SYSFS) && defined(CONFIG_NUMA)
 static ssize_t sysfs_compact_node(struct device *dev,
 			struct device_attribute *attr,
@@ -2069,6 +2208,45 @@ void wakeup_kcompactd(pg_data_t *pgdat, int order, int classzone_idx)
 	wake_up_interruptible(&pgdat->kcompactd_wait);
 }
 
+/*
+ * Compact all zones of the node until their fragmentation score drops
+ * below the low watermark. Returns the number of pages migrated.
+ */
+static unsigned long proactive_compact_node(pg_data_t *pgdat)
+{
+	int zoneid;
+	struct zone *zone;
+	struct compact_control cc = {
+		.order = -1,
+		.mode = MIGRATE_SYNC_LIGHT,
+		.ignore_skip_hint = true,
+		.proactive_compaction = true,
+	};
+
+	for (zoneid = 0; zoneid < MAX_NR_ZONES; zoneid++) {
+		zone = &pgdat->node_zones[zoneid];
+		if (!populated_zone(zone))
+			continue;
+
+		if (kthread_should_stop())
+			break;
+
+		cc.nr_freepages = 0;
+		cc.nr_migratepages = 0;
+		cc.zone = zone;
+		INIT_LIST_HEAD(&cc.freepages);
+		INIT_LIST_HEAD(&cc.migratepages);
+
+		compact_zone(zone, &cc);
+
+		VM_BUG_ON(!list_empty(&cc.freepages));
+		VM_BUG_ON(!list_empty(&cc.migratepages));
+	}
+
+	count_vm_events(KCOMPACTD_PROACTIVE_MIGRATED, cc.nr_migrated);
+	return cc.nr_migrated;
+}
+
 /*
  * The background compaction daemon, started as a kernel thread
  * from the init process.
@@ -2078,6 +2256,9 @@ static int kcompactd(void *p)
 {
 	pg_data_t *pgdat = (pg_data_t*)p;
 	struct task_struct *tsk = current;
+	const long default_timeout =
+			msecs_to_jiffies(HPAGE_FRAG_CHECK_INTERVAL_MSEC);
+	unsigned int proactive_defer_shift = 0;
 
 	const struct cpumask *cpumask = cpumask_of_node(pgdat->node_id);
 
@@ -2090,11 +2271,45 @@ static int kcompactd(void *p)
 	pgdat->kcompactd_classzone_idx = pgdat->nr_zones - 1;
 
 	while (!kthread_should_stop()) {
+		unsigned int prev_score, score;
+		bool proactive = READ_ONCE(sysctl_compaction_proactiveness);
+		long timeout = MAX_SCHEDULE_TIMEOUT;
+
+		/* nothing to check periodically until proactiveness is set */
+		if (proactive)
+			timeout = default_timeout << proactive_defer_shift;
+
 		trace_mm_compaction_kcompactd_sleep(pgdat->node_id);
-		wait_event_freezable(pgdat->kcompactd_wait,
-				kcompactd_work_requested(pgdat));
+		if (wait_event_freezable_timeout(pgdat->kcompactd_wait,
+				kcompactd_work_requested(pgdat) ||
+				(!proactive &&
+				 READ_ONCE(sysctl_compaction_proactiveness)),
+				timeout)) {
+			if (kcompactd_work_requested(pgdat))
+				kcompactd_do_work(pgdat);
+			continue;
+		}
 
-		kcompactd_do_work(pgdat);
+		/* Timed out: see if the node is worth compacting proactively */
+		if (!should_proactive_compact_node(pgdat))
+			continue;
+
+		count_vm_event(KCOMPACTD_PROACTIVE_WAKE);
+		prev_score = fragmentation_score_node(pgdat);
+		proactive_compact_node(pgdat);
+		score = fragmentation_score_node(pgdat);
+
+		/*
+		 * Back off exponentially while compaction cannot lower the
+		 * score, e.g. because the node is full of unmovable pages.
+		 */
+		if (score >= prev_score) {
+			if (proactive_defer_shift < COMPACT_MAX_DEFER_SHIFT)
+				proactive_defer_shift++;
+			count_vm_event(KCOMPACTD_PROACTIVE_BACKOFF);
+		} else {
+			proactive_defer_shift = 0;
+		}
 	}
 
 	return 0;
@@ -165,6 +165,38 @@ static int page_cache_tree_insert(struct address_space *mapping,
 	}
 	return 0;
 }
+
+/*
+ * Insert all subpages of a large page cache page.  The range must be
+ * completely empty; unlike page_cache_tree_insert() this does not
+ * replace shadow entries.  The caller preloads for the page's order; if
+ * an insertion fails anyway, the slots inserted so far are removed again.
+ */
+static int page_cache_tree_insert_large(struct address_space *mapping,
+					struct page *page, int nr)
+{
+	void **results;
+	pgoff_t idx;
+	int i, error;
+
+	if (radix_tree_gang_lookup_slot(&mapping->page_tree, &results, &idx,
+					page->index, 1) &&
+	    idx < page->index + nr)
+		return -EEXIST;
+
+	for (i = 0; i < nr; i++) {
+		error = radix_tree_insert(&mapping->page_tree,
+					  page->index + i, page + i);
+		if (unlikely(error)) {
+			while (i--)
+				radix_tree_delete(&mapping->page_tree,
+						  page->index + i);
+			return error;
+		}
+	}
+	mapping->nrpages += nr;
+	return 0;
+}
 //pagemappingƳ
 static void page_cache_tree_delete(struct address_space *mapping,
 				   struct page *page, void *shadow)
@@ -295,7 +327,8 @@ void __delete_from_page_cache(struct page *page, void *shadow)
 		if (PageTransHuge(page))
 			__dec_node_page_state(page, NR_SHMEM_THPS);
 	} else {
-		VM_BUG_ON_PAGE(PageTransHuge(page) && !PageHuge(page), page);
+		VM_BUG_ON_PAGE(PageTransHuge(page) && !PageHuge(page) &&
+			       !mapping_large_pages(mapping), page);
 	}
 
 	/*
@@ -337,7 +370,7 @@ void delete_from_page_cache(struct page *page)
 		freepage(page);
 
 	if (PageTransHuge(page) && !PageHuge(page)) {
-		page_ref_sub(page, HPAGE_PMD_NR);
+		page_ref_sub(page, hpage_nr_pages(page));
 		VM_BUG_ON_PAGE(page_count(page) <= 0, page);
 	} else {
 		put_page(page);
@@ -672,42 +705,60 @@ static int __add_to_page_cache_locked(struct page *page,
 				      void **shadowp)
 {
 	int huge = PageHuge(page);
+	bool large = !huge && PageTransHuge(page);
+	int nr = huge ? 1 : hpage_nr_pages(page);
 	struct mem_cgroup *memcg;
 	int error;
 
 	VM_BUG_ON_PAGE(!PageLocked(page), page);
 	VM_BUG_ON_PAGE(PageSwapBacked(page), page);
+	VM_BUG_ON_PAGE(large && !mapping_large_pages(mapping), page);
+	VM_BUG_ON_PAGE(offset != round_down(offset, nr), page);
 
 	if (!huge) {
 		error = mem_cgroup_try_charge(page, current->mm,
-					      gfp_mask, &memcg, false);
+					      gfp_mask, &memcg, large);
 		if (error)
 			return error;
 	}
 
-	error = radix_tree_maybe_preload(gfp_mask & ~__GFP_HIGHMEM);
+	if (large)
+		error = radix_tree_maybe_preload_order(gfp_mask & ~__GFP_HIGHMEM,
+						       compound_order(page));
+	else
+		error = radix_tree_maybe_preload(gfp_mask & ~__GFP_HIGHMEM);
 	if (error) {
 		if (!huge)
-			mem_cgroup_cancel_charge(page, memcg, false);
+			mem_cgroup_cancel_charge(page, memcg, large);
 		return error;
 	}
 
-	get_page(page);
+	page_ref_add(page, nr);
 	page->mapping = mapping;
 	page->index = offset;
 
 	spin_lock_irq(&mapping->tree_lock);
-	error = page_cache_tree_insert(mapping, page, shadowp);
+	if (large) {
+		/*
+		 * A large page takes one slot per subpage, like a shmem THP.
+		 * Shadow entries are not consumed: readahead only builds a
+		 * large page over an empty range, so if one turned up in the
+		 * meantime simply fail and let the caller use small pages.
+		 */
+		error = page_cache_tree_insert_large(mapping, page, nr);
+	} else {
+		error = page_cache_tree_insert(mapping, page, shadowp);
+	}
 	radix_tree_preload_end();
 	if (unlikely(error))
 		goto err_insert;
 
 	/* hugetlb pages do not participate in page cache accounting. */
 	if (!huge)
-		__inc_node_page_state(page, NR_FILE_PAGES);
+		__mod_node_page_state(page_pgdat(page), NR_FILE_PAGES, nr);
 	spin_unlock_irq(&mapping->tree_lock);
 	if (!huge)
-		mem_cgroup_commit_charge(page, memcg, false, false);
+		mem_cgroup_commit_charge(page, memcg, false, large);
 	trace_mm_filemap_add_to_page_cache(page);
 	return 0;
 err_insert:
@@ -715,8 +766,8 @@ err_insert:
 	/* Leave page->index set: truncation relies upon it */
 	spin_unlock_irq(&mapping->tree_lock);
 	if (!huge)
-		mem_cgroup_cancel_charge(page, memcg, false);
-	put_page(page);
+		mem_cgroup_cancel_charge(page, memcg, large);
+	page_ref_sub(page, nr);
 	return error;
 }
 
@@ -772,8 +823,107 @@ int add_to_page_cache_lru(struct page *page, struct address_space *mapping,
 }
 EXPORT_SYMBOL_GPL(add_to_page_cache_lru);
 
+/**
+ * add_to_page_cache_lru_batch - add a run of new pages to the pagecache
+ * @pvec:	new order-0 pages with ->index set, at consecutive indices
+ * @mapping:	the pages' address_space
+ * @gfp_mask:	page allocation mode
+ *
+ * This is add_to_page_cache_lru() for a readahead batch: the pages are
+ * inserted under one tree_lock acquisition and added to the LRU under one
+ * lru_lock acquisition, rather than once per page.  A run of consecutive
+ * indices spans at most two radix tree leaf nodes, which a single
+ * radix_tree_maybe_preload() covers.
+ *
+ * Pages that could not be added (usually because the index is populated
+ * already) are released and dropped from @pvec.  The pages left in @pvec
+ * are locked, in the pagecache and on the LRU, and still carry the
+ * caller's reference.  Returns the number of pages left in @pvec.
+ */
+unsigned add_to_page_cache_lru_batch(struct pagevec *pvec,
+				     struct address_space *mapping,
+				     gfp_t gfp_mask)
+{
+	struct mem_cgroup *memcg[PAGEVEC_SIZE];
+	void *shadow[PAGEVEC_SIZE];
+	unsigned long charged = 0, added = 0;
+	unsigned i, nr = pagevec_count(pvec), kept = 0;
+	struct pagevec lru_pvec;
+
+	for (i = 0; i < nr; i++) {
+		struct page *page = pvec->pages[i];
+
+		VM_BUG_ON_PAGE(PageSwapBacked(page), page);
+		VM_BUG_ON_PAGE(PageCompound(page), page);
+		VM_BUG_ON_PAGE(i && page->index !=
+			       pvec->pages[i - 1]->index + 1, page);
+
+		shadow[i] = NULL;
+		if (!mem_cgroup_try_charge(page, current->mm, gfp_mask,
+					   &memcg[i], false))
+			charged |= BIT(i);
+	}
+
+	if (!charged || radix_tree_maybe_preload(gfp_mask & ~__GFP_HIGHMEM))
+		goto out;
+
+	spin_lock_irq(&mapping->tree_lock);
+	for (i = 0; i < nr; i++) {
+		struct page *page = pvec->pages[i];
+
+		if (!(charged & BIT(i)))
+			continue;
+
+		__SetPageLocked(page);
+		get_page(page);
+		page->mapping = mapping;
+		if (page_cache_tree_insert(mapping, page, &shadow[i])) {
+			page->mapping = NULL;
+			put_page(page);
+			__ClearPageLocked(page);
+			continue;
+		}
+		__inc_node_page_state(page, NR_FILE_PAGES);
+		added |= BIT(i);
+	}
+	spin_unlock_irq(&mapping->tree_lock);
+	radix_tree_preload_end();
+out:
+	pagevec_init(&lru_pvec, 0);
+	for (i = 0; i < nr; i++) {
+		struct page *page = pvec->pages[i];
+
+		if (!(added & BIT(i))) {
+			if (charged & BIT(i))
+				mem_cgroup_cancel_charge(page, memcg[i], false);
+			put_page(page);
+			continue;
+		}
+		mem_cgroup_commit_charge(page, memcg[i], false, false);
+		trace_mm_filemap_add_to_page_cache(page);
+
+		/* See add_to_page_cache_lru() */
+		if (!(gfp_mask & __GFP_WRITE) &&
+		    shadow[i] && workingset_refault(shadow[i])) {
+			SetPageActive(page);
+			workingset_activation(page);
+		} else
+			ClearPageActive(page);
+
+		/* The LRU pagevec holds its own reference */
+		get_page(page);
+		pagevec_add(&lru_pvec, page);
+		pvec->pages[kept++] = page;
+	}
+	pvec->nr = kept;
+	if (pagevec_count(&lru_pvec))
+		__pagevec_lru_add(&lru_pvec);
+	return kept;
+}
+EXPORT_SYMBOL_GPL(add_to_page_cache_lru_batch);
+
 #ifdef CONFIG_NUMA
-struct page *__page_cache_alloc(gfp_t gfp)
+struct page *__page_cache_alloc_order(gfp_t gfp, unsigned int order)
 {
 	int n;
 	struct page *page;
@@ -783,14 +933,14 @@ struct page *__page_cache_alloc(gfp_t gfp)
 		do {
 			cpuset_mems_cookie = read_mems_allowed_begin();
 			n = cpuset_mem_spread_node();
-			page = __alloc_pages_node(n, gfp, 0);
+			page = __alloc_pages_node(n, gfp, order);
 		} while (!page && read_mems_allowed_retry(cpuset_mems_cookie));
 
 		return page;
 	}
-	return alloc_pages(gfp, 0);
+	return alloc_pages(gfp, order);
 }
-EXPORT_SYMBOL(__page_cache_alloc);
+EXPORT_SYMBOL(__page_cache_alloc_order);
 #endif
 
 /*
@@ -1199,6 +1349,26 @@ repeat:
 }
 EXPORT_SYMBOL(find_lock_entry);
 
+/*
+ * Only read() works on large page cache pages as a whole; everybody who
+ * looks up a locked page cache page expects a small page.  Split a large
+ * page for them: on success the subpage they hold is still locked.  If the
+ * large page is busy, drop it and return -EAGAIN so the caller looks the
+ * index up again.
+ */
+static int page_cache_split_large(struct address_space *mapping,
+				  struct page *page)
+{
+	if (likely(!mapping_large_pages(mapping) || !PageTransCompound(page)))
+		return 0;
+	if (!split_huge_page(page))
+		return 0;
+	unlock_page(page);
+	put_page(page);
+	cond_resched();
+	return -EAGAIN;
+}
+
 /**
  * pagecache_get_page - find and get a page reference
  * @mapping: the address_space to search
@@ -1247,11 +1417,13 @@ repeat:
 		}
 
 		/* Has the page been truncated? */
-		if (unlikely(page->mapping != mapping)) {
+		if (unlikely(compound_head(page)->mapping != mapping)) {
 			unlock_page(page);
 			put_page(page);
 			goto repeat;
 		}
+		if (unlikely(page_cache_split_large(mapping, page)))
+			goto repeat;
 		VM_BUG_ON_PAGE(page->index != offset, page);
 	}
 
@@ -1778,7 +1950,8 @@ find_page:
 				goto page_ok;
 
 			if (inode->i_blkbits == PAGE_SHIFT ||
-					!mapping->a_ops->is_partially_uptodate)
+					!mapping->a_ops->is_partially_uptodate ||
+					PageTransCompound(page))
 				goto page_not_up_to_date;
 			if (!trylock_page(page))
 				goto page_not_up_to_date;
@@ -1844,9 +2017,25 @@ page_ok:
 		index += offset >> PAGE_SHIFT;
 		offset &= ~PAGE_MASK;
 		prev_offset = offset;
+		written += ret;
+
+		/*
+		 * A large page covers several indices and we already hold a
+		 * reference on it: carry on with its next subpage without
+		 * another lookup, and without marking it accessed again.
+		 */
+		if (ret == nr && iov_iter_count(iter) &&
+		    PageTransCompound(page)) {
+			struct page *head = compound_head(page);
+
+			if (index < head->index + hpage_nr_pages(head)) {
+				page = head + (index - head->index);
+				prev_index = index;
+				goto page_ok;
+			}
+		}
 
 		put_page(page);
-		written += ret;
 		if (!iov_iter_count(iter))
 			goto out;
 		if (ret < nr) {
@@ -1863,7 +2052,7 @@ page_not_up_to_date:
 
 page_not_up_to_date_locked:
 		/* Did it get truncated before we got the lock? */
-		if (!page->mapping) {
+		if (!compound_head(page)->mapping) {
 			unlock_page(page);
 			put_page(page);
 			continue;
@@ -1874,6 +2063,10 @@ page_not_up_to_date_locked:
 			unlock_page(page);
 			goto page_ok;
 		}
+
+		/* Reading a large page failed: retry just the subpage we need */
+		if (page_cache_split_large(mapping, page))
+			continue;
 //˴ѾcachepageҪ
 readpage:
 		/*
@@ -2192,11 +2385,13 @@ retry_find:
 	}
 
 	/* Did it get truncated? */
-	if (unlikely(page->mapping != mapping)) {
+	if (unlikely(compound_head(page)->mapping != mapping)) {
 		unlock_page(page);
 		put_page(page);
 		goto retry_find;
 	}
+	if (unlikely(page_cache_split_large(mapping, page)))
+		goto retry_find;
 	VM_BUG_ON_PAGE(page->index != offset, page);
 
 	/*
@@ -2321,6 +2516,9 @@ repeat:
 				PageReadahead(page) ||
 				PageHWPoison(page))
 			goto skip;
+		/* Large pages are only mapped after a split by the fault */
+		if (PageTransCompound(page) && mapping_large_pages(mapping))
+			goto skip;
 		if (!trylock_page(page))
 			goto skip;
 
@@ -1737,7 +1737,7 @@ static void freeze_page(struct page *page)
 
 	/* We only need TTU_SPLIT_HUGE_PMD once */
 	ret = try_to_unmap(page, ttu_flags | TTU_SPLIT_HUGE_PMD);
-	for (i = 1; !ret && i < HPAGE_PMD_NR; i++) {
+	for (i = 1; !ret && i < hpage_nr_pages(page); i++) {
 		/* Cut short if the page is unmapped */
 		if (page_count(page) == 1)
 			return;
@@ -1747,11 +1747,11 @@ static void freeze_page(struct page *page)
 	VM_BUG_ON_PAGE(ret, page + i - 1);
 }
 
-static void unfreeze_page(struct page *page)
+static void unfreeze_page(struct page *page, int nr)
 {
 	int i;
 
-	for (i = 0; i < HPAGE_PMD_NR; i++)
+	for (i = 0; i < nr; i++)
 		remove_migration_ptes(page + i, page + i, true);
 }
 
@@ -1822,7 +1822,7 @@ static void __split_huge_page(struct page *page, struct list_head *list,
 	struct zone *zone = page_zone(head);
 	struct lruvec *lruvec;
 	pgoff_t end = -1;
-	int i;
+	int i, nr = hpage_nr_pages(head);
 
 	lruvec = mem_cgroup_page_lruvec(head, zone->zone_pgdat);
 
@@ -1832,7 +1832,7 @@ static void __split_huge_page(struct page *page, struct list_head *list,
 	if (!PageAnon(page))
 		end = DIV_ROUND_UP(i_size_read(head->mapping->host), PAGE_SIZE);
 
-	for (i = HPAGE_PMD_NR - 1; i >= 1; i--) {
+	for (i = nr - 1; i >= 1; i--) {
 		__split_huge_page_tail(head, i, lruvec, list);
 		/* Some pages can be beyond i_size: drop them from page cache */
 		if (head[i].index >= end) {
@@ -1856,9 +1856,9 @@ static void __split_huge_page(struct page *page, struct list_head *list,
 
 	spin_unlock_irqrestore(zone_lru_lock(page_zone(head)), flags);
 
-	unfreeze_page(head);
+	unfreeze_page(head, nr);
 
-	for (i = 0; i < HPAGE_PMD_NR; i++) {
+	for (i = 0; i < nr; i++) {
 		struct page *subpage = head + i;
 		if (subpage == page)
 			continue;
@@ -1877,7 +1877,7 @@ static void __split_huge_page(struct page *page, struct list_head *list,
 
 int total_mapcount(struct page *page)
 {
-	int i, compound, ret;
+	int i, nr, compound, ret;
 
 	VM_BUG_ON_PAGE(PageTail(page), page);
 
@@ -1887,14 +1887,15 @@ int total_mapcount(struct page *page)
 	compound = compound_mapcount(page);
 	if (PageHuge(page))
 		return compound;
+	nr = hpage_nr_pages(page);
 	ret = compound;
-	for (i = 0; i < HPAGE_PMD_NR; i++)
+	for (i = 0; i < nr; i++)
 		ret += atomic_read(&page[i]._mapcount) + 1;
 	/* File pages has compound_mapcount included in _mapcount */
 	if (!PageAnon(page))
-		return ret - compound * HPAGE_PMD_NR;
+		return ret - compound * nr;
 	if (PageDoubleMap(page))
-		ret -= HPAGE_PMD_NR;
+		ret -= nr;
 	return ret;
 }
 
@@ -1939,7 +1940,7 @@ int page_trans_huge_mapcount(struct page *page, int *total_mapcount)
 	page = compound_head(page);
 
 	_total_mapcount = ret = 0;
-	for (i = 0; i < HPAGE_PMD_NR; i++) {
+	for (i = 0; i < hpage_nr_pages(page); i++) {
 		mapcount = atomic_read(&page[i]._mapcount) + 1;
 		ret = max(ret, mapcount);
 		_total_mapcount += mapcount;
@@ -1987,7 +1988,8 @@ int split_huge_page_to_list(struct page *page, struct list_head *list)
 
 	VM_BUG_ON_PAGE(is_huge_zero_page(page), page);
 	VM_BUG_ON_PAGE(!PageLocked(page), page);
-	VM_BUG_ON_PAGE(!PageSwapBacked(page), page);
+	VM_BUG_ON_PAGE(!PageSwapBacked(page) && head->mapping &&
+		       !mapping_large_pages(head->mapping), page);
 	VM_BUG_ON_PAGE(!PageCompound(page), page);
 
 	if (PageAnon(head)) {
@@ -2017,7 +2019,7 @@ int split_huge_page_to_list(struct page *page, struct list_head *list)
 		}
 
 		/* Addidional pins from radix tree */
-		extra_pins = HPAGE_PMD_NR;
+		extra_pins = hpage_nr_pages(head);
 		anon_vma = NULL;
 		i_mmap_lock_read(mapping);
 	}
@@ -2066,7 +2068,7 @@ int split_huge_page_to_list(struct page *page, struct list_head *list)
 			pgdata->split_queue_len--;
 			list_del(page_deferred_list(head));
 		}
-		if (mapping)
+		if (mapping && PageSwapBacked(head))
 			__dec_node_page_state(page, NR_SHMEM_THPS);
 		spin_unlock(&pgdata->split_queue_lock);
 		__split_huge_page(page, list, flags);
@@ -2084,7 +2086,7 @@ int split_huge_page_to_list(struct page *page, struct list_head *list)
 fail:		if (mapping)
 			spin_unlock(&mapping->tree_lock);
 		spin_unlock_irqrestore(zone_lru_lock(page_zone(head)), flags);
-		unfreeze_page(head);
+		unfreeze_page(head, hpage_nr_pages(head));
 		ret = -EBUSY;
 	}
 
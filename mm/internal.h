@@ -191,6 +191,8 @@ struct compact_control {
 	bool ignore_skip_hint;		/* Scan blocks even if marked skip */
 	bool direct_compaction;		/* False from kcompactd or /proc/... */
 	bool whole_zone;		/* Whole zone has been scanned */
+	bool proactive_compaction;	/* kcompactd proactive compaction */
+	unsigned long nr_migrated;	/* Pages successfully migrated */
 //˴ɨҪcompactionorder    
 	int order;			/* order a direct compactor needs */
 	const gfp_t gfp_mask;		/* gfp mask of a direct compactor */
@@ -15,6 +15,7 @@
 #include <linux/page_idle.h>
 #include <linux/swapops.h>
 #include <linux/shmem_fs.h>
+#include <linux/seq_file.h>
 
 #include <asm/tlb.h>
 #include <asm/pgalloc.h>
@@ -73,21 +74,81 @@ static __read_mostly DEFINE_HASHTABLE(mm_slots_hash, MM_SLOTS_HASH_BITS);
 
 static struct kmem_cache *mm_slot_cache __read_mostly;
 
+/**
+ * struct khugepaged_mm_stats - per-mm collapse progress
+ * @scanned: PMD-sized extents examined
+ * @collapsed: extents collapsed into a huge page
+ * @failed: extents that could not be collapsed
+ * @requests: completed MADV_COLLAPSE and MADV_COLLAPSE_ASYNC requests
+ * @last_latency_ns: queue-to-completion time of the last request
+ * @max_latency_ns: worst queue-to-completion time seen
+ */
+struct khugepaged_mm_stats {
+	unsigned long scanned;
+	unsigned long collapsed;
+	unsigned long failed;
+	unsigned long requests;
+	u64 last_latency_ns;
+	u64 max_latency_ns;
+};
+
 /**
  * struct mm_slot - hash lookup from mm to mm_slot
  * @hash: hash collision list
  * @mm_node: khugepaged scan list headed in khugepaged_scan.mm_head
+ * @req_node: pending collapse request list headed in khugepaged_scan.req_head
  * @mm: the mm that this information is valid for
+ * @prio: scan priority, mm_head is kept sorted by decreasing priority
+ * @reqs: pending MADV_COLLAPSE_ASYNC ranges, oldest first
+ * @nr_reqs: number of entries on @reqs
+ * @stats: collapse progress, protected by khugepaged_mm_lock
  */
 struct mm_slot {
 	struct hlist_node hash;
 	struct list_head mm_node;
+	struct list_head req_node;
 	struct mm_struct *mm;
+	int prio;
+	struct list_head reqs;
+	unsigned int nr_reqs;
+	struct khugepaged_mm_stats stats;
+};
+
+/* pending MADV_COLLAPSE_ASYNC ranges per mm */
+#define KHUGEPAGED_MAX_REQUESTS	64
+
+/**
+ * struct khugepaged_request - a queued MADV_COLLAPSE_ASYNC range
+ * @node: entry in mm_slot->reqs
+ * @start: start of the range
+ * @end: end of the range
+ * @queued: ktime (ns) at which the range was queued
+ */
+struct khugepaged_request {
+	struct list_head node;
+	unsigned long start;
+	unsigned long end;
+	u64 queued;
 };
 
+/**
+ * struct collapse_control - scratch state of a collapse
+ * @node_load: pages of the extent being scanned found on each node, the
+ *	huge page is allocated on the node with the most
+ *
+ * khugepaged has its own, MADV_COLLAPSE callers allocate one, so that
+ * they never wait for each other.
+ */
+struct collapse_control {
+	int node_load[MAX_NUMNODES];
+};
+
+static struct collapse_control khugepaged_collapse_control;
+
 /**
  * struct khugepaged_scan - cursor for scanning
  * @mm_head: the head of the mm list to scan
+ * @req_head: mm_slots with a pending asynchronous collapse request
  * @mm_slot: the current mm_slot we are scanning
  * @address: the next address inside that to be scanned
  *
@@ -95,12 +156,14 @@ struct mm_slot {
  */
 struct khugepaged_scan {
 	struct list_head mm_head;
+	struct list_head req_head;
 	struct mm_slot *mm_slot;
 	unsigned long address;
 };
 
 static struct khugepaged_scan khugepaged_scan = {
 	.mm_head = LIST_HEAD_INIT(khugepaged_scan.mm_head),
+	.req_head = LIST_HEAD_INIT(khugepaged_scan.req_head),
 };
 
 static ssize_t scan_sleep_millisecs_show(struct kobject *kobj,
@@ -392,6 +455,54 @@ static inline int khugepaged_test_exit(struct mm_struct *mm)
 	return atomic_read(&mm->mm_users) == 0;
 }
 
+/*
+ * Keep khugepaged_scan.mm_head sorted by decreasing priority so that a
+ * full scan pass visits the most important mms first. The common case of
+ * a default priority mm is still a plain tail insertion.
+ */
+static void khugepaged_insert_slot(struct mm_slot *mm_slot)
+{
+	struct list_head *head = &khugepaged_scan.mm_head;
+	struct mm_slot *pos;
+
+	if (list_empty(head) ||
+	    list_last_entry(head, struct mm_slot, mm_node)->prio >= mm_slot->prio) {
+		list_add_tail(&mm_slot->mm_node, head);
+		return;
+	}
+
+	list_for_each_entry(pos, head, mm_node) {
+		if (pos->prio < mm_slot->prio) {
+			list_add_tail(&mm_slot->mm_node, &pos->mm_node);
+			return;
+		}
+	}
+}
+
+/* Forget the pending requests of an exiting mm */
+static void khugepaged_drop_requests(struct mm_slot *mm_slot)
+{
+	struct khugepaged_request *req, *next;
+
+	VM_BUG_ON(NR_CPUS != 1 && !spin_is_locked(&khugepaged_mm_lock));
+
+	list_del_init(&mm_slot->req_node);
+	list_for_each_entry_safe(req, next, &mm_slot->reqs, node)
+		kfree(req);
+	INIT_LIST_HEAD(&mm_slot->reqs);
+	mm_slot->nr_reqs = 0;
+}
+
+static void khugepaged_account(struct mm_slot *mm_slot,
+			       struct khugepaged_mm_stats *stats)
+{
+	VM_BUG_ON(NR_CPUS != 1 && !spin_is_locked(&khugepaged_mm_lock));
+
+	mm_slot->stats.scanned += stats->scanned;
+	mm_slot->stats.collapsed += stats->collapsed;
+	mm_slot->stats.failed += stats->failed;
+}
+
 int __khugepaged_enter(struct mm_struct *mm)
 {
 	struct mm_slot *mm_slot;
@@ -400,6 +511,8 @@ int __khugepaged_enter(struct mm_struct *mm)
 	mm_slot = alloc_mm_slot();
 	if (!mm_slot)
 		return -ENOMEM;
+	INIT_LIST_HEAD(&mm_slot->req_node);
+	INIT_LIST_HEAD(&mm_slot->reqs);
 
 	/* __khugepaged_exit() must not run from under us */
 	VM_BUG_ON_MM(khugepaged_test_exit(mm), mm);
@@ -415,7 +528,7 @@ int __khugepaged_enter(struct mm_struct *mm)
 	 * down a little.
 	 */
 	wakeup = list_empty(&khugepaged_scan.mm_head);
-	list_add_tail(&mm_slot->mm_node, &khugepaged_scan.mm_head);
+	khugepaged_insert_slot(mm_slot);
 	spin_unlock(&khugepaged_mm_lock);
 
 	atomic_inc(&mm->mm_count);
@@ -452,6 +565,8 @@ void __khugepaged_exit(struct mm_struct *mm)
 
 	spin_lock(&khugepaged_mm_lock);
 	mm_slot = get_mm_slot(mm);
+	if (mm_slot)
+		khugepaged_drop_requests(mm_slot);
 	if (mm_slot && khugepaged_scan.mm_slot != mm_slot) {
 		hash_del(&mm_slot->hash);
 		list_del(&mm_slot->mm_node);
@@ -665,9 +780,7 @@ static void khugepaged_alloc_sleep(void)
 	remove_wait_queue(&khugepaged_wait, &wait);
 }
 
-static int khugepaged_node_load[MAX_NUMNODES];
-
-static bool khugepaged_scan_abort(int nid)
+static bool khugepaged_scan_abort(int nid, struct collapse_control *cc)
 {
 	int i;
 
@@ -679,11 +792,11 @@ static bool khugepaged_scan_abort(int nid)
 		return false;
 
 	/* If there is a count for this node already, it must be acceptable */
-	if (khugepaged_node_load[nid])
+	if (cc->node_load[nid])
 		return false;
 
 	for (i = 0; i < MAX_NUMNODES; i++) {
-		if (!khugepaged_node_load[i])
+		if (!cc->node_load[i])
 			continue;
 		if (node_distance(nid, i) > RECLAIM_DISTANCE)
 			return true;
@@ -698,28 +811,29 @@ static inline gfp_t alloc_hugepage_khugepaged_gfpmask(void)
 }
 
 #ifdef CONFIG_NUMA
-static int khugepaged_find_target_node(void)
+static int khugepaged_find_target_node(struct collapse_control *cc)
 {
+	/* shared by all callers, only a hint for balancing */
 	static int last_khugepaged_target_node = NUMA_NO_NODE;
-	int nid, target_node = 0, max_value = 0;
+	int nid, target_node = 0, max_value = 0, last;
 
 	/* find first node with max normal pages hit */
 	for (nid = 0; nid < MAX_NUMNODES; nid++)
-		if (khugepaged_node_load[nid] > max_value) {
-			max_value = khugepaged_node_load[nid];
+		if (cc->node_load[nid] > max_value) {
+			max_value = cc->node_load[nid];
 			target_node = nid;
 		}
 
 	/* do some balance if several nodes have the same hit record */
-	if (target_node <= last_khugepaged_target_node)
-		for (nid = last_khugepaged_target_node + 1; nid < MAX_NUMNODES;
-				nid++)
-			if (max_value == khugepaged_node_load[nid]) {
+	last = READ_ONCE(last_khugepaged_target_node);
+	if (target_node <= last)
+		for (nid = last + 1; nid < MAX_NUMNODES; nid++)
+			if (max_value == cc->node_load[nid]) {
 				target_node = nid;
 				break;
 			}
 
-	last_khugepaged_target_node = target_node;
+	WRITE_ONCE(last_khugepaged_target_node, target_node);
 	return target_node;
 }
 
@@ -757,7 +871,7 @@ khugepaged_alloc_page(struct page **hpage, gfp_t gfp, int node)
 	return *hpage;
 }
 #else
-static int khugepaged_find_target_node(void)
+static int khugepaged_find_target_node(struct collapse_control *cc)
 {
 	return 0;
 }
@@ -921,7 +1035,7 @@ static bool __collapse_huge_page_swapin(struct mm_struct *mm,
 	return true;
 }
 
-static void collapse_huge_page(struct mm_struct *mm,
+static int collapse_huge_page(struct mm_struct *mm,
 				   unsigned long address,
 				   struct page **hpage,
 				   int node, int referenced)
@@ -1080,16 +1194,23 @@ out_up_write:
 	up_write(&mm->mmap_sem);
 out_nolock:
 	trace_mm_collapse_huge_page(mm, isolated, result);
-	return;
+	return result;
 out:
 	mem_cgroup_cancel_charge(new_page, memcg, true);
 	goto out_up_write;
 }
 
+/*
+ * Returns 1 if a collapse was attempted, in which case mmap_sem has been
+ * released. *@collapse_result is set to SCAN_SUCCEED only if @address is
+ * now mapped by a huge page.
+ */
 static int khugepaged_scan_pmd(struct mm_struct *mm,
 			       struct vm_area_struct *vma,
 			       unsigned long address,
-			       struct page **hpage)
+			       struct page **hpage,
+			       int *collapse_result,
+			       struct collapse_control *cc)
 {
 	pmd_t *pmd;
 	pte_t *pte, *_pte;
@@ -1108,7 +1229,7 @@ static int khugepaged_scan_pmd(struct mm_struct *mm,
 		goto out;
 	}
 
-	memset(khugepaged_node_load, 0, sizeof(khugepaged_node_load));
+	memset(cc->node_load, 0, sizeof(cc->node_load));
 	pte = pte_offset_map_lock(mm, pmd, address, &ptl);
 	for (_address = address, _pte = pte; _pte < pte+HPAGE_PMD_NR;
 	     _pte++, _address += PAGE_SIZE) {
@@ -1151,16 +1272,16 @@ static int khugepaged_scan_pmd(struct mm_struct *mm,
 
 		/*
 		 * Record which node the original page is from and save this
-		 * information to khugepaged_node_load[].
+		 * information to cc->node_load[].
 		 * Khupaged will allocate hugepage from the node has the max
 		 * hit record.
 		 */
 		node = page_to_nid(page);
-		if (khugepaged_scan_abort(node)) {
+		if (khugepaged_scan_abort(node, cc)) {
 			result = SCAN_SCAN_ABORT;
 			goto out_unmap;
 		}
-		khugepaged_node_load[node]++;
+		cc->node_load[node]++;
 		if (!PageLRU(page)) {
 			result = SCAN_PAGE_LRU;
 			goto out_unmap;
@@ -1201,11 +1322,14 @@ static int khugepaged_scan_pmd(struct mm_struct *mm,
 out_unmap:
 	pte_unmap_unlock(pte, ptl);
 	if (ret) {
-		node = khugepaged_find_target_node();
+		node = khugepaged_find_target_node(cc);
 		/* collapse_huge_page will return with the mmap_sem released */
-		collapse_huge_page(mm, address, hpage, node, referenced);
+		*collapse_result = collapse_huge_page(mm, address, hpage, node,
+						      referenced);
 	}
 out:
+	if (!ret)
+		*collapse_result = result;
 	trace_mm_khugepaged_scan_pmd(mm, page, writable, referenced,
 				     none_or_zero, result, unmapped);
 	return ret;
@@ -1221,6 +1345,7 @@ static void collect_mm_slot(struct mm_slot *mm_slot)
 		/* free mm_slot */
 		hash_del(&mm_slot->hash);
 		list_del(&mm_slot->mm_node);
+		khugepaged_drop_requests(mm_slot);
 
 		/*
 		 * Not strictly needed because the mm exited already.
@@ -1552,7 +1677,8 @@ out:
 
 static void khugepaged_scan_shmem(struct mm_struct *mm,
 		struct address_space *mapping,
-		pgoff_t start, struct page **hpage)
+		pgoff_t start, struct page **hpage,
+		struct collapse_control *cc)
 {
 	struct page *page = NULL;
 	struct radix_tree_iter iter;
@@ -1563,7 +1689,7 @@ static void khugepaged_scan_shmem(struct mm_struct *mm,
 
 	present = 0;
 	swap = 0;
-	memset(khugepaged_node_load, 0, sizeof(khugepaged_node_load));
+	memset(cc->node_load, 0, sizeof(cc->node_load));
 	rcu_read_lock();
 	radix_tree_for_each_slot(slot, &mapping->page_tree, &iter, start) {
 		if (iter.index >= start + HPAGE_PMD_NR)
@@ -1589,11 +1715,11 @@ static void khugepaged_scan_shmem(struct mm_struct *mm,
 		}
 
 		node = page_to_nid(page);
-		if (khugepaged_scan_abort(node)) {
+		if (khugepaged_scan_abort(node, cc)) {
 			result = SCAN_SCAN_ABORT;
 			break;
 		}
-		khugepaged_node_load[node]++;
+		cc->node_load[node]++;
 
 		if (!PageLRU(page)) {
 			result = SCAN_PAGE_LRU;
@@ -1624,7 +1750,7 @@ static void khugepaged_scan_shmem(struct mm_struct *mm,
 		if (present < HPAGE_PMD_NR - khugepaged_max_ptes_none) {
 			result = SCAN_EXCEED_NONE_PTE;
 		} else {
-			node = khugepaged_find_target_node();
+			node = khugepaged_find_target_node(cc);
 			collapse_shmem(mm, mapping, start, hpage, node);
 		}
 	}
@@ -1634,7 +1760,8 @@ static void khugepaged_scan_shmem(struct mm_struct *mm,
 #else
 static void khugepaged_scan_shmem(struct mm_struct *mm,
 		struct address_space *mapping,
-		pgoff_t start, struct page **hpage)
+		pgoff_t start, struct page **hpage,
+		struct collapse_control *cc)
 {
 	BUILD_BUG();
 }
@@ -1648,6 +1775,7 @@ static unsigned int khugepaged_scan_mm_slot(unsigned int pages,
 	struct mm_slot *mm_slot;
 	struct mm_struct *mm;
 	struct vm_area_struct *vma;
+	struct khugepaged_mm_stats stats = { };
 	int progress = 0;
 
 	VM_BUG_ON(!pages);
@@ -1713,12 +1841,21 @@ skip:
 				up_read(&mm->mmap_sem);
 				ret = 1;
 				khugepaged_scan_shmem(mm, file->f_mapping,
-						pgoff, hpage);
+						pgoff, hpage,
+						&khugepaged_collapse_control);
 				fput(file);
 			} else {
+				int result;
+
 				ret = khugepaged_scan_pmd(mm, vma,
 						khugepaged_scan.address,
-						hpage);
+						hpage, &result,
+						&khugepaged_collapse_control);
+				stats.scanned++;
+				if (result == SCAN_SUCCEED)
+					stats.collapsed++;
+				else if (ret)
+					stats.failed++;
 			}
 			/* move to next address */
 			khugepaged_scan.address += HPAGE_PMD_SIZE;
@@ -1736,6 +1873,7 @@ breakouterloop_mmap_sem:
 
 	spin_lock(&khugepaged_mm_lock);
 	VM_BUG_ON(khugepaged_scan.mm_slot != mm_slot);
+	khugepaged_account(mm_slot, &stats);
 	/*
 	 * Release the current mm_slot if this mm is about to die, or
 	 * if we scanned all vmas of this mm.
@@ -1768,12 +1906,329 @@ static int khugepaged_has_work(void)
 		khugepaged_enabled();
 }
 
+static int khugepaged_has_requests(void)
+{
+	return !list_empty(&khugepaged_scan.req_head);
+}
+
 static int khugepaged_wait_event(void)
 {
 	return !list_empty(&khugepaged_scan.mm_head) ||
+		khugepaged_has_requests() ||
 		kthread_should_stop();
 }
 
+/*
+ * Collapse every PMD-sized extent fully contained in [start, end) of @mm.
+ * Called without mmap_sem; it is taken per extent because
+ * collapse_huge_page() drops it anyway. Allocation failures are not
+ * retried: the caller asked for the collapse now, not after
+ * alloc_sleep_millisecs. Only anonymous memory is handled. mmap_sem is
+ * all that serializes this against khugepaged and other callers.
+ *
+ * Returns 0 if every populated extent is now huge, -EAGAIN if some could
+ * not be collapsed, -ENOMEM if we ran out of huge pages and -EINVAL if
+ * nothing in the range is eligible for THP.
+ */
+static int khugepaged_collapse_range(struct mm_struct *mm,
+				     unsigned long start, unsigned long end,
+				     struct khugepaged_mm_stats *stats)
+{
+	struct collapse_control *cc;
+	struct page *hpage = NULL;
+	unsigned long address;
+	bool eligible = false, wait = false;
+	int err = 0;
+
+	cc = kmalloc(sizeof(*cc), GFP_KERNEL);
+	if (!cc)
+		return -ENOMEM;
+
+	for (address = ALIGN(start, HPAGE_PMD_SIZE);
+	     address + HPAGE_PMD_SIZE <= end; address += HPAGE_PMD_SIZE) {
+		struct vm_area_struct *vma;
+		int ret, result;
+
+		cond_resched();
+		if (fatal_signal_pending(current)) {
+			err = -EINTR;
+			break;
+		}
+
+		if (!khugepaged_prealloc_page(&hpage, &wait)) {
+			err = -ENOMEM;
+			break;
+		}
+
+		down_read(&mm->mmap_sem);
+		result = hugepage_vma_revalidate(mm, address, &vma);
+		if (!result && shmem_file(vma->vm_file))
+			result = SCAN_VMA_CHECK;
+		if (result) {
+			up_read(&mm->mmap_sem);
+			if (result == SCAN_ANY_PROCESS)
+				break;
+			continue;
+		}
+		eligible = true;
+
+		ret = khugepaged_scan_pmd(mm, vma, address, &hpage, &result,
+					  cc);
+		if (!ret)
+			up_read(&mm->mmap_sem);
+
+		stats->scanned++;
+		if (result == SCAN_SUCCEED) {
+			stats->collapsed++;
+		} else if (result != SCAN_PMD_NULL) {
+			/* SCAN_PMD_NULL: already huge or never populated */
+			stats->failed++;
+			err = -EAGAIN;
+		}
+	}
+
+	if (!IS_ERR_OR_NULL(hpage))
+		put_page(hpage);
+	kfree(cc);
+
+	if (!err && !eligible)
+		err = -EINVAL;
+	return err;
+}
+
+static void khugepaged_account_request(struct mm_struct *mm,
+				       struct khugepaged_mm_stats *stats,
+				       u64 latency)
+{
+	struct mm_slot *mm_slot;
+
+	spin_lock(&khugepaged_mm_lock);
+	mm_slot = get_mm_slot(mm);
+	if (mm_slot) {
+		khugepaged_account(mm_slot, stats);
+		mm_slot->stats.requests++;
+		mm_slot->stats.last_latency_ns = latency;
+		if (latency > mm_slot->stats.max_latency_ns)
+			mm_slot->stats.max_latency_ns = latency;
+	}
+	spin_unlock(&khugepaged_mm_lock);
+}
+
+/*
+ * Queue *@reqp on @mm_slot, which then owns it, or merge it into the last
+ * pending range if the two are adjacent: madvise() over several vmas
+ * comes in one piece per vma.  Disjoint ranges are kept apart, whatever
+ * lies between them was not asked for.
+ */
+static int khugepaged_queue_request(struct mm_slot *mm_slot,
+				    struct khugepaged_request **reqp)
+{
+	struct khugepaged_request *req = *reqp, *last;
+
+	VM_BUG_ON(NR_CPUS != 1 && !spin_is_locked(&khugepaged_mm_lock));
+
+	if (!list_empty(&mm_slot->reqs)) {
+		last = list_last_entry(&mm_slot->reqs,
+				       struct khugepaged_request, node);
+		if (last->end == req->start) {
+			last->end = req->end;
+			return 0;
+		}
+	}
+	if (mm_slot->nr_reqs >= KHUGEPAGED_MAX_REQUESTS)
+		return -EAGAIN;
+
+	list_add_tail(&req->node, &mm_slot->reqs);
+	mm_slot->nr_reqs++;
+	*reqp = NULL;
+	if (list_empty(&mm_slot->req_node))
+		list_add_tail(&mm_slot->req_node, &khugepaged_scan.req_head);
+	return 0;
+}
+
+/*
+ * MADV_COLLAPSE and MADV_COLLAPSE_ASYNC, called from madvise_vma() with
+ * mmap_sem held for read. The synchronous variant drops mmap_sem while it
+ * works and tells sys_madvise() so by clearing *prev.
+ */
+int khugepaged_madvise_collapse(struct vm_area_struct *vma,
+				struct vm_area_struct **prev,
+				unsigned long start, unsigned long end,
+				bool async)
+{
+	struct mm_struct *mm = vma->vm_mm;
+	struct khugepaged_mm_stats stats = { };
+	struct khugepaged_request *req;
+	struct mm_slot *mm_slot;
+	u64 queued;
+	int err;
+
+	if (!hugepage_vma_check(vma) || shmem_file(vma->vm_file))
+		return -EINVAL;
+
+	if (async) {
+		*prev = vma;
+		if (!khugepaged_enabled())
+			return -EINVAL;
+		if (!test_bit(MMF_VM_HUGEPAGE, &mm->flags) &&
+		    __khugepaged_enter(mm))
+			return -ENOMEM;
+
+		req = kmalloc(sizeof(*req), GFP_KERNEL);
+		if (!req)
+			return -ENOMEM;
+		req->start = start;
+		req->end = end;
+		req->queued = ktime_get_ns();
+
+		err = -EAGAIN;
+		spin_lock(&khugepaged_mm_lock);
+		mm_slot = get_mm_slot(mm);
+		if (mm_slot)
+			err = khugepaged_queue_request(mm_slot, &req);
+		if (!err)
+			khugepaged_sleep_expire = 0;
+		spin_unlock(&khugepaged_mm_lock);
+		kfree(req);	/* NULL if queued */
+
+		if (!err)
+			wake_up_interruptible(&khugepaged_wait);
+		return err;
+	}
+
+	*prev = NULL;	/* tell sys_madvise we drop mmap_sem */
+	up_read(&mm->mmap_sem);
+	queued = ktime_get_ns();
+	err = khugepaged_collapse_range(mm, start, end, &stats);
+	khugepaged_account_request(mm, &stats, ktime_get_ns() - queued);
+	down_read(&mm->mmap_sem);
+
+	return err;
+}
+
+/*
+ * Serve queued MADV_COLLAPSE_ASYNC requests ahead of the periodic scan,
+ * one range of each mm in turn.
+ */
+static void khugepaged_do_requests(void)
+{
+	struct khugepaged_request *req;
+	struct mm_slot *mm_slot;
+	struct mm_struct *mm;
+
+	spin_lock(&khugepaged_mm_lock);
+	while (khugepaged_has_requests()) {
+		struct khugepaged_mm_stats stats = { };
+
+		mm_slot = list_first_entry(&khugepaged_scan.req_head,
+					   struct mm_slot, req_node);
+		req = list_first_entry(&mm_slot->reqs,
+				       struct khugepaged_request, node);
+		list_del(&req->node);
+		mm_slot->nr_reqs--;
+		list_del_init(&mm_slot->req_node);
+		if (mm_slot->nr_reqs)
+			list_add_tail(&mm_slot->req_node,
+				      &khugepaged_scan.req_head);
+		mm = mm_slot->mm;
+		if (!mmget_not_zero(mm)) {
+			kfree(req);
+			continue;
+		}
+		spin_unlock(&khugepaged_mm_lock);
+
+		khugepaged_collapse_range(mm, req->start, req->end, &stats);
+		khugepaged_account_request(mm, &stats,
+					   ktime_get_ns() - req->queued);
+		mmput(mm);
+		kfree(req);
+
+		cond_resched();
+		if (unlikely(kthread_should_stop() || try_to_freeze()))
+			return;
+		spin_lock(&khugepaged_mm_lock);
+	}
+	spin_unlock(&khugepaged_mm_lock);
+}
+
+int khugepaged_set_mm_priority(struct mm_struct *mm, int prio)
+{
+	struct mm_slot *mm_slot;
+
+	if (prio < 0 || prio > KHUGEPAGED_PRIO_MAX)
+		return -EINVAL;
+	if (!khugepaged_enabled())
+		return -EINVAL;
+	if (!test_bit(MMF_VM_HUGEPAGE, &mm->flags) && __khugepaged_enter(mm))
+		return -ENOMEM;
+
+	spin_lock(&khugepaged_mm_lock);
+	mm_slot = get_mm_slot(mm);
+	if (!mm_slot) {
+		spin_unlock(&khugepaged_mm_lock);
+		return -EAGAIN;
+	}
+	if (prio > mm_slot->prio && !capable(CAP_SYS_NICE)) {
+		spin_unlock(&khugepaged_mm_lock);
+		return -EPERM;
+	}
+	mm_slot->prio = prio;
+	/* The slot being scanned keeps its place until the cursor moves on */
+	if (khugepaged_scan.mm_slot != mm_slot) {
+		list_del(&mm_slot->mm_node);
+		khugepaged_insert_slot(mm_slot);
+	}
+	spin_unlock(&khugepaged_mm_lock);
+
+	return 0;
+}
+
+int khugepaged_get_mm_priority(struct mm_struct *mm)
+{
+	struct mm_slot *mm_slot;
+	int prio = 0;
+
+	spin_lock(&khugepaged_mm_lock);
+	mm_slot = get_mm_slot(mm);
+	if (mm_slot)
+		prio = mm_slot->prio;
+	spin_unlock(&khugepaged_mm_lock);
+
+	return prio;
+}
+
+void khugepaged_show_mm_stat(struct seq_file *m, struct mm_struct *mm)
+{
+	struct khugepaged_mm_stats stats = { };
+	struct mm_slot *mm_slot;
+	unsigned int pending = 0;
+	int prio = 0;
+
+	spin_lock(&khugepaged_mm_lock);
+	mm_slot = get_mm_slot(mm);
+	if (mm_slot) {
+		stats = mm_slot->stats;
+		prio = mm_slot->prio;
+		pending = mm_slot->nr_reqs;
+	}
+	spin_unlock(&khugepaged_mm_lock);
+
+	seq_printf(m,
+		   "registered: %d\n"
+		   "priority: %d\n"
+		   "pmd_scanned: %lu\n"
+		   "pmd_collapsed: %lu\n"
+		   "pmd_failed: %lu\n"
+		   "requests: %lu\n"
+		   "request_pending: %u\n"
+		   "last_latency_us: %llu\n"
+		   "max_latency_us: %llu\n",
+		   !!mm_slot, prio, stats.scanned, stats.collapsed,
+		   stats.failed, stats.requests, pending,
+		   div_u64(stats.last_latency_ns, NSEC_PER_USEC),
+		   div_u64(stats.max_latency_ns, NSEC_PER_USEC));
+}
+
 static void khugepaged_do_scan(void)
 {
 	struct page *hpage = NULL;
@@ -1810,12 +2265,15 @@ static void khugepaged_do_scan(void)
 
 static bool khugepaged_should_wakeup(void)
 {
-	return kthread_should_stop() ||
+	return kthread_should_stop() || khugepaged_has_requests() ||
 	       time_after_eq(jiffies, khugepaged_sleep_expire);
 }
 
 static void khugepaged_wait_work(void)
 {
+	if (khugepaged_has_requests())
+		return;
+
 	if (khugepaged_has_work()) {
 		const unsigned long scan_sleep_jiffies =
 			msecs_to_jiffies(khugepaged_scan_sleep_millisecs);
@@ -1842,6 +2300,7 @@ static int khugepaged(void *none)
 	set_user_nice(current, MAX_NICE);
 
 	while (!kthread_should_stop()) {
+		khugepaged_do_requests();
 		khugepaged_do_scan();
 		khugepaged_wait_work();
 	}
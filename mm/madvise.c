@@ -21,6 +21,7 @@
 #include <linux/swap.h>
 #include <linux/swapops.h>
 #include <linux/mmu_notifier.h>
+#include <linux/khugepaged.h>
 
 #include <asm/tlb.h>
 
@@ -36,6 +37,8 @@ static int madvise_need_mmap_write(int behavior)
 	case MADV_WILLNEED:
 	case MADV_DONTNEED:
 	case MADV_FREE:
+	case MADV_COLLAPSE:
+	case MADV_COLLAPSE_ASYNC:
 		return 0;
 	default:
 		/* be safe, default to 1. list exceptions explicitly */
@@ -582,6 +585,12 @@ madvise_vma(struct vm_area_struct *vma, struct vm_area_struct **prev,
 		/* passthrough */
 	case MADV_DONTNEED:
 		return madvise_dontneed(vma, prev, start, end);
+#ifdef CONFIG_TRANSPARENT_HUGEPAGE
+	case MADV_COLLAPSE:
+	case MADV_COLLAPSE_ASYNC:
+		return khugepaged_madvise_collapse(vma, prev, start, end,
+					behavior == MADV_COLLAPSE_ASYNC);
+#endif
 	default:
 		return madvise_behavior(vma, prev, start, end, behavior);
 	}
@@ -607,6 +616,8 @@ madvise_behavior_valid(int behavior)
 #ifdef CONFIG_TRANSPARENT_HUGEPAGE
 	case MADV_HUGEPAGE:
 	case MADV_NOHUGEPAGE:
+	case MADV_COLLAPSE:
+	case MADV_COLLAPSE_ASYNC:
 #endif
 	case MADV_DONTDUMP:
 	case MADV_DODUMP:
@@ -658,6 +669,10 @@ madvise_behavior_valid(int behavior)
  *  MADV_NOHUGEPAGE - mark the given range as not worth being backed by
  *		transparent huge pages so the existing pages will not be
  *		coalesced into THP and new pages will not be allocated as THP.
+ *  MADV_COLLAPSE - collapse the existing pages of the given range into THP
+ *		now, in the caller's context.
+ *  MADV_COLLAPSE_ASYNC - queue the given range for immediate collapse by
+ *		khugepaged, ahead of its periodic scan.
  *  MADV_DONTDUMP - the application wants to prevent pages in the given range
  *		from being included in its core dump.
  *  MADV_DODUMP - cancel MADV_DONTDUMP: no longer exclude from core dump.
@@ -755,7 +770,7 @@ SYSCALL_DEFINE3(madvise, unsigned long, start, size_t, len_in, int, behavior)
 			goto out;
 		if (prev)
 			vma = prev->vm_next;
-		else	/* madvise_remove dropped mmap_sem */
+		else	/* madvise_remove/collapse dropped mmap_sem */
 			vma = find_vma(current->mm, start);
 	}
 out:
@@ -541,53 +541,109 @@ mem_cgroup_largest_soft_limit_node(struct mem_cgroup_tree_per_node *mctz)
 }
 
 /*
- * Return page count for single (non recursive) @memcg.
- *
- * Implementation Note: reading percpu statistics for memcg.
- *
- * Both of vmstat[] and percpu_counter has threshold and do periodic
- * synchronization to implement "quick" read. There are trade-off between
- * reading cost and precision of value. Then, we may have a chance to implement
- * a periodic synchronization of counter in memcg's counter.
+ * Statistics are kept in per-cpu deltas which are folded, once they exceed
+ * MEMCG_STAT_BATCH, into atomic counters for the memcg itself and for every
+ * ancestor whose hierarchy includes it. Reads are therefore O(1) and never
+ * walk cpus or descendants, at the price of up to MEMCG_STAT_BATCH units
+ * per cpu of not yet folded updates.
  *
- * But this _read() function is used for user interface now. The user accounts
- * memory usage by memory cgroup and he _always_ requires exact value because
- * he accounts memory. Even if we provide quick-and-fuzzy read, we always
- * have to visit all online cpus and make sum. So, for now, unnecessary
- * synchronization is not implemented. (just implemented for cpu hotplug)
- *
- * If there are kernel internal actions which can make use of some not-exact
- * value, and reading all cpu value can be performance bottleneck in some
- * common workload, threshold and synchronization as vmstat[] should be
- * implemented.
+ * A descendant is part of an ancestor's tree statistics if the ancestor is
+ * the root or uses hierarchy, which matches for_each_mem_cgroup_tree().
+ * The hierarchical page_counter parents are exactly those ancestors.
+ */
+void memcg_fold_stat(struct mem_cgroup *memcg, int idx, long val)
+{
+	struct mem_cgroup *mi = memcg;
+
+	atomic_long_add(val, &memcg->stat_local[idx]);
+	do {
+		atomic_long_add(val, &mi->stat_tree[idx]);
+		if (mi == root_mem_cgroup)
+			return;
+		mi = parent_mem_cgroup(mi);
+	} while (mi);
+	atomic_long_add(val, &root_mem_cgroup->stat_tree[idx]);
+}
+
+void memcg_fold_events(struct mem_cgroup *memcg, int idx, unsigned long val)
+{
+	struct mem_cgroup *mi = memcg;
+
+	atomic_long_add(val, &memcg->events_local[idx]);
+	do {
+		atomic_long_add(val, &mi->events_tree[idx]);
+		if (mi == root_mem_cgroup)
+			return;
+		mi = parent_mem_cgroup(mi);
+	} while (mi);
+	atomic_long_add(val, &root_mem_cgroup->events_tree[idx]);
+}
+
+/*
+ * Fold whatever is left in the per-cpu deltas of a memcg that is going
+ * away, so that the tree statistics of its ancestors stay accurate.
+ */
+static void memcg_flush_stats(struct mem_cgroup *memcg)
+{
+	int cpu, i;
+
+	for_each_possible_cpu(cpu) {
+		struct mem_cgroup_stat_cpu *stat = per_cpu_ptr(memcg->stat, cpu);
+
+		for (i = 0; i < MEMCG_NR_STAT; i++) {
+			if (stat->count[i])
+				memcg_fold_stat(memcg, i, stat->count[i]);
+			stat->count[i] = 0;
+		}
+		for (i = 0; i < MEMCG_NR_EVENTS; i++) {
+			if (stat->events[i])
+				memcg_fold_events(memcg, i, stat->events[i]);
+			stat->events[i] = 0;
+		}
+	}
+}
+
+/*
+ * Return page count for single (non recursive) @memcg.
  */
 static unsigned long
 mem_cgroup_read_stat(struct mem_cgroup *memcg, enum mem_cgroup_stat_index idx)
 {
-	long val = 0;
-	int cpu;
+	long val = atomic_long_read(&memcg->stat_local[idx]);
 
-	/* Per-cpu values can be negative, use a signed accumulator */
-	for_each_possible_cpu(cpu)
-		val += per_cpu(memcg->stat->count[idx], cpu);
 	/*
-	 * Summing races with updates, so val may be negative.  Avoid exposing
-	 * transient negative values.
+	 * Updates still sitting in per-cpu deltas may make val transiently
+	 * negative.  Avoid exposing that.
 	 */
 	if (val < 0)
 		val = 0;
 	return val;
 }
 
+/*
+ * Return page count for @memcg and all the descendants it aggregates.
+ */
+static unsigned long
+mem_cgroup_read_stat_tree(struct mem_cgroup *memcg,
+			  enum mem_cgroup_stat_index idx)
+{
+	long val = atomic_long_read(&memcg->stat_tree[idx]);
+
+	if (val < 0)
+		val = 0;
+	return val;
+}
+
 static unsigned long mem_cgroup_read_events(struct mem_cgroup *memcg,
 					    enum mem_cgroup_events_index idx)
 {
-	unsigned long val = 0;
-	int cpu;
+	return atomic_long_read(&memcg->events_local[idx]);
+}
 
-	for_each_possible_cpu(cpu)
-		val += per_cpu(memcg->stat->events[idx], cpu);
-	return val;
+static unsigned long mem_cgroup_read_events_tree(struct mem_cgroup *memcg,
+					enum mem_cgroup_events_index idx)
+{
+	return atomic_long_read(&memcg->events_tree[idx]);
 }
 
 static void mem_cgroup_charge_statistics(struct mem_cgroup *memcg,
@@ -599,23 +655,20 @@ static void mem_cgroup_charge_statistics(struct mem_cgroup *memcg,
 	 * counted as CACHE even if it's on ANON LRU.
 	 */
 	if (PageAnon(page))
-		__this_cpu_add(memcg->stat->count[MEM_CGROUP_STAT_RSS],
-				nr_pages);
+		__mod_memcg_stat(memcg, MEM_CGROUP_STAT_RSS, nr_pages);
 	else
-		__this_cpu_add(memcg->stat->count[MEM_CGROUP_STAT_CACHE],
-				nr_pages);
+		__mod_memcg_stat(memcg, MEM_CGROUP_STAT_CACHE, nr_pages);
 
 	if (compound) {
 		VM_BUG_ON_PAGE(!PageTransHuge(page), page);
-		__this_cpu_add(memcg->stat->count[MEM_CGROUP_STAT_RSS_HUGE],
-				nr_pages);
+		__mod_memcg_stat(memcg, MEM_CGROUP_STAT_RSS_HUGE, nr_pages);
 	}
 
 	/* pagein of a big page is an event. So, ignore page size */
 	if (nr_pages > 0)
-		__this_cpu_inc(memcg->stat->events[MEM_CGROUP_EVENTS_PGPGIN]);
+		__count_memcg_events(memcg, MEM_CGROUP_EVENTS_PGPGIN, 1);
 	else {
-		__this_cpu_inc(memcg->stat->events[MEM_CGROUP_EVENTS_PGPGOUT]);
+		__count_memcg_events(memcg, MEM_CGROUP_EVENTS_PGPGOUT, 1);
 		nr_pages = -nr_pages; /* for event */
 	}
 
@@ -1864,15 +1917,38 @@ static int memcg_cpu_hotplug_callback(struct notifier_block *nb,
 	return NOTIFY_OK;
 }
 
+/*
+ * Reclaim from @memcg's hierarchy and account the time spent and pages
+ * reclaimed to @memcg, either as asynchronous or as direct reclaim.
+ */
+static unsigned long memcg_reclaim(struct mem_cgroup *memcg,
+				   unsigned long nr_pages, gfp_t gfp_mask,
+				   bool may_swap, bool async)
+{
+	unsigned long nr_reclaimed;
+	u64 start = ktime_get_ns();
+
+	nr_reclaimed = try_to_free_mem_cgroup_pages(memcg, nr_pages,
+						    gfp_mask, may_swap);
+	if (async) {
+		atomic64_add(ktime_get_ns() - start, &memcg->async_reclaim_ns);
+		atomic_long_add(nr_reclaimed, &memcg->async_reclaim_pages);
+	} else {
+		atomic64_add(ktime_get_ns() - start, &memcg->direct_reclaim_ns);
+		atomic_long_add(nr_reclaimed, &memcg->direct_reclaim_pages);
+	}
+	return nr_reclaimed;
+}
+
 static void reclaim_high(struct mem_cgroup *memcg,
 			 unsigned int nr_pages,
-			 gfp_t gfp_mask)
+			 gfp_t gfp_mask, bool async)
 {
 	do {
 		if (page_counter_read(&memcg->memory) <= memcg->high)
 			continue;
 		mem_cgroup_events(memcg, MEMCG_HIGH, 1);
-		try_to_free_mem_cgroup_pages(memcg, nr_pages, gfp_mask, true);
+		memcg_reclaim(memcg, nr_pages, gfp_mask, true, async);
 	} while ((memcg = parent_mem_cgroup(memcg)));
 }
 
@@ -1881,7 +1957,48 @@ static void high_work_func(struct work_struct *work)
 	struct mem_cgroup *memcg;
 
 	memcg = container_of(work, struct mem_cgroup, high_work);
-	reclaim_high(memcg, CHARGE_BATCH, GFP_KERNEL);
+	reclaim_high(memcg, CHARGE_BATCH, GFP_KERNEL, true);
+}
+
+/* Upper bound of a single async reclaim pass, 2MB with 4K pages */
+#define MEMCG_ASYNC_RECLAIM_BATCH	512
+
+static struct workqueue_struct *memcg_async_reclaim_wq;
+
+/*
+ * The async watermark sits async_ratio percent of the way up to the
+ * lower of memory.high and memory.max. Zero ratio or no limit disables it.
+ */
+static unsigned long memcg_async_wmark(struct mem_cgroup *memcg)
+{
+	unsigned int ratio = READ_ONCE(memcg->async_ratio);
+	unsigned long limit;
+
+	limit = min(READ_ONCE(memcg->high), READ_ONCE(memcg->memory.limit));
+	if (!ratio || limit == PAGE_COUNTER_MAX)
+		return PAGE_COUNTER_MAX;
+	return limit / 100 * ratio + limit % 100 * ratio / 100;
+}
+
+static void async_reclaim_func(struct work_struct *work)
+{
+	struct mem_cgroup *memcg;
+	int nr_retries = MEM_CGROUP_RECLAIM_RETRIES;
+
+	memcg = container_of(work, struct mem_cgroup, async_work);
+	while (nr_retries) {
+		unsigned long wmark = memcg_async_wmark(memcg);
+		unsigned long usage = page_counter_read(&memcg->memory);
+
+		if (usage <= wmark)
+			break;
+
+		if (!memcg_reclaim(memcg, min_t(unsigned long, usage - wmark,
+						MEMCG_ASYNC_RECLAIM_BATCH),
+				   GFP_KERNEL, true, true))
+			nr_retries--;
+		cond_resched();
+	}
 }
 
 /*
@@ -1897,7 +2014,7 @@ void mem_cgroup_handle_over_high(void)
 		return;
 
 	memcg = get_mem_cgroup_from_mm(current->mm);
-	reclaim_high(memcg, nr_pages, GFP_KERNEL);
+	reclaim_high(memcg, nr_pages, GFP_KERNEL, false);
 	css_put(&memcg->css);
 	current->memcg_nr_pages_over_high = 0;
 }
@@ -1955,8 +2072,8 @@ retry:
 
 	mem_cgroup_events(mem_over_limit, MEMCG_MAX, 1);
 
-	nr_reclaimed = try_to_free_mem_cgroup_pages(mem_over_limit, nr_pages,
-						    gfp_mask, may_swap);
+	nr_reclaimed = memcg_reclaim(mem_over_limit, nr_pages,
+				     gfp_mask, may_swap, false);
 
 	if (mem_cgroup_margin(mem_over_limit) >= nr_pages)
 		goto retry;
@@ -2021,6 +2138,19 @@ done_restock:
 	if (batch > nr_pages)
 		refill_stock(memcg, batch - nr_pages);
 
+	/*
+	 * Wake up the async reclaim worker of every cgroup in the hierarchy
+	 * which crossed its async watermark, so that it is brought back down
+	 * before the charging tasks hit high or max and have to reclaim.
+	 */
+	for (mem_over_limit = memcg; mem_over_limit;
+	     mem_over_limit = parent_mem_cgroup(mem_over_limit)) {
+		if (page_counter_read(&mem_over_limit->memory) >
+		    memcg_async_wmark(mem_over_limit))
+			queue_work(memcg_async_reclaim_wq,
+				   &mem_over_limit->async_work);
+	}
+
 	/*
 	 * If the hierarchy is above the normal consumption range, schedule
 	 * reclaim on returning to userland.  We can perform reclaim here
@@ -2398,16 +2528,15 @@ void memcg_kmem_uncharge(struct page *page, int order)
  */
 void mem_cgroup_split_huge_fixup(struct page *head)
 {
-	int i;
+	int i, nr = hpage_nr_pages(head);
 
 	if (mem_cgroup_disabled())
 		return;
 
-	for (i = 1; i < HPAGE_PMD_NR; i++)
+	for (i = 1; i < nr; i++)
 		head[i].mem_cgroup = head->mem_cgroup;
 
-	__this_cpu_sub(head->mem_cgroup->stat->count[MEM_CGROUP_STAT_RSS_HUGE],
-		       HPAGE_PMD_NR);
+	__mod_memcg_stat(head->mem_cgroup, MEM_CGROUP_STAT_RSS_HUGE, -nr);
 }
 #endif /* CONFIG_TRANSPARENT_HUGEPAGE */
 
@@ -2416,7 +2545,7 @@ static void mem_cgroup_swap_statistics(struct mem_cgroup *memcg,
 					 bool charge)
 {
 	int val = (charge) ? 1 : -1;
-	this_cpu_add(memcg->stat->count[MEM_CGROUP_STAT_SWAP], val);
+	mod_memcg_stat(memcg, MEM_CGROUP_STAT_SWAP, val);
 }
 
 /**
@@ -2743,28 +2872,18 @@ static int mem_cgroup_hierarchy_write(struct cgroup_subsys_state *css,
 
 static void tree_stat(struct mem_cgroup *memcg, unsigned long *stat)
 {
-	struct mem_cgroup *iter;
 	int i;
 
-	memset(stat, 0, sizeof(*stat) * MEMCG_NR_STAT);
-
-	for_each_mem_cgroup_tree(iter, memcg) {
-		for (i = 0; i < MEMCG_NR_STAT; i++)
-			stat[i] += mem_cgroup_read_stat(iter, i);
-	}
+	for (i = 0; i < MEMCG_NR_STAT; i++)
+		stat[i] = mem_cgroup_read_stat_tree(memcg, i);
 }
 
 static void tree_events(struct mem_cgroup *memcg, unsigned long *events)
 {
-	struct mem_cgroup *iter;
 	int i;
 
-	memset(events, 0, sizeof(*events) * MEMCG_NR_EVENTS);
-
-	for_each_mem_cgroup_tree(iter, memcg) {
-		for (i = 0; i < MEMCG_NR_EVENTS; i++)
-			events[i] += mem_cgroup_read_events(iter, i);
-	}
+	for (i = 0; i < MEMCG_NR_EVENTS; i++)
+		events[i] = mem_cgroup_read_events_tree(memcg, i);
 }
 
 static unsigned long mem_cgroup_usage(struct mem_cgroup *memcg, bool swap)
@@ -2772,17 +2891,11 @@ static unsigned long mem_cgroup_usage(struct mem_cgroup *memcg, bool swap)
 	unsigned long val = 0;
 
 	if (mem_cgroup_is_root(memcg)) {
-		struct mem_cgroup *iter;
-
-		for_each_mem_cgroup_tree(iter, memcg) {
-			val += mem_cgroup_read_stat(iter,
-					MEM_CGROUP_STAT_CACHE);
-			val += mem_cgroup_read_stat(iter,
-					MEM_CGROUP_STAT_RSS);
-			if (swap)
-				val += mem_cgroup_read_stat(iter,
-						MEM_CGROUP_STAT_SWAP);
-		}
+		val += mem_cgroup_read_stat_tree(memcg, MEM_CGROUP_STAT_CACHE);
+		val += mem_cgroup_read_stat_tree(memcg, MEM_CGROUP_STAT_RSS);
+		if (swap)
+			val += mem_cgroup_read_stat_tree(memcg,
+							 MEM_CGROUP_STAT_SWAP);
 	} else {
 		if (!swap)
 			val = page_counter_read(&memcg->memory);
@@ -3196,20 +3309,18 @@ static int memcg_stat_show(struct seq_file *m, void *v)
 			   (u64)memsw * PAGE_SIZE);
 
 	for (i = 0; i < MEM_CGROUP_STAT_NSTATS; i++) {
-		unsigned long long val = 0;
+		unsigned long long val;
 
 		if (i == MEM_CGROUP_STAT_SWAP && !do_memsw_account())
 			continue;
-		for_each_mem_cgroup_tree(mi, memcg)
-			val += mem_cgroup_read_stat(mi, i) * PAGE_SIZE;
+		val = (u64)mem_cgroup_read_stat_tree(memcg, i) * PAGE_SIZE;
 		seq_printf(m, "total_%s %llu\n", mem_cgroup_stat_names[i], val);
 	}
 
 	for (i = 0; i < MEM_CGROUP_EVENTS_NSTATS; i++) {
-		unsigned long long val = 0;
+		unsigned long long val;
 
-		for_each_mem_cgroup_tree(mi, memcg)
-			val += mem_cgroup_read_events(mi, i);
+		val = mem_cgroup_read_events_tree(memcg, i);
 		seq_printf(m, "total_%s %llu\n",
 			   mem_cgroup_events_names[i], val);
 	}
@@ -4167,6 +4278,9 @@ static void mem_cgroup_free(struct mem_cgroup *memcg)
 	memcg_wb_domain_exit(memcg);
 	for_each_node(node)
 		free_mem_cgroup_per_node_info(memcg, node);
+	/* NULL when mem_cgroup_alloc() failed early */
+	if (memcg->stat)
+		memcg_flush_stats(memcg);
 	free_percpu(memcg->stat);
 	kfree(memcg);
 }
@@ -4202,6 +4316,7 @@ static struct mem_cgroup *mem_cgroup_alloc(void)
 		goto fail;
 
 	INIT_WORK(&memcg->high_work, high_work_func);
+	INIT_WORK(&memcg->async_work, async_reclaim_func);
 	memcg->last_scanned_node = MAX_NUMNODES;
 	INIT_LIST_HEAD(&memcg->oom_notify);
 	mutex_init(&memcg->thresholds_lock);
@@ -4333,6 +4448,7 @@ static void mem_cgroup_css_free(struct cgroup_subsys_state *css)
 
 	vmpressure_cleanup(&memcg->vmpressure);
 	cancel_work_sync(&memcg->high_work);
+	cancel_work_sync(&memcg->async_work);
 	mem_cgroup_remove_from_trees(memcg);
 	memcg_free_kmem(memcg);
 	mem_cgroup_free(memcg);
@@ -4362,6 +4478,7 @@ static void mem_cgroup_css_reset(struct cgroup_subsys_state *css)
 	page_counter_limit(&memcg->tcpmem, PAGE_COUNTER_MAX);
 	memcg->low = 0;
 	memcg->high = PAGE_COUNTER_MAX;
+	memcg->async_ratio = 0;
 	memcg->soft_limit = PAGE_COUNTER_MAX;
 	memcg_wb_domain_size_changed(memcg);
 }
@@ -4525,10 +4642,8 @@ static int mem_cgroup_move_account(struct page *page,
 	spin_lock_irqsave(&from->move_lock, flags);
 
 	if (!anon && page_mapped(page)) {
-		__this_cpu_sub(from->stat->count[MEM_CGROUP_STAT_FILE_MAPPED],
-			       nr_pages);
-		__this_cpu_add(to->stat->count[MEM_CGROUP_STAT_FILE_MAPPED],
-			       nr_pages);
+		__mod_memcg_stat(from, MEM_CGROUP_STAT_FILE_MAPPED, -nr_pages);
+		__mod_memcg_stat(to, MEM_CGROUP_STAT_FILE_MAPPED, nr_pages);
 	}
 
 	/*
@@ -4540,18 +4655,14 @@ static int mem_cgroup_move_account(struct page *page,
 		struct address_space *mapping = page_mapping(page);
 
 		if (mapping_cap_account_dirty(mapping)) {
-			__this_cpu_sub(from->stat->count[MEM_CGROUP_STAT_DIRTY],
-				       nr_pages);
-			__this_cpu_add(to->stat->count[MEM_CGROUP_STAT_DIRTY],
-				       nr_pages);
+			__mod_memcg_stat(from, MEM_CGROUP_STAT_DIRTY, -nr_pages);
+			__mod_memcg_stat(to, MEM_CGROUP_STAT_DIRTY, nr_pages);
 		}
 	}
 
 	if (PageWriteback(page)) {
-		__this_cpu_sub(from->stat->count[MEM_CGROUP_STAT_WRITEBACK],
-			       nr_pages);
-		__this_cpu_add(to->stat->count[MEM_CGROUP_STAT_WRITEBACK],
-			       nr_pages);
+		__mod_memcg_stat(from, MEM_CGROUP_STAT_WRITEBACK, -nr_pages);
+		__mod_memcg_stat(to, MEM_CGROUP_STAT_WRITEBACK, nr_pages);
 	}
 
 	/*
@@ -5113,6 +5224,36 @@ static ssize_t memory_high_write(struct kernfs_open_file *of,
 	return nbytes;
 }
 
+static int memory_high_async_ratio_show(struct seq_file *m, void *v)
+{
+	struct mem_cgroup *memcg = mem_cgroup_from_css(seq_css(m));
+
+	seq_printf(m, "%u\n", READ_ONCE(memcg->async_ratio));
+	return 0;
+}
+
+static ssize_t memory_high_async_ratio_write(struct kernfs_open_file *of,
+					     char *buf, size_t nbytes,
+					     loff_t off)
+{
+	struct mem_cgroup *memcg = mem_cgroup_from_css(of_css(of));
+	unsigned int ratio;
+	int err;
+
+	buf = strstrip(buf);
+	err = kstrtouint(buf, 0, &ratio);
+	if (err)
+		return err;
+	if (ratio > 100)
+		return -EINVAL;
+
+	WRITE_ONCE(memcg->async_ratio, ratio);
+	if (page_counter_read(&memcg->memory) > memcg_async_wmark(memcg))
+		queue_work(memcg_async_reclaim_wq, &memcg->async_work);
+
+	return nbytes;
+}
+
 static int memory_max_show(struct seq_file *m, void *v)
 {
 	struct mem_cgroup *memcg = mem_cgroup_from_css(seq_css(m));
@@ -5175,6 +5316,40 @@ static ssize_t memory_max_write(struct kernfs_open_file *of,
 	return nbytes;
 }
 
+static ssize_t memory_reclaim(struct kernfs_open_file *of, char *buf,
+			      size_t nbytes, loff_t off)
+{
+	struct mem_cgroup *memcg = mem_cgroup_from_css(of_css(of));
+	unsigned int nr_retries = MEM_CGROUP_RECLAIM_RETRIES;
+	unsigned long nr_to_reclaim, nr_reclaimed = 0;
+	int err;
+
+	buf = strstrip(buf);
+	err = page_counter_memparse(buf, "", &nr_to_reclaim);
+	if (err)
+		return err;
+
+	while (nr_reclaimed < nr_to_reclaim) {
+		unsigned long reclaimed;
+
+		if (signal_pending(current))
+			return -EINTR;
+
+		reclaimed = try_to_free_mem_cgroup_pages(memcg,
+						nr_to_reclaim - nr_reclaimed,
+						GFP_KERNEL, true);
+		if (!reclaimed) {
+			if (!nr_retries--)
+				return -EAGAIN;
+			/* pages sitting in per-cpu pagevecs can't be reclaimed */
+			lru_add_drain_all();
+		}
+		nr_reclaimed += reclaimed;
+	}
+
+	return nbytes;
+}
+
 static int memory_events_show(struct seq_file *m, void *v)
 {
 	struct mem_cgroup *memcg = mem_cgroup_from_css(seq_css(m));
@@ -5249,6 +5424,19 @@ static int memory_stat_show(struct seq_file *m, void *v)
 	seq_printf(m, "pgmajfault %lu\n",
 		   events[MEM_CGROUP_EVENTS_PGMAJFAULT]);
 
+	/* Reclaim targeted at this cgroup, off and on the charge path */
+
+	seq_printf(m, "reclaim_async_usec %llu\n",
+		   div_u64(atomic64_read(&memcg->async_reclaim_ns),
+			   NSEC_PER_USEC));
+	seq_printf(m, "reclaim_async_pages %lu\n",
+		   atomic_long_read(&memcg->async_reclaim_pages));
+	seq_printf(m, "reclaim_direct_usec %llu\n",
+		   div_u64(atomic64_read(&memcg->direct_reclaim_ns),
+			   NSEC_PER_USEC));
+	seq_printf(m, "reclaim_direct_pages %lu\n",
+		   atomic_long_read(&memcg->direct_reclaim_pages));
+
 	return 0;
 }
 
@@ -5270,12 +5458,22 @@ static struct cftype memory_files[] = {
 		.seq_show = memory_high_show,
 		.write = memory_high_write,
 	},
+	{
+		.name = "high_async_ratio",
+		.flags = CFTYPE_NOT_ON_ROOT,
+		.seq_show = memory_high_async_ratio_show,
+		.write = memory_high_async_ratio_write,
+	},
 	{
 		.name = "max",
 		.flags = CFTYPE_NOT_ON_ROOT,
 		.seq_show = memory_max_show,
 		.write = memory_max_write,
 	},
+	{
+		.name = "reclaim",
+		.write = memory_reclaim,
+	},
 	{
 		.name = "events",
 		.flags = CFTYPE_NOT_ON_ROOT,
@@ -5504,10 +5702,10 @@ static void uncharge_batch(struct mem_cgroup *memcg, unsigned long pgpgout,
 	}
 
 	local_irq_save(flags);
-	__this_cpu_sub(memcg->stat->count[MEM_CGROUP_STAT_RSS], nr_anon);
-	__this_cpu_sub(memcg->stat->count[MEM_CGROUP_STAT_CACHE], nr_file);
-	__this_cpu_sub(memcg->stat->count[MEM_CGROUP_STAT_RSS_HUGE], nr_huge);
-	__this_cpu_add(memcg->stat->events[MEM_CGROUP_EVENTS_PGPGOUT], pgpgout);
+	__mod_memcg_stat(memcg, MEM_CGROUP_STAT_RSS, -nr_anon);
+	__mod_memcg_stat(memcg, MEM_CGROUP_STAT_CACHE, -nr_file);
+	__mod_memcg_stat(memcg, MEM_CGROUP_STAT_RSS_HUGE, -nr_huge);
+	__count_memcg_events(memcg, MEM_CGROUP_EVENTS_PGPGOUT, pgpgout);
 	__this_cpu_add(memcg->stat->nr_page_events, nr_pages);
 	memcg_check_events(memcg, dummy_page);
 	local_irq_restore(flags);
@@ -5739,7 +5937,7 @@ bool mem_cgroup_charge_skmem(struct mem_cgroup *memcg, unsigned int nr_pages)
 	if (in_softirq())
 		gfp_mask = GFP_NOWAIT;
 
-	this_cpu_add(memcg->stat->count[MEMCG_SOCK], nr_pages);
+	mod_memcg_stat(memcg, MEMCG_SOCK, nr_pages);
 
 	if (try_charge(memcg, gfp_mask, nr_pages) == 0)
 		return true;
@@ -5760,7 +5958,7 @@ void mem_cgroup_uncharge_skmem(struct mem_cgroup *memcg, unsigned int nr_pages)
 		return;
 	}
 
-	this_cpu_sub(memcg->stat->count[MEMCG_SOCK], nr_pages);
+	mod_memcg_stat(memcg, MEMCG_SOCK, -nr_pages);
 
 	page_counter_uncharge(&memcg->memory, nr_pages);
 	css_put_many(&memcg->css, nr_pages);
@@ -5796,6 +5994,11 @@ static int __init mem_cgroup_init(void)
 
 	hotcpu_notifier(memcg_cpu_hotplug_callback, 0);
 
+	memcg_async_reclaim_wq = alloc_workqueue("memcg_async_reclaim",
+						 WQ_UNBOUND | WQ_FREEZABLE |
+						 WQ_MEM_RECLAIM, 0);
+	BUG_ON(!memcg_async_reclaim_wq);
+
 	for_each_possible_cpu(cpu)
 		INIT_WORK(&per_cpu_ptr(&memcg_stock, cpu)->work,
 			  drain_local_stock);
@@ -111,11 +111,26 @@ int read_cache_pages(struct address_space *mapping, struct list_head *pages,
 }
 
 EXPORT_SYMBOL(read_cache_pages);
+
+static void read_pages_batch(struct address_space *mapping, struct file *filp,
+		struct pagevec *pvec, gfp_t gfp)
+{
+	unsigned i, nr;
+
+	nr = add_to_page_cache_lru_batch(pvec, mapping, gfp);
+	for (i = 0; i < nr; i++) {
+		mapping->a_ops->readpage(filp, pvec->pages[i]);
+		put_page(pvec->pages[i]);
+	}
+	pagevec_reinit(pvec);
+}
+
 //readpagesreadpageȡļ
 static int read_pages(struct address_space *mapping, struct file *filp,
 		struct list_head *pages, unsigned int nr_pages, gfp_t gfp)
 {
 	struct blk_plug plug;
+	struct pagevec pvec;
 	unsigned page_idx;
 	int ret;
 
@@ -128,13 +143,33 @@ static int read_pages(struct address_space *mapping, struct file *filp,
 		goto out;
 	}
 
+	/*
+	 * Insert runs of consecutive small pages into the page cache a
+	 * pagevec at a time; large pages go in on their own.
+	 */
+	pagevec_init(&pvec, 0);
 	for (page_idx = 0; page_idx < nr_pages; page_idx++) {
 		struct page *page = lru_to_page(pages);
 		list_del(&page->lru);
-		if (!add_to_page_cache_lru(page, mapping, page->index, gfp))
-			mapping->a_ops->readpage(filp, page);
-		put_page(page);
+
+		if (pagevec_count(&pvec) &&
+		    (PageTransHuge(page) || page->index !=
+		     pvec.pages[pagevec_count(&pvec) - 1]->index + 1))
+			read_pages_batch(mapping, filp, &pvec, gfp);
+
+		if (PageTransHuge(page)) {
+			if (!add_to_page_cache_lru(page, mapping, page->index,
+						   gfp))
+				mapping->a_ops->readpage(filp, page);
+			put_page(page);
+			continue;
+		}
+
+		if (!pagevec_add(&pvec, page))
+			read_pages_batch(mapping, filp, &pvec, gfp);
 	}
+	if (pagevec_count(&pvec))
+		read_pages_batch(mapping, filp, &pvec, gfp);
 	ret = 0;
 
 out:
@@ -143,6 +178,43 @@ out:
 	return ret;
 }
 
+/*
+ * Pick the largest page cache order to use at @index for a mapping that
+ * takes large pages: the page must be naturally aligned, fit in the @nr
+ * pages left to read, stay within i_size, not cover the PageReadahead
+ * marker at @mark (a compound page cannot carry it), and cover only empty
+ * slots - shadow entries are left to small pages, so refaults are seen.
+ */
+static unsigned int ra_page_order(struct address_space *mapping,
+		pgoff_t index, unsigned long nr, pgoff_t end_index, pgoff_t mark)
+{
+	unsigned long next = ULONG_MAX;
+	unsigned int order;
+	void **slot;
+
+	if (!mapping_large_pages(mapping))
+		return 0;
+
+	rcu_read_lock();
+	if (!radix_tree_gang_lookup_slot(&mapping->page_tree, &slot, &next,
+					 index, 1))
+		next = ULONG_MAX;
+	rcu_read_unlock();
+
+	for (order = MAX_PAGECACHE_ORDER; order >= 2; order--) {
+		unsigned long size = 1UL << order;
+
+		if (index & (size - 1) || size > nr)
+			continue;
+		if (index + size - 1 > end_index || index + size > next)
+			continue;
+		if (mark >= index && mark < index + size)
+			continue;
+		return order;
+	}
+	return 0;
+}
+
 /*
  * __do_page_cache_readahead() actually reads a chunk of disk.  It allocates all
  * the pages first, then submits them all for I/O. This avoids the very bad
@@ -163,7 +235,8 @@ int __do_page_cache_readahead(struct address_space *mapping, struct file *filp,
 	struct page *page;
 	unsigned long end_index;	/* The last page we want to read */
 	LIST_HEAD(page_pool);
-	int page_idx;
+	int page_idx, nr;
+	int nr_pages = 0;
 	int ret = 0;
 	loff_t isize = i_size_read(inode);
 	gfp_t gfp_mask = readahead_gfp_mask(mapping);
@@ -176,9 +249,11 @@ int __do_page_cache_readahead(struct address_space *mapping, struct file *filp,
 	/*
 	 * Preallocate as many pages as we will need.
 	 */
-	for (page_idx = 0; page_idx < nr_to_read; page_idx++) {
+	for (page_idx = 0; page_idx < nr_to_read; page_idx += nr) {
 		pgoff_t page_offset = offset + page_idx;
+		unsigned int order;
 
+		nr = 1;
 		if (page_offset > end_index)
 			break;
 
@@ -188,14 +263,30 @@ int __do_page_cache_readahead(struct address_space *mapping, struct file *filp,
 		if (page && !radix_tree_exceptional_entry(page))
 			continue;
 
-		page = __page_cache_alloc(gfp_mask);
+		page = NULL;
+		order = ra_page_order(mapping, page_offset,
+				      nr_to_read - page_idx, end_index,
+				      offset + nr_to_read - lookahead_size);
+		if (order) {
+			/* Only take a large page if one is readily available */
+			page = __page_cache_alloc_order((gfp_mask | __GFP_COMP) &
+							~__GFP_DIRECT_RECLAIM,
+							order);
+			if (page) {
+				prep_transhuge_page(page);
+				nr = 1 << order;
+			}
+		}
+		if (!page)
+			page = __page_cache_alloc(gfp_mask);
 		if (!page)
 			break;
 		page->index = page_offset;
 		list_add(&page->lru, &page_pool);
 		if (page_idx == nr_to_read - lookahead_size)
 			SetPageReadahead(page);
-		ret++;
+		nr_pages++;
+		ret += nr;
 	}
 
 	/*
@@ -203,8 +294,8 @@ int __do_page_cache_readahead(struct address_space *mapping, struct file *filp,
 	 * uptodate then the caller will launch readpage again, and
 	 * will then handle the error.
 	 */
-	if (ret)
-		read_pages(mapping, filp, &page_pool, ret, gfp_mask);
+	if (nr_pages)
+		read_pages(mapping, filp, &page_pool, nr_pages, gfp_mask);
 	BUG_ON(!list_empty(&page_pool));
 out:
 	return ret;
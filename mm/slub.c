@@ -2272,10 +2272,14 @@ static inline void flush_slab(struct kmem_cache *s, struct kmem_cache_cpu *c)
  *
  * Called from IPI handler with interrupts disabled.
  */
+static void cpu_array_drain(struct kmem_cache *s, int cpu);
+
 static inline void __flush_cpu_slab(struct kmem_cache *s, int cpu)
 {
 	struct kmem_cache_cpu *c = per_cpu_ptr(s->cpu_slab, cpu);
 
+	cpu_array_drain(s, cpu);
+
 	if (likely(c)) {
 		if (c->page)
 			flush_slab(s, c);
@@ -2295,8 +2299,23 @@ static bool has_cpu_slab(int cpu, void *info)
 {
 	struct kmem_cache *s = info;
 	struct kmem_cache_cpu *c = per_cpu_ptr(s->cpu_slab, cpu);
+	struct kmem_cache_cpu_array __percpu *pca;
+	unsigned long flags;
+	bool ret;
+
+	if (c->page || c->partial)
+		return true;
+
+	/*
+	 * A resize frees the old arrays only after its IPI ran here, so
+	 * they can be looked at while interrupts are off.
+	 */
+	local_irq_save(flags);
+	pca = lockless_dereference(s->cpu_array);
+	ret = pca && READ_ONCE(per_cpu_ptr(pca, cpu)->avail);
+	local_irq_restore(flags);
 
-	return c->page || c->partial;
+	return ret;
 }
 
 static void flush_all(struct kmem_cache *s)
@@ -2598,6 +2617,313 @@ static void *__slab_alloc(struct kmem_cache *s, gfp_t gfpflags, int node,
 	return p;
 }
 
+/*
+ * Fill @p with up to @size objects from the cpu slab, falling back to the
+ * slowpath when it runs dry. No hooks are run. Returns the number of
+ * objects allocated.
+ */
+static int cpu_slab_alloc_bulk(struct kmem_cache *s, gfp_t flags,
+			       size_t size, void **p)
+{
+	struct kmem_cache_cpu *c;
+	unsigned long irqflags;
+	int i;
+
+	/*
+	 * Drain objects in the per cpu slab, while disabling local
+	 * IRQs, which protects against PREEMPT and interrupts
+	 * handlers invoking normal fastpath.
+	 */
+	local_irq_save(irqflags);
+	c = this_cpu_ptr(s->cpu_slab);
+
+	for (i = 0; i < size; i++) {
+		void *object = c->freelist;
+
+		if (unlikely(!object)) {
+			/*
+			 * Invoking slow path likely have side-effect
+			 * of re-populating per CPU c->freelist
+			 */
+			p[i] = ___slab_alloc(s, flags, NUMA_NO_NODE,
+					    _RET_IP_, c);
+			if (unlikely(!p[i])) {
+				local_irq_restore(irqflags);
+				return i;
+			}
+
+			c = this_cpu_ptr(s->cpu_slab);
+			continue; /* goto for-loop */
+		}
+		c->freelist = get_freepointer(s, object);
+		p[i] = object;
+	}
+	c->tid = next_tid(c->tid);
+	local_irq_restore(irqflags);
+
+	return i;
+}
+
+/*
+ * Per cpu object arrays
+ *
+ * The cpu slab only serves objects from a single slab page. When objects
+ * are allocated on one cpu and freed on another that page keeps running
+ * dry and both sides end up in the slowpath on list_lock. A cache can
+ * therefore keep a per cpu stack of free objects on top of the cpu slab:
+ * frees push to it, allocations pop from it, and it is refilled from and
+ * flushed to the slabs in batches. The array sits below the debug, kasan
+ * and memcg hooks, which see objects in the array as free, so it is not
+ * available to debug and kasan caches.
+ *
+ * Readers only access the array with interrupts disabled. A resize
+ * unpublishes the old arrays and drains them with an IPI before they are
+ * freed.
+ */
+#define SLUB_CPU_ARRAY_MAX	1024
+#define SLUB_CPU_ARRAY_BATCH	16
+
+/* Default array size for new caches, from slub_cpu_array= */
+static unsigned int slub_cpu_array;
+static bool slub_cpu_array_ready;
+
+static inline bool kmem_cache_has_cpu_array(struct kmem_cache *s)
+{
+	return !kmem_cache_debug(s) && !(s->flags & SLAB_KASAN);
+}
+
+static inline unsigned int cpu_array_batch(struct kmem_cache_cpu_array *a)
+{
+	return clamp(a->limit / 2, 1U, (unsigned int)SLUB_CPU_ARRAY_BATCH);
+}
+
+struct detached_freelist {
+	struct page *page;
+	void *tail;
+	void *freelist;
+	int cnt;
+	struct kmem_cache *s;
+};
+
+static inline int build_detached_freelist(struct kmem_cache *s, size_t size,
+					  void **p, struct detached_freelist *df);
+static __always_inline void do_slab_free(struct kmem_cache *s,
+				struct page *page, void *head, void *tail,
+				int cnt, unsigned long addr);
+
+/* Return objects to their slabs, bypassing the hooks */
+static void cpu_array_free_objects(struct kmem_cache *s, size_t size,
+				   void **p)
+{
+	do {
+		struct detached_freelist df;
+
+		size = build_detached_freelist(s, size, p, &df);
+		if (unlikely(!df.page))
+			continue;
+
+		do_slab_free(df.s, df.page, df.freelist, df.tail, df.cnt,
+			     _RET_IP_);
+	} while (likely(size));
+}
+
+/* Flush the @nr oldest objects of @a. Interrupts must be disabled. */
+static void cpu_array_flush(struct kmem_cache *s,
+			    struct kmem_cache_cpu_array *a, unsigned int nr)
+{
+	if (!nr)
+		return;
+
+	cpu_array_free_objects(s, nr, a->objects);
+	a->avail -= nr;
+	memmove(a->objects, a->objects + nr, a->avail * sizeof(void *));
+}
+
+static void cpu_array_drain(struct kmem_cache *s, int cpu)
+{
+	struct kmem_cache_cpu_array __percpu *pca;
+
+	pca = lockless_dereference(s->cpu_array);
+	if (pca) {
+		struct kmem_cache_cpu_array *a = per_cpu_ptr(pca, cpu);
+
+		cpu_array_flush(s, a, a->avail);
+	}
+}
+
+static noinline void *cpu_array_refill(struct kmem_cache *s, gfp_t gfpflags,
+				       unsigned int batch)
+{
+	struct kmem_cache_cpu_array __percpu *pca;
+	struct kmem_cache_cpu_array *a;
+	void *objects[SLUB_CPU_ARRAY_BATCH];
+	unsigned long flags;
+	int nr, keep, i;
+
+	nr = cpu_slab_alloc_bulk(s, gfpflags & ~__GFP_ZERO, batch, objects);
+	if (!nr)
+		return NULL;
+
+	/*
+	 * Objects from pfmemalloc slabs may only go to callers entitled to
+	 * the reserves, so only the first one, which goes to this caller,
+	 * is allowed to be one. Move the others to the end to be freed.
+	 */
+	for (keep = i = 1; i < nr; i++) {
+		if (!PageSlabPfmemalloc(virt_to_head_page(objects[i])))
+			swap(objects[keep++], objects[i]);
+	}
+
+	i = 1;
+	local_irq_save(flags);
+	pca = lockless_dereference(s->cpu_array);
+	if (likely(pca)) {
+		a = this_cpu_ptr(pca);
+		while (i < keep && a->avail < a->limit)
+			a->objects[a->avail++] = objects[i++];
+	}
+	/*
+	 * pfmemalloc objects, or we raced with a resize or got interrupted
+	 * by another refill
+	 */
+	if (unlikely(i < nr))
+		cpu_array_free_objects(s, nr - i, objects + i);
+	local_irq_restore(flags);
+
+	/* The first object goes to the caller */
+	return objects[0];
+}
+
+static __always_inline void *cpu_array_alloc(struct kmem_cache *s,
+					     gfp_t gfpflags)
+{
+	struct kmem_cache_cpu_array __percpu *pca;
+	struct kmem_cache_cpu_array *a;
+	unsigned int batch = 0;
+	unsigned long flags;
+	void *object = NULL;
+
+	local_irq_save(flags);
+	pca = lockless_dereference(s->cpu_array);
+	if (likely(pca)) {
+		a = this_cpu_ptr(pca);
+		if (likely(a->avail))
+			object = a->objects[--a->avail];
+		else
+			batch = cpu_array_batch(a);
+	}
+	local_irq_restore(flags);
+
+	if (likely(object)) {
+		stat(s, CPU_ARRAY_ALLOC_HIT);
+		return object;
+	}
+	if (!batch)
+		return NULL;
+
+	stat(s, CPU_ARRAY_ALLOC_MISS);
+	return cpu_array_refill(s, gfpflags, batch);
+}
+
+static __always_inline bool cpu_array_free(struct kmem_cache *s,
+					   struct page *page, void *object)
+{
+	struct kmem_cache_cpu_array __percpu *pca;
+	struct kmem_cache_cpu_array *a;
+	unsigned long flags;
+
+	/* Keep remote node objects out, they would be handed out locally */
+	if (page_to_nid(page) != numa_mem_id())
+		return false;
+
+	/* Reserve objects go back to their slab, see cpu_array_refill() */
+	if (unlikely(PageSlabPfmemalloc(page)))
+		return false;
+
+	local_irq_save(flags);
+	pca = lockless_dereference(s->cpu_array);
+	if (unlikely(!pca)) {
+		local_irq_restore(flags);
+		return false;
+	}
+
+	a = this_cpu_ptr(pca);
+	if (unlikely(a->avail == a->limit)) {
+		cpu_array_flush(s, a, cpu_array_batch(a));
+		stat(s, CPU_ARRAY_FLUSH);
+	}
+	a->objects[a->avail++] = object;
+	local_irq_restore(flags);
+
+	stat(s, CPU_ARRAY_FREE_HIT);
+	return true;
+}
+
+static struct kmem_cache_cpu_array __percpu *alloc_cpu_array(unsigned int size)
+{
+	struct kmem_cache_cpu_array __percpu *pca;
+	int cpu;
+
+	pca = __alloc_percpu(sizeof(struct kmem_cache_cpu_array) +
+			     size * sizeof(void *), sizeof(void *));
+	if (!pca)
+		return NULL;
+
+	for_each_possible_cpu(cpu)
+		per_cpu_ptr(pca, cpu)->limit = size;
+	return pca;
+}
+
+struct cpu_array_drain_info {
+	struct kmem_cache *s;
+	struct kmem_cache_cpu_array __percpu *pca;
+};
+
+static void cpu_array_drain_old(void *d)
+{
+	struct cpu_array_drain_info *info = d;
+	struct kmem_cache_cpu_array *a = this_cpu_ptr(info->pca);
+
+	cpu_array_flush(info->s, a, a->avail);
+}
+
+static int resize_cpu_array(struct kmem_cache *s, unsigned int size)
+{
+	static DEFINE_MUTEX(cpu_array_mutex);
+	struct kmem_cache_cpu_array __percpu *new = NULL;
+	struct cpu_array_drain_info info = { .s = s };
+
+	if (size > SLUB_CPU_ARRAY_MAX)
+		return -EINVAL;
+	if (size && !kmem_cache_has_cpu_array(s))
+		return -EINVAL;
+
+	if (size) {
+		new = alloc_cpu_array(size);
+		if (!new)
+			return -ENOMEM;
+	}
+
+	mutex_lock(&cpu_array_mutex);
+	get_online_cpus();
+	info.pca = s->cpu_array;
+	WRITE_ONCE(s->cpu_array, NULL);
+	/*
+	 * Users of the old arrays run with interrupts disabled: once the
+	 * IPI has run on every cpu nobody can be looking at them anymore.
+	 */
+	if (info.pca)
+		on_each_cpu(cpu_array_drain_old, &info, 1);
+	WRITE_ONCE(s->cpu_array_size, size);
+	smp_wmb();	/* Publish the array limits first */
+	WRITE_ONCE(s->cpu_array, new);
+	put_online_cpus();
+	mutex_unlock(&cpu_array_mutex);
+
+	free_percpu(info.pca);
+	return 0;
+}
+
 /*
  * Inlined fastpath so that allocation functions (kmalloc, kmem_cache_alloc)
  * have the fastpath folded into their functions. So no function call
@@ -2619,6 +2945,12 @@ static __always_inline void *slab_alloc_node(struct kmem_cache *s,
 	s = slab_pre_alloc_hook(s, gfpflags);
 	if (!s)
 		return NULL;
+
+	if (READ_ONCE(s->cpu_array) && node == NUMA_NO_NODE) {
+		object = cpu_array_alloc(s, gfpflags);
+		if (likely(object))
+			goto out;
+	}
 redo:
 	/*
 	 * Must read kmem_cache cpu data via this cpu ptr. Preemption is
@@ -2686,7 +3018,7 @@ redo:
 		prefetch_freepointer(s, next_object);
 		stat(s, ALLOC_FASTPATH);
 	}
-
+out:
 	if (unlikely(gfpflags & __GFP_ZERO) && object)
 		memset(object, 0, s->object_size);
 
@@ -2940,6 +3272,8 @@ static __always_inline void slab_free(struct kmem_cache *s, struct page *page,
 	 */
 	if (s->flags & SLAB_KASAN && !(s->flags & SLAB_DESTROY_BY_RCU))
 		return;
+	if (!tail && READ_ONCE(s->cpu_array) && cpu_array_free(s, page, head))
+		return;
 	do_slab_free(s, page, head, tail, cnt, addr);
 }
 
@@ -2960,14 +3294,6 @@ void kmem_cache_free(struct kmem_cache *s, void *x)
 }
 EXPORT_SYMBOL(kmem_cache_free);
 
-struct detached_freelist {
-	struct page *page;
-	void *tail;
-	void *freelist;
-	int cnt;
-	struct kmem_cache *s;
-};
-
 /*
  * This function progressively scans the array with free objects (with
  * a limited look ahead) and extract objects belonging to the same
@@ -3073,42 +3399,16 @@ EXPORT_SYMBOL(kmem_cache_free_bulk);
 int kmem_cache_alloc_bulk(struct kmem_cache *s, gfp_t flags, size_t size,
 			  void **p)
 {
-	struct kmem_cache_cpu *c;
 	int i;
 
 	/* memcg and kmem_cache debug support */
 	s = slab_pre_alloc_hook(s, flags);
 	if (unlikely(!s))
 		return false;
-	/*
-	 * Drain objects in the per cpu slab, while disabling local
-	 * IRQs, which protects against PREEMPT and interrupts
-	 * handlers invoking normal fastpath.
-	 */
-	local_irq_disable();
-	c = this_cpu_ptr(s->cpu_slab);
-
-	for (i = 0; i < size; i++) {
-		void *object = c->freelist;
 
-		if (unlikely(!object)) {
-			/*
-			 * Invoking slow path likely have side-effect
-			 * of re-populating per CPU c->freelist
-			 */
-			p[i] = ___slab_alloc(s, flags, NUMA_NO_NODE,
-					    _RET_IP_, c);
-			if (unlikely(!p[i]))
-				goto error;
-
-			c = this_cpu_ptr(s->cpu_slab);
-			continue; /* goto for-loop */
-		}
-		c->freelist = get_freepointer(s, object);
-		p[i] = object;
-	}
-	c->tid = next_tid(c->tid);
-	local_irq_enable();
+	i = cpu_slab_alloc_bulk(s, flags, size, p);
+	if (unlikely(i < size))
+		goto error;
 
 	/* Clear memory outside IRQ disabled fastpath loop */
 	if (unlikely(flags & __GFP_ZERO)) {
@@ -3122,7 +3422,6 @@ int kmem_cache_alloc_bulk(struct kmem_cache *s, gfp_t flags, size_t size,
 	slab_post_alloc_hook(s, flags, size, p);
 	return i;
 error:
-	local_irq_enable();
 	slab_post_alloc_hook(s, flags, i, p);
 	__kmem_cache_free_bulk(s, i, p);
 	return 0;
@@ -3347,6 +3646,7 @@ static void free_kmem_cache_nodes(struct kmem_cache *s)
 void __kmem_cache_release(struct kmem_cache *s)
 {
 	cache_random_seq_destroy(s);
+	free_percpu(s->cpu_array);
 	free_percpu(s->cpu_slab);
 	free_kmem_cache_nodes(s);
 }
@@ -3584,8 +3884,19 @@ static int kmem_cache_open(struct kmem_cache *s, unsigned long flags)
 	if (!init_kmem_cache_nodes(s))
 		goto error;
 
-	if (alloc_kmem_cache_cpus(s))
+	if (alloc_kmem_cache_cpus(s)) {
+		/*
+		 * Boot caches get their arrays in kmem_cache_init_late().
+		 * Memcg caches take the size of their root cache, which may
+		 * have been set through sysfs.
+		 */
+		unsigned int size = is_root_cache(s) ? slub_cpu_array :
+			READ_ONCE(memcg_root_cache(s)->cpu_array_size);
+
+		if (slub_cpu_array_ready && size)
+			resize_cpu_array(s, size);
 		return 0;
+	}
 
 	free_kmem_cache_nodes(s);
 error:
@@ -3699,6 +4010,16 @@ static int __init setup_slub_min_objects(char *str)
 
 __setup("slub_min_objects=", setup_slub_min_objects);
 
+static int __init setup_slub_cpu_array(char *str)
+{
+	get_option(&str, (int *)&slub_cpu_array);
+	slub_cpu_array = min(slub_cpu_array, (unsigned int)SLUB_CPU_ARRAY_MAX);
+
+	return 1;
+}
+
+__setup("slub_cpu_array=", setup_slub_cpu_array);
+
 void *__kmalloc(size_t size, gfp_t flags)
 {
 	struct kmem_cache *s;
@@ -4156,6 +4477,22 @@ void __init kmem_cache_init(void)
 
 void __init kmem_cache_init_late(void)
 {
+	struct kmem_cache *s;
+
+	/*
+	 * The early percpu area is too small to hold the object arrays of
+	 * all boot caches, so they are set up only now.
+	 */
+	get_online_cpus();
+	mutex_lock(&slab_mutex);
+	if (slub_cpu_array) {
+		list_for_each_entry(s, &slab_caches, list)
+			if (kmem_cache_has_cpu_array(s))
+				resize_cpu_array(s, slub_cpu_array);
+	}
+	slub_cpu_array_ready = true;
+	mutex_unlock(&slab_mutex);
+	put_online_cpus();
 }
 
 struct kmem_cache *
@@ -4916,6 +5253,28 @@ static ssize_t cpu_partial_store(struct kmem_cache *s, const char *buf,
 }
 SLAB_ATTR(cpu_partial);
 
+static ssize_t cpu_array_show(struct kmem_cache *s, char *buf)
+{
+	return sprintf(buf, "%u\n", s->cpu_array_size);
+}
+
+static ssize_t cpu_array_store(struct kmem_cache *s, const char *buf,
+			       size_t length)
+{
+	unsigned int objects;
+	int err;
+
+	err = kstrtouint(buf, 10, &objects);
+	if (err)
+		return err;
+
+	err = resize_cpu_array(s, objects);
+	if (err)
+		return err;
+	return length;
+}
+SLAB_ATTR(cpu_array);
+
 static ssize_t ctor_show(struct kmem_cache *s, char *buf)
 {
 	if (!s->ctor)
@@ -5039,6 +5398,16 @@ static ssize_t total_objects_show(struct kmem_cache *s, char *buf)
 }
 SLAB_ATTR_RO(total_objects);
 
+/*
+ * Called before debug flags are set at runtime: from then on allocations
+ * and frees must go through the debug processing of the slow paths.
+ */
+static void disable_cpu_array(struct kmem_cache *s)
+{
+	if (READ_ONCE(s->cpu_array))
+		resize_cpu_array(s, 0);
+}
+
 static ssize_t sanity_checks_show(struct kmem_cache *s, char *buf)
 {
 	return sprintf(buf, "%d\n", !!(s->flags & SLAB_CONSISTENCY_CHECKS));
@@ -5049,6 +5418,7 @@ static ssize_t sanity_checks_store(struct kmem_cache *s,
 {
 	s->flags &= ~SLAB_CONSISTENCY_CHECKS;
 	if (buf[0] == '1') {
+		disable_cpu_array(s);
 		s->flags &= ~__CMPXCHG_DOUBLE;
 		s->flags |= SLAB_CONSISTENCY_CHECKS;
 	}
@@ -5074,6 +5444,7 @@ static ssize_t trace_store(struct kmem_cache *s, const char *buf,
 
 	s->flags &= ~SLAB_TRACE;
 	if (buf[0] == '1') {
+		disable_cpu_array(s);
 		s->flags &= ~__CMPXCHG_DOUBLE;
 		s->flags |= SLAB_TRACE;
 	}
@@ -5094,6 +5465,7 @@ static ssize_t red_zone_store(struct kmem_cache *s,
 
 	s->flags &= ~SLAB_RED_ZONE;
 	if (buf[0] == '1') {
+		disable_cpu_array(s);
 		s->flags |= SLAB_RED_ZONE;
 	}
 	calculate_sizes(s, -1);
@@ -5114,6 +5486,7 @@ static ssize_t poison_store(struct kmem_cache *s,
 
 	s->flags &= ~SLAB_POISON;
 	if (buf[0] == '1') {
+		disable_cpu_array(s);
 		s->flags |= SLAB_POISON;
 	}
 	calculate_sizes(s, -1);
@@ -5134,6 +5507,7 @@ static ssize_t store_user_store(struct kmem_cache *s,
 
 	s->flags &= ~SLAB_STORE_USER;
 	if (buf[0] == '1') {
+		disable_cpu_array(s);
 		s->flags &= ~__CMPXCHG_DOUBLE;
 		s->flags |= SLAB_STORE_USER;
 	}
@@ -5317,6 +5691,10 @@ STAT_ATTR(CPU_PARTIAL_ALLOC, cpu_partial_alloc);
 STAT_ATTR(CPU_PARTIAL_FREE, cpu_partial_free);
 STAT_ATTR(CPU_PARTIAL_NODE, cpu_partial_node);
 STAT_ATTR(CPU_PARTIAL_DRAIN, cpu_partial_drain);
+STAT_ATTR(CPU_ARRAY_ALLOC_HIT, cpu_array_alloc_hit);
+STAT_ATTR(CPU_ARRAY_ALLOC_MISS, cpu_array_alloc_miss);
+STAT_ATTR(CPU_ARRAY_FREE_HIT, cpu_array_free_hit);
+STAT_ATTR(CPU_ARRAY_FLUSH, cpu_array_flush);
 #endif
 
 static struct attribute *slab_attrs[] = {
@@ -5326,6 +5704,7 @@ static struct attribute *slab_attrs[] = {
 	&order_attr.attr,
 	&min_partial_attr.attr,
 	&cpu_partial_attr.attr,
+	&cpu_array_attr.attr,
 	&objects_attr.attr,
 	&objects_partial_attr.attr,
 	&partial_attr.attr,
@@ -5384,6 +5763,10 @@ static struct attribute *slab_attrs[] = {
 	&cpu_partial_free_attr.attr,
 	&cpu_partial_node_attr.attr,
 	&cpu_partial_drain_attr.attr,
+	&cpu_array_alloc_hit_attr.attr,
+	&cpu_array_alloc_miss_attr.attr,
+	&cpu_array_free_hit_attr.attr,
+	&cpu_array_flush_attr.attr,
 #endif
 #ifdef CONFIG_FAILSLAB
 	&failslab_attr.attr,
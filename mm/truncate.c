@@ -159,7 +159,7 @@ int truncate_inode_page(struct address_space *mapping, struct page *page)
 	loff_t holelen;
 	VM_BUG_ON_PAGE(PageTail(page), page);
 
-	holelen = PageTransHuge(page) ? HPAGE_PMD_SIZE : PAGE_SIZE;
+	holelen = (loff_t)hpage_nr_pages(page) << PAGE_SHIFT;
 	if (page_mapped(page)) {
 		unmap_mapping_range(mapping,
 				   (loff_t)page->index << PAGE_SHIFT,
@@ -291,7 +291,12 @@ void truncate_inode_pages_range(struct address_space *mapping,
 				unlock_page(page);
 				continue;
 			}
-			truncate_inode_page(mapping, page);
+			/*
+			 * A large page cache page is clean and unmapped, so
+			 * it goes as a whole even if it sticks out of the
+			 * range; if it is gone already this does nothing.
+			 */
+			truncate_inode_page(mapping, compound_head(page));
 			unlock_page(page);
 		}
 		pagevec_remove_exceptionals(&pvec);
@@ -376,7 +381,7 @@ void truncate_inode_pages_range(struct address_space *mapping,
 			lock_page(page);
 			WARN_ON(page_to_pgoff(page) != index);
 			wait_on_page_writeback(page);
-			truncate_inode_page(mapping, page);
+			truncate_inode_page(mapping, compound_head(page));
 			unlock_page(page);
 		}
 		pagevec_remove_exceptionals(&pvec);
@@ -505,10 +510,12 @@ unsigned long invalidate_mapping_pages(struct address_space *mapping,
 				unlock_page(page);
 				continue;
 			} else if (PageTransHuge(page)) {
-				index += HPAGE_PMD_NR - 1;
-				i += HPAGE_PMD_NR - 1;
+				int nr = hpage_nr_pages(page);
+
+				index += nr - 1;
+				i += nr - 1;
 				/* 'end' is in the middle of THP */
-				if (index ==  round_down(end, HPAGE_PMD_NR))
+				if (index ==  round_down(end, nr))
 					continue;
 			}
 
@@ -542,6 +549,7 @@ static int
 invalidate_complete_page2(struct address_space *mapping, struct page *page)
 {
 	unsigned long flags;
+	int nr = hpage_nr_pages(page);
 
 	if (page->mapping != mapping)
 		return 0;
@@ -560,6 +568,7 @@ invalidate_complete_page2(struct address_space *mapping, struct page *page)
 	if (mapping->a_ops->freepage)
 		mapping->a_ops->freepage(page);
 
+	page_ref_sub(page, nr - 1);
 	put_page(page);	/* pagecache ref */
 	return 1;
 failed:
@@ -606,6 +615,7 @@ int invalidate_inode_pages2_range(struct address_space *mapping,
 			indices)) {
 		for (i = 0; i < pagevec_count(&pvec); i++) {
 			struct page *page = pvec.pages[i];
+			struct page *head;
 
 			/* We rely upon deletion not changing page->index */
 			index = indices[i];
@@ -619,19 +629,25 @@ int invalidate_inode_pages2_range(struct address_space *mapping,
 
 			lock_page(page);
 			WARN_ON(page_to_pgoff(page) != index);
-			if (page->mapping != mapping) {
+			/*
+			 * The range may start or end inside a large page cache
+			 * page, whose tail pages have no ->mapping: it goes as
+			 * a whole, through its head.
+			 */
+			head = compound_head(page);
+			if (head->mapping != mapping) {
 				unlock_page(page);
 				continue;
 			}
-			wait_on_page_writeback(page);
-			if (page_mapped(page)) {
+			wait_on_page_writeback(head);
+			if (page_mapped(head)) {
 				if (!did_range_unmap) {
 					/*
 					 * Zap the rest of the file in one hit.
 					 */
 					unmap_mapping_range(mapping,
-					   (loff_t)index << PAGE_SHIFT,
-					   (loff_t)(1 + end - index)
+					   (loff_t)head->index << PAGE_SHIFT,
+					   (loff_t)(1 + end - head->index)
 							 << PAGE_SHIFT,
 							 0);
 					did_range_unmap = 1;
@@ -640,14 +656,15 @@ int invalidate_inode_pages2_range(struct address_space *mapping,
 					 * Just zap this page
 					 */
 					unmap_mapping_range(mapping,
-					   (loff_t)index << PAGE_SHIFT,
-					   PAGE_SIZE, 0);
+					   (loff_t)head->index << PAGE_SHIFT,
+					   (loff_t)hpage_nr_pages(head)
+							<< PAGE_SHIFT, 0);
 				}
 			}
-			BUG_ON(page_mapped(page));
-			ret2 = do_launder_page(mapping, page);
+			BUG_ON(page_mapped(head));
+			ret2 = do_launder_page(mapping, head);
 			if (ret2 == 0) {
-				if (!invalidate_complete_page2(mapping, page))
+				if (!invalidate_complete_page2(mapping, head))
 					ret2 = -EBUSY;
 			}
 			if (ret2 < 0)
@@ -22,7 +22,7 @@
 #include <linux/kallsyms.h>
 #include <linux/list.h>
 #include <linux/notifier.h>
-#include <linux/rbtree.h>
+#include <linux/rbtree_augmented.h>
 #include <linux/radix-tree.h>
 #include <linux/rcupdate.h>
 #include <linux/pfn.h>
@@ -281,25 +281,37 @@ EXPORT_SYMBOL(vmalloc_to_pfn);
 #define VM_VM_AREA	0x04
 
 static DEFINE_SPINLOCK(vmap_area_lock);
+static DEFINE_SPINLOCK(free_vmap_area_lock);
 /* Export for kexec only */
 
 //vmapҲvmap_area_listѵַССеģvmap_area_root
 //rbtreeʽ֯ġ
 LIST_HEAD(vmap_area_list);
-static LLIST_HEAD(vmap_purge_list);
 static struct rb_root vmap_area_root = RB_ROOT;
 
-/* The vmap cache globals are protected by vmap_area_lock */
-//ĸʾfree_vmap_cachenode֮ǰĿնֵ
-//ֵֵĻͲҪֻcache㿪ʼҼɣ
-//Сֵʾcachenode֮ǰҪĵ㣬Ҫ
-//
-static struct rb_node *free_vmap_cache;
-static unsigned long cached_hole_size;
-static unsigned long cached_vstart;
-static unsigned long cached_align;
+/*
+ * Free KVA space is kept in its own address sorted rbtree and list,
+ * protected by free_vmap_area_lock. Each node is augmented with the size
+ * of the largest free area in its subtree, so the lowest fitting area is
+ * found in O(log n). The busy and free trees are complementary: lazily
+ * freed areas stay busy until they are purged.
+ */
+static struct rb_root free_vmap_area_root = RB_ROOT;
+static LIST_HEAD(free_vmap_area_list);
 
-static unsigned long vmap_area_pcpu_hole;
+/*
+ * Spare vmap_area used when an allocation splits a free area in two. It is
+ * preloaded outside of free_vmap_area_lock, so that the allocation under
+ * the lock rarely has to fall back to GFP_NOWAIT.
+ */
+static DEFINE_PER_CPU(struct vmap_area *, ne_fit_preload_node);
+
+/*
+ * Lazily freed areas are queued on per-cpu lists, so that concurrent frees
+ * do not bounce one list head around, and purged in batches covered by a
+ * single TLB flush.
+ */
+static DEFINE_PER_CPU(struct llist_head, vmap_purge_list);
 
 //Ұַaddrvmap_area
 static struct vmap_area *__find_vmap_area(unsigned long addr)
@@ -349,9 +361,341 @@ static void __insert_vmap_area(struct vmap_area *va)
 	if (tmp) {
 		struct vmap_area *prev;
 		prev = rb_entry(tmp, struct vmap_area, rb_node);
-		list_add_rcu(&va->list, &prev->list);
+		list_add(&va->list, &prev->list);
 	} else
-		list_add_rcu(&va->list, &vmap_area_list);
+		list_add(&va->list, &vmap_area_list);
+}
+
+static void __unlink_vmap_area(struct vmap_area *va)
+{
+	BUG_ON(RB_EMPTY_NODE(&va->rb_node));
+
+	rb_erase(&va->rb_node, &vmap_area_root);
+	RB_CLEAR_NODE(&va->rb_node);
+	list_del(&va->list);
+}
+
+static __always_inline unsigned long va_size(struct vmap_area *va)
+{
+	return va->va_end - va->va_start;
+}
+
+static __always_inline unsigned long get_subtree_max_size(struct rb_node *node)
+{
+	struct vmap_area *va;
+
+	va = rb_entry_safe(node, struct vmap_area, rb_node);
+	return va ? va->subtree_max_size : 0;
+}
+
+static __always_inline unsigned long
+compute_subtree_max_size(struct vmap_area *va)
+{
+	return max3(va_size(va),
+		    get_subtree_max_size(va->rb_node.rb_left),
+		    get_subtree_max_size(va->rb_node.rb_right));
+}
+
+RB_DECLARE_CALLBACKS(static, free_vmap_area_rb_augment_cb,
+		     struct vmap_area, rb_node, unsigned long,
+		     subtree_max_size, compute_subtree_max_size)
+
+/*
+ * Refresh subtree_max_size from @va up to the root after the size of @va
+ * or of one of its children changed. Stops early once a node is unchanged.
+ */
+static __always_inline void augment_tree_propagate_from(struct vmap_area *va)
+{
+	free_vmap_area_rb_augment_cb_propagate(&va->rb_node, NULL);
+}
+
+static void insert_free_vmap_area(struct vmap_area *va)
+{
+	struct rb_node **p = &free_vmap_area_root.rb_node;
+	struct rb_node *parent = NULL;
+	struct rb_node *tmp;
+
+	while (*p) {
+		struct vmap_area *tmp_va;
+
+		parent = *p;
+		tmp_va = rb_entry(parent, struct vmap_area, rb_node);
+		if (va->va_end <= tmp_va->va_start)
+			p = &(*p)->rb_left;
+		else if (va->va_start >= tmp_va->va_end)
+			p = &(*p)->rb_right;
+		else
+			BUG();
+	}
+
+	va->subtree_max_size = va_size(va);
+	rb_link_node(&va->rb_node, parent, p);
+	/* the path to the new leaf must be up to date before rebalancing */
+	if (parent)
+		free_vmap_area_rb_augment_cb_propagate(parent, NULL);
+	rb_insert_augmented(&va->rb_node, &free_vmap_area_root,
+			    &free_vmap_area_rb_augment_cb);
+
+	tmp = rb_prev(&va->rb_node);
+	if (tmp) {
+		struct vmap_area *prev;
+		prev = rb_entry(tmp, struct vmap_area, rb_node);
+		list_add(&va->list, &prev->list);
+	} else
+		list_add(&va->list, &free_vmap_area_list);
+}
+
+static void unlink_free_vmap_area(struct vmap_area *va)
+{
+	rb_erase_augmented(&va->rb_node, &free_vmap_area_root,
+			   &free_vmap_area_rb_augment_cb);
+	RB_CLEAR_NODE(&va->rb_node);
+	list_del(&va->list);
+}
+
+/*
+ * Find the last free area starting below @addr, or NULL if there is none.
+ */
+static struct vmap_area *find_free_vmap_area_prev(unsigned long addr)
+{
+	struct rb_node *n = free_vmap_area_root.rb_node;
+	struct vmap_area *prev = NULL;
+
+	while (n) {
+		struct vmap_area *tmp;
+
+		tmp = rb_entry(n, struct vmap_area, rb_node);
+		if (tmp->va_start < addr) {
+			prev = tmp;
+			n = n->rb_right;
+		} else
+			n = n->rb_left;
+	}
+
+	return prev;
+}
+
+/*
+ * Return the KVA range of @va, which is no longer in the busy tree, to the
+ * free tree. @va is merged with its free neighbours where possible, in
+ * which case it is freed; otherwise it becomes a free area node itself.
+ */
+static void merge_or_add_free_vmap_area(struct vmap_area *va)
+{
+	struct vmap_area *prev, *next = NULL;
+	struct list_head *head;
+	bool merged = false;
+
+	prev = find_free_vmap_area_prev(va->va_start);
+	head = prev ? &prev->list : &free_vmap_area_list;
+	if (head->next != &free_vmap_area_list)
+		next = list_entry(head->next, struct vmap_area, list);
+
+	if (next && next->va_start == va->va_end) {
+		next->va_start = va->va_start;
+		kfree(va);
+		va = next;
+		merged = true;
+	}
+
+	if (prev && prev->va_end == va->va_start) {
+		prev->va_end = va->va_end;
+		if (merged)
+			unlink_free_vmap_area(va);
+		kfree(va);
+		va = prev;
+		merged = true;
+	}
+
+	if (merged)
+		augment_tree_propagate_from(va);
+	else
+		insert_free_vmap_area(va);
+}
+
+static __always_inline bool
+is_within_this_va(struct vmap_area *va, unsigned long size,
+		  unsigned long align, unsigned long vstart)
+{
+	unsigned long nva_start_addr;
+
+	if (va->va_start > vstart)
+		nva_start_addr = ALIGN(va->va_start, align);
+	else
+		nva_start_addr = ALIGN(vstart, align);
+
+	/* Can be overflowed due to big size or alignment. */
+	if (nva_start_addr + size < nva_start_addr ||
+			nva_start_addr < vstart)
+		return false;
+
+	return nva_start_addr + size <= va->va_end;
+}
+
+/*
+ * Find the lowest free area at or above @vstart that can hold @size bytes
+ * aligned to @align. Subtrees whose largest free area is too small are
+ * skipped, so this is O(log n). The search length accounts for the worst
+ * case alignment overhead.
+ */
+static __always_inline struct vmap_area *
+find_vmap_lowest_match(unsigned long size, unsigned long align,
+		       unsigned long vstart)
+{
+	struct vmap_area *va;
+	struct rb_node *node;
+	unsigned long length;
+
+	node = free_vmap_area_root.rb_node;
+	length = size + align - 1;
+
+	while (node) {
+		va = rb_entry(node, struct vmap_area, rb_node);
+
+		if (get_subtree_max_size(node->rb_left) >= length &&
+				vstart < va->va_start) {
+			node = node->rb_left;
+		} else {
+			if (is_within_this_va(va, size, align, vstart))
+				return va;
+
+			/*
+			 * No point going right unless the right subtree has
+			 * a large enough free area.
+			 */
+			if (get_subtree_max_size(node->rb_right) >= length) {
+				node = node->rb_right;
+				continue;
+			}
+
+			/*
+			 * Climb back up to the first right subtree which may
+			 * satisfy the request. vstart is moved past the parent
+			 * so that an already checked subtree is not entered
+			 * again.
+			 */
+			while ((node = rb_parent(node))) {
+				va = rb_entry(node, struct vmap_area, rb_node);
+				if (is_within_this_va(va, size, align, vstart))
+					return va;
+
+				if (get_subtree_max_size(node->rb_right) >= length &&
+						vstart <= va->va_start) {
+					vstart = va->va_start + 1;
+					node = node->rb_right;
+					break;
+				}
+			}
+		}
+	}
+
+	return NULL;
+}
+
+enum fit_type {
+	NOTHING_FIT = 0,
+	FL_FIT_TYPE = 1,	/* full fit */
+	LE_FIT_TYPE = 2,	/* left edge fit */
+	RE_FIT_TYPE = 3,	/* right edge fit */
+	NE_FIT_TYPE = 4		/* no edge fit */
+};
+
+static __always_inline enum fit_type
+classify_va_fit_type(struct vmap_area *va, unsigned long nva_start_addr,
+		     unsigned long size)
+{
+	if (nva_start_addr < va->va_start ||
+			nva_start_addr + size > va->va_end)
+		return NOTHING_FIT;
+
+	if (va->va_start == nva_start_addr) {
+		if (va->va_end == nva_start_addr + size)
+			return FL_FIT_TYPE;
+		return LE_FIT_TYPE;
+	}
+	if (va->va_end == nva_start_addr + size)
+		return RE_FIT_TYPE;
+	return NE_FIT_TYPE;
+}
+
+/*
+ * Carve [nva_start_addr, nva_start_addr + size) out of the free area @va.
+ * Splitting @va in two needs a new node, which is taken from @spare if
+ * possible.
+ */
+static int adjust_va_to_fit_type(struct vmap_area *va,
+				 unsigned long nva_start_addr,
+				 unsigned long size, enum fit_type type,
+				 struct vmap_area **spare)
+{
+	struct vmap_area *lva = NULL;
+
+	switch (type) {
+	case FL_FIT_TYPE:
+		unlink_free_vmap_area(va);
+		kfree(va);
+		return 0;
+	case LE_FIT_TYPE:
+		va->va_start += size;
+		break;
+	case RE_FIT_TYPE:
+		va->va_end = nva_start_addr;
+		break;
+	case NE_FIT_TYPE:
+		lva = *spare;
+		*spare = NULL;
+		if (unlikely(!lva)) {
+			lva = kmalloc(sizeof(struct vmap_area), GFP_NOWAIT);
+			if (!lva)
+				return -ENOMEM;
+		}
+		lva->va_start = va->va_start;
+		lva->va_end = nva_start_addr;
+		va->va_start = nva_start_addr + size;
+		break;
+	default:
+		return -EINVAL;
+	}
+
+	augment_tree_propagate_from(va);
+	if (lva)
+		insert_free_vmap_area(lva);
+
+	return 0;
+}
+
+/*
+ * Returns the start address of the newly carved area, or @vend on failure.
+ * Must be called with free_vmap_area_lock held.
+ */
+static unsigned long __alloc_vmap_area(unsigned long size, unsigned long align,
+				       unsigned long vstart, unsigned long vend)
+{
+	unsigned long nva_start_addr;
+	struct vmap_area *va;
+	enum fit_type type;
+
+	va = find_vmap_lowest_match(size, align, vstart);
+	if (unlikely(!va))
+		return vend;
+
+	if (va->va_start > vstart)
+		nva_start_addr = ALIGN(va->va_start, align);
+	else
+		nva_start_addr = ALIGN(vstart, align);
+
+	if (nva_start_addr + size > vend)
+		return vend;
+
+	type = classify_va_fit_type(va, nva_start_addr, size);
+	if (WARN_ON_ONCE(type == NOTHING_FIT))
+		return vend;
+
+	if (adjust_va_to_fit_type(va, nva_start_addr, size, type,
+				  this_cpu_ptr(&ne_fit_preload_node)))
+		return vend;
+
+	return nva_start_addr;
 }
 
 static void purge_vmap_area_lazy(void);
@@ -362,20 +706,14 @@ static BLOCKING_NOTIFIER_HEAD(vmap_notify_list);
  * Allocate a region of KVA of the specified size and alignment, within the
  * vstart and vend.
  */
-/*
- vmap_area_list вһδʹõĿռ䣬㷨vmap_area_list
-(ӵ͵ַߵַ)ҳһδʹõĿռ䣬Ȼ㷨Ż
-*/
 static struct vmap_area *alloc_vmap_area(unsigned long size,
 				unsigned long align,
 				unsigned long vstart, unsigned long vend,
 				int node, gfp_t gfp_mask)
 {
-	struct vmap_area *va;
-	struct rb_node *n;
+	struct vmap_area *va, *pva;
 	unsigned long addr;
 	int purged = 0;
-	struct vmap_area *first;
 
 	BUG_ON(!size);
 	BUG_ON(offset_in_page(size));
@@ -395,111 +733,31 @@ static struct vmap_area *alloc_vmap_area(unsigned long size,
 	kmemleak_scan_area(&va->rb_node, SIZE_MAX, gfp_mask & GFP_RECLAIM_MASK);
 
 retry:
-	spin_lock(&vmap_area_lock);
 	/*
-	 * Invalidate cache if we have more permissive parameters.
-	 * cached_hole_size notes the largest hole noticed _below_
-	 * the vmap_area cached in free_vmap_cache: if size fits
-	 * into that hole, we want to scan from vstart to reuse
-	 * the hole instead of allocating above free_vmap_cache.
-	 * Note that __free_vmap_area may update free_vmap_cache
-	 * without updating cached_hole_size or cached_align.
+	 * Preload this CPU with a spare node for the split case while we can
+	 * still use the caller's gfp mask.
 	 */
-/*
-ڿһΣعע size < cached_hole_size˼˵
-֮ǰĿնҪĻʹcacheʹá
-൱cacheʾǰûҪĿնͲҪٴ
-ˣֱӴcacheͿˡ
-*/
-	if (!free_vmap_cache ||
-			size < cached_hole_size ||
-			vstart < cached_vstart ||
-			align < cached_align) {
-nocache:
-		cached_hole_size = 0;
-		free_vmap_cache = NULL;
-	}
-	/* record if we encounter less permissive parameters */
-	cached_vstart = vstart;
-	cached_align = align;
-
-	/* find starting point for our search */
-	if (free_vmap_cache) {
-		first = rb_entry(free_vmap_cache, struct vmap_area, rb_node);
-		addr = ALIGN(first->va_end, align);
-		if (addr < vstart)
-			goto nocache;
-		if (addr + size < addr)
-			goto overflow;
-
-	} else {
-		addr = ALIGN(vstart, align);
-		if (addr + size < addr)
-			goto overflow;
-
-		n = vmap_area_root.rb_node;
-		first = NULL;
-/*
-СĵַʼsizeĿնlisttreeͨһδ룬
-struct vmap_area *tmp = vmap_area_list
-while(tmp->end < addr)
-{
-	tmp=tmp->next;
-}
-if(tmp->start>addr)
-{
-	return tmp->prev
-}
-return tmp;
-
-*/
-		while (n) {
-			struct vmap_area *tmp;
-			tmp = rb_entry(n, struct vmap_area, rb_node);
-			if (tmp->va_end >= addr) {
-				first = tmp;
-				if (tmp->va_start <= addr)
-					break;
-				n = n->rb_left;
-			} else
-				n = n->rb_right;
-		}
-		//ֻ vmap_area.end < add ʱfirstŻʱnull
-		//൱ʱһҪֵұ
-		if (!first)
-			goto found;
-	}
-
-	/* from the starting point, walk areas until a suitable hole is found */
-/*
-addrСvmap_area_listҵһСsizeĿն
-vmap_areaĺܶĻЧģ
-ʹvmallocռ䣬ͻvmallocֵ֧͵ַʼһֱ
-鵽ߵַÿηҪһ飬Чʵ£1861
-kernelֹ⡣
-*/
-	while (addr + size > first->va_start && addr + size <= vend) {
-		if (addr + cached_hole_size < first->va_start)
-			cached_hole_size = first->va_start - addr;
-		addr = ALIGN(first->va_end, align);
-		if (addr + size < addr)
-			goto overflow;
-
-		if (list_is_last(&first->list, &vmap_area_list))
-			goto found;
-
-		first = list_next_entry(first, list);
-	}
-
-found:
-	if (addr + size > vend)
+	pva = NULL;
+	if (!this_cpu_read(ne_fit_preload_node))
+		pva = kmalloc_node(sizeof(struct vmap_area),
+				gfp_mask & GFP_RECLAIM_MASK, node);
+
+	spin_lock(&free_vmap_area_lock);
+	if (pva && __this_cpu_cmpxchg(ne_fit_preload_node, NULL, pva))
+		kfree(pva);
+	addr = __alloc_vmap_area(size, align, vstart, vend);
+	spin_unlock(&free_vmap_area_lock);
+
+	if (unlikely(addr == vend))
 		goto overflow;
 
 	va->va_start = addr;
 	va->va_end = addr + size;
 	va->flags = 0;
+	va->vm = NULL;
+
+	spin_lock(&vmap_area_lock);
 	__insert_vmap_area(va);
-	free_vmap_cache = &va->rb_node;
 	spin_unlock(&vmap_area_lock);
 
 	BUG_ON(!IS_ALIGNED(va->va_start, align));
@@ -509,7 +767,6 @@ found:
 	return va;
 
 overflow:
-	spin_unlock(&vmap_area_lock);
 	if (!purged) {
 		purge_vmap_area_lazy();
 		purged = 1;
@@ -544,49 +801,18 @@ int unregister_vmap_purge_notifier(struct notifier_block *nb)
 }
 EXPORT_SYMBOL_GPL(unregister_vmap_purge_notifier);
 
-static void __free_vmap_area(struct vmap_area *va)
-{
-	BUG_ON(RB_EMPTY_NODE(&va->rb_node));
-
-	if (free_vmap_cache) {
-		if (va->va_end < cached_vstart) {
-			free_vmap_cache = NULL;
-		} else {
-			struct vmap_area *cache;
-			cache = rb_entry(free_vmap_cache, struct vmap_area, rb_node);
-			if (va->va_start <= cache->va_start) {
-				free_vmap_cache = rb_prev(&va->rb_node);
-				/*
-				 * We don't try to update cached_hole_size or
-				 * cached_align, but it won't go very wrong.
-				 */
-			}
-		}
-	}
-	rb_erase(&va->rb_node, &vmap_area_root);
-	RB_CLEAR_NODE(&va->rb_node);
-	list_del_rcu(&va->list);
-
-	/*
-	 * Track the highest possible candidate for pcpu area
-	 * allocation.  Areas outside of vmalloc area can be returned
-	 * here too, consider only end addresses which fall inside
-	 * vmalloc area proper.
-	 */
-	if (va->va_end > VMALLOC_START && va->va_end <= VMALLOC_END)
-		vmap_area_pcpu_hole = max(vmap_area_pcpu_hole, va->va_end);
-
-	kfree_rcu(va, rcu_head);
-}
-
 /*
  * Free a region of KVA allocated by alloc_vmap_area
  */
 static void free_vmap_area(struct vmap_area *va)
 {
 	spin_lock(&vmap_area_lock);
-	__free_vmap_area(va);
+	__unlink_vmap_area(va);
 	spin_unlock(&vmap_area_lock);
+
+	spin_lock(&free_vmap_area_lock);
+	merge_or_add_free_vmap_area(va);
+	spin_unlock(&free_vmap_area_lock);
 }
 
 /*
@@ -670,10 +896,11 @@ static void __purge_vmap_area_lazy(unsigned long *start, unsigned long *end,
 					int sync, int force_flush)
 {
 	static DEFINE_SPINLOCK(purge_lock);
-	struct llist_node *valist;
+	struct llist_node *valist = NULL;
 	struct vmap_area *va;
 	struct vmap_area *n_va;
 	int nr = 0;
+	int cpu;
 
 	/*
 	 * If sync is 0 but force_flush is 1, we'll go sync anyway but callers
@@ -689,13 +916,20 @@ static void __purge_vmap_area_lazy(unsigned long *start, unsigned long *end,
 	if (sync)
 		purge_fragmented_blocks_allcpus();
 
-	valist = llist_del_all(&vmap_purge_list);
-	llist_for_each_entry(va, valist, purge_list) {
-		if (va->va_start < *start)
-			*start = va->va_start;
-		if (va->va_end > *end)
-			*end = va->va_end;
-		nr += (va->va_end - va->va_start) >> PAGE_SHIFT;
+	/* Gather the per-cpu lazy lists into one batch */
+	for_each_possible_cpu(cpu) {
+		struct llist_node *list;
+
+		list = llist_del_all(per_cpu_ptr(&vmap_purge_list, cpu));
+		llist_for_each_entry_safe(va, n_va, list, purge_list) {
+			if (va->va_start < *start)
+				*start = va->va_start;
+			if (va->va_end > *end)
+				*end = va->va_end;
+			nr += (va->va_end - va->va_start) >> PAGE_SHIFT;
+			va->purge_list.next = valist;
+			valist = &va->purge_list;
+		}
 	}
 
 	if (nr)
@@ -706,9 +940,14 @@ static void __purge_vmap_area_lazy(unsigned long *start, unsigned long *end,
 
 	if (nr) {
 		spin_lock(&vmap_area_lock);
-		llist_for_each_entry_safe(va, n_va, valist, purge_list)
-			__free_vmap_area(va);
+		llist_for_each_entry(va, valist, purge_list)
+			__unlink_vmap_area(va);
 		spin_unlock(&vmap_area_lock);
+
+		spin_lock(&free_vmap_area_lock);
+		llist_for_each_entry_safe(va, n_va, valist, purge_list)
+			merge_or_add_free_vmap_area(va);
+		spin_unlock(&free_vmap_area_lock);
 	}
 	spin_unlock(&purge_lock);
 }
@@ -747,7 +986,7 @@ static void free_vmap_area_noflush(struct vmap_area *va)
 				    &vmap_lazy_nr);
 
 	/* After this point, we may free va at any time */
-	llist_add(&va->purge_list, &vmap_purge_list);
+	llist_add(&va->purge_list, raw_cpu_ptr(&vmap_purge_list));
 
 	if (unlikely(nr_lazy > lazy_max_pages()))
 		try_purge_vmap_area_lazy();
@@ -1272,6 +1511,40 @@ void __init vm_area_register_early(struct vm_struct *vm, size_t align)
 	vm_area_add_early(vm);
 }
 
+/*
+ * Seed the free tree with everything outside the busy areas imported from
+ * vmlist. The whole address space is covered, so callers may pass any
+ * vstart/vend range to alloc_vmap_area().
+ */
+static void __init vmap_init_free_space(void)
+{
+	unsigned long vmap_start = 1;
+	const unsigned long vmap_end = ULONG_MAX;
+	struct vmap_area *busy, *free;
+
+	list_for_each_entry(busy, &vmap_area_list, list) {
+		if (busy->va_start > vmap_start) {
+			free = kzalloc(sizeof(struct vmap_area), GFP_NOWAIT);
+			if (!WARN_ON_ONCE(!free)) {
+				free->va_start = vmap_start;
+				free->va_end = busy->va_start;
+				insert_free_vmap_area(free);
+			}
+		}
+
+		vmap_start = busy->va_end;
+	}
+
+	if (vmap_end > vmap_start) {
+		free = kzalloc(sizeof(struct vmap_area), GFP_NOWAIT);
+		if (!WARN_ON_ONCE(!free)) {
+			free->va_start = vmap_start;
+			free->va_end = vmap_end;
+			insert_free_vmap_area(free);
+		}
+	}
+}
+
 void __init vmalloc_init(void)
 {
 	struct vmap_area *va;
@@ -1302,8 +1575,7 @@ void __init vmalloc_init(void)
 		__insert_vmap_area(va);
 	}
 
-	vmap_area_pcpu_hole = VMALLOC_END;
-
+	vmap_init_free_space();
 	vmap_initialized = true;
 }
 
@@ -2392,81 +2664,59 @@ static struct vmap_area *node_to_va(struct rb_node *n)
 }
 
 /**
- * pvm_find_next_prev - find the next and prev vmap_area surrounding @end
- * @end: target address
- * @pnext: out arg for the next vmap_area
- * @pprev: out arg for the previous vmap_area
- *
- * Returns: %true if either or both of next and prev are found,
- *	    %false if no vmap_area exists
+ * pvm_find_va_enclose_addr - find the free area enclosing or below @addr
+ * @addr: target address
  *
- * Find vmap_areas end addresses of which enclose @end.  ie. if not
- * NULL, *pnext->va_end > @end and *pprev->va_end <= @end.
+ * Returns: the free vmap_area with the highest va_start <= @addr, or
+ *	    %NULL if there is none. The returned area does not necessarily
+ *	    contain @addr.
  */
-static bool pvm_find_next_prev(unsigned long end,
-			       struct vmap_area **pnext,
-			       struct vmap_area **pprev)
+static struct vmap_area *pvm_find_va_enclose_addr(unsigned long addr)
 {
-	struct rb_node *n = vmap_area_root.rb_node;
+	struct rb_node *n = free_vmap_area_root.rb_node;
 	struct vmap_area *va = NULL;
 
 	while (n) {
-		va = rb_entry(n, struct vmap_area, rb_node);
-		if (end < va->va_end)
-			n = n->rb_left;
-		else if (end > va->va_end)
+		struct vmap_area *tmp;
+
+		tmp = rb_entry(n, struct vmap_area, rb_node);
+		if (tmp->va_start <= addr) {
+			va = tmp;
+			if (tmp->va_end >= addr)
+				break;
 			n = n->rb_right;
-		else
-			break;
+		} else
+			n = n->rb_left;
 	}
 
-	if (!va)
-		return false;
-
-	if (va->va_end > end) {
-		*pnext = va;
-		*pprev = node_to_va(rb_prev(&(*pnext)->rb_node));
-	} else {
-		*pprev = va;
-		*pnext = node_to_va(rb_next(&(*pprev)->rb_node));
-	}
-	return true;
+	return va;
 }
 
 /**
- * pvm_determine_end - find the highest aligned address between two vmap_areas
- * @pnext: in/out arg for the next vmap_area
- * @pprev: in/out arg for the previous vmap_area
+ * pvm_determine_end_from_reverse - find the highest aligned end address
+ * @va: in/out arg for the free vmap_area to start the search from
  * @align: alignment
  *
- * Returns: determined end address
- *
- * Find the highest aligned address between *@pnext and *@pprev below
- * VMALLOC_END.  *@pnext and *@pprev are adjusted so that the aligned
- * down address is between the end addresses of the two vmap_areas.
+ * Returns: determined end address, or 0 if none is found
  *
- * Please note that the address returned by this function may fall
- * inside *@pnext vmap_area.  The caller is responsible for checking
- * that.
+ * Walk the free areas downwards from *@va and return the highest
+ * @align aligned address below VMALLOC_END which leaves a non-empty part
+ * of a free area below it. *@va is updated to that free area.
  */
-static unsigned long pvm_determine_end(struct vmap_area **pnext,
-				       struct vmap_area **pprev,
-				       unsigned long align)
+static unsigned long pvm_determine_end_from_reverse(struct vmap_area **va,
+						    unsigned long align)
 {
 	const unsigned long vmalloc_end = VMALLOC_END & ~(align - 1);
 	unsigned long addr;
 
-	if (*pnext)
-		addr = min((*pnext)->va_start & ~(align - 1), vmalloc_end);
-	else
-		addr = vmalloc_end;
-
-	while (*pprev && (*pprev)->va_end > addr) {
-		*pnext = *pprev;
-		*pprev = node_to_va(rb_prev(&(*pnext)->rb_node));
+	while (*va) {
+		addr = min((*va)->va_end & ~(align - 1), vmalloc_end);
+		if ((*va)->va_start < addr)
+			return addr;
+		*va = node_to_va(rb_prev(&(*va)->rb_node));
 	}
 
-	return addr;
+	return 0;
 }
 
 /**
@@ -2487,9 +2737,9 @@ static unsigned long pvm_determine_end(struct vmap_area **pnext,
  * areas are allocated from top.
  *
  * Despite its complicated look, this allocator is rather simple.  It
- * does everything top-down and scans areas from the end looking for
- * matching slot.  While scanning, if any of the areas overlaps with
- * existing vmap_area, the base address is pulled down to fit the
+ * does everything top-down and scans the free areas from the end looking
+ * for a matching slot.  While scanning, if any of the areas does not fit
+ * in the free area below it, the base address is pulled down to fit the
  * area.  Scanning is repeated till all the areas fit and then all
  * necessary data structres are inserted and the result is returned.
  */
@@ -2499,11 +2749,13 @@ struct vm_struct **pcpu_get_vm_areas(const unsigned long *offsets,
 {
 	const unsigned long vmalloc_start = ALIGN(VMALLOC_START, align);
 	const unsigned long vmalloc_end = VMALLOC_END & ~(align - 1);
-	struct vmap_area **vas, *prev, *next;
+	struct vmap_area **vas, **fvas, *va;
 	struct vm_struct **vms;
 	int area, area2, last_area, term_area;
-	unsigned long base, start, end, last_end;
+	unsigned long base, start, size, end, last_end;
+	enum fit_type type;
 	bool purged = false;
+	int ret;
 
 	/* verify parameters and allocate data structures */
 	BUG_ON(offset_in_page(align) || !is_power_of_2(align));
@@ -2539,66 +2791,61 @@ struct vm_struct **pcpu_get_vm_areas(const unsigned long *offsets,
 
 	vms = kcalloc(nr_vms, sizeof(vms[0]), GFP_KERNEL);
 	vas = kcalloc(nr_vms, sizeof(vas[0]), GFP_KERNEL);
-	if (!vas || !vms)
+	fvas = kcalloc(nr_vms, sizeof(fvas[0]), GFP_KERNEL);
+	if (!vas || !vms || !fvas)
 		goto err_free2;
 
+	/*
+	 * Every area may split a free area in two, so reserve a spare free
+	 * area node for each of them up front.
+	 */
 	for (area = 0; area < nr_vms; area++) {
 		vas[area] = kzalloc(sizeof(struct vmap_area), GFP_KERNEL);
+		fvas[area] = kzalloc(sizeof(struct vmap_area), GFP_KERNEL);
 		vms[area] = kzalloc(sizeof(struct vm_struct), GFP_KERNEL);
-		if (!vas[area] || !vms[area])
+		if (!vas[area] || !fvas[area] || !vms[area])
 			goto err_free;
 	}
 retry:
-	spin_lock(&vmap_area_lock);
+	spin_lock(&free_vmap_area_lock);
 
 	/* start scanning - we scan from the top, begin with the last area */
 	area = term_area = last_area;
 	start = offsets[area];
 	end = start + sizes[area];
 
-	if (!pvm_find_next_prev(vmap_area_pcpu_hole, &next, &prev)) {
-		base = vmalloc_end - last_end;
-		goto found;
-	}
-	base = pvm_determine_end(&next, &prev, align) - end;
+	va = pvm_find_va_enclose_addr(vmalloc_end);
+	base = pvm_determine_end_from_reverse(&va, align) - end;
 
 	while (true) {
-		BUG_ON(next && next->va_end <= base + end);
-		BUG_ON(prev && prev->va_end > base + end);
-
 		/*
 		 * base might have underflowed, add last_end before
 		 * comparing.
 		 */
-		if (base + last_end < vmalloc_start + last_end) {
-			spin_unlock(&vmap_area_lock);
-			if (!purged) {
-				purge_vmap_area_lazy();
-				purged = true;
-				goto retry;
-			}
-			goto err_free;
-		}
+		if (base + last_end < vmalloc_start + last_end)
+			goto overflow;
+
+		/* no free area is left to fit a base into */
+		if (!va)
+			goto overflow;
 
 		/*
-		 * If next overlaps, move base downwards so that it's
-		 * right below next and then recheck.
+		 * If the area exceeds the current free area, move base
+		 * downwards and then recheck.
 		 */
-		if (next && next->va_start < base + end) {
-			base = pvm_determine_end(&next, &prev, align) - end;
+		if (base + end > va->va_end) {
+			base = pvm_determine_end_from_reverse(&va, align) - end;
 			term_area = area;
 			continue;
 		}
 
 		/*
-		 * If prev overlaps, shift down next and prev and move
-		 * base so that it's right below new next and then
-		 * recheck.
+		 * If the area starts below the current free area, move on to
+		 * the previous free area and recheck.
 		 */
-		if (prev && prev->va_end > base + start)  {
-			next = prev;
-			prev = node_to_va(rb_prev(&next->rb_node));
-			base = pvm_determine_end(&next, &prev, align) - end;
+		if (base + start < va->va_start) {
+			va = node_to_va(rb_prev(&va->rb_node));
+			base = pvm_determine_end_from_reverse(&va, align) - end;
 			term_area = area;
 			continue;
 		}
@@ -2612,20 +2859,31 @@ retry:
 			break;
 		start = offsets[area];
 		end = start + sizes[area];
-		pvm_find_next_prev(base + end, &next, &prev);
+		va = pvm_find_va_enclose_addr(base + end);
 	}
-found:
-	/* we've found a fitting base, insert all va's */
-	for (area = 0; area < nr_vms; area++) {
-		struct vmap_area *va = vas[area];
 
-		va->va_start = base + offsets[area];
-		va->va_end = va->va_start + sizes[area];
-		__insert_vmap_area(va);
+	/* we've found a fitting base, carve all areas out of the free space */
+	for (area = 0; area < nr_vms; area++) {
+		start = base + offsets[area];
+		size = sizes[area];
+
+		va = pvm_find_va_enclose_addr(start);
+		BUG_ON(!va);
+		type = classify_va_fit_type(va, start, size);
+		BUG_ON(type == NOTHING_FIT);
+		/* cannot fail, a spare node is reserved for each area */
+		ret = adjust_va_to_fit_type(va, start, size, type, &fvas[area]);
+		BUG_ON(ret);
+
+		va = vas[area];
+		va->va_start = start;
+		va->va_end = start + size;
 	}
+	spin_unlock(&free_vmap_area_lock);
 
-	vmap_area_pcpu_hole = base + offsets[last_area];
-
+	spin_lock(&vmap_area_lock);
+	for (area = 0; area < nr_vms; area++)
+		__insert_vmap_area(vas[area]);
 	spin_unlock(&vmap_area_lock);
 
 	/* insert all vm's */
@@ -2633,15 +2891,27 @@ found:
 		setup_vmalloc_vm(vms[area], vas[area], VM_ALLOC,
 				 pcpu_get_vm_areas);
 
+	for (area = 0; area < nr_vms; area++)
+		kfree(fvas[area]);
+	kfree(fvas);
 	kfree(vas);
 	return vms;
 
+overflow:
+	spin_unlock(&free_vmap_area_lock);
+	if (!purged) {
+		purge_vmap_area_lazy();
+		purged = true;
+		goto retry;
+	}
 err_free:
 	for (area = 0; area < nr_vms; area++) {
 		kfree(vas[area]);
+		kfree(fvas[area]);
 		kfree(vms[area]);
 	}
 err_free2:
+	kfree(fvas);
 	kfree(vas);
 	kfree(vms);
 	return NULL;
@@ -1011,6 +1011,9 @@ const char * const vmstat_text[] = {
 	"pgfree",
 	"pgactivate",
 	"pgdeactivate",
+	"pgalloc_pcp_highorder",
+	"pgalloc_pcp_highorder_refill",
+	"pgfree_pcp_highorder",
 
 	"pgfault",
 	"pgmajfault",
@@ -1057,6 +1060,9 @@ const char * const vmstat_text[] = {
 	"compact_fail",
 	"compact_success",
 	"compact_daemon_wake",
+	"compact_daemon_proactive_wake",
+	"compact_daemon_proactive_migrated",
+	"compact_daemon_proactive_backoff",
 #endif
 
 #ifdef CONFIG_HUGETLB_PAGE
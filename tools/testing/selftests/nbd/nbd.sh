@@ -0,0 +1,149 @@
+#!/bin/bash
+# Run nbd against nbd-server over loopback, with several connections per
+# device, and disconnect while I/O is in flight.
+#
+# Needs nbd-server and nbd-client 3.15 or later (for "-C"), run as root.
+# NBD_CONNECTIONS, NBD_DEV and NBD_PORT override the defaults below.
+
+TCID="nbd.sh"
+CONNS=${NBD_CONNECTIONS:-4}
+DEV=${NBD_DEV:-/dev/nbd0}
+PORT=${NBD_PORT:-10899}
+SIZE_MB=256
+
+TMPDIR=$(mktemp -d)
+SERVER_PID=
+
+fail()
+{
+	echo "$TCID: FAIL: $*"
+	exit 1
+}
+
+cleanup()
+{
+	nbd-client -d $DEV >/dev/null 2>&1
+	[ -n "$SERVER_PID" ] && kill $SERVER_PID 2>/dev/null
+	rm -rf $TMPDIR
+}
+trap cleanup EXIT
+
+check_prereqs()
+{
+	if [ $UID != 0 ]; then
+		echo "$TCID: must be run as root"
+		exit 1
+	fi
+	for prog in nbd-server nbd-client dd cmp blockdev; do
+		if ! which $prog >/dev/null 2>&1; then
+			echo "$TCID: $prog not found"
+			exit 1
+		fi
+	done
+	modprobe nbd >/dev/null 2>&1
+	if [ ! -b $DEV ]; then
+		echo "$TCID: $DEV not found, CONFIG_BLK_DEV_NBD is not set"
+		exit 1
+	fi
+	mount -t debugfs none /sys/kernel/debug >/dev/null 2>&1
+}
+
+start_server()
+{
+	dd if=/dev/zero of=$TMPDIR/export bs=1M count=$SIZE_MB 2>/dev/null
+	cat > $TMPDIR/config <<EOC
+[generic]
+	listenaddr = 127.0.0.1
+	port = $PORT
+[test]
+	exportname = $TMPDIR/export
+	flush = true
+	trim = true
+EOC
+	nbd-server -C $TMPDIR/config -d >$TMPDIR/server.log 2>&1 &
+	SERVER_PID=$!
+	sleep 1
+	kill -0 $SERVER_PID 2>/dev/null || fail "nbd-server did not start"
+}
+
+connect()
+{
+	nbd-client -C $CONNS -N test 127.0.0.1 $PORT $DEV ||
+		fail "nbd-client could not connect"
+	local dbg=/sys/kernel/debug/nbd/$(basename $DEV)/connections
+	if [ -r $dbg ]; then
+		local n=$(wc -l < $dbg)
+		[ $n -eq $CONNS ] || fail "$n connections, expected $CONNS"
+	fi
+}
+
+disconnect()
+{
+	nbd-client -d $DEV || fail "nbd-client -d failed"
+	# NBD_DO_IT returns once all receivers have stopped
+	local i
+	for i in $(seq 50); do
+		[ "$(cat /sys/block/$(basename $DEV)/size)" = 0 ] && return
+		sleep 0.1
+	done
+	fail "$DEV still has a size after disconnect"
+}
+
+# data written over all connections reads back intact
+test_data()
+{
+	echo "$TCID: data integrity over $CONNS connections"
+	connect
+	dd if=/dev/urandom of=$TMPDIR/data bs=1M count=64 2>/dev/null
+	dd if=$TMPDIR/data of=$DEV bs=1M oflag=direct 2>/dev/null ||
+		fail "write failed"
+	local i
+	for i in 0 1 2 3; do
+		dd if=$TMPDIR/data of=$DEV bs=64k seek=$((1024 + i * 256)) \
+		   skip=$((i * 256)) count=256 oflag=direct 2>/dev/null &
+	done
+	wait
+	blockdev --flushbufs $DEV
+	dd if=$DEV of=$TMPDIR/readback bs=1M count=64 iflag=direct 2>/dev/null ||
+		fail "read failed"
+	cmp -s $TMPDIR/data $TMPDIR/readback || fail "data mismatch"
+	dd if=$DEV of=$TMPDIR/readback bs=1M skip=64 count=64 iflag=direct \
+	   2>/dev/null || fail "read failed"
+	cmp -s $TMPDIR/data $TMPDIR/readback || fail "parallel data mismatch"
+	disconnect
+}
+
+# disconnecting with I/O in flight fails that I/O and frees the device
+test_disconnect_busy()
+{
+	echo "$TCID: disconnect with I/O in flight"
+	connect
+	local i pids=
+	for i in $(seq $((CONNS * 2))); do
+		dd if=$DEV of=/dev/null bs=4k iflag=direct 2>/dev/null &
+		pids="$pids $!"
+		dd if=/dev/zero of=$DEV bs=4k seek=$((i * 4096)) count=100000 \
+		   oflag=direct 2>/dev/null &
+		pids="$pids $!"
+	done
+	sleep 2
+	disconnect
+	for i in $pids; do
+		wait $i
+	done
+	dmesg | tail -n 100 | grep -q -e "BUG:" -e "WARNING:" &&
+		fail "kernel warning during disconnect, see dmesg"
+
+	# the device can be used again afterwards
+	connect
+	dd if=$DEV of=/dev/null bs=1M count=16 iflag=direct 2>/dev/null ||
+		fail "read after reconnect failed"
+	disconnect
+}
+
+check_prereqs
+start_server
+test_data
+test_disconnect_busy
+echo "$TCID: PASS"
+exit 0
@@ -0,0 +1,92 @@
+#!/bin/bash
+# Zone commands on a partition of a zoned null_blk device must address the
+# partition's zones, not the disk's zones at the same relative offset.
+#
+# Needs addpart and blkzone from util-linux, run as root.  null_blk must
+# not be loaded yet.
+
+TCID="zoned.sh"
+ZONE_MB=4
+# the partition covers disk zones 2 to 5
+PART_START=$((2 * ZONE_MB * 2048))
+PART_LEN=$((4 * ZONE_MB * 2048))
+
+DEV=/dev/nullb0
+PART=${DEV}p1
+
+fail()
+{
+	echo "$TCID: FAIL: $*"
+	exit 1
+}
+
+cleanup()
+{
+	delpart $DEV 1 >/dev/null 2>&1
+	rmmod null_blk >/dev/null 2>&1
+}
+trap cleanup EXIT
+
+check_prereqs()
+{
+	if [ $UID != 0 ]; then
+		echo "$TCID: must be run as root"
+		exit 1
+	fi
+	for prog in addpart delpart blkzone dd; do
+		if ! which $prog >/dev/null 2>&1; then
+			echo "$TCID: $prog not found"
+			exit 1
+		fi
+	done
+	if grep -q "^null_blk " /proc/modules; then
+		echo "$TCID: null_blk is already loaded"
+		exit 1
+	fi
+	modprobe null_blk nr_devices=1 gb=1 zoned=1 zone_size=$ZONE_MB ||
+		fail "could not load null_blk in zoned mode"
+	[ -b $DEV ] || fail "$DEV not found"
+}
+
+# write $2 MB at MB offset $3 of $1
+write_mb()
+{
+	dd if=/dev/zero of=$1 bs=1M count=$2 seek=$3 oflag=direct \
+	   2>/dev/null
+}
+
+# resetting the first zone of a partition leaves the disk's first zone
+test_reset_partition()
+{
+	echo "$TCID: zone reset on a partition"
+	addpart $DEV 1 $PART_START $PART_LEN || fail "addpart failed"
+	udevadm settle >/dev/null 2>&1
+	[ -b $PART ] || fail "$PART not found"
+
+	write_mb $DEV 1 0 || fail "write to disk zone 0 failed"
+	write_mb $PART 1 0 || fail "write to partition zone 0 failed"
+
+	blkzone reset -o 0 -c 1 $PART || fail "blkzone reset failed"
+
+	# disk zone 0 still has its write pointer at 1MB
+	write_mb $DEV 1 1 ||
+		fail "disk zone 0 was reset instead of the partition's"
+	# and the partition's zone 0 was rewound to its start
+	write_mb $PART 1 0 || fail "partition zone 0 was not reset"
+}
+
+# the partition's zones are reported at partition relative offsets
+test_report_partition()
+{
+	echo "$TCID: zone report on a partition"
+	local start
+	start=$(blkzone report -o 0 -c 1 $PART |
+		sed -n 's/.*start: *\(0x[0-9a-f]*\).*/\1/p')
+	[ "$((start))" = 0 ] || fail "first zone of $PART starts at $start"
+}
+
+check_prereqs
+test_reset_partition
+test_report_partition
+echo "$TCID: PASS"
+exit 0